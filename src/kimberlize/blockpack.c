@@ -0,0 +1,907 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * blockpack
+ *
+ * Compresses a VM overlay as a series of independently compressed LZMA
+ * blocks, so that both kimberlize and dekimberlize can spread the work
+ * over every core, and appends an index of the blocks so that any byte
+ * range can be read back without decompressing what comes before it.
+ *
+ * Layout, all integers big-endian:
+ *
+ *   header   "KBLZ", u32 version, u32 block size, u32 reserved
+ *   block    u32 raw length, u32 packed length, u32 flags, packed data
+ *   ...
+ *   end      a block header with both lengths zero
+ *   index    per block: u64 raw offset, u64 file offset,
+ *                       u32 raw length, u32 packed length
+ *   trailer  u64 index offset, u32 block count, "KBLI"
+ *
+ * Blocks are framed on their own, so decompression never needs the index
+ * and works on a pipe or FIFO as the overlay arrives.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <lzma.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+
+#define BLOCKPACK_MAGIC       "KBLZ"
+#define BLOCKPACK_INDEX_MAGIC "KBLI"
+#define BLOCKPACK_VERSION     1
+
+#define HEADER_SIZE       16
+#define BLOCK_HEADER_SIZE 12
+#define INDEX_ENTRY_SIZE  24
+#define TRAILER_SIZE      16
+
+#define BLOCK_STORED      0x1   /* Block did not compress, kept as is. */
+
+#define DEFAULT_BLOCK_KB  4096
+#define MAX_BLOCK_KB      (256 * 1024)
+#define DEFAULT_PRESET    6
+
+/* Blocks in flight per worker thread, to keep workers busy while the
+ * writer waits on the oldest block. */
+#define BLOCKS_PER_THREAD 2
+
+
+typedef enum {
+  JOB_EMPTY,
+  JOB_READY,
+  JOB_BUSY,
+  JOB_DONE
+} job_state_t;
+
+typedef struct {
+  job_state_t    state;
+  unsigned long  seq;
+  unsigned char *in;
+  size_t         in_len;
+  unsigned char *out;
+  size_t         out_len;
+  uint32_t       flags;
+  int            failed;
+} job_t;
+
+typedef struct {
+  uint64_t raw_offset;
+  uint64_t file_offset;
+  uint32_t raw_len;
+  uint32_t packed_len;
+} index_entry_t;
+
+
+static int decompressing = 0;
+static int num_threads = 1;
+static int preset = DEFAULT_PRESET;
+static size_t block_size = DEFAULT_BLOCK_KB * 1024;
+
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static job_t *jobs;
+static int num_jobs;
+static unsigned long next_work = 0;     /* Next block a worker takes. */
+static unsigned long total_blocks = 0;  /* Valid once reading finished. */
+static int reading_done = 0;
+static int aborted = 0;
+
+
+static void
+usage(void) {
+  fprintf(stderr, "usage: blockpack [-b block-kb] [-p preset] [-t threads] "
+	  "< input > output\n"
+	  "       blockpack -d [-t threads] < input > output\n"
+	  "       blockpack -l file\n"
+	  "       blockpack -x offset:length file\n");
+}
+
+
+static void
+put_u32(unsigned char *p, uint32_t v) {
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static void
+put_u64(unsigned char *p, uint64_t v) {
+  put_u32(p, v >> 32);
+  put_u32(p + 4, v & 0xffffffff);
+}
+
+static uint32_t
+get_u32(const unsigned char *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+    ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t
+get_u64(const unsigned char *p) {
+  return ((uint64_t)get_u32(p) << 32) | get_u32(p + 4);
+}
+
+
+/*
+ * Read exactly n bytes unless the input ends first.  Returns the number
+ * of bytes read, or -1 on error.
+ */
+
+static ssize_t
+read_full(int fd, void *buf, size_t n) {
+  size_t done = 0;
+
+  while(done < n) {
+    ssize_t r = read(fd, (char *)buf + done, n - done);
+    if(r < 0) {
+      if(errno == EINTR)
+	continue;
+      perror("read");
+      return -1;
+    }
+    if(r == 0)
+      break;
+    done += r;
+  }
+
+  return done;
+}
+
+static int
+write_full(int fd, const void *buf, size_t n) {
+  size_t done = 0;
+
+  while(done < n) {
+    ssize_t w = write(fd, (const char *)buf + done, n - done);
+    if(w < 0) {
+      if(errno == EINTR)
+	continue;
+      perror("write");
+      return -1;
+    }
+    done += w;
+  }
+
+  return 0;
+}
+
+static int
+pread_full(int fd, void *buf, size_t n, off_t offset) {
+  size_t done = 0;
+
+  while(done < n) {
+    ssize_t r = pread(fd, (char *)buf + done, n - done, offset + done);
+    if(r < 0) {
+      if(errno == EINTR)
+	continue;
+      perror("pread");
+      return -1;
+    }
+    if(r == 0) {
+      fprintf(stderr, "blockpack: unexpected end of file\n");
+      return -1;
+    }
+    done += r;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Compress or decompress one block in place of the job's input.
+ */
+
+static int
+compress_block(job_t *job) {
+  size_t bound = lzma_stream_buffer_bound(job->in_len);
+  lzma_ret ret;
+
+  job->out = (unsigned char *)malloc(bound);
+  if(job->out == NULL) {
+    perror("malloc");
+    return -1;
+  }
+
+  job->out_len = 0;
+  ret = lzma_easy_buffer_encode(preset, LZMA_CHECK_CRC32, NULL,
+				job->in, job->in_len,
+				job->out, &job->out_len, bound);
+  if(ret != LZMA_OK) {
+    fprintf(stderr, "blockpack: compression failed (%d)\n", ret);
+    return -1;
+  }
+
+  if(job->out_len >= job->in_len) {
+    memcpy(job->out, job->in, job->in_len);
+    job->out_len = job->in_len;
+    job->flags = BLOCK_STORED;
+  }
+  else
+    job->flags = 0;
+
+  return 0;
+}
+
+static int
+decompress_buffer(const unsigned char *in, size_t in_len, uint32_t flags,
+		  unsigned char *out, size_t out_len) {
+  uint64_t memlimit = UINT64_MAX;
+  size_t in_pos = 0, out_pos = 0;
+  lzma_ret ret;
+
+  if(flags & BLOCK_STORED) {
+    if(in_len != out_len) {
+      fprintf(stderr, "blockpack: stored block has bad length\n");
+      return -1;
+    }
+    memcpy(out, in, in_len);
+    return 0;
+  }
+
+  ret = lzma_stream_buffer_decode(&memlimit, 0, NULL, in, &in_pos, in_len,
+				  out, &out_pos, out_len);
+  if((ret != LZMA_OK) || (in_pos != in_len) || (out_pos != out_len)) {
+    fprintf(stderr, "blockpack: corrupt block (%d)\n", ret);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int
+decompress_block(job_t *job) {
+  job->out = (unsigned char *)malloc(job->out_len ? job->out_len : 1);
+  if(job->out == NULL) {
+    perror("malloc");
+    return -1;
+  }
+
+  return decompress_buffer(job->in, job->in_len, job->flags,
+			   job->out, job->out_len);
+}
+
+
+static void *
+worker_thread(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&job_mutex);
+
+  for(;;) {
+    job_t *job;
+    int err;
+
+    while(!aborted) {
+      job = &jobs[next_work % num_jobs];
+      if((job->state == JOB_READY) && (job->seq == next_work))
+	break;
+      if(reading_done && (next_work >= total_blocks))
+	break;
+      pthread_cond_wait(&job_cond, &job_mutex);
+    }
+
+    if(aborted || (reading_done && (next_work >= total_blocks)))
+      break;
+
+    job->state = JOB_BUSY;
+    next_work++;
+    pthread_mutex_unlock(&job_mutex);
+
+    err = decompressing ? decompress_block(job) : compress_block(job);
+
+    pthread_mutex_lock(&job_mutex);
+    job->failed = (err < 0);
+    job->state = JOB_DONE;
+    pthread_cond_broadcast(&job_cond);
+  }
+
+  pthread_mutex_unlock(&job_mutex);
+
+  return NULL;
+}
+
+
+/*
+ * Writer side of the pipeline: emit finished blocks in order.  When
+ * compressing, also frame them and build the index.
+ */
+
+typedef struct {
+  int            out_fd;
+  uint64_t       raw_offset;
+  uint64_t       file_offset;
+  index_entry_t *index;
+  unsigned long  index_capacity;
+  int            failed;
+} writer_t;
+
+static int
+write_job(writer_t *w, job_t *job) {
+  if(!decompressing) {
+    unsigned char header[BLOCK_HEADER_SIZE];
+
+    if(w->index_capacity <= job->seq) {
+      unsigned long capacity = w->index_capacity ? w->index_capacity*2 : 64;
+      index_entry_t *index;
+
+      index = (index_entry_t *)realloc(w->index,
+				       capacity * sizeof(index_entry_t));
+      if(index == NULL) {
+	perror("realloc");
+	return -1;
+      }
+      w->index = index;
+      w->index_capacity = capacity;
+    }
+
+    w->index[job->seq].raw_offset = w->raw_offset;
+    w->index[job->seq].file_offset = w->file_offset;
+    w->index[job->seq].raw_len = job->in_len;
+    w->index[job->seq].packed_len = job->out_len;
+
+    put_u32(header, job->in_len);
+    put_u32(header + 4, job->out_len);
+    put_u32(header + 8, job->flags);
+    if(write_full(w->out_fd, header, BLOCK_HEADER_SIZE) < 0)
+      return -1;
+
+    w->file_offset += BLOCK_HEADER_SIZE + job->out_len;
+    w->raw_offset += job->in_len;
+  }
+
+  return write_full(w->out_fd, job->out, job->out_len);
+}
+
+static void *
+writer_thread(void *arg) {
+  writer_t *w = (writer_t *)arg;
+  unsigned long seq;
+
+  pthread_mutex_lock(&job_mutex);
+
+  for(seq=0; ; seq++) {
+    job_t *job = &jobs[seq % num_jobs];
+    int err;
+
+    while(!aborted && !(reading_done && (seq >= total_blocks)) &&
+	  !((job->state == JOB_DONE) && (job->seq == seq)))
+      pthread_cond_wait(&job_cond, &job_mutex);
+
+    if(aborted || (reading_done && (seq >= total_blocks)))
+      break;
+
+    pthread_mutex_unlock(&job_mutex);
+
+    err = job->failed ? -1 : write_job(w, job);
+
+    free(job->in);
+    free(job->out);
+    job->in = job->out = NULL;
+
+    pthread_mutex_lock(&job_mutex);
+    if(err < 0) {
+      w->failed = 1;
+      aborted = 1;
+    }
+    job->state = JOB_EMPTY;
+    pthread_cond_broadcast(&job_cond);
+  }
+
+  pthread_mutex_unlock(&job_mutex);
+
+  return NULL;
+}
+
+
+/*
+ * Hand a block read from the input to the workers, waiting for its slot
+ * to drain first.  Takes ownership of buf.
+ */
+
+static int
+queue_block(unsigned long seq, unsigned char *buf, size_t in_len,
+	    size_t out_len, uint32_t flags) {
+  job_t *job = &jobs[seq % num_jobs];
+
+  pthread_mutex_lock(&job_mutex);
+  while(!aborted && (job->state != JOB_EMPTY))
+    pthread_cond_wait(&job_cond, &job_mutex);
+
+  if(aborted) {
+    pthread_mutex_unlock(&job_mutex);
+    free(buf);
+    return -1;
+  }
+
+  job->seq = seq;
+  job->in = buf;
+  job->in_len = in_len;
+  job->out = NULL;
+  job->out_len = out_len;
+  job->flags = flags;
+  job->failed = 0;
+  job->state = JOB_READY;
+  pthread_cond_broadcast(&job_cond);
+  pthread_mutex_unlock(&job_mutex);
+
+  return 0;
+}
+
+static void
+finish_reading(unsigned long blocks, int failed) {
+  pthread_mutex_lock(&job_mutex);
+  total_blocks = blocks;
+  reading_done = 1;
+  if(failed)
+    aborted = 1;
+  pthread_cond_broadcast(&job_cond);
+  pthread_mutex_unlock(&job_mutex);
+}
+
+
+/*
+ * Read the input in block_size pieces (compression) or as framed blocks
+ * (decompression) and feed them to the pipeline.
+ */
+
+static int
+read_blocks(int in_fd) {
+  unsigned long seq = 0;
+
+  if(decompressing) {
+    unsigned char header[HEADER_SIZE];
+
+    if((read_full(in_fd, header, HEADER_SIZE) != HEADER_SIZE) ||
+       (memcmp(header, BLOCKPACK_MAGIC, 4) != 0)) {
+      fprintf(stderr, "blockpack: input is not a blockpack file\n");
+      finish_reading(0, 1);
+      return -1;
+    }
+    if(get_u32(header + 4) != BLOCKPACK_VERSION) {
+      fprintf(stderr, "blockpack: unsupported version %u\n",
+	      get_u32(header + 4));
+      finish_reading(0, 1);
+      return -1;
+    }
+  }
+
+  for(;;) {
+    unsigned char *buf;
+    size_t in_len, out_len = 0;
+    uint32_t flags = 0;
+    ssize_t n;
+
+    if(decompressing) {
+      unsigned char header[BLOCK_HEADER_SIZE];
+
+      if(read_full(in_fd, header, BLOCK_HEADER_SIZE) != BLOCK_HEADER_SIZE) {
+	fprintf(stderr, "blockpack: truncated input\n");
+	finish_reading(seq, 1);
+	return -1;
+      }
+
+      out_len = get_u32(header);
+      in_len = get_u32(header + 4);
+      flags = get_u32(header + 8);
+      if((out_len == 0) && (in_len == 0))
+	break;
+
+      if((out_len > MAX_BLOCK_KB * 1024) ||
+	 (in_len > lzma_stream_buffer_bound(out_len))) {
+	fprintf(stderr, "blockpack: corrupt block header\n");
+	finish_reading(seq, 1);
+	return -1;
+      }
+    }
+    else
+      in_len = block_size;
+
+    buf = (unsigned char *)malloc(in_len ? in_len : 1);
+    if(buf == NULL) {
+      perror("malloc");
+      finish_reading(seq, 1);
+      return -1;
+    }
+
+    n = read_full(in_fd, buf, in_len);
+    if((n < 0) || (decompressing && ((size_t)n != in_len))) {
+      if(n >= 0)
+	fprintf(stderr, "blockpack: truncated input\n");
+      free(buf);
+      finish_reading(seq, 1);
+      return -1;
+    }
+
+    if(n == 0) {
+      free(buf);
+      break;
+    }
+
+    if(queue_block(seq, buf, n, out_len, flags) < 0) {
+      finish_reading(seq, 1);
+      return -1;
+    }
+    seq++;
+
+    if(!decompressing && ((size_t)n < block_size))
+      break;
+  }
+
+  finish_reading(seq, 0);
+
+  return 0;
+}
+
+
+static int
+write_index(writer_t *w) {
+  unsigned char end[BLOCK_HEADER_SIZE];
+  unsigned char trailer[TRAILER_SIZE];
+  uint64_t index_offset;
+  unsigned long i;
+
+  memset(end, 0, BLOCK_HEADER_SIZE);
+  if(write_full(w->out_fd, end, BLOCK_HEADER_SIZE) < 0)
+    return -1;
+  index_offset = w->file_offset + BLOCK_HEADER_SIZE;
+
+  for(i=0; i<total_blocks; i++) {
+    unsigned char entry[INDEX_ENTRY_SIZE];
+
+    put_u64(entry, w->index[i].raw_offset);
+    put_u64(entry + 8, w->index[i].file_offset);
+    put_u32(entry + 16, w->index[i].raw_len);
+    put_u32(entry + 20, w->index[i].packed_len);
+    if(write_full(w->out_fd, entry, INDEX_ENTRY_SIZE) < 0)
+      return -1;
+  }
+
+  put_u64(trailer, index_offset);
+  put_u32(trailer + 8, total_blocks);
+  memcpy(trailer + 12, BLOCKPACK_INDEX_MAGIC, 4);
+
+  return write_full(w->out_fd, trailer, TRAILER_SIZE);
+}
+
+
+/*
+ * Compress or decompress stdin to stdout.
+ */
+
+static int
+run_pipeline(void) {
+  pthread_t *workers, writer;
+  writer_t w;
+  int i, err;
+
+  num_jobs = num_threads * BLOCKS_PER_THREAD;
+  jobs = (job_t *)calloc(num_jobs, sizeof(job_t));
+  workers = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
+  if((jobs == NULL) || (workers == NULL)) {
+    perror("calloc");
+    return -1;
+  }
+
+  memset(&w, 0, sizeof(writer_t));
+  w.out_fd = STDOUT_FILENO;
+
+  if(!decompressing) {
+    unsigned char header[HEADER_SIZE];
+
+    memcpy(header, BLOCKPACK_MAGIC, 4);
+    put_u32(header + 4, BLOCKPACK_VERSION);
+    put_u32(header + 8, block_size);
+    put_u32(header + 12, 0);
+    if(write_full(w.out_fd, header, HEADER_SIZE) < 0)
+      return -1;
+    w.file_offset = HEADER_SIZE;
+  }
+
+  for(i=0; i<num_threads; i++)
+    if(pthread_create(&workers[i], NULL, worker_thread, NULL) != 0) {
+      fprintf(stderr, "blockpack: failed creating thread\n");
+      return -1;
+    }
+  if(pthread_create(&writer, NULL, writer_thread, &w) != 0) {
+    fprintf(stderr, "blockpack: failed creating thread\n");
+    return -1;
+  }
+
+  err = read_blocks(STDIN_FILENO);
+
+  for(i=0; i<num_threads; i++)
+    pthread_join(workers[i], NULL);
+  pthread_join(writer, NULL);
+
+  if((err < 0) || w.failed || aborted)
+    return -1;
+
+  if(!decompressing && (write_index(&w) < 0))
+    return -1;
+
+  free(w.index);
+  free(workers);
+  free(jobs);
+
+  return 0;
+}
+
+
+/*
+ * Load the index of a blockpack file.  Returns the number of blocks, or
+ * -1 if the file has no valid index.
+ */
+
+static long
+load_index(int fd, index_entry_t **index) {
+  unsigned char trailer[TRAILER_SIZE], *raw;
+  uint64_t index_offset;
+  uint32_t count, i;
+  off_t size;
+
+  size = lseek(fd, 0, SEEK_END);
+  if(size < HEADER_SIZE + BLOCK_HEADER_SIZE + TRAILER_SIZE) {
+    fprintf(stderr, "blockpack: file too short to be a blockpack file\n");
+    return -1;
+  }
+
+  if(pread_full(fd, trailer, TRAILER_SIZE, size - TRAILER_SIZE) < 0)
+    return -1;
+
+  index_offset = get_u64(trailer);
+  count = get_u32(trailer + 8);
+  if((memcmp(trailer + 12, BLOCKPACK_INDEX_MAGIC, 4) != 0) ||
+     (index_offset + (uint64_t)count * INDEX_ENTRY_SIZE + TRAILER_SIZE !=
+      (uint64_t)size)) {
+    fprintf(stderr, "blockpack: missing or corrupt index\n");
+    return -1;
+  }
+
+  raw = (unsigned char *)malloc(count * INDEX_ENTRY_SIZE + 1);
+  *index = (index_entry_t *)calloc(count + 1, sizeof(index_entry_t));
+  if((raw == NULL) || (*index == NULL)) {
+    perror("malloc");
+    return -1;
+  }
+
+  if(pread_full(fd, raw, count * INDEX_ENTRY_SIZE, index_offset) < 0)
+    return -1;
+
+  for(i=0; i<count; i++) {
+    unsigned char *entry = raw + i * INDEX_ENTRY_SIZE;
+
+    (*index)[i].raw_offset = get_u64(entry);
+    (*index)[i].file_offset = get_u64(entry + 8);
+    (*index)[i].raw_len = get_u32(entry + 16);
+    (*index)[i].packed_len = get_u32(entry + 20);
+  }
+
+  free(raw);
+
+  return count;
+}
+
+
+static int
+list_blocks(const char *path) {
+  index_entry_t *index = NULL;
+  uint64_t raw_total = 0, packed_total = 0;
+  long count, i;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    perror(path);
+    return -1;
+  }
+
+  count = load_index(fd, &index);
+  if(count < 0)
+    return -1;
+
+  printf("%8s %14s %14s %10s %10s\n",
+	 "block", "raw-offset", "file-offset", "raw", "packed");
+  for(i=0; i<count; i++) {
+    printf("%8ld %14llu %14llu %10u %10u\n", i,
+	   (unsigned long long)index[i].raw_offset,
+	   (unsigned long long)index[i].file_offset,
+	   index[i].raw_len, index[i].packed_len);
+    raw_total += index[i].raw_len;
+    packed_total += index[i].packed_len;
+  }
+  printf("%ld blocks, %llu bytes packed into %llu\n", count,
+	 (unsigned long long)raw_total, (unsigned long long)packed_total);
+
+  free(index);
+  close(fd);
+
+  return 0;
+}
+
+
+/*
+ * Write raw bytes [offset, offset+length) of a blockpack file to stdout,
+ * decompressing only the blocks that hold them.
+ */
+
+static int
+extract_range(const char *range, const char *path) {
+  unsigned long long offset, length, end;
+  index_entry_t *index = NULL;
+  long count, lo, hi;
+  int fd;
+
+  if(sscanf(range, "%llu:%llu", &offset, &length) != 2) {
+    usage();
+    return -1;
+  }
+  end = offset + length;
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    perror(path);
+    return -1;
+  }
+
+  count = load_index(fd, &index);
+  if(count < 0)
+    return -1;
+
+  /* Binary search for the last block starting at or before offset. */
+  lo = 0;
+  hi = count - 1;
+  while(lo < hi) {
+    long mid = (lo + hi + 1) / 2;
+    if(index[mid].raw_offset <= offset)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  for(; (lo < count) && (offset < end); lo++) {
+    index_entry_t *e = &index[lo];
+    unsigned char header[BLOCK_HEADER_SIZE], *packed, *raw;
+    uint64_t from, to;
+
+    if(e->raw_offset + e->raw_len <= offset)
+      continue;
+
+    packed = (unsigned char *)malloc(e->packed_len + 1);
+    raw = (unsigned char *)malloc(e->raw_len + 1);
+    if((packed == NULL) || (raw == NULL)) {
+      perror("malloc");
+      return -1;
+    }
+
+    if((pread_full(fd, header, BLOCK_HEADER_SIZE, e->file_offset) < 0) ||
+       (pread_full(fd, packed, e->packed_len,
+		   e->file_offset + BLOCK_HEADER_SIZE) < 0) ||
+       (decompress_buffer(packed, e->packed_len, get_u32(header + 8),
+			  raw, e->raw_len) < 0))
+      return -1;
+
+    from = offset - e->raw_offset;
+    to = (end < e->raw_offset + e->raw_len) ?
+      end - e->raw_offset : e->raw_len;
+    if(write_full(STDOUT_FILENO, raw + from, to - from) < 0)
+      return -1;
+    offset = e->raw_offset + to;
+
+    free(packed);
+    free(raw);
+  }
+
+  if(offset < end) {
+    fprintf(stderr, "blockpack: range extends past the end of the data\n");
+    return -1;
+  }
+
+  free(index);
+  close(fd);
+
+  return 0;
+}
+
+
+int
+main(int argc, char *argv[]) {
+  char *extract = NULL;
+  int list = 0, opt;
+  long n;
+
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+  num_threads = (n > 0) ? n : 1;
+
+  while((opt = getopt(argc, argv, "b:dhlp:t:x:")) != -1) {
+    switch(opt) {
+    case 'b':
+      n = atol(optarg);
+      if((n <= 0) || (n > MAX_BLOCK_KB)) {
+	fprintf(stderr, "blockpack: block size must be 1-%d KB\n",
+		MAX_BLOCK_KB);
+	return EXIT_FAILURE;
+      }
+      block_size = n * 1024;
+      break;
+
+    case 'd':
+      decompressing = 1;
+      break;
+
+    case 'l':
+      list = 1;
+      break;
+
+    case 'p':
+      preset = atoi(optarg);
+      if((preset < 0) || (preset > 9)) {
+	fprintf(stderr, "blockpack: preset must be 0-9\n");
+	return EXIT_FAILURE;
+      }
+      break;
+
+    case 't':
+      num_threads = atoi(optarg);
+      if(num_threads <= 0) {
+	fprintf(stderr, "blockpack: thread count must be positive\n");
+	return EXIT_FAILURE;
+      }
+      break;
+
+    case 'x':
+      extract = optarg;
+      break;
+
+    default:
+      usage();
+      return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if(list || (extract != NULL)) {
+    if(optind != argc - 1) {
+      usage();
+      return EXIT_FAILURE;
+    }
+    if(list)
+      return (list_blocks(argv[optind]) < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+    return (extract_range(extract, argv[optind]) < 0) ?
+      EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  if(optind != argc) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  if(run_pipeline() < 0) {
+    fprintf(stderr, "blockpack: failed\n");
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
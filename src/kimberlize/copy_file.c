@@ -0,0 +1,139 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include "copy_file.h"
+
+
+#define COPY_BUFFER_SIZE 65536
+
+
+/*
+ * Copy [offset, offset+length) through a buffer, for when the kernel
+ * can't copy between the two files itself.
+ */
+
+static int
+copy_range_by_hand(int in_fd, int out_fd, off_t offset, off_t length) {
+  char buf[COPY_BUFFER_SIZE];
+
+  while(length > 0) {
+    size_t want = (length > COPY_BUFFER_SIZE) ? COPY_BUFFER_SIZE : length;
+    ssize_t n, done;
+
+    n = pread(in_fd, buf, want, offset);
+    if(n < 0) {
+      if(errno == EINTR)
+	continue;
+      return -1;
+    }
+    if(n == 0)
+      break;
+
+    for(done=0; done<n; ) {
+      ssize_t w = pwrite(out_fd, buf + done, n - done, offset + done);
+      if(w < 0) {
+	if(errno == EINTR)
+	  continue;
+	return -1;
+      }
+      done += w;
+    }
+
+    offset += n;
+    length -= n;
+  }
+
+  return 0;
+}
+
+static int
+copy_range(int in_fd, int out_fd, off_t offset, off_t length) {
+  while(length > 0) {
+    off_t in_off = offset, out_off = offset;
+    ssize_t n;
+
+    n = copy_file_range(in_fd, &in_off, out_fd, &out_off, length, 0);
+    if(n < 0) {
+      if(errno == EINTR)
+	continue;
+      if((errno == EXDEV) || (errno == EINVAL) || (errno == ENOSYS) ||
+	 (errno == EOPNOTSUPP))
+	return copy_range_by_hand(in_fd, out_fd, offset, length);
+      return -1;
+    }
+    if(n == 0)          /* Source shrank underneath us. */
+      break;
+
+    offset += n;
+    length -= n;
+  }
+
+  return 0;
+}
+
+
+int
+copy_file_fast(int in_fd, int out_fd, off_t size) {
+  struct stat st;
+  off_t data, hole;
+
+  if((fstat(in_fd, &st) == 0) && (st.st_size == size) &&
+     (ioctl(out_fd, FICLONE, in_fd) == 0))
+    return 0;
+
+  /*
+   * Size the output first, so the ranges never written stay holes, then
+   * walk the source's data extents.  Filesystems without SEEK_DATA
+   * report the whole file as one extent.
+   */
+
+  if(ftruncate(out_fd, size) < 0)
+    return -1;
+
+  for(data = 0; data < size; data = hole) {
+    data = lseek(in_fd, data, SEEK_DATA);
+    if(data < 0) {
+      if(errno == ENXIO)        /* Only a hole remains. */
+	break;
+      if(errno != EINVAL)
+	return -1;
+      return copy_range(in_fd, out_fd, 0, size);
+    }
+    if(data >= size)
+      break;
+
+    hole = lseek(in_fd, data, SEEK_HOLE);
+    if(hole < 0)
+      return -1;
+    if(hole > size)
+      hole = size;
+
+    if(copy_range(in_fd, out_fd, data, hole - data) < 0)
+      return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,34 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COPY_FILE_H
+#define COPY_FILE_H
+
+#include <sys/types.h>
+
+/*
+ * Copy the first size bytes of in_fd to out_fd, which should be empty.
+ * Reflinks the whole file where the filesystem allows it; otherwise
+ * copies only the allocated extents, in the kernel where possible, and
+ * leaves holes as holes.  Returns 0, or -1 with errno set.
+ */
+
+int copy_file_fast(int in_fd, int out_fd, off_t size);
+
+#endif
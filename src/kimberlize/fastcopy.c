@@ -0,0 +1,78 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * fastcopy
+ *
+ * A 'cp' for disk images: reflinks where the filesystem allows it, and
+ * otherwise copies only the allocated parts of the source, so the holes
+ * of a sparse .vdi are not written out as zeroes.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "copy_file.h"
+
+
+int
+main(int argc, char *argv[]) {
+  struct stat st;
+  int in_fd, out_fd;
+
+  if(argc != 3) {
+    fprintf(stderr, "usage: fastcopy source destination\n");
+    return EXIT_FAILURE;
+  }
+
+  in_fd = open(argv[1], O_RDONLY);
+  if(in_fd < 0) {
+    perror(argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  if(fstat(in_fd, &st) < 0) {
+    perror("fstat");
+    return EXIT_FAILURE;
+  }
+
+  out_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+  if(out_fd < 0) {
+    perror(argv[2]);
+    return EXIT_FAILURE;
+  }
+
+  if(copy_file_fast(in_fd, out_fd, st.st_size) < 0) {
+    perror("fastcopy");
+    unlink(argv[2]);
+    return EXIT_FAILURE;
+  }
+
+  if(close(out_fd) < 0) {
+    perror("close");
+    unlink(argv[2]);
+    return EXIT_FAILURE;
+  }
+
+  close(in_fd);
+
+  return EXIT_SUCCESS;
+}
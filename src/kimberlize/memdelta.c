@@ -0,0 +1,823 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * memdelta
+ *
+ * Takes the difference between two VM memory states a page at a time,
+ * in place of a generic byte-level delta.  Each page of the new state is
+ * classified as unchanged from the base, all zeroes, moved from
+ * elsewhere in the base, or new data; runs of pages of the same kind
+ * become one entry in the page map, and only new data is stored.
+ *
+ * Layout, all integers big-endian:
+ *
+ *   header  "KMDL", u32 version, u32 page size, u32 map entries,
+ *           u64 base size, u64 target size
+ *   map     per entry: u8 kind, 3 bytes zero, u32 pages, u64 base page
+ *   data    the pages of every MAP_DATA entry, in map order; the last
+ *           page of the target may be short
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "copy_file.h"
+
+
+#define MEMDELTA_MAGIC   "KMDL"
+#define MEMDELTA_VERSION 1
+#define MEMDELTA_PAGE    4096
+
+#define HEADER_SIZE      32
+#define MAP_ENTRY_SIZE   16
+
+enum map_kind {
+  MAP_SAME = 0,      /* Same as the base at the same offset. */
+  MAP_ZERO = 1,      /* All zeroes. */
+  MAP_MOVED = 2,     /* Same as the base starting at another page. */
+  MAP_DATA = 3       /* Stored in the delta. */
+};
+
+typedef struct {
+  uint32_t kind;
+  uint32_t pages;
+  uint64_t base_page;
+} map_entry_t;
+
+typedef struct {
+  unsigned char *data;
+  size_t         size;
+} mapping_t;
+
+typedef struct {
+  map_entry_t *entries;
+  uint32_t     count;
+  uint32_t     capacity;
+} page_map_t;
+
+
+static int verbose = 0;
+static int num_threads = 1;
+
+
+static void
+usage(void) {
+  fprintf(stderr, "usage: memdelta [-v] delta base-file new-file delta-file\n"
+	  "       memdelta [-v] [-t threads] patch delta-file base-file "
+	  "new-file\n");
+}
+
+
+static void
+put_u32(unsigned char *p, uint32_t v) {
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static void
+put_u64(unsigned char *p, uint64_t v) {
+  put_u32(p, v >> 32);
+  put_u32(p + 4, v & 0xffffffff);
+}
+
+static uint32_t
+get_u32(const unsigned char *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+    ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t
+get_u64(const unsigned char *p) {
+  return ((uint64_t)get_u32(p) << 32) | get_u32(p + 4);
+}
+
+
+static int
+writen(int fd, const void *buf, size_t n) {
+  size_t done = 0;
+
+  while(done < n) {
+    ssize_t w = write(fd, (const char *)buf + done, n - done);
+    if(w < 0) {
+      if(errno == EINTR)
+	continue;
+      perror("write");
+      return -1;
+    }
+    done += w;
+  }
+
+  return 0;
+}
+
+
+static int
+map_file(const char *path, mapping_t *m) {
+  struct stat st;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    perror(path);
+    return -1;
+  }
+
+  if(fstat(fd, &st) < 0) {
+    perror("fstat");
+    close(fd);
+    return -1;
+  }
+
+  m->size = st.st_size;
+  m->data = NULL;
+  if(m->size > 0) {
+    m->data = (unsigned char *)mmap(NULL, m->size, PROT_READ, MAP_PRIVATE,
+				    fd, 0);
+    if(m->data == MAP_FAILED) {
+      perror("mmap");
+      close(fd);
+      return -1;
+    }
+    madvise(m->data, m->size, MADV_SEQUENTIAL);
+  }
+
+  close(fd);
+
+  return 0;
+}
+
+static void
+unmap_file(mapping_t *m) {
+  if(m->data != NULL)
+    munmap(m->data, m->size);
+}
+
+
+/*
+ * Page comparisons.  Full pages are compared 64 bytes per iteration with
+ * SSE2 where the compiler targets it.
+ */
+
+static int
+pages_equal(const unsigned char *a, const unsigned char *b, size_t len) {
+#ifdef __SSE2__
+  if(len == MEMDELTA_PAGE) {
+    size_t i;
+
+    for(i=0; i<len; i+=64) {
+      const __m128i *va = (const __m128i *)(a + i);
+      const __m128i *vb = (const __m128i *)(b + i);
+      __m128i eq;
+
+      eq = _mm_and_si128(
+	     _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(va),
+					  _mm_loadu_si128(vb)),
+			   _mm_cmpeq_epi8(_mm_loadu_si128(va + 1),
+					  _mm_loadu_si128(vb + 1))),
+	     _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(va + 2),
+					  _mm_loadu_si128(vb + 2)),
+			   _mm_cmpeq_epi8(_mm_loadu_si128(va + 3),
+					  _mm_loadu_si128(vb + 3))));
+      if(_mm_movemask_epi8(eq) != 0xffff)
+	return 0;
+    }
+
+    return 1;
+  }
+#endif
+
+  return memcmp(a, b, len) == 0;
+}
+
+static int
+page_is_zero(const unsigned char *p, size_t len) {
+  size_t i;
+
+#ifdef __SSE2__
+  if(len == MEMDELTA_PAGE) {
+    for(i=0; i<len; i+=64) {
+      const __m128i *v = (const __m128i *)(p + i);
+      __m128i any;
+
+      any = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(v),
+				      _mm_loadu_si128(v + 1)),
+			 _mm_or_si128(_mm_loadu_si128(v + 2),
+				      _mm_loadu_si128(v + 3)));
+      if(_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128()))
+	 != 0xffff)
+	return 0;
+    }
+
+    return 1;
+  }
+#endif
+
+  for(i=0; i<len; i++)
+    if(p[i] != 0)
+      return 0;
+
+  return 1;
+}
+
+static uint64_t
+page_hash(const unsigned char *p) {
+  uint64_t h = 0x84222325cbf29ce4ULL, w;
+  size_t i;
+
+  for(i=0; i<MEMDELTA_PAGE; i+=sizeof(w)) {
+    memcpy(&w, p + i, sizeof(w));
+    h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+  }
+
+  return h;
+}
+
+
+/*
+ * Hash table from page contents to the first base page holding them,
+ * used to find pages that moved.  Built on the first page that needs it,
+ * so a new state which only differs in place never pays for it.
+ */
+
+typedef struct {
+  uint32_t *slots;      /* Base page + 1, or 0 if empty. */
+  uint64_t  mask;
+} page_index_t;
+
+static int
+build_page_index(page_index_t *index, const mapping_t *base) {
+  uint64_t pages = base->size / MEMDELTA_PAGE, size = 1024, i;
+
+  while(size < pages * 2)
+    size *= 2;
+
+  index->slots = (uint32_t *)calloc(size, sizeof(uint32_t));
+  if(index->slots == NULL) {
+    perror("calloc");
+    return -1;
+  }
+  index->mask = size - 1;
+
+  for(i=0; i<pages; i++) {
+    const unsigned char *page = base->data + i * MEMDELTA_PAGE;
+    uint64_t slot;
+
+    if(page_is_zero(page, MEMDELTA_PAGE))
+      continue;
+
+    for(slot = page_hash(page) & index->mask; index->slots[slot] != 0;
+	slot = (slot + 1) & index->mask)
+      if(pages_equal(base->data + (uint64_t)(index->slots[slot] - 1) *
+		     MEMDELTA_PAGE, page, MEMDELTA_PAGE))
+	break;
+
+    if(index->slots[slot] == 0)
+      index->slots[slot] = i + 1;
+  }
+
+  return 0;
+}
+
+static int64_t
+find_base_page(const page_index_t *index, const mapping_t *base,
+	       const unsigned char *page) {
+  uint64_t slot;
+
+  for(slot = page_hash(page) & index->mask; index->slots[slot] != 0;
+      slot = (slot + 1) & index->mask) {
+    uint64_t candidate = index->slots[slot] - 1;
+
+    if(pages_equal(base->data + candidate * MEMDELTA_PAGE, page,
+		   MEMDELTA_PAGE))
+      return candidate;
+  }
+
+  return -1;
+}
+
+
+/*
+ * Append one page to the map, extending the last entry when the page
+ * continues its run.
+ */
+
+static int
+add_page(page_map_t *map, uint32_t kind, uint64_t base_page) {
+  map_entry_t *last = map->count ? &map->entries[map->count - 1] : NULL;
+
+  if((last != NULL) && (last->kind == kind) && (last->pages < UINT32_MAX) &&
+     ((kind != MAP_MOVED) || (last->base_page + last->pages == base_page))) {
+    last->pages++;
+    return 0;
+  }
+
+  if(map->count == map->capacity) {
+    uint32_t capacity = map->capacity ? map->capacity * 2 : 256;
+    map_entry_t *entries;
+
+    entries = (map_entry_t *)realloc(map->entries,
+				     capacity * sizeof(map_entry_t));
+    if(entries == NULL) {
+      perror("realloc");
+      return -1;
+    }
+    map->entries = entries;
+    map->capacity = capacity;
+  }
+
+  last = &map->entries[map->count++];
+  last->kind = kind;
+  last->pages = 1;
+  last->base_page = base_page;
+
+  return 0;
+}
+
+
+static int
+make_delta(const char *base_path, const char *new_path,
+	   const char *delta_path) {
+  mapping_t base, target;
+  page_map_t map;
+  page_index_t index;
+  unsigned char header[HEADER_SIZE];
+  uint64_t pages, page, counts[4] = {0, 0, 0, 0}, offset;
+  uint32_t i;
+  int fd;
+
+  memset(&map, 0, sizeof(page_map_t));
+  memset(&index, 0, sizeof(page_index_t));
+
+  if((map_file(base_path, &base) < 0) || (map_file(new_path, &target) < 0))
+    return -1;
+
+  pages = (target.size + MEMDELTA_PAGE - 1) / MEMDELTA_PAGE;
+
+  for(page=0; page<pages; page++) {
+    const unsigned char *p = target.data + page * MEMDELTA_PAGE;
+    uint64_t offset = page * MEMDELTA_PAGE;
+    size_t len = target.size - offset;
+    uint32_t kind = MAP_DATA;
+    int64_t from = 0;
+
+    if(len > MEMDELTA_PAGE)
+      len = MEMDELTA_PAGE;
+
+    if((offset + len <= base.size) &&
+       pages_equal(p, base.data + offset, len))
+      kind = MAP_SAME;
+    else if(page_is_zero(p, len))
+      kind = MAP_ZERO;
+    else if((len == MEMDELTA_PAGE) && (base.size >= MEMDELTA_PAGE)) {
+      if((index.slots == NULL) && (build_page_index(&index, &base) < 0))
+	return -1;
+      from = find_base_page(&index, &base, p);
+      if(from >= 0)
+	kind = MAP_MOVED;
+      else
+	from = 0;
+    }
+
+    if(add_page(&map, kind, from) < 0)
+      return -1;
+    counts[kind]++;
+  }
+
+  fd = open(delta_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) {
+    perror(delta_path);
+    return -1;
+  }
+
+  memcpy(header, MEMDELTA_MAGIC, 4);
+  put_u32(header + 4, MEMDELTA_VERSION);
+  put_u32(header + 8, MEMDELTA_PAGE);
+  put_u32(header + 12, map.count);
+  put_u64(header + 16, base.size);
+  put_u64(header + 24, target.size);
+  if(writen(fd, header, HEADER_SIZE) < 0)
+    return -1;
+
+  for(i=0; i<map.count; i++) {
+    unsigned char entry[MAP_ENTRY_SIZE];
+
+    memset(entry, 0, MAP_ENTRY_SIZE);
+    entry[0] = map.entries[i].kind;
+    put_u32(entry + 4, map.entries[i].pages);
+    put_u64(entry + 8, map.entries[i].base_page);
+    if(writen(fd, entry, MAP_ENTRY_SIZE) < 0)
+      return -1;
+  }
+
+  for(i=0, offset=0; i<map.count; i++) {
+    uint64_t len = (uint64_t)map.entries[i].pages * MEMDELTA_PAGE;
+
+    if(offset + len > target.size)
+      len = target.size - offset;
+    if((map.entries[i].kind == MAP_DATA) &&
+       (writen(fd, target.data + offset, len) < 0))
+      return -1;
+    offset += len;
+  }
+
+  if(close(fd) < 0) {
+    perror("close");
+    return -1;
+  }
+
+  if(verbose)
+    fprintf(stderr, "memdelta: %llu pages: %llu unchanged, %llu zero, "
+	    "%llu moved, %llu new; %u map entries\n",
+	    (unsigned long long)pages, (unsigned long long)counts[MAP_SAME],
+	    (unsigned long long)counts[MAP_ZERO],
+	    (unsigned long long)counts[MAP_MOVED],
+	    (unsigned long long)counts[MAP_DATA], map.count);
+
+  free(map.entries);
+  free(index.slots);
+  unmap_file(&base);
+  unmap_file(&target);
+
+  return 0;
+}
+
+
+/*
+ * A piece of the new state that differs from the base at the same
+ * offset.  Pieces are at most APPLY_PIECE_SIZE so that threads share a
+ * few large changed runs evenly.
+ */
+
+#define APPLY_PIECE_SIZE (1024 * 1024)
+
+typedef struct {
+  uint64_t             offset;
+  uint64_t             length;
+  const unsigned char *src;       /* NULL to zero the range. */
+} apply_piece_t;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  apply_piece_t  *pieces;
+  size_t          count;
+  size_t          next;
+  unsigned char  *out;
+  int             fd;
+  uint64_t        base_size;
+} apply_work_t;
+
+static int
+add_piece(apply_piece_t **pieces, size_t *count, size_t *capacity,
+	  uint64_t offset, uint64_t length, const unsigned char *src) {
+  while(length > 0) {
+    uint64_t len = (length > APPLY_PIECE_SIZE) ? APPLY_PIECE_SIZE : length;
+
+    if(*count == *capacity) {
+      size_t c = *capacity ? *capacity * 2 : 256;
+      apply_piece_t *p;
+
+      p = (apply_piece_t *)realloc(*pieces, c * sizeof(apply_piece_t));
+      if(p == NULL) {
+	perror("realloc");
+	return -1;
+      }
+      *pieces = p;
+      *capacity = c;
+    }
+
+    (*pieces)[*count].offset = offset;
+    (*pieces)[*count].length = len;
+    (*pieces)[*count].src = src;
+    (*count)++;
+
+    offset += len;
+    length -= len;
+    if(src != NULL)
+      src += len;
+  }
+
+  return 0;
+}
+
+static void *
+apply_thread(void *arg) {
+  apply_work_t *work = (apply_work_t *)arg;
+
+  for(;;) {
+    apply_piece_t *piece;
+
+    pthread_mutex_lock(&work->mutex);
+    piece = (work->next < work->count) ? &work->pieces[work->next++] : NULL;
+    pthread_mutex_unlock(&work->mutex);
+
+    if(piece == NULL)
+      break;
+
+    if(piece->src != NULL) {
+      memcpy(work->out + piece->offset, piece->src, piece->length);
+      continue;
+    }
+
+    /*
+     * Zeroes past the end of the base are already there.  Zeroes over
+     * cloned base pages are punched out where possible, rather than
+     * dirtying every page.
+     */
+
+    if(piece->offset >= work->base_size)
+      continue;
+    if(fallocate(work->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		 piece->offset, piece->length) == 0)
+      continue;
+    memset(work->out + piece->offset, 0, piece->length);
+  }
+
+  return NULL;
+}
+
+
+/*
+ * Rebuild the new state from the base and a delta.  The output starts
+ * as a clone of the base, and threads then write only the pages that
+ * differ, into a shared mapping of it, so the time taken follows the
+ * size of the delta rather than the size of the memory state.
+ */
+
+static int
+apply_delta(const char *delta_path, const char *base_path,
+	    const char *new_path) {
+  mapping_t delta, base;
+  const unsigned char *data;
+  uint64_t base_size, target_size, offset;
+  uint32_t count, i;
+  apply_work_t work;
+  pthread_t *threads;
+  size_t capacity = 0;
+  char tmp_path[PATH_MAX];
+  int fd, base_fd, t;
+
+  memset(&work, 0, sizeof(apply_work_t));
+
+  if((map_file(delta_path, &delta) < 0) || (map_file(base_path, &base) < 0))
+    return -1;
+
+  if((delta.size < HEADER_SIZE) ||
+     (memcmp(delta.data, MEMDELTA_MAGIC, 4) != 0) ||
+     (get_u32(delta.data + 4) != MEMDELTA_VERSION) ||
+     (get_u32(delta.data + 8) != MEMDELTA_PAGE)) {
+    fprintf(stderr, "memdelta: '%s' is not a memory delta\n", delta_path);
+    return -1;
+  }
+
+  count = get_u32(delta.data + 12);
+  base_size = get_u64(delta.data + 16);
+  target_size = get_u64(delta.data + 24);
+  if(base_size != base.size) {
+    fprintf(stderr, "memdelta: delta was taken against a different base\n");
+    return -1;
+  }
+  if(HEADER_SIZE + (uint64_t)count * MAP_ENTRY_SIZE > delta.size) {
+    fprintf(stderr, "memdelta: truncated delta\n");
+    return -1;
+  }
+
+
+  /* Check the whole map and turn it into pieces of work first. */
+
+  data = delta.data + HEADER_SIZE + (uint64_t)count * MAP_ENTRY_SIZE;
+
+  for(i=0, offset=0; i<count; i++) {
+    const unsigned char *entry = delta.data + HEADER_SIZE +
+      (uint64_t)i * MAP_ENTRY_SIZE;
+    uint64_t len = (uint64_t)get_u32(entry + 4) * MEMDELTA_PAGE;
+    uint64_t from = get_u64(entry + 8) * MEMDELTA_PAGE;
+    const unsigned char *src = NULL;
+
+    if(offset + len > target_size)
+      len = target_size - offset;
+
+    switch(entry[0]) {
+    case MAP_SAME:
+      if(offset + len > base.size) {
+	fprintf(stderr, "memdelta: delta refers past the end of the base\n");
+	return -1;
+      }
+      offset += len;
+      continue;
+
+    case MAP_MOVED:
+      if((from > base.size) || (len > base.size - from)) {
+	fprintf(stderr, "memdelta: delta refers past the end of the base\n");
+	return -1;
+      }
+      src = base.data + from;
+      break;
+
+    case MAP_ZERO:
+      break;
+
+    case MAP_DATA:
+      if((uint64_t)(delta.data + delta.size - data) < len) {
+	fprintf(stderr, "memdelta: truncated delta\n");
+	return -1;
+      }
+      src = data;
+      data += len;
+      break;
+
+    default:
+      fprintf(stderr, "memdelta: unknown page map entry %d\n", entry[0]);
+      return -1;
+    }
+
+    if(add_piece(&work.pieces, &work.count, &capacity, offset, len, src) < 0)
+      return -1;
+    offset += len;
+  }
+
+  if(offset != target_size) {
+    fprintf(stderr, "memdelta: page map does not cover the new state\n");
+    return -1;
+  }
+
+
+  /* Clone the base and patch it in place. */
+
+  base_fd = open(base_path, O_RDONLY);
+  if(base_fd < 0) {
+    perror(base_path);
+    return -1;
+  }
+
+  /*
+   * The new state is built beside new_path and renamed into place, so
+   * that the new file may be the base itself, which is still mapped.
+   */
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", new_path);
+  fd = mkstemp(tmp_path);
+  if((fd < 0) || (fchmod(fd, 0644) < 0)) {
+    perror(new_path);
+    if(fd >= 0) {
+      close(fd);
+      unlink(tmp_path);
+    }
+    return -1;
+  }
+
+  /*
+   * Start from a copy of the base.  A reflink shares the base's blocks,
+   * so pages the delta leaves unchanged are never read or written.
+   */
+
+  if(copy_file_fast(base_fd, fd, base.size) < 0) {
+    perror("memdelta: copying base");
+    goto fail;
+  }
+  close(base_fd);
+
+  if(ftruncate(fd, target_size) < 0) {
+    perror("ftruncate");
+    goto fail;
+  }
+
+  if(work.count > 0) {
+    work.out = (unsigned char *)mmap(NULL, target_size,
+				     PROT_READ | PROT_WRITE, MAP_SHARED,
+				     fd, 0);
+    if(work.out == MAP_FAILED) {
+      perror("mmap");
+      goto fail;
+    }
+  }
+  work.fd = fd;
+  work.base_size = base.size;
+  pthread_mutex_init(&work.mutex, NULL);
+
+  if((size_t)num_threads > work.count)
+    num_threads = work.count ? work.count : 1;
+
+  threads = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
+  if(threads == NULL) {
+    perror("calloc");
+    goto fail;
+  }
+
+  for(t=0; t<num_threads; t++)
+    if(pthread_create(&threads[t], NULL, apply_thread, &work) != 0) {
+      fprintf(stderr, "memdelta: failed creating thread\n");
+      goto fail;
+    }
+  for(t=0; t<num_threads; t++)
+    pthread_join(threads[t], NULL);
+
+  if(verbose)
+    fprintf(stderr, "memdelta: applied %lu pieces with %d threads\n",
+	    (unsigned long)work.count, num_threads);
+
+  if((work.out != NULL) && (munmap(work.out, target_size) < 0)) {
+    perror("munmap");
+    goto fail;
+  }
+
+  if(close(fd) < 0) {
+    perror("close");
+    fd = -1;
+    goto fail;
+  }
+  fd = -1;
+
+  if(rename(tmp_path, new_path) < 0) {
+    perror(new_path);
+    goto fail;
+  }
+
+  free(threads);
+  free(work.pieces);
+  unmap_file(&delta);
+  unmap_file(&base);
+
+  return 0;
+
+ fail:
+  if(fd >= 0)
+    close(fd);
+  unlink(tmp_path);
+
+  return -1;
+}
+
+int
+main(int argc, char *argv[]) {
+  int opt, err;
+  long n;
+
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+  num_threads = (n > 0) ? n : 1;
+
+  while((opt = getopt(argc, argv, "ht:v")) != -1) {
+    switch(opt) {
+    case 't':
+      num_threads = atoi(optarg);
+      if(num_threads <= 0) {
+	fprintf(stderr, "memdelta: thread count must be positive\n");
+	return EXIT_FAILURE;
+      }
+      break;
+
+    case 'v':
+      verbose = 1;
+      break;
+
+    default:
+      usage();
+      return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if(argc - optind != 4) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  if(strcmp(argv[optind], "delta") == 0)
+    err = make_delta(argv[optind+1], argv[optind+2], argv[optind+3]);
+  else if(strcmp(argv[optind], "patch") == 0)
+    err = apply_delta(argv[optind+1], argv[optind+2], argv[optind+3]);
+  else {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  return (err < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
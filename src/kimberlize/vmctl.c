@@ -0,0 +1,283 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * vmctl
+ *
+ * Controls the VMs kimberlize and dekimberlize work with, through a
+ * pluggable hypervisor backend: VirtualBox, or a fake one that keeps
+ * its VMs in files, for running the launch path without VirtualBox.
+ *
+ * Waiting for a VM to change state is driven by the backend's change
+ * notifications, so that a wait ends as soon as the state changes.  Not
+ * every change leaves a trace in the VM's files, so the state is also
+ * asked for every VMCTL_RECHECK_MS, which is no slower than the polling
+ * it replaced.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "vmctl.h"
+
+
+#define VMCTL_RECHECK_MS 100
+#define VMCTL_SETTLE_MS  10     /* To take a burst of changes at once. */
+
+
+static const vmctl_backend_t *backends[] = {
+  &vmctl_virtualbox,
+  &vmctl_fake
+};
+
+
+int
+vmctl_parse_info(const char *text, const char *key, char *value,
+		 size_t len) {
+  size_t key_len = strlen(key);
+  const char *line;
+
+  for(line = text; line != NULL && *line != '\0'; ) {
+    const char *end = strchr(line, '\n');
+    size_t line_len = (end != NULL) ? (size_t)(end - line) : strlen(line);
+
+    if((line_len > key_len + 1) && (strncmp(line, key, key_len) == 0) &&
+       (line[key_len] == '=')) {
+      const char *v = line + key_len + 1;
+      size_t v_len = line_len - key_len - 1;
+
+      if((v_len >= 2) && (v[0] == '"') && (v[v_len-1] == '"')) {
+	v++;
+	v_len -= 2;
+      }
+      if(v_len >= len)
+	v_len = len - 1;
+      memcpy(value, v, v_len);
+      value[v_len] = '\0';
+      return 0;
+    }
+
+    line = (end != NULL) ? end + 1 : NULL;
+  }
+
+  return -1;
+}
+
+
+static long long
+now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/*
+ * Whether state is one of the comma-separated states.
+ */
+
+static int
+state_in(const char *state, const char *states) {
+  size_t len = strlen(state);
+  const char *p = states;
+
+  while(p != NULL) {
+    if((strncmp(p, state, len) == 0) && ((p[len] == ',') || (p[len] == '\0')))
+      return 1;
+    p = strchr(p, ',');
+    if(p != NULL)
+      p++;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Wait until the VM is in one of states, or, with states NULL, print
+ * every state it goes through.  Returns 0 once it is, 1 on timeout, and
+ * -1 on error.  A negative timeout waits forever.
+ */
+
+static int
+wait_for_state(const vmctl_backend_t *backend, void *vm, const char *states,
+	       int timeout_ms) {
+  char state[VMCTL_STATE_MAX], last[VMCTL_STATE_MAX] = "";
+  long long start = now_ms();
+  int fd = backend->watch_fd(vm);
+
+  while(1) {
+    struct pollfd pfd;
+    int wait_ms = VMCTL_RECHECK_MS;
+
+    if(backend->state(vm, state) < 0)
+      return -1;
+
+    if(states == NULL) {
+      if(strcmp(state, last) != 0) {
+	printf("%s\n", state);
+	fflush(stdout);
+	strcpy(last, state);
+      }
+    }
+    else if(state_in(state, states))
+      return 0;
+
+    if(timeout_ms >= 0) {
+      long long left = timeout_ms - (now_ms() - start);
+      if(left <= 0)
+	return 1;
+      if(left < wait_ms)
+	wait_ms = left;
+    }
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if(poll(&pfd, (fd >= 0) ? 1 : 0, wait_ms) > 0) {
+      struct timespec settle = { 0, VMCTL_SETTLE_MS * 1000000 };
+
+      nanosleep(&settle, NULL);
+      backend->watch_ack(vm);
+    }
+  }
+}
+
+
+static void
+usage(void) {
+  printf("usage: vmctl [-b virtualbox|fake] <command> <vm-name> [args]\n"
+	 "  state <vm>                     print the VM's state\n"
+	 "  wait <vm> <state[,state..]> [seconds]\n"
+	 "                                 wait for the VM to reach a state\n"
+	 "  events <vm>                    print each state the VM goes to\n"
+	 "  start <vm>\n"
+	 "  poweroff <vm>\n"
+	 "  snapshot-exists <vm> <name>\n"
+	 "  snapshot-take <vm> <name>\n"
+	 "  snapshot-restore <vm>          discard the current state\n"
+	 "  floppy <vm> <image|none>\n"
+	 "  forget-floppy <vm> <image>\n"
+	 "  info <vm> <key>                print a showvminfo field, or\n"
+	 "                                 MachineFolder\n"
+	 "  create <vm> [megabytes]        make a VM (fake backend only)\n"
+	 "The backend can also be chosen with VMCTL_BACKEND.\n");
+}
+
+
+int
+main(int argc, char *argv[]) {
+  const vmctl_backend_t *backend = NULL;
+  const char *name, *command, *vm_name;
+  char value[VMCTL_INFO_MAX];
+  unsigned int i;
+  void *vm;
+  int opt, ret = -1;
+
+  name = getenv("VMCTL_BACKEND");
+  if(name == NULL)
+    name = "virtualbox";
+
+  while((opt = getopt(argc, argv, "b:h")) != -1) {
+    switch(opt) {
+    case 'b':
+      name = optarg;
+      break;
+    default:
+      usage();
+      return EXIT_FAILURE;
+    }
+  }
+
+  for(i=0; i<sizeof(backends)/sizeof(backends[0]); i++)
+    if(strcmp(backends[i]->name, name) == 0)
+      backend = backends[i];
+
+  if((backend == NULL) || (argc - optind < 2)) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  command = argv[optind];
+  vm_name = argv[optind + 1];
+  argv += optind + 2;
+  argc -= optind + 2;
+
+  signal(SIGPIPE, SIG_IGN);
+
+  if(strcmp(command, "create") == 0) {
+    if(backend->create == NULL) {
+      fprintf(stderr, "vmctl: the %s backend can't create VMs\n", 
+	      backend->name);
+      return EXIT_FAILURE;
+    }
+    return (backend->create(vm_name, (argc > 0) ? atoi(argv[0]) : 16) < 0) ?
+      EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  vm = backend->open(vm_name);
+  if(vm == NULL) {
+    fprintf(stderr, "vmctl: no VM '%s'\n", vm_name);
+    return EXIT_FAILURE;
+  }
+
+  if(strcmp(command, "state") == 0) {
+    if((ret = backend->state(vm, value)) == 0)
+      printf("%s\n", value);
+  }
+  else if((strcmp(command, "wait") == 0) && (argc >= 1)) {
+    ret = wait_for_state(backend, vm, argv[0], 
+			 (argc >= 2) ? atoi(argv[1]) * 1000 : -1);
+  }
+  else if(strcmp(command, "events") == 0)
+    ret = wait_for_state(backend, vm, NULL, -1);
+  else if(strcmp(command, "start") == 0)
+    ret = backend->start(vm);
+  else if(strcmp(command, "poweroff") == 0)
+    ret = backend->poweroff(vm);
+  else if((strcmp(command, "snapshot-exists") == 0) && (argc >= 1))
+    ret = (backend->snapshot_exists(vm, argv[0]) == 1) ? 0 : 1;
+  else if((strcmp(command, "snapshot-take") == 0) && (argc >= 1))
+    ret = backend->snapshot_take(vm, argv[0]);
+  else if(strcmp(command, "snapshot-restore") == 0)
+    ret = backend->snapshot_restore(vm);
+  else if((strcmp(command, "floppy") == 0) && (argc >= 1))
+    ret = backend->floppy(vm, (strcmp(argv[0], "none") == 0) ? NULL : argv[0]);
+  else if((strcmp(command, "forget-floppy") == 0) && (argc >= 1))
+    ret = backend->forget_floppy(vm, argv[0]);
+  else if((strcmp(command, "info") == 0) && (argc >= 1)) {
+    if((ret = backend->info(vm, argv[0], value, sizeof(value))) == 0)
+      printf("%s\n", value);
+  }
+  else {
+    usage();
+    ret = -1;
+  }
+
+  backend->close(vm);
+
+  return (ret == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
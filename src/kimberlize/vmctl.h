@@ -0,0 +1,71 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VMCTL_H
+#define VMCTL_H
+
+#include <stddef.h>
+
+/*
+ * A hypervisor backend for vmctl.  Every call takes the handle open()
+ * returned for a VM and returns 0, or -1 on failure, but for
+ * snapshot_exists, which returns 1 or 0.
+ *
+ * VM states are VirtualBox's names for them: "poweroff", "saved",
+ * "starting", "running", "paused", "stopping", "aborted" and so on.
+ *
+ * watch_fd() returns a descriptor which turns readable when the VM's
+ * state may have changed, and watch_ack() empties it; vmctl then asks
+ * for the state again rather than polling for it.
+ */
+
+#define VMCTL_STATE_MAX 32
+#define VMCTL_INFO_MAX  4096
+
+typedef struct {
+  const char *name;
+  void *(*open)(const char *vm);
+  void  (*close)(void *vm);
+  int   (*state)(void *vm, char *state);
+  int   (*watch_fd)(void *vm);
+  void  (*watch_ack)(void *vm);
+  int   (*start)(void *vm);
+  int   (*poweroff)(void *vm);
+  int   (*snapshot_exists)(void *vm, const char *name);
+  int   (*snapshot_take)(void *vm, const char *name);
+  int   (*snapshot_restore)(void *vm);
+  int   (*floppy)(void *vm, const char *image);
+  int   (*forget_floppy)(void *vm, const char *image);
+  int   (*info)(void *vm, const char *key, char *value, size_t len);
+  int   (*create)(const char *vm, int megabytes);   /* May be NULL. */
+} vmctl_backend_t;
+
+extern const vmctl_backend_t vmctl_virtualbox;
+extern const vmctl_backend_t vmctl_fake;
+
+
+/*
+ * Find key="value" in VBoxManage's -machinereadable output, which the
+ * fake backend keeps its VMs' details in too.  Returns 0 if found.
+ */
+
+int vmctl_parse_info(const char *text, const char *key, char *value,
+		     size_t len);
+
+#endif
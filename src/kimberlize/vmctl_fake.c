@@ -0,0 +1,560 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The fake backend of vmctl, for running kimberlize, dekimberlize and
+ * the launch path on a machine without VirtualBox.  Each VM is a
+ * directory under VMCTL_FAKE_DIR laid out like a VirtualBox machine
+ * folder: a settings file naming its disk, and memory and disk images
+ * under Snapshots.  Next to them are its state, its details in
+ * showvminfo's format, and the names of its snapshots.
+ *
+ * Its timing and failures are scripted through the environment:
+ *
+ *   VMCTL_FAKE_START_MS  time from start until running (500)
+ *   VMCTL_FAKE_STOP_MS   time from poweroff until powered off (100)
+ *   VMCTL_FAKE_FAIL      commands to fail, e.g. "start,floppy"
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "copy_file.h"
+#include "vmctl.h"
+
+
+#define FAKE_DEFAULT_DIR      "/tmp/vmctl-fake"
+#define FAKE_DEFAULT_START_MS 500
+#define FAKE_DEFAULT_STOP_MS  100
+
+typedef struct {
+  char name[PATH_MAX];
+  char folder[PATH_MAX];
+  int  inotify_fd;
+} fake_vm_t;
+
+
+static const char *
+fake_dir(void) {
+  const char *dir = getenv("VMCTL_FAKE_DIR");
+
+  return (dir != NULL) ? dir : FAKE_DEFAULT_DIR;
+}
+
+
+static int
+fake_env_ms(const char *name, int dflt) {
+  const char *value = getenv(name);
+
+  return (value != NULL) ? atoi(value) : dflt;
+}
+
+
+/*
+ * Format a path into a buffer of PATH_MAX, failing rather than
+ * truncating it.
+ */
+
+static int
+fake_path(char *path, const char *format, ...) {
+  va_list ap;
+  int len;
+
+  va_start(ap, format);
+  len = vsnprintf(path, PATH_MAX, format, ap);
+  va_end(ap);
+
+  if((len < 0) || (len >= PATH_MAX)) {
+    fprintf(stderr, "vmctl: fake path too long\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Whether the script says the command should fail.
+ */
+
+static int
+fake_fails(const char *command) {
+  const char *fail = getenv("VMCTL_FAKE_FAIL");
+  size_t len = strlen(command);
+  const char *p;
+
+  for(p = fail; p != NULL; p = strchr(p, ',') ? strchr(p, ',') + 1 : NULL)
+    if((strncmp(p, command, len) == 0) && ((p[len] == ',') || (p[len] == '\0'))) {
+      fprintf(stderr, "vmctl: fake %s failing as scripted\n", command);
+      return 1;
+    }
+
+  return 0;
+}
+
+
+/*
+ * Replace a file of the VM's in one go, so that a watcher never reads
+ * half of it.
+ */
+
+static int
+fake_write(const char *folder, const char *file, const char *contents) {
+  char path[PATH_MAX], tmp[PATH_MAX];
+  FILE *fp;
+
+  if((fake_path(path, "%s/%s", folder, file) < 0) ||
+     (fake_path(tmp, "%s/.%s.tmp", folder, file) < 0))
+    return -1;
+
+  fp = fopen(tmp, "w");
+  if(fp == NULL)
+    return -1;
+  fputs(contents, fp);
+  if(fclose(fp) != 0)
+    return -1;
+
+  return rename(tmp, path);
+}
+
+
+static int
+fake_read(const char *folder, const char *file, char *buf, size_t len) {
+  char path[PATH_MAX];
+  size_t n;
+  FILE *fp;
+
+  if(fake_path(path, "%s/%s", folder, file) < 0)
+    return -1;
+  fp = fopen(path, "r");
+  if(fp == NULL)
+    return -1;
+  n = fread(buf, 1, len - 1, fp);
+  buf[n] = '\0';
+  fclose(fp);
+
+  return 0;
+}
+
+
+static void
+fake_uuid(char *uuid) {
+  unsigned char b[16];
+  int fd = open("/dev/urandom", O_RDONLY);
+
+  if((fd < 0) || (read(fd, b, sizeof(b)) != sizeof(b)))
+    memset(b, 0, sizeof(b));
+  if(fd >= 0)
+    close(fd);
+
+  sprintf(uuid, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-"
+	  "%02x%02x%02x%02x%02x%02x", b[0], b[1], b[2], b[3], b[4], b[5],
+	  b[6], b[7], b[8], b[9], b[10], b[11], b[12], b[13], b[14], b[15]);
+}
+
+
+static int
+fake_copy(const char *folder, const char *from_uuid, const char *to_uuid) {
+  char from[PATH_MAX], to[PATH_MAX];
+  struct stat st;
+  int in_fd, out_fd, ret;
+
+  if((fake_path(from, "%s/Snapshots/{%s}.sav", folder, from_uuid) < 0) ||
+     (fake_path(to, "%s/Snapshots/{%s}.sav", folder, to_uuid) < 0))
+    return -1;
+
+  in_fd = open(from, O_RDONLY);
+  if((in_fd < 0) || (fstat(in_fd, &st) < 0))
+    return -1;
+  out_fd = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(out_fd < 0) {
+    close(in_fd);
+    return -1;
+  }
+  ret = copy_file_fast(in_fd, out_fd, st.st_size);
+  close(in_fd);
+  close(out_fd);
+
+  return ret;
+}
+
+
+static int
+fake_info(void *arg, const char *key, char *value, size_t len) {
+  fake_vm_t *vm = (fake_vm_t *)arg;
+  char info[VMCTL_INFO_MAX];
+
+  if(strcmp(key, "MachineFolder") == 0) {
+    snprintf(value, len, "%s", vm->folder);
+    return 0;
+  }
+
+  if(strcmp(key, "VMState") == 0) {
+    if(fake_read(vm->folder, "state", value, len) < 0)
+      return -1;
+    value[strcspn(value, "\n")] = '\0';
+    return 0;
+  }
+
+  if(fake_read(vm->folder, "info", info, sizeof(info)) < 0)
+    return -1;
+
+  return vmctl_parse_info(info, key, value, len);
+}
+
+
+static int
+fake_state(void *arg, char *state) {
+  return fake_info(arg, "VMState", state, VMCTL_STATE_MAX);
+}
+
+
+static void *
+fake_open(const char *name) {
+  fake_vm_t *vm;
+  struct stat st;
+
+  vm = (fake_vm_t *)calloc(1, sizeof(fake_vm_t));
+  if(vm == NULL)
+    return NULL;
+  snprintf(vm->name, sizeof(vm->name), "%s", name);
+  if((fake_path(vm->folder, "%s/%s", fake_dir(), name) < 0) ||
+     (stat(vm->folder, &st) < 0)) {
+    free(vm);
+    return NULL;
+  }
+
+  vm->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if(vm->inotify_fd >= 0)
+    inotify_add_watch(vm->inotify_fd, vm->folder, IN_MOVED_TO);
+
+  return vm;
+}
+
+
+static void
+fake_close(void *arg) {
+  fake_vm_t *vm = (fake_vm_t *)arg;
+
+  if(vm->inotify_fd >= 0)
+    close(vm->inotify_fd);
+  free(vm);
+}
+
+
+static int
+fake_watch_fd(void *arg) {
+  return ((fake_vm_t *)arg)->inotify_fd;
+}
+
+
+static void
+fake_watch_ack(void *arg) {
+  fake_vm_t *vm = (fake_vm_t *)arg;
+  char buf[4096];
+
+  while(read(vm->inotify_fd, buf, sizeof(buf)) > 0)
+    ;
+}
+
+
+/*
+ * Move the VM to state now, and on to final after delay_ms, from a
+ * process of its own as the hypervisor would.
+ */
+
+static int
+fake_transition(fake_vm_t *vm, const char *state, const char *final,
+		int delay_ms) {
+  pid_t pid;
+
+  if(fake_write(vm->folder, "state", state) < 0)
+    return -1;
+
+  pid = fork();
+  if(pid < 0)
+    return -1;
+  if(pid == 0) {
+    struct timespec ts = { delay_ms / 1000, (delay_ms % 1000) * 1000000 };
+    char current[VMCTL_STATE_MAX];
+
+    if(fork() != 0)
+      _exit(0);
+    setsid();
+    nanosleep(&ts, NULL);
+    if((fake_state(vm, current) == 0) && (strcmp(current, state) == 0))
+      fake_write(vm->folder, "state", final);
+    _exit(0);
+  }
+  waitpid(pid, NULL, 0);
+
+  return 0;
+}
+
+
+static int
+fake_start(void *arg) {
+  fake_vm_t *vm = (fake_vm_t *)arg;
+  char state[VMCTL_STATE_MAX];
+
+  if(fake_fails("start") || (fake_state(vm, state) < 0))
+    return -1;
+  if((strcmp(state, "poweroff") != 0) && (strcmp(state, "saved") != 0) &&
+     (strcmp(state, "aborted") != 0)) {
+    fprintf(stderr, "vmctl: fake VM '%s' is %s\n", vm->name, state);
+    return -1;
+  }
+
+  return fake_transition(vm, "starting", "running", 
+			 fake_env_ms("VMCTL_FAKE_START_MS", 
+				     FAKE_DEFAULT_START_MS));
+}
+
+
+static int
+fake_poweroff(void *arg) {
+  fake_vm_t *vm = (fake_vm_t *)arg;
+  char state[VMCTL_STATE_MAX];
+
+  if(fake_fails("poweroff") || (fake_state(vm, state) < 0))
+    return -1;
+  if((strcmp(state, "running") != 0) && (strcmp(state, "paused") != 0)) {
+    fprintf(stderr, "vmctl: fake VM '%s' is %s\n", vm->name, state);
+    return -1;
+  }
+
+  return fake_transition(vm, "stopping", "poweroff", 
+			 fake_env_ms("VMCTL_FAKE_STOP_MS", 
+				     FAKE_DEFAULT_STOP_MS));
+}
+
+
+static int
+fake_snapshot_exists(void *arg, const char *name) {
+  fake_vm_t *vm = (fake_vm_t *)arg;
+  char snapshots[VMCTL_INFO_MAX], *line, *save = NULL;
+
+  if(fake_read(vm->folder, "snapshots", snapshots, sizeof(snapshots)) < 0)
+    return 0;
+
+  for(line = strtok_r(snapshots, "\n", &save); line != NULL;
+      line = strtok_r(NULL, "\n", &save))
+    if(strcmp(line, name) == 0)
+      return 1;
+
+  return 0;
+}
+
+
+/*
+ * Snapshots keep the memory image of the current state under the
+ * snapshot's UUID, and restoring one copies it back.
+ */
+
+static int
+fake_snapshot_take(void *arg, const char *name) {
+  fake_vm_t *vm = (fake_vm_t *)arg;
+  char info[VMCTL_INFO_MAX], snapshots[VMCTL_INFO_MAX] = "";
+  char uuid[64], snapshot_uuid[40], cfg[PATH_MAX];
+
+  if(fake_fails("snapshot-take"))
+    return -1;
+
+  if((fake_info(vm, "UUID", uuid, sizeof(uuid)) < 0) ||
+     (fake_info(vm, "CfgFile", cfg, sizeof(cfg)) < 0))
+    return -1;
+
+  fake_uuid(snapshot_uuid);
+  if(fake_copy(vm->folder, uuid, snapshot_uuid) < 0)
+    return -1;
+
+  fake_read(vm->folder, "snapshots", snapshots, sizeof(snapshots));
+  strncat(snapshots, name, sizeof(snapshots) - strlen(snapshots) - 2);
+  strcat(snapshots, "\n");
+
+  if(snprintf(info, sizeof(info), "name=\"%s\"\nUUID=\"%s\"\n"
+	      "SnapshotUUID=\"%s\"\nCfgFile=\"%s\"\n", vm->name, uuid, 
+	      snapshot_uuid, cfg) >= (int) sizeof(info))
+    return -1;
+
+  if((fake_write(vm->folder, "snapshots", snapshots) < 0) ||
+     (fake_write(vm->folder, "info", info) < 0))
+    return -1;
+
+  return 0;
+}
+
+
+static int
+fake_snapshot_restore(void *arg) {
+  fake_vm_t *vm = (fake_vm_t *)arg;
+  char uuid[64], snapshot_uuid[64], state[VMCTL_STATE_MAX];
+
+  if(fake_fails("snapshot-restore") || (fake_state(vm, state) < 0))
+    return -1;
+  if((strcmp(state, "running") == 0) || (strcmp(state, "starting") == 0)) {
+    fprintf(stderr, "vmctl: fake VM '%s' is %s\n", vm->name, state);
+    return -1;
+  }
+
+  if((fake_info(vm, "UUID", uuid, sizeof(uuid)) < 0) ||
+     (fake_info(vm, "SnapshotUUID", snapshot_uuid, 
+		sizeof(snapshot_uuid)) < 0) ||
+     (fake_copy(vm->folder, snapshot_uuid, uuid) < 0))
+    return -1;
+
+  return fake_write(vm->folder, "state", "saved");
+}
+
+
+static int
+fake_floppy(void *arg, const char *image) {
+  fake_vm_t *vm = (fake_vm_t *)arg;
+  char state[VMCTL_STATE_MAX];
+
+  if(fake_fails("floppy") || (fake_state(vm, state) < 0) ||
+     (strcmp(state, "running") != 0))
+    return -1;
+
+  return fake_write(vm->folder, "floppy", (image != NULL) ? image : "");
+}
+
+
+static int
+fake_forget_floppy(void *arg, const char *image) {
+  (void)arg;
+  (void)image;
+
+  return fake_fails("forget-floppy") ? -1 : 0;
+}
+
+
+/*
+ * Make a saved VM with a memory image of the given size, filled with
+ * random data, and a disk image an eighth of that.
+ */
+
+static int
+fake_fill(const char *path, int megabytes) {
+  char buf[65536];
+  int in_fd, out_fd, i, ret = 0;
+
+  in_fd = open("/dev/urandom", O_RDONLY);
+  out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if((in_fd < 0) || (out_fd < 0))
+    ret = -1;
+
+  for(i=0; (ret == 0) && (i < megabytes * 16); i++)
+    if((read(in_fd, buf, sizeof(buf)) != sizeof(buf)) ||
+       (write(out_fd, buf, sizeof(buf)) != sizeof(buf)))
+      ret = -1;
+
+  if(in_fd >= 0)
+    close(in_fd);
+  if(out_fd >= 0)
+    close(out_fd);
+
+  return ret;
+}
+
+
+static int
+fake_create(const char *name, int megabytes) {
+  char folder[PATH_MAX], path[PATH_MAX], info[VMCTL_INFO_MAX];
+  char uuid[40], disk_uuid[40], settings[512];
+
+  mkdir(fake_dir(), 0755);
+  if((fake_path(folder, "%s/%s", fake_dir(), name) < 0) ||
+     (fake_path(path, "%s/Snapshots", folder) < 0))
+    return -1;
+  if(((mkdir(folder, 0755) < 0) && (errno != EEXIST)) ||
+     ((mkdir(path, 0755) < 0) && (errno != EEXIST))) {
+    perror(folder);
+    return -1;
+  }
+
+  fake_uuid(uuid);
+  fake_uuid(disk_uuid);
+
+  if(fake_path(path, "%s/Snapshots/{%s}.sav", folder, uuid) < 0)
+    return -1;
+  if(fake_fill(path, megabytes) < 0) {
+    perror(path);
+    return -1;
+  }
+  if(fake_path(path, "%s/Snapshots/{%s}.vdi", folder, disk_uuid) < 0)
+    return -1;
+  if(fake_fill(path, (megabytes + 7) / 8) < 0) {
+    perror(path);
+    return -1;
+  }
+
+  /* What kimberlize and dekimberlize look for in the settings file. */
+  snprintf(settings, sizeof(settings), 
+	   "<VirtualBox>\n"
+	   "  <Image uuid=\"{%s}\" format=\"VDI\"/>\n"
+	   "  <HardDiskAttachment hardDisk=\"{%s}\" bus=\"IDE\"/>\n"
+	   "</VirtualBox>\n", disk_uuid, disk_uuid);
+  if((fake_path(path, "%s.xml", name) < 0) ||
+     (fake_write(folder, path, settings) < 0))
+    return -1;
+
+  if(snprintf(info, sizeof(info), "name=\"%s\"\nUUID=\"%s\"\n"
+	      "CfgFile=\"%s/%s.xml\"\n", name, uuid, folder, name) >=
+     (int) sizeof(info))
+    return -1;
+  if((fake_write(folder, "info", info) < 0) ||
+     (fake_write(folder, "snapshots", "") < 0) ||
+     (fake_write(folder, "state", "saved") < 0))
+    return -1;
+
+  printf("%s\n", folder);
+
+  return 0;
+}
+
+
+const vmctl_backend_t vmctl_fake = {
+  .name             = "fake",
+  .open             = fake_open,
+  .close            = fake_close,
+  .state            = fake_state,
+  .watch_fd         = fake_watch_fd,
+  .watch_ack        = fake_watch_ack,
+  .start            = fake_start,
+  .poweroff         = fake_poweroff,
+  .snapshot_exists  = fake_snapshot_exists,
+  .snapshot_take    = fake_snapshot_take,
+  .snapshot_restore = fake_snapshot_restore,
+  .floppy           = fake_floppy,
+  .forget_floppy    = fake_forget_floppy,
+  .info             = fake_info,
+  .create           = fake_create
+};
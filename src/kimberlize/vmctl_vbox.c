@@ -0,0 +1,343 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The VirtualBox backend of vmctl.  It runs VBoxManage directly, without
+ * a shell or sed, and learns of state changes from inotify on the VM's
+ * machine folder, which VirtualBox writes its settings, logs and saved
+ * states into whenever the VM starts, stops or is saved.  Opening a VM
+ * runs nothing: its machine folder is only looked up once something
+ * needs it, so a state or info query costs one VBoxManage.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "vmctl.h"
+
+
+#define VBOX_MAX_ARGS 8
+
+#define VBOX_WATCH_EVENTS \
+  (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_TO)
+
+typedef struct {
+  char name[PATH_MAX];
+  char folder[PATH_MAX];        /* Empty until looked up. */
+  int  inotify_fd;
+  int  watching;
+} vbox_vm_t;
+
+
+/*
+ * Run VBoxManage with the NULL-terminated arguments, keeping what it
+ * prints in out if out isn't NULL.  Returns its exit status, or -1.
+ */
+
+static int
+vboxmanage(char *out, size_t out_len, const char *arg, ...) {
+  const char *argv[VBOX_MAX_ARGS + 2];
+  int pipefd[2], status, argc = 0;
+  size_t got = 0;
+  va_list ap;
+  pid_t pid;
+
+  argv[argc++] = "VBoxManage";
+  va_start(ap, arg);
+  for(; (arg != NULL) && (argc <= VBOX_MAX_ARGS); arg = va_arg(ap, const char *))
+    argv[argc++] = arg;
+  va_end(ap);
+  argv[argc] = NULL;
+
+  if(pipe2(pipefd, O_CLOEXEC) < 0)
+    return -1;
+
+  pid = fork();
+  if(pid < 0) {
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return -1;
+  }
+
+  if(pid == 0) {
+    int devnull = open("/dev/null", O_WRONLY);
+
+    dup2((out != NULL) ? pipefd[1] : devnull, STDOUT_FILENO);
+    execvp(argv[0], (char **) argv);
+    _exit(127);
+  }
+
+  close(pipefd[1]);
+  while(1) {
+    char discard[4096];
+    ssize_t n;
+
+    if((out != NULL) && (got < out_len - 1))
+      n = read(pipefd[0], out + got, out_len - 1 - got);
+    else
+      n = read(pipefd[0], discard, sizeof(discard));
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      break;
+    if((out != NULL) && (got < out_len - 1))
+      got += n;
+  }
+  close(pipefd[0]);
+  if(out != NULL)
+    out[got] = '\0';
+
+  while(waitpid(pid, &status, 0) < 0)
+    if(errno != EINTR)
+      return -1;
+
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+
+/*
+ * Run showvminfo, and note the machine folder from it if it isn't known
+ * yet.  Versions which don't report the settings file keep their
+ * machines in the user's VirtualBox directory.
+ */
+
+static int
+vbox_showvminfo(vbox_vm_t *vm, char *out, size_t out_len) {
+  char cfg[PATH_MAX], *slash;
+  int len;
+
+  if(vboxmanage(out, out_len, "showvminfo", vm->name, 
+		"-machinereadable", NULL) != 0)
+    return -1;
+
+  if(vm->folder[0] != '\0')
+    return 0;
+
+  if((vmctl_parse_info(out, "CfgFile", cfg, sizeof(cfg)) == 0) &&
+     ((slash = strrchr(cfg, '/')) != NULL)) {
+    *slash = '\0';
+    len = snprintf(vm->folder, sizeof(vm->folder), "%s", cfg);
+  }
+  else
+    len = snprintf(vm->folder, sizeof(vm->folder), 
+		   "%s/.VirtualBox/Machines/%s",
+		   getenv("HOME") ? getenv("HOME") : "", vm->name);
+
+  if(len >= (int) sizeof(vm->folder)) {
+    fprintf(stderr, "vmctl: machine folder of '%s' is too long\n", vm->name);
+    vm->folder[0] = '\0';
+    return -1;
+  }
+
+  return 0;
+}
+
+
+static int
+vbox_folder(vbox_vm_t *vm) {
+  char out[65536];
+
+  if(vm->folder[0] != '\0')
+    return 0;
+
+  return vbox_showvminfo(vm, out, sizeof(out));
+}
+
+
+static int
+vbox_info(void *arg, const char *key, char *value, size_t len) {
+  vbox_vm_t *vm = (vbox_vm_t *)arg;
+  char out[65536];
+
+  if(strcmp(key, "MachineFolder") == 0) {
+    if(vbox_folder(vm) < 0)
+      return -1;
+    snprintf(value, len, "%s", vm->folder);
+    return 0;
+  }
+
+  if(vbox_showvminfo(vm, out, sizeof(out)) < 0)
+    return -1;
+
+  return vmctl_parse_info(out, key, value, len);
+}
+
+
+static void *
+vbox_open(const char *name) {
+  vbox_vm_t *vm;
+
+  vm = (vbox_vm_t *)calloc(1, sizeof(vbox_vm_t));
+  if(vm == NULL)
+    return NULL;
+  snprintf(vm->name, sizeof(vm->name), "%s", name);
+  vm->inotify_fd = -1;
+
+  return vm;
+}
+
+
+static void
+vbox_close(void *arg) {
+  vbox_vm_t *vm = (vbox_vm_t *)arg;
+
+  if(vm->inotify_fd >= 0)
+    close(vm->inotify_fd);
+  free(vm);
+}
+
+
+static int
+vbox_state(void *arg, char *state) {
+  return vbox_info(arg, "VMState", state, VMCTL_STATE_MAX);
+}
+
+
+/*
+ * Watch the machine folder, and the Logs and Snapshots folders in it,
+ * from the first time a caller asks to.
+ */
+
+static int
+vbox_watch_fd(void *arg) {
+  static const char *folders[] = { "", "/Logs", "/Snapshots" };
+  vbox_vm_t *vm = (vbox_vm_t *)arg;
+  char path[PATH_MAX];
+  unsigned int i;
+
+  if(vm->watching)
+    return vm->inotify_fd;
+  vm->watching = 1;
+
+  if(vbox_folder(vm) < 0)
+    return -1;
+
+  vm->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if(vm->inotify_fd < 0)
+    return -1;
+
+  for(i=0; i<sizeof(folders)/sizeof(folders[0]); i++)
+    if(snprintf(path, sizeof(path), "%s%s", vm->folder, folders[i]) < 
+       (int) sizeof(path))
+      inotify_add_watch(vm->inotify_fd, path, VBOX_WATCH_EVENTS);
+
+  return vm->inotify_fd;
+}
+
+
+static void
+vbox_watch_ack(void *arg) {
+  vbox_vm_t *vm = (vbox_vm_t *)arg;
+  char buf[4096];
+
+  if(vm->inotify_fd < 0)
+    return;
+
+  while(read(vm->inotify_fd, buf, sizeof(buf)) > 0)
+    ;
+}
+
+
+static int
+vbox_start(void *arg) {
+  vbox_vm_t *vm = (vbox_vm_t *)arg;
+
+  return vboxmanage(NULL, 0, "startvm", vm->name, NULL) ? -1 : 0;
+}
+
+
+static int
+vbox_poweroff(void *arg) {
+  vbox_vm_t *vm = (vbox_vm_t *)arg;
+
+  return vboxmanage(NULL, 0, "controlvm", vm->name, "poweroff", NULL) ? -1 : 0;
+}
+
+
+static int
+vbox_snapshot_exists(void *arg, const char *name) {
+  vbox_vm_t *vm = (vbox_vm_t *)arg;
+
+  return (vboxmanage(NULL, 0, "snapshot", vm->name, "showvminfo", name, 
+		     NULL) == 0) ? 1 : 0;
+}
+
+
+static int
+vbox_snapshot_take(void *arg, const char *name) {
+  vbox_vm_t *vm = (vbox_vm_t *)arg;
+
+  return vboxmanage(NULL, 0, "snapshot", vm->name, "take", name, NULL) ? 
+    -1 : 0;
+}
+
+
+static int
+vbox_snapshot_restore(void *arg) {
+  vbox_vm_t *vm = (vbox_vm_t *)arg;
+
+  return vboxmanage(NULL, 0, "snapshot", vm->name, "discardcurrent", 
+		    "-state", NULL) ? -1 : 0;
+}
+
+
+static int
+vbox_floppy(void *arg, const char *image) {
+  vbox_vm_t *vm = (vbox_vm_t *)arg;
+
+  return vboxmanage(NULL, 0, "controlvm", vm->name, "floppyattach", 
+		    (image != NULL) ? image : "none", NULL) ? -1 : 0;
+}
+
+
+static int
+vbox_forget_floppy(void *arg, const char *image) {
+  (void)arg;
+
+  return vboxmanage(NULL, 0, "unregisterimage", "floppy", image, NULL) ? 
+    -1 : 0;
+}
+
+
+const vmctl_backend_t vmctl_virtualbox = {
+  .name             = "virtualbox",
+  .open             = vbox_open,
+  .close            = vbox_close,
+  .state            = vbox_state,
+  .watch_fd         = vbox_watch_fd,
+  .watch_ack        = vbox_watch_ack,
+  .start            = vbox_start,
+  .poweroff         = vbox_poweroff,
+  .snapshot_exists  = vbox_snapshot_exists,
+  .snapshot_take    = vbox_snapshot_take,
+  .snapshot_restore = vbox_snapshot_restore,
+  .floppy           = vbox_floppy,
+  .forget_floppy    = vbox_forget_floppy,
+  .info             = vbox_info,
+  .create           = NULL
+};
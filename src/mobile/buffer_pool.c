@@ -0,0 +1,310 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "buffer_pool.h"
+#include "common.h"
+
+
+/*
+ * Buffers kept on the free list of the chunk pool for each connection
+ * served at once.  A connection's thread decodes or encodes one chunk at
+ * a time, and a session's stream feeder, bulk and chunk indexing threads
+ * take a few more, so a handful covers the steady state while keeping
+ * RSS small on mobile devices, which make one connection.
+ */
+
+#define CHUNK_POOL_FREE_PER_CONNECTION 4
+
+
+struct buffer_pool {
+  pthread_mutex_t mutex;
+  size_t          buffer_size;
+  size_t          alignment;
+  int             max_free;
+  int             num_free;
+  char          **free_list;
+};
+
+
+buffer_pool_t *
+buffer_pool_create(size_t buffer_size, int max_free) {
+  buffer_pool_t *pool;
+  long page_size;
+
+  if((buffer_size == 0) || (max_free < 0))
+    return NULL;
+
+  pool = (buffer_pool_t *)calloc(1, sizeof(buffer_pool_t));
+  if(pool == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+
+  pool->free_list = (char **)calloc(max_free + 1, sizeof(char *));
+  if(pool->free_list == NULL) {
+    perror("calloc");
+    free(pool);
+    return NULL;
+  }
+
+  page_size = sysconf(_SC_PAGESIZE);
+  if(page_size <= 0)
+    page_size = 4096;
+
+  pool->alignment = page_size;
+  pool->buffer_size = buffer_size;
+  pool->max_free = max_free;
+  pool->num_free = 0;
+
+  pthread_mutex_init(&pool->mutex, NULL);
+
+  return pool;
+}
+
+
+void
+buffer_pool_destroy(buffer_pool_t *pool) {
+  if(pool == NULL)
+    return;
+
+  buffer_pool_trim(pool);
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool->free_list);
+  free(pool);
+}
+
+
+char *
+buffer_pool_get(buffer_pool_t *pool) {
+  char *buf = NULL;
+  int err;
+
+  if(pool == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&pool->mutex);
+  if(pool->num_free > 0)
+    buf = pool->free_list[--pool->num_free];
+  pthread_mutex_unlock(&pool->mutex);
+
+  if(buf != NULL)
+    return buf;
+
+  err = posix_memalign((void **)&buf, pool->alignment, pool->buffer_size);
+  if(err != 0) {
+    fprintf(stderr, "(buffer-pool) posix_memalign failed: %s\n",
+	    strerror(err));
+    return NULL;
+  }
+
+  return buf;
+}
+
+
+void
+buffer_pool_put(buffer_pool_t *pool, char *buf) {
+  if((pool == NULL) || (buf == NULL))
+    return;
+
+  pthread_mutex_lock(&pool->mutex);
+  if(pool->num_free < pool->max_free) {
+    pool->free_list[pool->num_free++] = buf;
+    buf = NULL;
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  free(buf);
+}
+
+
+/*
+ * Keep up to max_free idle buffers from now on, releasing any beyond
+ * that.
+ */
+
+int
+buffer_pool_set_max_free(buffer_pool_t *pool, int max_free) {
+  char **free_list;
+
+  if((pool == NULL) || (max_free < 0))
+    return -1;
+
+  pthread_mutex_lock(&pool->mutex);
+
+  while(pool->num_free > max_free)
+    free(pool->free_list[--pool->num_free]);
+
+  free_list = (char **)realloc(pool->free_list, 
+			       (max_free + 1) * sizeof(char *));
+  if(free_list == NULL) {
+    pthread_mutex_unlock(&pool->mutex);
+    perror("realloc");
+    return -1;
+  }
+  pool->free_list = free_list;
+  pool->max_free = max_free;
+
+  pthread_mutex_unlock(&pool->mutex);
+
+  return 0;
+}
+
+
+/*
+ * Release every idle buffer.
+ */
+
+void
+buffer_pool_trim(buffer_pool_t *pool) {
+  if(pool == NULL)
+    return;
+
+  pthread_mutex_lock(&pool->mutex);
+  while(pool->num_free > 0)
+    free(pool->free_list[--pool->num_free]);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+
+size_t
+buffer_pool_buffer_size(buffer_pool_t *pool) {
+  if(pool == NULL)
+    return 0;
+
+  return pool->buffer_size;
+}
+
+
+/*
+ * Pooled chunk buffers hold the chunk size this end is tuned to, and
+ * at least the CHUNK_SIZE pieces which chunk manifests and the chunk
+ * store work in.  Larger chunks, which an adaptive sender plans on fast
+ * links, get buffers of their own, freed rather than kept.
+ */
+
+static buffer_pool_t *chunk_pool = NULL;
+static pthread_once_t chunk_pool_once = PTHREAD_ONCE_INIT;
+
+static void
+chunk_pool_init(void) {
+  size_t size = transfer_tuning()->chunk_size;
+
+  if(size < CHUNK_SIZE)
+    size = CHUNK_SIZE;
+
+  chunk_pool = buffer_pool_create(size, CHUNK_POOL_FREE_PER_CONNECTION);
+}
+
+buffer_pool_t *
+chunk_buffer_pool(void) {
+  pthread_once(&chunk_pool_once, chunk_pool_init);
+  return chunk_pool;
+}
+
+char *
+chunk_buffer_get(size_t size) {
+  buffer_pool_t *pool = chunk_buffer_pool();
+  char *buf;
+
+  if(size <= buffer_pool_buffer_size(pool))
+    return buffer_pool_get(pool);
+
+  buf = (char *)malloc(size);
+  if(buf == NULL)
+    perror("malloc");
+
+  return buf;
+}
+
+void
+chunk_buffer_put(char *buf, size_t size) {
+  buffer_pool_t *pool = chunk_buffer_pool();
+
+  if(size <= buffer_pool_buffer_size(pool))
+    buffer_pool_put(pool, buf);
+  else
+    free(buf);
+}
+
+int
+chunk_buffer_pool_reserve(int connections) {
+  if(connections < 1)
+    connections = 1;
+
+  return buffer_pool_set_max_free(chunk_buffer_pool(), 
+				  connections * CHUNK_POOL_FREE_PER_CONNECTION);
+}
+
+
+/*
+ * XDR routine for chunks.  Decoding reads the length first and fills a
+ * buffer from chunk_buffer_get() (unless chunk_val is already one of
+ * the pool's) rather than letting xdr_bytes() malloc a new megabyte,
+ * and XDR_FREE hands the buffer back.  A buffer taken for a chunk which
+ * then fails to decode goes straight back, as the server stubs never
+ * free arguments they couldn't decode.
+ */
+
+bool_t
+xdr_chunk(XDR *xdrs, chunk *objp) {
+  buffer_pool_t *pool = chunk_buffer_pool();
+
+  switch(xdrs->x_op) {
+
+  case XDR_FREE:
+    if(objp->chunk_val != NULL) {
+      chunk_buffer_put(objp->chunk_val, objp->chunk_len);
+      objp->chunk_val = NULL;
+    }
+    objp->chunk_len = 0;
+    return TRUE;
+
+  case XDR_DECODE:
+    if(objp->chunk_val != NULL)
+      return xdr_bytes(xdrs, &objp->chunk_val, &objp->chunk_len, 
+		       buffer_pool_buffer_size(pool));
+
+    if(!xdr_u_int(xdrs, &objp->chunk_len) || 
+       (objp->chunk_len > CHUNK_SIZE_MAX)) {
+      objp->chunk_len = 0;
+      return FALSE;
+    }
+
+    objp->chunk_val = chunk_buffer_get(objp->chunk_len);
+    if((objp->chunk_val == NULL) ||
+       !xdr_opaque(xdrs, objp->chunk_val, objp->chunk_len)) {
+      chunk_buffer_put(objp->chunk_val, objp->chunk_len);
+      objp->chunk_val = NULL;
+      objp->chunk_len = 0;
+      return FALSE;
+    }
+    return TRUE;
+
+  case XDR_ENCODE:
+    break;
+  }
+
+  return xdr_bytes(xdrs, &objp->chunk_val, &objp->chunk_len, CHUNK_SIZE_MAX);
+}
@@ -0,0 +1,78 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BUFFER_POOL_H_
+#define _BUFFER_POOL_H_
+
+#include <rpc/rpc.h>
+
+
+/*
+ * A pool of reusable, page-aligned buffers of one fixed size.  Buffers
+ * handed back to the pool are kept for the next caller instead of being
+ * freed, up to a limit, so the file transfer path neither churns the
+ * allocator nor faults in fresh pages for every chunk.
+ */
+
+typedef struct buffer_pool buffer_pool_t;
+
+buffer_pool_t *	buffer_pool_create(size_t buffer_size, int max_free);
+void		buffer_pool_destroy(buffer_pool_t *pool);
+char *		buffer_pool_get(buffer_pool_t *pool);
+void		buffer_pool_put(buffer_pool_t *pool, char *buf);
+int		buffer_pool_set_max_free(buffer_pool_t *pool, int max_free);
+void		buffer_pool_trim(buffer_pool_t *pool);
+size_t		buffer_pool_buffer_size(buffer_pool_t *pool);
+
+
+/*
+ * The pool that chunk payloads come from, shared by every thread of the
+ * process.  Its buffers hold the tuned chunk size, or CHUNK_SIZE if that
+ * is larger.  It keeps idle buffers enough for one connection, as a
+ * mobile client makes; a display serving several sessions at once, each
+ * with a connection and a dispatch thread of its own, reserves enough
+ * for all of them with chunk_buffer_pool_reserve().  The display trims
+ * it when it exits.
+ *
+ * chunk_buffer_get() hands out a pooled buffer for a chunk of up to the
+ * pool's size, and a buffer of its own for a larger one, up to
+ * CHUNK_SIZE_MAX.  chunk_buffer_put() must be given the same size.
+ */
+
+buffer_pool_t *	chunk_buffer_pool(void);
+int		chunk_buffer_pool_reserve(int connections);
+char *		chunk_buffer_get(size_t size);
+void		chunk_buffer_put(char *buf, size_t size);
+
+
+/*
+ * A file chunk as carried by send_partial and retrieve_partial.  It has
+ * the same wire format as "opaque data<>", but xdr_chunk() decodes into
+ * chunk_buffer_get(chunk_len) and frees with chunk_buffer_put(), so a
+ * chunk_val it is to free must come from there (or be NULL).
+ */
+
+typedef struct {
+  u_int  chunk_len;
+  char  *chunk_val;
+} chunk;
+
+bool_t		xdr_chunk(XDR *xdrs, chunk *objp);
+
+#endif
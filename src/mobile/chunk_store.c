@@ -0,0 +1,294 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "buffer_pool.h"
+#include "chunk_store.h"
+#include "sha256.h"
+#include "common.h"
+
+
+static pthread_mutex_t store_mutex = PTHREAD_MUTEX_INITIALIZER;
+static off_t           store_bytes = -1;     /* -1 until scanned. */
+
+
+typedef struct {
+  time_t mtime;
+  off_t  size;
+  char   name[2 * SHA256_DIGEST_LENGTH + 1];
+} store_entry_t;
+
+
+/*
+ * The path of the chunk named by digest, or -1 if the store's directory
+ * leaves no room for it.
+ */
+
+static int
+chunk_path(const unsigned char *digest, char *path) {
+  char hex[2 * SHA256_DIGEST_LENGTH + 1];
+  int i;
+
+  for(i=0; i<SHA256_DIGEST_LENGTH; i++)
+    sprintf(hex + 2*i, "%02x", digest[i]);
+
+  if(snprintf(path, PATH_MAX, "%s/%s", CHUNK_STORE_DIR, hex) >= PATH_MAX)
+    return -1;
+
+  return 0;
+}
+
+
+static int
+make_store_dir(void) {
+  if(make_dirs(CHUNK_STORE_DIR, 0700) < 0) {
+    perror("mkdir");
+    return -1;
+  }
+
+  return 0;
+}
+
+
+static int
+compare_entries(const void *a, const void *b) {
+  const store_entry_t *ea = (const store_entry_t *)a;
+  const store_entry_t *eb = (const store_entry_t *)b;
+
+  if(ea->mtime < eb->mtime)
+    return -1;
+  return (ea->mtime > eb->mtime);
+}
+
+
+/*
+ * Work out how much the store holds and, if it is over CHUNK_STORE_MAX,
+ * remove chunks oldest first until it is back under 90% of it.  Called
+ * with store_mutex held.
+ */
+
+static void
+scan_and_evict(void) {
+  DIR *dir;
+  struct dirent *de;
+  struct stat buf;
+  store_entry_t *entries = NULL, *tmp;
+  int count = 0, capacity = 0, i;
+  char path[PATH_MAX];
+  off_t total = 0;
+
+  dir = opendir(CHUNK_STORE_DIR);
+  if(dir == NULL) {
+    store_bytes = 0;
+    return;
+  }
+
+  while((de = readdir(dir)) != NULL) {
+    if(strlen(de->d_name) != 2 * SHA256_DIGEST_LENGTH)
+      continue;
+
+    snprintf(path, PATH_MAX, "%s/%s", CHUNK_STORE_DIR, de->d_name);
+    if(stat(path, &buf) < 0)
+      continue;
+
+    if(count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      tmp = (store_entry_t *)realloc(entries, 
+				     capacity * sizeof(store_entry_t));
+      if(tmp == NULL) {
+	perror("realloc");
+	break;
+      }
+      entries = tmp;
+    }
+
+    entries[count].mtime = buf.st_mtime;
+    entries[count].size = buf.st_size;
+    strcpy(entries[count].name, de->d_name);
+    count++;
+
+    total += buf.st_size;
+  }
+
+  closedir(dir);
+
+  if(total > CHUNK_STORE_MAX) {
+    qsort(entries, count, sizeof(store_entry_t), compare_entries);
+
+    for(i=0; (i < count) && (total > CHUNK_STORE_MAX / 10 * 9); i++) {
+      snprintf(path, PATH_MAX, "%s/%s", CHUNK_STORE_DIR, entries[i].name);
+      if(unlink(path) == 0)
+	total -= entries[i].size;
+    }
+
+    fprintf(stderr, "(chunk-store) evicted %d chunks\n", i);
+  }
+
+  free(entries);
+  store_bytes = total;
+}
+
+
+/*
+ * Copy the chunk named by digest into fd at offset.  Returns 0 if it
+ * was there, and -1 if not or if it isn't exactly length bytes long.
+ */
+
+int
+chunk_store_fetch(const unsigned char *digest, int fd, off_t offset, 
+		  size_t length) {
+  char path[PATH_MAX];
+  struct stat buf;
+  char *data;
+  ssize_t n;
+  int chunkfd, ret = -1;
+
+  if((digest == NULL) || (length > CHUNK_SIZE))
+    return -1;
+
+  if(chunk_path(digest, path) < 0)
+    return -1;
+
+  chunkfd = open(path, O_RDONLY);
+  if(chunkfd < 0)
+    return -1;
+
+  if((fstat(chunkfd, &buf) < 0) || (buf.st_size != (off_t) length)) {
+    close(chunkfd);
+    return -1;
+  }
+
+  data = buffer_pool_get(chunk_buffer_pool());
+  if(data == NULL) {
+    close(chunkfd);
+    return -1;
+  }
+
+  n = pread(chunkfd, data, length, 0);
+  if((n == (ssize_t) length) && 
+     (pwriten(fd, data, length, offset) == (ssize_t) length)) {
+    futimens(chunkfd, NULL);        /* Most recently used. */
+    ret = 0;
+  }
+
+  buffer_pool_put(chunk_buffer_pool(), data);
+  close(chunkfd);
+
+  return ret;
+}
+
+
+/*
+ * Add a chunk to the store, provided it really has the digest the
+ * client claimed for it.
+ */
+
+int
+chunk_store_insert(const unsigned char *digest, const char *buf, 
+		   size_t length) {
+  unsigned char actual[SHA256_DIGEST_LENGTH];
+  char path[PATH_MAX], tmppath[PATH_MAX];
+  int fd;
+
+  if((digest == NULL) || (buf == NULL))
+    return -1;
+
+  if(chunk_path(digest, path) < 0)
+    return -1;
+  if(access(path, F_OK) == 0)
+    return 0;
+
+  sha256(buf, length, actual);
+  if(memcmp(actual, digest, SHA256_DIGEST_LENGTH) != 0) {
+    fprintf(stderr, "(chunk-store) chunk doesn't match its digest\n");
+    return -1;
+  }
+
+  if(make_store_dir() < 0)
+    return -1;
+
+  /* Named for the process and thread, so that writers never collide. */
+  if(snprintf(tmppath, PATH_MAX, "%s.%d.%lx", path, (int) getpid(), 
+	      (unsigned long) pthread_self()) >= PATH_MAX) {
+    fprintf(stderr, "(chunk-store) path of chunk is too long\n");
+    return -1;
+  }
+
+  fd = open(tmppath, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  if(fd < 0) {
+    perror("open");
+    return -1;
+  }
+
+  if(writen(fd, buf, length) < 0) {
+    perror("write");
+    close(fd);
+    unlink(tmppath);
+    return -1;
+  }
+
+  close(fd);
+
+  if(rename(tmppath, path) < 0) {
+    perror("rename");
+    unlink(tmppath);
+    return -1;
+  }
+
+  pthread_mutex_lock(&store_mutex);
+  if(store_bytes >= 0)
+    store_bytes += length;
+  if((store_bytes < 0) || (store_bytes > CHUNK_STORE_MAX))
+    scan_and_evict();
+  pthread_mutex_unlock(&store_mutex);
+
+  return 0;
+}
+
+
+int
+chunk_store_insert_from_file(const unsigned char *digest, int fd, 
+			     off_t offset, size_t length) {
+  char *data;
+  int ret = -1;
+
+  if(length > CHUNK_SIZE)
+    return -1;
+
+  data = buffer_pool_get(chunk_buffer_pool());
+  if(data == NULL)
+    return -1;
+
+  if(pread(fd, data, length, offset) == (ssize_t) length)
+    ret = chunk_store_insert(digest, data, length);
+
+  buffer_pool_put(chunk_buffer_pool(), data);
+
+  return ret;
+}
@@ -0,0 +1,48 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CHUNK_STORE_H_
+#define _CHUNK_STORE_H_
+
+#include <sys/types.h>
+#include "common.h"
+
+
+/*
+ * A store of file chunks on the display, named by the SHA-256 of their
+ * contents.  Users relaunch the same few overlays on the same displays,
+ * so before an upload the client sends the digest of every chunk and
+ * the display fills in the ones it already holds from here.  The store
+ * survives across sessions and is kept under CHUNK_STORE_MAX bytes by
+ * dropping the least recently used chunks.  KIMBERLEY_CHUNK_STORE_DIR in
+ * the environment moves it.
+ */
+
+#define CHUNK_STORE_DIR \
+  kimberley_dir("KIMBERLEY_CHUNK_STORE_DIR", "/var/tmp/kimberley/chunks")
+#define CHUNK_STORE_MAX ((off_t) 2048 * 1048576)
+
+int	chunk_store_fetch(const unsigned char *digest, int fd, off_t offset, 
+			  size_t length);
+int	chunk_store_insert(const unsigned char *digest, const char *buf, 
+			   size_t length);
+int	chunk_store_insert_from_file(const unsigned char *digest, int fd, 
+				     off_t offset, size_t length);
+
+#endif
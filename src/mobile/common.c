@@ -17,46 +17,51 @@
  *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <rpc/pmap_clnt.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/sendfile.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include "common.h"
+#include "trace.h"
 
 
-static int log_ready = 0;
-static FILE *log_fp = NULL;
-static pthread_mutex_t log_mutex;
-
+/*
+ * The log is a trace file (see trace.h): log_message() records an event
+ * on the calling thread's own ring buffer, without locking or writing,
+ * and trace_decode prints the log.  It is named for the time it was
+ * opened, unless KIMBERLEY_TRACE names it, as it must when launchers
+ * started in the same second share a host.
+ */
 
 int
 log_init(void) {
-  int err;
   struct timeval tv;
   struct tm* tm;
   char log_filename[PATH_MAX];
   char time_str[200];
+  char *named = getenv("KIMBERLEY_TRACE");
 
-
-  if(log_ready != 0 || log_fp != NULL)
-    return -1;
-  
-  memset(&tv, 0, sizeof(struct timeval));
-
-  err = pthread_mutex_init(&log_mutex, NULL);
-  if(err != 0) {
-    fprintf(stderr, "(common) failed initializing log mutex!\n");
-    return -1;
+  if((named != NULL) && (named[0] != '\0')) {
+    fprintf(stderr, "(common) initializing log: %s\n", named);
+    return trace_open(named);
   }
 
+  memset(&tv, 0, sizeof(struct timeval));
   gettimeofday(&tv, NULL);
   tm = localtime(&tv.tv_sec);
 
@@ -67,129 +72,51 @@ log_init(void) {
 
   strftime(time_str, 200, "%Y-%m-%d_%H:%M:%S", tm);
 
-
-  /*
-   * Print the formatted time, in seconds, followed by a decimal point
-   *  and the milliseconds. 
-   */
-
-  snprintf(log_filename, PATH_MAX, "/tmp/%s.log", time_str);
+  snprintf(log_filename, PATH_MAX, "/tmp/%s.trace", time_str);
   fprintf(stderr, "(common) initializing log: %s\n", log_filename);
 
-  log_fp = fopen(log_filename, "w+");
-  if(log_fp == NULL) {
-    perror("(common) fopen");
-    return -1;
-  }
-  
-  log_ready = 1;
-
-  return 0;
+  return trace_open(log_filename);
 }
 
 
 int
 log_message(char *message) {
-  int err;
-  struct timeval tv;
-  struct tm *tm;
-  char ftime_str[200];
-
-  if(log_ready == 0 || log_fp == NULL || message == NULL)
+  if(message == NULL)
     return -1;
 
-  err = pthread_mutex_lock(&log_mutex);
-  if(err < 0) {
-    fprintf(stderr, "(common) pthread_mutex_lock returned "
-	    "error: %d\n", err);
-    return -1;
-  }
-
-  memset(&tv, 0, sizeof(struct timeval));
-  gettimeofday(&tv, NULL);
-
-  tm = localtime(&tv.tv_sec);
-
-
-  /*
-   * Format the date and time, down to a single second. 
-   */
-
-  strftime(ftime_str, 200, "%Y-%m-%d_%H:%M:%S", tm);
-  
-  err = fprintf(log_fp, "%s.%.6u: %s\n", ftime_str, tv.tv_usec, message);
-  if(err <= 0) {
-    perror("(common) fwrite");
-    pthread_mutex_unlock(&log_mutex);
-    return -1;
-  }
-
-  fflush(log_fp);
-
-  err = pthread_mutex_unlock(&log_mutex);
-  if(err < 0) {
-    fprintf(stderr, "(common) pthread_mutex_unlock returned "
-	    "error: %d\n", err);
-    return -1;
-  }
+  trace_message(message);
 
   return 0;
 }
 
+
+/*
+ * Record each line of a text log, such as dekimberlize's, in the log.
+ */
+
 int
 log_append_file(char *filename) {
-  int bytes, err;
-  struct stat buf;
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
   FILE *fp;
 
-  if(log_ready == 0 || log_fp == NULL || filename == NULL)
+  if(filename == NULL)
     return -1;
 
-  memset(&buf, 0, sizeof(struct stat));
-  err = stat(filename, &buf);
-  if(err < 0) {
-    fprintf(stderr, "(common) couldn't stat log file %s\n", filename);
-    return -1;
-  }
-
-  bytes = buf.st_size;
   fp = fopen(filename, "r");
   if(fp == NULL) {
-    perror("(common) fopen");
-    return -1;
-  }
-
-  err = pthread_mutex_lock(&log_mutex);
-  if(err < 0) {
-    fprintf(stderr, "(common) pthread_mutex_lock returned "
-	    "error: %d\n", err);
-    fclose(fp);
+    fprintf(stderr, "(common) couldn't open log file %s\n", filename);
     return -1;
   }
 
-  while(bytes > 0) {
-    int num_read;
-    char str[ARG_MAX];
-    
-    num_read = fread(str, 1, ARG_MAX, fp);
-    if(num_read <= 0) 
-      continue;
-
-    fwrite(str, num_read, 1, log_fp);
-
-    bytes-=num_read;
-  }
-
-  fflush(log_fp);
-
-  err = pthread_mutex_unlock(&log_mutex);
-  if(err < 0) {
-    fprintf(stderr, "(common) pthread_mutex_unlock returned "
-	    "error: %d\n", err);
-    fclose(fp);
-    return -1;
+  while((len = getline(&line, &size, fp)) > 0) {
+    if(line[len - 1] == '\n')
+      len--;
+    trace_event(TRACE_TEXT, line, len);
   }
 
+  free(line);
   fclose(fp);
 
   return 0;
@@ -197,25 +124,9 @@ log_append_file(char *filename) {
 
 void
 log_deinit(void) {
-  int err;
-
-  err = pthread_mutex_lock(&log_mutex);
-  if(err < 0)
-    fprintf(stderr, "(common) pthread_mutex_lock returned "
-	    "error: %d\n", err);
-
   fprintf(stderr, "(common) deinitializing log\n");
 
-  log_ready = 0;
-  if(log_fp != NULL) {
-    fclose(log_fp);
-    log_fp = NULL;
-  }
-
-  err = pthread_mutex_unlock(&log_mutex);
-  if(err < 0)
-    fprintf(stderr, "(common) pthread_mutex_unlock returned "
-	    "error: %d\n", err);
+  trace_close();
 }
 
 
@@ -247,6 +158,228 @@ writen(int fd, const void *vptr, size_t n)
 }
 
 
+/*
+ * Write "n" bytes to a descriptor at the given offset reliably. 
+ */
+
+ssize_t
+pwriten(int fd, const void *vptr, size_t n, off_t offset)
+{
+  size_t nleft;
+  ssize_t nwritten;
+  const char *ptr;
+
+  ptr = vptr;
+  nleft = n;
+  while (nleft > 0) {
+    if ( (nwritten = pwrite(fd, ptr, nleft, offset)) <= 0) {
+      if (nwritten < 0 && errno == EINTR)
+        nwritten = 0;   /* and call pwrite() again */
+      else
+        return (-1);    /* error */
+    }
+
+    nleft -= nwritten;
+    ptr += nwritten;
+    offset += nwritten;
+  }
+  return (n);
+}
+
+
+/*
+ * Reserve a file's full size on disk before it is written, so that the
+ * blocks are allocated contiguously and later writes never extend it.
+ * Filesystems without fallocate() still get the file sized with
+ * ftruncate(), leaving it sparse.
+ */
+
+int
+preallocate_file(int fd, off_t size) {
+
+  if(size <= 0)
+    return 0;
+
+  if(fallocate(fd, 0, 0, size) == 0)
+    return 0;
+
+  if((errno != EOPNOTSUPP) && (errno != ENOSYS)) {
+    perror("fallocate");
+    return -1;
+  }
+
+  if(ftruncate(fd, size) < 0) {
+    perror("ftruncate");
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * The directory named by the environment variable, or dflt if it is
+ * unset or empty.  launch_bench moves the display's directories into
+ * a scratch directory of its own this way.
+ */
+
+const char *
+kimberley_dir(const char *variable, const char *dflt) {
+  const char *dir = getenv(variable);
+
+  return ((dir != NULL) && (dir[0] != '\0')) ? dir : dflt;
+}
+
+
+/*
+ * Make a directory and any missing parents of it, as mkdir -p does.
+ */
+
+int
+make_dirs(const char *path, mode_t mode) {
+  char dir[PATH_MAX], *p;
+
+  if(snprintf(dir, sizeof(dir), "%s", path) >= (int) sizeof(dir)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  for(p = dir + 1; *p != '\0'; p++) {
+    if(*p != '/')
+      continue;
+    *p = '\0';
+    if((mkdir(dir, mode) < 0) && (errno != EEXIST))
+      return -1;
+    *p = '/';
+  }
+
+  if((mkdir(dir, mode) < 0) && (errno != EEXIST))
+    return -1;
+
+  return 0;
+}
+
+
+/*
+ * Read a size such as "256k" from the environment, keeping "value" if
+ * the variable is unset or out of the range given.
+ */
+
+static void
+tuning_from_env(const char *name, int *value, long min, long max) {
+  char *str = getenv(name), *end;
+  long size;
+
+  if((str == NULL) || (str[0] == '\0'))
+    return;
+
+  size = strtol(str, &end, 10);
+  switch(tolower(*end)) {
+  case 'k':
+    size <<= 10;
+    end++;
+    break;
+  case 'm':
+    size <<= 20;
+    end++;
+    break;
+  }
+
+  if((*end != '\0') || (size < min) || (size > max)) {
+    fprintf(stderr, "(common) ignoring %s=%s, which isn't a size from "
+	    "%ld to %ld\n", name, str, min, max);
+    return;
+  }
+
+  *value = size;
+}
+
+
+static transfer_tuning_t tuning;
+static pthread_once_t tuning_once = PTHREAD_ONCE_INIT;
+
+static void
+tuning_init(void) {
+  tuning.chunk_size = CHUNK_SIZE;
+  tuning.record_size = BUFSIZ;
+  tuning.socket_buffer = 0;
+  tuning.adapt = 1;
+
+  tuning_from_env("KIMBERLEY_CHUNK_SIZE", &tuning.chunk_size,
+		  CHUNK_SIZE_MIN, CHUNK_SIZE_MAX);
+  tuning_from_env("KIMBERLEY_RECORD_SIZE", &tuning.record_size,
+		  512, CHUNK_SIZE_MAX);
+  tuning_from_env("KIMBERLEY_SOCKET_BUFFER", &tuning.socket_buffer,
+		  0, 64 << 20);
+  tuning_from_env("KIMBERLEY_ADAPT", &tuning.adapt, 0, 1);
+}
+
+transfer_tuning_t *
+transfer_tuning(void) {
+  pthread_once(&tuning_once, tuning_init);
+  return &tuning;
+}
+
+
+/*
+ * Set up an RPC connection's socket.  XDR record streams already write
+ * whole records, so Nagle's algorithm only holds back the tail of each
+ * one until the other end's delayed ACK, stalling every call that waits
+ * for its reply.  The socket buffers are those the connection is tuned
+ * for; setting them at all turns off the kernel's autotuning.
+ */
+
+void
+tune_rpc_socket(int fd) {
+  int size = transfer_tuning()->socket_buffer, one = 1;
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if(size <= 0)
+    return;
+
+  if((setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0) ||
+     (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0))
+    perror("(common) setsockopt");
+}
+
+
+/*
+ * Let a socket buffer hold at least "size" bytes.  It is never made
+ * smaller than the kernel has already made it: setting it at all ends
+ * the kernel's autotuning of it, and is capped at net.core.wmem_max or
+ * rmem_max, which autotuning may well have gone past.  (The kernel
+ * reports twice what was set, to allow for its own overhead.)
+ */
+
+void
+grow_socket_buffer(int fd, int optname, int size) {
+  const char *max_path = (optname == SO_SNDBUF) ? 
+    "/proc/sys/net/core/wmem_max" : "/proc/sys/net/core/rmem_max";
+  int current;
+  socklen_t len = sizeof(current);
+  FILE *fp;
+
+  if(getsockopt(fd, SOL_SOCKET, optname, &current, &len) < 0)
+    return;
+
+  fp = fopen(max_path, "r");
+  if(fp != NULL) {
+    int max;
+
+    if((fscanf(fp, "%d", &max) == 1) && (size > max))
+      size = max;
+    fclose(fp);
+  }
+
+  if(2 * size <= current)
+    return;
+
+  if(setsockopt(fd, SOL_SOCKET, optname, &size, sizeof(size)) < 0)
+    perror("(common) setsockopt");
+}
+
+
 unsigned short
 choose_random_port(void) {
   struct timeval t;
@@ -299,102 +432,93 @@ make_tcpip_connection(char *hostname, unsigned short port) {
 }
 
 
-void
-local_tunnel(int sock1, int sock2) {
+/*
+ * Send "size" bytes of a file down a socket with sendfile(), so that the
+ * data never passes through user space or XDR.
+ */
 
-  fprintf(stderr, "Tunneling between fd=%d and fd=%d\n", sock1, sock2);
-  
-  while(1) {
-    int size_in, size_out, in, out, maxfd, err;
-    char buf[4096], *dir;
-    fd_set readfds, exceptfds;
-    
-    FD_ZERO(&readfds);
-    FD_ZERO(&exceptfds);
-    FD_SET(sock1, &readfds);
-    FD_SET(sock2, &readfds);
-    FD_SET(sock1, &exceptfds);
-    FD_SET(sock2, &exceptfds);
-
-    maxfd = sock1;
-    if(sock2 > maxfd)
-      maxfd = sock2;
-    maxfd++;
-
-    err = select(maxfd, &readfds, NULL, &exceptfds, NULL);
-    if(err < 0) {
-      perror("select");
-      close(sock1);
-      close(sock2);
-      pthread_exit((void *)-1);
+int
+bulk_send_file(int sockfd, int fd, off_t size) {
+  off_t offset = 0;
+
+  while(offset < size) {
+    ssize_t sent;
+
+    sent = sendfile(sockfd, fd, &offset, size - offset);
+    if(sent < 0) {
+      if(errno == EINTR)
+	continue;
+      perror("sendfile");
+      return -1;
     }
+    if(sent == 0) {
+      fprintf(stderr, "(common) file ended %ld bytes early\n", 
+	      (long) (size - offset));
+      return -1;
+    }
+  }
 
+  return 0;
+}
 
-    /* Figure out which direction information will flow. */
-    if(FD_ISSET(sock1, &exceptfds) || FD_ISSET(sock2, &exceptfds)) {
-      fprintf(stderr, "(launcher-tunnel) select() reported exceptions!\n");
-      close(sock1);
-      close(sock2);
-      pthread_exit((void *)-1);
-    }
-  
-  
-    if(FD_ISSET(sock1, &readfds)) {
-      in = sock1;
-      out = sock2;
-      dir = "out";
-    }
-    else if(FD_ISSET(sock2, &readfds)) {
-      in = sock2;
-      out = sock1;
-      dir = "in";
-    }
-    else {
-      fprintf(stderr, "(launcher-tunnel) select() succeeded, but no file "
-              "descriptors are ready to be read!\n");
-      close(sock1);
-      close(sock2);
-      pthread_exit((void *)-1);
-    }
-    
-    
-    /* Pass up to 4096 bytes of data between sockets. */
-    
-    size_in = read(in, (void *)buf, 4096);
-    if(size_in < 0) {
-      perror("read");
-      continue;
-    }
-    else if(size_in == 0) { /* EOF */
-      fprintf(stderr, "(launcher-tunnel) A connection (%d) was closed "
-	      "(EOF on read).\n", in);
-      close(sock1);
-      close(sock2);
-      pthread_exit((void *)0);
-    }
 
-    size_out = writen(out, (void *)buf, size_in);
-    if(size_out < 0) {
-      perror("write");
-      fprintf(stderr, "(launcher-tunnel) A connection (%d) was closed "
-	      "(EOF on write).\n", out);
-      close(sock1);
-      close(sock2);
-      pthread_exit((void *)0);
+/*
+ * Write "size" bytes arriving on a socket into a file at "start" with
+ * splice(), moving the pages through a pipe instead of copying them to
+ * user space.  Returns the number of bytes written, which falls short of
+ * "size" if the connection broke, or -1 if nothing could be attempted.
+ */
+
+off_t
+bulk_receive_file(int sockfd, int fd, off_t start, off_t size) {
+  int pipefd[2];
+  loff_t offset = start;
+
+  if(pipe(pipefd) < 0) {
+    perror("pipe");
+    return -1;
+  }
+
+  size += start;
+
+  while(offset < size) {
+    ssize_t in, out;
+    size_t len = size - offset;
+
+    if(len > CHUNK_SIZE)
+      len = CHUNK_SIZE;
+
+    in = splice(sockfd, NULL, pipefd[1], NULL, len, 
+		SPLICE_F_MOVE | SPLICE_F_MORE);
+    if(in < 0) {
+      if(errno == EINTR)
+	continue;
+      perror("splice");
+      break;
+    }
+    if(in == 0) {
+      fprintf(stderr, "(common) connection closed %ld bytes early\n",
+	      (long) (size - offset));
+      break;
     }
 
-    if(size_in != size_out) {
-      fprintf(stderr, "(launcher-tunnel) Somehow lost bytes, "
-	      "from %d in to %d out!\n", size_in, size_out);
-      continue;
+    while(in > 0) {
+      out = splice(pipefd[0], NULL, fd, &offset, in, SPLICE_F_MOVE);
+      if(out <= 0) {
+	if(out < 0 && errno == EINTR)
+	  continue;
+	perror("splice");
+	goto done;
+      }
+      in -= out;
     }
-    
-    //    fprintf(stderr, "(launcher-tunnel) tunneled %d bytes %s\n", size_in, dir);
   }
 
-  /* Should never get here. */ 
- 
-  pthread_exit((void *)0);
+ done:
+  close(pipefd[0]);
+  close(pipefd[1]);
+
+  return offset - start;
 }
 
 
@@ -413,10 +537,118 @@ typedef struct {
 } crs_args_t;
 
 
+/*
+ * svc_run() serves one call at a time, so a call which takes long, like
+ * loading a VM or ending a session, holds up every other connection's
+ * calls, pings included.  Instead, the server thread accepts connections
+ * itself and gives each its own dispatch thread, which reads and answers
+ * that connection's calls through the MT-safe stubs rpcgen generates.
+ * Calls on one connection are still answered in order, as the transport
+ * requires, but calls on different connections run side by side.
+ *
+ * Each dispatch thread creates and registers its own transport: glibc
+ * keeps the RPC server's tables per thread, so a transport can only be
+ * served from the thread which registered it.
+ */
+
+typedef struct {
+  int fd;
+  unsigned int prog;
+  unsigned int vers;
+  void (*handler)(struct svc_req *, SVCXPRT *);
+} rpc_dispatch_args_t;
+
+
+/*
+ * svc_fdset can't tell whether a transport is still alive: it is global,
+ * and undefined for descriptors at or above FD_SETSIZE.  Each dispatch
+ * thread instead swaps in a copy of its transport's operations whose
+ * destroy notes, in the thread's own flag, that the transport is gone.
+ */
+
+static __thread void (*dispatch_destroy)(SVCXPRT *) = NULL;
+static __thread int dispatch_alive = 0;
+
+
+static void
+note_transport_destroyed(SVCXPRT *xprt) {
+  dispatch_alive = 0;
+  dispatch_destroy(xprt);
+}
+
+
 static void *
-rpc_server_thread(void *arg) {
+rpc_dispatch_thread(void *arg) {
+    rpc_dispatch_args_t *args = (rpc_dispatch_args_t *)arg;
+    struct xp_ops ops;
     SVCXPRT *transp;
+    socklen_t len;
+    int fd = args->fd;
+
+    tune_rpc_socket(fd);
+    transp = svcfd_create(fd, transfer_tuning()->record_size,
+			  transfer_tuning()->record_size);
+    if(transp == NULL) {
+      fprintf(stderr, "(libsstub) rpc_dispatch_thread: cannot create "
+	      "Sun RPC transport\n");
+      close(fd);
+      free(args);
+      return NULL;
+    }
+
+    /* svcfd_create() doesn't record who is calling, which the handlers
+     * need from svc_getcaller(). */
+
+    len = sizeof(transp->xp_raddr);
+    if(getpeername(fd, (struct sockaddr *) &transp->xp_raddr, &len) == 0)
+      transp->xp_addrlen = len;
+
+    if(!svc_register(transp, args->prog, args->vers, args->handler, 0)) {
+      fprintf(stderr, "(Sun RPC) unable to register \"client to "
+	      "content\" program (prog=0x%x, vers=%d, tcp)\n",
+	      args->prog, args->vers);
+      svc_destroy(transp);
+      free(args);
+      return NULL;
+    }
+
+    free(args);
+
+    /* The transport destroys itself, and closes its socket, once the
+     * other end hangs up or breaks the protocol. */
+
+    ops = *transp->xp_ops;
+    dispatch_destroy = ops.xp_destroy;
+    ops.xp_destroy = note_transport_destroyed;
+    transp->xp_ops = &ops;
+    dispatch_alive = 1;
+
+    while(dispatch_alive) {
+      struct pollfd pfd;
+
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+
+      if(poll(&pfd, 1, -1) < 0) {
+	if(errno == EINTR)
+	  continue;
+	perror("poll");
+	svc_destroy(transp);
+	break;
+      }
+
+      svc_getreq_common(fd);
+    }
+
+    return NULL;
+}
+
+
+static void *
+rpc_server_thread(void *arg) {
     struct sockaddr_in servaddr;
+    pthread_attr_t attr;
     int rpcfd;
 
     crs_args_t *args = (crs_args_t *)arg;
@@ -442,26 +674,47 @@ rpc_server_thread(void *arg) {
       pthread_exit((void *)-1);
     }
 
-    transp = svctcp_create(rpcfd, BUFSIZ, BUFSIZ);
-    if (transp == NULL) {
-      fprintf (stderr, "%s", "cannot create Sun RPC tcp service.");
+    if(listen(rpcfd, SOMAXCONN) < 0) {
+      perror("listen");
       pthread_exit((void *)-1);
     }
 
     pmap_unset(args->prog, args->vers);
-    
-    if (!svc_register(transp, args->prog, args->vers, args->handler, 0)) {
-      fprintf(stderr, "(Sun RPC) unable to register \"client to "
-	      "content\" program (prog=0x%x, vers=%d, tcp)\n",  
-	      args->prog, args->vers);
-      pthread_exit((void *)-1);
-    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
     *(args->control_ready) = 1;       /* Signal the parent thread that
 				       * our Sun RPC server is ready to
 				       * accept connections. */
 
-    svc_run();
+    while(1) {
+      rpc_dispatch_args_t *dargs;
+      pthread_t tid;
+      int connfd;
+
+      if((connfd = accept(rpcfd, NULL, NULL)) < 0) {
+	if(errno == EINTR || errno == ECONNABORTED)
+	  continue;
+	perror("accept");
+	break;
+      }
+
+      dargs = (rpc_dispatch_args_t *)malloc(sizeof(rpc_dispatch_args_t));
+      dargs->fd = connfd;
+      dargs->prog = args->prog;
+      dargs->vers = args->vers;
+      dargs->handler = args->handler;
+
+      if(pthread_create(&tid, &attr, rpc_dispatch_thread, dargs) != 0) {
+	fprintf(stderr, "(libsstub) rpc_server_thread: failed creating "
+		"dispatch thread\n");
+	close(connfd);
+	free(dargs);
+      }
+    }
+
+    pthread_attr_destroy(&attr);
     pthread_exit((void *)-1);
 }
 
@@ -592,15 +845,17 @@ convert_socket_to_rpc_client(int connfd, unsigned int prog,
     return NULL;
   }
   
-  if ((clnt = clnttcp_create(&control_name, prog, vers,
-			     &connfd, BUFSIZ, BUFSIZ)) == NULL) {
+  tune_rpc_socket(connfd);
+  if ((clnt = clnttcp_create(&control_name, prog, vers, &connfd,
+			     transfer_tuning()->record_size,
+			     transfer_tuning()->record_size)) == NULL) {
     clnt_pcreateerror("clnttcp_create");
     return NULL;
   }
   
-  tv.tv_sec = 30*60; /* I'd prefer if this were infinite, but Sun RPC
-		      * dereferences the timeval and therefore we
-		      * can't send NULL. */
+  tv.tv_sec = RPC_TIMEOUT; /* I'd prefer if this were infinite, but Sun RPC
+			    * dereferences the timeval and therefore we
+			    * can't send NULL. */
   tv.tv_usec = 0;
   
   if(!clnt_control(clnt, CLSET_TIMEOUT, (char *)&tv)) {
@@ -613,6 +868,53 @@ convert_socket_to_rpc_client(int connfd, unsigned int prog,
 }
 
 
+/*
+ * Send a call without waiting for its reply, so that several calls
+ * can be in flight on the same connection.  Sun RPC's "message passing"
+ * mode does this when the timeout is zero: the request is flushed and
+ * RPC_TIMEDOUT is returned straight away.  The reply is read and
+ * discarded by clnt_call() when a later call looks for its own xid,
+ * so the caller must periodically make a normal call to drain them.
+ *
+ * Depending on the RPC library, either the per-call or the per-client
+ * timeout is consulted, so both are set to zero for the duration.
+ */
+
+enum clnt_stat
+rpc_call_pipelined(CLIENT *clnt, u_long proc, 
+		   xdrproc_t xdr_args, caddr_t args,
+		   xdrproc_t xdr_results, caddr_t results) {
+  enum clnt_stat retval;
+  struct timeval tv;
+
+  if(clnt == NULL)
+    return RPC_FAILED;
+
+  tv.tv_sec = 0;
+  tv.tv_usec = 0;
+
+  if(!clnt_control(clnt, CLSET_TIMEOUT, (char *)&tv)) {
+    fprintf(stderr, "rpc_call_pipelined: changing timeout failed");
+    return RPC_FAILED;
+  }
+
+  retval = clnt_call(clnt, proc, xdr_args, args, xdr_results, results, tv);
+
+  tv.tv_sec = RPC_TIMEOUT;
+  tv.tv_usec = 0;
+
+  if(!clnt_control(clnt, CLSET_TIMEOUT, (char *)&tv)) {
+    fprintf(stderr, "rpc_call_pipelined: restoring timeout failed");
+    return RPC_FAILED;
+  }
+
+  if(retval == RPC_TIMEDOUT)   /* Expected; the request was sent. */
+    retval = RPC_SUCCESS;
+
+  return retval;
+}
+
+
 int
 compress_file(char *filename, char *new_filename) {
   int err;
@@ -32,10 +32,92 @@
 
 /*
  * The chunk size is 1 megabyte for sending parts of files between
- * client and server.
+ * client and server.  Chunk manifests always digest CHUNK_SIZE pieces,
+ * but the pieces carried by send_partial and retrieve_partial may be
+ * tuned (see transfer_tuning below), up to CHUNK_SIZE_MAX, which is
+ * what either end can decode.
  */
 
-#define CHUNK_SIZE 1048576
+#define CHUNK_SIZE     1048576
+#define CHUNK_SIZE_MIN 4096
+#define CHUNK_SIZE_MAX (8 * CHUNK_SIZE)
+
+
+/*
+ * Transfer settings which can be tuned per deployment, read from the
+ * environment the first time they are asked for:
+ *
+ *   KIMBERLEY_CHUNK_SIZE     bytes per send_partial or retrieve_partial
+ *                            call (CHUNK_SIZE)
+ *   KIMBERLEY_RECORD_SIZE    send and receive buffer sizes of the XDR
+ *                            record streams of RPC connections (BUFSIZ)
+ *   KIMBERLEY_SOCKET_BUFFER  SO_SNDBUF and SO_RCVBUF of RPC connections,
+ *                            or 0 to leave them to the kernel's
+ *                            autotuning (0)
+ *   KIMBERLEY_ADAPT          0 to hold to the chunk size and SEND_WINDOW
+ *                            rather than planning them, and the socket
+ *                            buffers, from the link (see link_estimate.h)
+ *                            as a transfer goes (1)
+ *
+ * Sizes may end in k or m.  The fields may also be set directly, as
+ * rpc_bench does, before the connections they apply to are made.
+ */
+
+typedef struct {
+  int chunk_size;
+  int record_size;
+  int socket_buffer;
+  int adapt;
+} transfer_tuning_t;
+
+
+/*
+ * Number of send_partial calls the client may have outstanding before
+ * it waits for a reply.  The display may lower this in send_window.
+ */
+
+#define SEND_WINDOW     8
+#define SEND_WINDOW_MAX 32
+
+
+/*
+ * Seconds the display waits for the client to open a bulk data
+ * connection after agreeing to one in send_file_bulk.
+ */
+
+#define BULK_ACCEPT_TIMEOUT 30
+
+
+/*
+ * The first word of a path probe connection (see path_probe.h), in
+ * place of a bulk data connection's cookie, which is never 0.  It is
+ * followed by messages of a word giving their length and that many
+ * bytes, each of which the display reads and throws away before
+ * writing the length back: PATH_PROBE_PINGS empty ones, then one of
+ * PATH_PROBE_BULK bytes.  Both ends give up on a read or write after
+ * PATH_PROBE_IO_TIMEOUT_MS, and the display hangs up on longer
+ * messages or more of them.
+ */
+
+#define PATH_PROBE_COOKIE         0
+#define PATH_PROBE_PINGS          16
+#define PATH_PROBE_BULK           (256 * 1024)
+#define PATH_PROBE_IO_TIMEOUT_MS  2000
+
+
+/*
+ * Number of times the client reconnects to resume a transfer whose
+ * connection was lost, one second apart, before giving up.
+ */
+
+#define RESUME_ATTEMPTS 5
+
+
+/*
+ * Timeout, in seconds, of a normal (non-pipelined) RPC.
+ */
+
+#define RPC_TIMEOUT (30*60)
 
 int            log_init(void);
 int            log_message(char *message);
@@ -45,9 +127,25 @@ void           log_deinit(void);
 int            compress_file(char *filename, char *new_filename);
 int            decompress_file(char *filename, char *new_filename);
 
+ssize_t        writen(int fd, const void *vptr, size_t n);
+ssize_t        pwriten(int fd, const void *vptr, size_t n, off_t offset);
+int            preallocate_file(int fd, off_t size);
+const char *   kimberley_dir(const char *variable, const char *dflt);
+int            make_dirs(const char *path, mode_t mode);
+transfer_tuning_t *transfer_tuning(void);
+void           tune_rpc_socket(int fd);
+void           grow_socket_buffer(int fd, int optname, int size);
+
+int            make_tcpip_connection(char *hostname, unsigned short port);
+int            bulk_send_file(int sockfd, int fd, off_t size);
+off_t          bulk_receive_file(int sockfd, int fd, off_t start, off_t size);
+
 CLIENT *       convert_socket_to_rpc_client(int connfd, 
 					    unsigned int prog,
 					    unsigned int vers);
+enum clnt_stat rpc_call_pipelined(CLIENT *clnt, u_long proc,
+				  xdrproc_t xdr_args, caddr_t args,
+				  xdrproc_t xdr_results, caddr_t results);
 
 unsigned short choose_random_port(void);
 unsigned short setup_rpc_server(unsigned int prog, 
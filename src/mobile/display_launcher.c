@@ -17,12 +17,21 @@
  *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -32,68 +41,432 @@
 
 #include "kcm_dbus_app_glue.h"
 #include "rpc_mobile_launcher.h"
+#include "buffer_pool.h"
 #include "display_launcher.h"
+#include "relay.h"
 #include "common.h"
 
 
-volatile kimberley_state_t current_state;
+int launcher_listenfd = -1;
+
+static unsigned short rpc_port;
+
+
+/*
+ * The sessions the display is running.  A session is counted against
+ * max_sessions from the moment its client connects until its VM is down
+ * and its last reference is dropped, except while it is suspended.
+ */
+
+static pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+static session_t      *sessions = NULL;
+static int             num_active = 0;
+static int             next_session_id = 1;
+static int             max_sessions = DEFAULT_MAX_SESSIONS;
+
+
+/*
+ * Times, a tenth of a second apart, to look for the session a
+ * reconnecting client wants to resume while its old connection is still
+ * being torn down.
+ */
+
+#define SESSION_RESUME_TRIES 20
+
+
+static int
+remove_entry(const char *path, const struct stat *sb, int flag, 
+	     struct FTW *ftwbuf) {
+  if(remove(path) < 0)
+    if(errno != ENOENT)
+      perror("remove");
+
+  return 0;
+}
+
+
+/*
+ * Start a session for a newly connected client, unless the display
+ * already runs as many as it may.
+ */
+
+static session_t *
+session_create(void) {
+  session_t *s;
+
+  pthread_mutex_lock(&sessions_mutex);
+
+  if(num_active >= max_sessions) {
+    pthread_mutex_unlock(&sessions_mutex);
+    fprintf(stderr, "(display-launcher) Already running %d sessions, "
+	    "turning the client away.\n", max_sessions);
+    return NULL;
+  }
+
+  s = (session_t *)calloc(1, sizeof(session_t));
+  if(s == NULL) {
+    pthread_mutex_unlock(&sessions_mutex);
+    perror("calloc");
+    return NULL;
+  }
+
+  s->id = next_session_id++;
+  s->refs = 1;                  /* Held by the client's connection. */
+  s->finish_pipe[1] = -1;
+  snprintf(s->work_dir, PATH_MAX, "%s/%d", SESSION_DIR, s->id);
+
+  s->next = sessions;
+  sessions = s;
+  num_active++;
+
+  pthread_mutex_unlock(&sessions_mutex);
+
+  pthread_mutex_init(&s->mutex, NULL);
+  pthread_mutex_init(&s->launch_mutex, NULL);
+  pthread_cond_init(&s->launch_changed, NULL);
+  init_session_transfers(s);
+
+  make_dirs(SESSION_DIR, 0755);
+  nftw(s->work_dir, remove_entry, 16, FTW_DEPTH|FTW_PHYS);
+  if(mkdir(s->work_dir, 0700) < 0) {
+    perror("mkdir");
+    session_put(s);
+    return NULL;
+  }
+
+  fprintf(stderr, "(display-launcher) Started session %d in %s.\n",
+	  s->id, s->work_dir);
+
+  return s;
+}
+
+
+/*
+ * Find the session of the client making an RPC call, taking a
+ * reference to it.
+ */
+
+session_t *
+session_get(struct svc_req *rqstp) {
+  struct sockaddr_in *caller;
+  unsigned short port;
+  session_t *s;
+
+  caller = (struct sockaddr_in *) svc_getcaller(rqstp->rq_xprt);
+  if(caller == NULL)
+    return NULL;
+  port = ntohs(caller->sin_port);
+
+  pthread_mutex_lock(&sessions_mutex);
+  for(s = sessions; s != NULL; s = s->next)
+    if((s->rpc_port != 0) && (s->rpc_port == port)) {
+      s->refs++;
+      break;
+    }
+  pthread_mutex_unlock(&sessions_mutex);
+
+  if(s == NULL)
+    fprintf(stderr, "(display-launcher) call from port %u belongs to no "
+	    "session\n", port);
+
+  return s;
+}
+
+
+void
+session_hold(session_t *s) {
+  pthread_mutex_lock(&sessions_mutex);
+  s->refs++;
+  pthread_mutex_unlock(&sessions_mutex);
+}
+
+
+/*
+ * Drop a reference to a session, freeing it and removing its work
+ * directory if it was the last.
+ */
+
+void
+session_put(session_t *s) {
+  session_t **sp;
+
+  pthread_mutex_lock(&sessions_mutex);
+  if(--s->refs > 0) {
+    pthread_mutex_unlock(&sessions_mutex);
+    return;
+  }
+
+  for(sp = &sessions; *sp != s; sp = &(*sp)->next)
+    ;
+  *sp = s->next;
+  if(!s->suspended)
+    num_active--;
+  pthread_mutex_unlock(&sessions_mutex);
+
+  abandon_transfers(s);
+  finish_launch(s);
+  nftw(s->work_dir, remove_entry, 16, FTW_DEPTH|FTW_PHYS);
+  pthread_mutex_destroy(&s->incoming.mutex);
+  pthread_cond_destroy(&s->incoming.arrived);
+  pthread_mutex_destroy(&s->launch_mutex);
+  pthread_cond_destroy(&s->launch_changed);
+  pthread_mutex_destroy(&s->mutex);
+
+  fprintf(stderr, "(display-launcher) Session %d is gone.\n", s->id);
+
+  free(s);
+}
 
 
 int
-cleanup(void) {
-  int err, fd;
+session_path(session_t *s, char *path, char *filename) {
+  if(snprintf(path, PATH_MAX, "%s/%s", s->work_dir, filename) >= PATH_MAX) {
+    fprintf(stderr, "(display-launcher) path of %s is too long\n", filename);
+    return -1;
+  }
 
-  /*
-   * We're bringing down the connection, so no locking is really necessary,
-   * so try and get one but otherwise continue on.
-   */
+  return 0;
+}
 
 
-  /*
-   * Signal dekimberlize that the connection was lost, if it hasn't
-   * been signaled yet.
-   */
+/*
+ * Give the session's incoming transfer a new ID, and return it.  The ID
+ * is also the cookie with which a bulk data connection writes into the
+ * session's file, so it comes from /dev/urandom rather than rand(), and
+ * is never one another session's transfer has.  Called with
+ * s->incoming.mutex held.  Returns -1 if no random bytes could be read.
+ */
+
+int
+session_new_transfer_id(session_t *s) {
+  session_t *other;
+  uint32_t random;
+  int fd, id;
+
+  fd = open("/dev/urandom", O_RDONLY);
+  if(fd < 0) {
+    perror("open");
+    return -1;
+  }
+
+  pthread_mutex_lock(&sessions_mutex);
+
+  do {
+    if(read(fd, &random, sizeof(random)) != sizeof(random)) {
+      perror("read");
+      id = -1;
+      break;
+    }
+
+    /* Positive, and never PATH_PROBE_COOKIE. */
+    id = (int) (random & 0x7fffffff);
+    for(other = sessions; (id != 0) && (other != NULL); other = other->next)
+      if((other != s) && (other->incoming.id == id))
+	id = 0;
+  } while(id == 0);
+
+  s->incoming.id = (id > 0) ? id : 0;
+
+  pthread_mutex_unlock(&sessions_mutex);
 
-  fd = open("/tmp/dekimberlize_finished", O_RDWR|O_CREAT);
   close(fd);
 
-  err = pthread_mutex_trylock(&current_state.mutex);
-  if(err < 0)
-    fprintf(stderr, "(display-launcher) pthread_mutex_lock returned "
-	    "error: %d\n", err);
+  return id;
+}
+
+
+/*
+ * Claim a suspended session for which match() holds, along with the
+ * reference it was kept with.  A client may reconnect before the display
+ * has noticed that its old connection dropped, so a session which
+ * matches but is still connected is given a moment to be suspended.
+ */
+
+session_t *
+session_find_suspended(int (*match)(session_t *, void *), void *arg) {
+  session_t *s;
+  int tries, connected;
+
+  for(tries = 0; tries < SESSION_RESUME_TRIES; tries++) {
+    struct timeval tv;
+
+    connected = 0;
+
+    pthread_mutex_lock(&sessions_mutex);
+    for(s = sessions; s != NULL; s = s->next) {
+      if(!s->suspended && (s->rpc_port == 0))
+	continue;
+      if(!match(s, arg))
+	continue;
+      if(s->suspended) {
+	s->suspended = 0;
+	num_active++;
+	break;
+      }
+      connected = 1;
+    }
+    pthread_mutex_unlock(&sessions_mutex);
+
+    if((s != NULL) || !connected)
+      return s;
+
+    tv.tv_sec = 0;
+    tv.tv_usec = 100000;
+    select(0, NULL, NULL, NULL, &tv);
+  }
+
+  return NULL;
+}
+
+
+/*
+ * A client which lost its connection mid-transfer has reconnected, and
+ * was given the fresh session s.  Carry on its suspended session over
+ * the new connection instead.  The caller's reference to s stays good,
+ * and it gets one to the suspended session as well.
+ */
+
+void
+session_adopt(session_t *s, session_t *suspended) {
+  fprintf(stderr, "(display-launcher) Resuming interrupted session %d.\n",
+	  suspended->id);
+
+  pthread_mutex_lock(&sessions_mutex);
+  suspended->rpc_port = s->rpc_port;
+  suspended->refs++;
+  s->rpc_port = 0;
+  s->refs--;                    /* The connection's, never the last. */
+  pthread_mutex_unlock(&sessions_mutex);
+}
+
+
+/*
+ * Detach the session of a closed connection from the connection's port,
+ * returning it with the connection's reference.
+ */
+
+static session_t *
+session_detach(unsigned short port) {
+  session_t *s;
+
+  pthread_mutex_lock(&sessions_mutex);
+  for(s = sessions; s != NULL; s = s->next)
+    if(s->rpc_port == port) {
+      s->rpc_port = 0;
+      break;
+    }
+  pthread_mutex_unlock(&sessions_mutex);
+
+  return s;
+}
+
+
+/*
+ * Remove the files a session received and forget its settings.
+ */
+
+void
+discard_session(session_t *s) {
+
+  abandon_transfers(s);
 
-  if(strlen(current_state.overlay_location) > 0)
-    if(remove(current_state.overlay_location) < 0)
+  if((strlen(s->overlay_location) > 0) && 
+     (strlen(s->overlay_hash) == 0))
+    if(remove(s->overlay_location) < 0)
       if(errno != ENOENT)
 	perror("remove");
 
-  if(strlen(current_state.encryption_key_filename) > 0)
-    if(remove(current_state.encryption_key_filename) < 0)
+  if(strlen(s->encryption_key_filename) > 0)
+    if(remove(s->encryption_key_filename) < 0)
       if(errno != ENOENT)
 	perror("remove");
 
-  if(strlen(current_state.persistent_state_filename) > 0)
-    if(remove(current_state.persistent_state_filename) < 0)
+  if(strlen(s->persistent_state_filename) > 0)
+    if(remove(s->persistent_state_filename) < 0)
       if(errno != ENOENT)
 	perror("remove");
 
-  if(strlen(current_state.persistent_state_modified_filename) > 0)
-    if(remove(current_state.persistent_state_modified_filename) < 0)
+  if(strlen(s->persistent_state_modified_filename) > 0)
+    if(remove(s->persistent_state_modified_filename) < 0)
       if(errno != ENOENT)
 	perror("remove");
 
-  if(strlen(current_state.persistent_state_diff_filename) > 0)
-    if(remove(current_state.persistent_state_diff_filename) < 0)
+  if(strlen(s->persistent_state_diff_filename) > 0)
+    if(remove(s->persistent_state_diff_filename) < 0)
       if(errno != ENOENT)
 	perror("remove");
 
-  current_state.overlay_location[0]='\0';
-  current_state.encryption_key_filename[0]='\0';
-  current_state.persistent_state_filename[0]='\0';
-  current_state.persistent_state_modified_filename[0]='\0';
-  current_state.persistent_state_diff_filename[0]='\0';
+  s->overlay_location[0]='\0';
+  s->overlay_hash[0]='\0';
+  s->encryption_key_filename[0]='\0';
+  s->persistent_state_filename[0]='\0';
+  s->persistent_state_modified_filename[0]='\0';
+  s->persistent_state_diff_filename[0]='\0';
+}
+
+
+/*
+ * The client is gone for good.  Signal its dekimberlize that the
+ * connection was lost, if it hasn't been signaled yet, and drop the
+ * reference the session was kept with.  The session itself lasts until
+ * its display scripts are done with it.
+ */
+
+static void
+end_session(session_t *s) {
+  finish_launch(s);
+  discard_session(s);
+
+  fprintf(stderr, "(display-launcher) Ended session %d.\n", s->id);
+
+  session_put(s);
+}
+
+
+/*
+ * End the suspended sessions whose clients never came back.
+ */
+
+static void
+expire_suspended_sessions(void) {
+  session_t *s;
+  time_t now = time(NULL);
+
+  do {
+    pthread_mutex_lock(&sessions_mutex);
+    for(s = sessions; s != NULL; s = s->next)
+      if(s->suspended && (now - s->suspended_at >= SESSION_RESUME_TIMEOUT)) {
+	s->suspended = 0;
+	num_active++;
+	break;
+      }
+    pthread_mutex_unlock(&sessions_mutex);
+
+    if(s != NULL) {
+      fprintf(stderr, "(display-launcher) Client of session %d never "
+	      "came back.\n", s->id);
+      end_session(s);
+    }
+  } while(s != NULL);
+}
+
+
+int
+cleanup(void) {
+  session_t *s;
+
+  /*
+   * We're bringing down the process, so take what the sessions left
+   * behind without waiting for anyone to let go of them.
+   */
+
+  for(s = sessions; s != NULL; s = s->next) {
+    finish_launch(s);
+    discard_session(s);
+    nftw(s->work_dir, remove_entry, 16, FTW_DEPTH|FTW_PHYS);
+  }
 
-  pthread_mutex_init(&current_state.mutex, NULL);
+  buffer_pool_trim(chunk_buffer_pool());
 
   log_deinit();
 
@@ -109,7 +482,172 @@ catch_sigint(int sig) {
 }
 
 
+/*
+ * Answer a client's path probes until it hangs up.  They are served
+ * outside of any session, so that probing doesn't count against
+ * max_sessions; a client which stalls, or sends more or longer
+ * messages than a probe does, is hung up on so that it can't hold a
+ * thread.
+ */
+
+static void
+serve_path_probe(int connfd) {
+  char buf[65536];
+  struct timeval tv;
+  uint32_t len;
+  ssize_t got;
+  size_t left;
+  int one = 1, messages = 0;
+
+  tv.tv_sec = PATH_PROBE_IO_TIMEOUT_MS / 1000;
+  tv.tv_usec = (PATH_PROBE_IO_TIMEOUT_MS % 1000) * 1000;
+  setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  while((messages++ < PATH_PROBE_PINGS + 1) &&
+	(recv(connfd, &len, sizeof(len), MSG_WAITALL) == sizeof(len))) {
+    if(ntohl(len) > PATH_PROBE_BULK) {
+      fprintf(stderr, "(display-launcher) Path probe message of %u bytes "
+	      "is too long.\n", ntohl(len));
+      return;
+    }
+
+    for(left = ntohl(len); left > 0; left -= got) {
+      got = recv(connfd, buf, (left < sizeof(buf)) ? left : sizeof(buf), 0);
+      if(got <= 0)
+	return;
+    }
+
+    if(writen(connfd, &len, sizeof(len)) < 0)
+      return;
+  }
+}
+
+
+/*
+ * Serve one connection accepted on the launcher port.  It is either a
+ * client, whose calls get tunneled to the RPC server under a session of
+ * their own, the bulk data connection of a transfer, or a path probe.
+ * Every RPC record begins with a record mark whose high bit is set,
+ * while bulk and probe cookies never have it set, so the first four
+ * bytes tell them apart.
+ */
+
+static void *
+connection_thread(void *arg) {
+  int kcm_connfd = (int)(long)arg;
+  int rpc_connfd;
+  uint32_t first;
+  struct sockaddr_in sa;
+  socklen_t salen = sizeof(sa);
+  unsigned short port;
+  session_t *s;
+
+  if(recv(kcm_connfd, &first, sizeof(first), MSG_PEEK|MSG_WAITALL) != 
+     sizeof(first)) {
+    close(kcm_connfd);
+    return NULL;
+  }
+
+  if(!(ntohl(first) & 0x80000000)) {
+    recv(kcm_connfd, &first, sizeof(first), MSG_WAITALL);
+    if(ntohl(first) == PATH_PROBE_COOKIE) {
+      serve_path_probe(kcm_connfd);
+      close(kcm_connfd);
+    }
+    else if(deliver_bulk_connection(ntohl(first), kcm_connfd) < 0) {
+      fprintf(stderr, "(display-launcher) bad cookie on bulk data "
+	      "connection\n");
+      close(kcm_connfd);
+    }
+    return NULL;
+  }
+
+  s = session_create();
+  if(s == NULL) {
+    close(kcm_connfd);
+    return NULL;
+  }
+
+
+  /*
+   * Every KCM connection gets its own connection to the RPC server,
+   * since the tunnel closes both ends when it is done.  Its local port
+   * is how the session's calls are recognised.
+   */
+
+  rpc_connfd = make_tcpip_connection("localhost", rpc_port);
+  if((rpc_connfd < 0) ||
+     (getsockname(rpc_connfd, (struct sockaddr *) &sa, &salen) < 0)) {
+    fprintf(stderr, "(display-launcher) couldn't connect to the "
+	    "RPC server\n");
+    if(rpc_connfd >= 0)
+      close(rpc_connfd);
+    close(kcm_connfd);
+    end_session(s);
+    return NULL;
+  }
+
+  port = ntohs(sa.sin_port);
+
+  pthread_mutex_lock(&sessions_mutex);
+  s->rpc_port = port;
+  pthread_mutex_unlock(&sessions_mutex);
+
+  fprintf(stderr, "(display-launcher) Tunneling session %d..\n", s->id);
+
+  local_tunnel(kcm_connfd, rpc_connfd);
+
+  fprintf(stderr, "(display-launcher) A connection was closed.\n");
+
+
+  /*
+   * The connection may carry on a resumed session by now, rather than
+   * the one it started with.
+   */
+
+  s = session_detach(port);
+  if(s == NULL)
+    return NULL;
+
+
+  /*
+   * If the connection dropped in the middle of a transfer, keep the
+   * session around so that the client can reconnect and resume it.
+   */
+
+  if(transfer_interrupted(s)) {
+    fprintf(stderr, "(display-launcher) A transfer was interrupted. "
+	    "Keeping session %d for the client to resume.\n", s->id);
+    pthread_mutex_lock(&sessions_mutex);
+    s->suspended = 1;
+    s->suspended_at = time(NULL);
+    num_active--;
+    pthread_mutex_unlock(&sessions_mutex);
+    return NULL;
+  }
+
+  end_session(s);
+
+  return NULL;
+}
+
+
+void
+usage(char *argv0) {
+  printf("display_launcher [-n max-sessions]\n");
+}
+
+
+/*
+ * The connection to the bus, made by the first create_kcm_service().
+ * Services are published from main and from every session's launch, so
+ * the calls are made one at a time under kcm_mutex.
+ */
+
 DBusGConnection *dbus_conn = NULL;
+static pthread_mutex_t kcm_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 int
 create_kcm_service(char *name, unsigned short port) {
@@ -125,7 +663,7 @@ create_kcm_service(char *name, unsigned short port) {
       return -1;
     }
 
-    g_type_init();
+    pthread_mutex_lock(&kcm_mutex);
 
     fprintf(stderr, "(display-launcher) connecting to DBus..\n");
 
@@ -191,6 +729,8 @@ create_kcm_service(char *name, unsigned short port) {
     
     /* The DBusGConnection should never be unreffed,
      * it lives once and is shared amongst the process */
+
+    pthread_mutex_unlock(&kcm_mutex);
     
     return ret;
 }
@@ -198,10 +738,11 @@ create_kcm_service(char *name, unsigned short port) {
 int
 main(int argc, char *argv[])
 {
-  int                listenfd, kcm_connfd, rpc_connfd;
+  int                listenfd, kcm_connfd;
   struct sockaddr_in sa;
-  int                err;
+  int                err, opt;
   unsigned short     port;
+  pthread_t          tid;
 
 
   if(log_init() < 0) {
@@ -211,12 +752,42 @@ main(int argc, char *argv[])
 
   log_message("display launcher started up..");
 
+  while((opt = getopt(argc, argv, "n:")) != -1) {
+
+    switch(opt) {
+
+    case 'n':
+      max_sessions = atoi(optarg);
+      if(max_sessions < 1) {
+	usage(argv[0]);
+	exit(EXIT_FAILURE);
+      }
+      break;
+
+    default:
+      usage(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
 
-  memset(&current_state, 0, sizeof(kimberley_state_t));
-  pthread_mutex_init(&current_state.mutex, NULL);
+  fprintf(stderr, "(display-launcher) running up to %d sessions at once\n",
+	  max_sessions);
+  chunk_buffer_pool_reserve(max_sessions);
 
 
   signal(SIGINT, catch_sigint);
+  signal(SIGPIPE, SIG_IGN);
+
+
+  /*
+   * Sessions' threads call into the KCM too, so GLib and D-Bus must be
+   * ready for threads before the first call.
+   */
+
+  if(!g_thread_supported())
+    g_thread_init(NULL);
+  dbus_g_thread_init();
+  g_type_init();
 
   listenfd = socket(AF_INET, SOCK_STREAM, 0);
   if(listenfd < 0) {
@@ -245,16 +816,18 @@ main(int argc, char *argv[])
     perror("listen");
     return -1;
   }
+
+  launcher_listenfd = listenfd;
   
   fprintf(stderr, "(display-launcher) bringing up mobile launcher "
 	  "RPC server..\n");
     
-  rpc_connfd = setup_rpc_server_and_connection(MOBILELAUNCHER_PROG, 
-					       MOBILELAUNCHER_VERS,
-					       mobilelauncher_prog_1);
+  rpc_port = setup_rpc_server(MOBILELAUNCHER_PROG, MOBILELAUNCHER_VERS,
+			      mobilelauncher_prog_1, INADDR_LOOPBACK);
 
 
   while(1) {
+    struct pollfd pfd;
 
     fprintf(stderr, "(display-launcher) registering with KCM..\n");
     
@@ -273,25 +846,37 @@ main(int argc, char *argv[])
     }
     
     fprintf(stderr, "(display-launcher) Accepting KCM connection..\n");
-    
+
+
+    /*
+     * Look for suspended sessions to expire while waiting.
+     */
+
+    pfd.fd = listenfd;
+    pfd.events = POLLIN;
+    while(poll(&pfd, 1, 10 * 1000) <= 0)
+      expire_suspended_sessions();
   
     kcm_connfd = accept(listenfd, NULL, NULL);
     if(kcm_connfd < 0) {
       perror("accept");
       return -1;
     }
-  
-    fprintf(stderr, "(display-launcher) Tunneling..\n");
-  
-    local_tunnel(kcm_connfd, rpc_connfd);
-  
-    fprintf(stderr, "(display-launcher) A connection was closed.\n");
 
-    if(cleanup() < 0) {
-      fprintf(stderr, "(display-launcher) Unable to cleanup from the last "
-	      "connection.  Killing the process..\n");
-      exit(EXIT_FAILURE);
+
+    /*
+     * Each connection is served by a thread of its own, so that several
+     * clients, and their bulk data connections, can be served at once.
+     */
+
+    err = pthread_create(&tid, NULL, connection_thread, 
+			 (void *)(long)kcm_connfd);
+    if(err != 0) {
+      fprintf(stderr, "(display-launcher) failed creating thread\n");
+      close(kcm_connfd);
+      continue;
     }
+    pthread_detach(tid);
   }
   
   return -1;
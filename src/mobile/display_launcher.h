@@ -20,21 +20,189 @@
 #ifndef _MOBILE_LAUNCHER_H_
 #define _MOBILE_LAUNCHER_H_
 
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include "rpc_mobile_launcher.h"
+#include "ranges.h"
+#include "trace.h"
+#include "common.h"
+
+
+/*
+ * Where dekimberlize keeps overlays, and what they unpacked to, by the
+ * SHA-256 of the overlay file, for overlays launched again later.
+ * KIMBERLEY_OVERLAY_CACHE_DIR in the environment moves it.
+ */
+
+#define OVERLAY_CACHE_DIR \
+  kimberley_dir("KIMBERLEY_OVERLAY_CACHE_DIR", "/var/tmp/kimberley/overlays")
+
+
+/*
+ * Every session gets a work directory of its own under SESSION_DIR, for
+ * the files it receives and for the files through which dekimberlize
+ * and the display scripts report back, so that sessions never see each
+ * other's.  It is removed with the session.  KIMBERLEY_SESSION_DIR in
+ * the environment moves them.
+ */
+
+#define SESSION_DIR \
+  kimberley_dir("KIMBERLEY_SESSION_DIR", "/tmp/kimberley/sessions")
+
+
+/*
+ * Sessions the display runs at once unless told otherwise with -n, and
+ * seconds a session whose connection dropped mid-transfer is kept for
+ * its client to resume.
+ */
+
+#define DEFAULT_MAX_SESSIONS    1
+#define SESSION_RESUME_TIMEOUT  300
+
+#define SESSION_COMMAND_MAX     (4 * PATH_MAX)
+
+
+/*
+ * Longest a wait_status call is held, in seconds, whatever the client
+ * asks for.
+ */
+
+#define LAUNCH_WAIT_MAX         60
+
+
+/*
+ * Milliseconds to keep probing a new VNC server before advertising it
+ * regardless.
+ */
+
+#define VNC_PROBE_TIMEOUT_MS    30000
+
+
+/*
+ * The file a session is currently receiving.  The destination file is
+ * allocated at its full size up front, and every chunk names the offset
+ * it belongs at.  Writes never extend the file, so chunks may land in
+ * any order and the file stays contiguous on disk for dekimberlize to
+ * read back.
+ *
+ * Which parts have arrived is kept as a set of byte ranges, so that a
+ * client which lost its connection can ask for them with query_received
+ * and send only what is missing.  The bulk data thread updates the
+ * transfer too, hence the mutex.
+ *
+ * If the client sent a chunk manifest with have_chunks, the finished
+ * file is added to the chunk store so that later uploads of the same
+ * chunks can be skipped.
+ */
+
 typedef struct {
   pthread_mutex_t mutex;
+  pthread_cond_t  arrived;      /* Signaled when more of it arrives. */
+  int             id;
+  int             fd;
+  int             size;
+  int             error;
+  char            filename[PATH_MAX];
+  range_set_t     received;
+  chunk_manifest  manifest;
+} incoming_t;
+
+
+/*
+ * Streaming an overlay into dekimberlize while it is still arriving.
+ * Protected by the incoming transfer's mutex.
+ */
+
+enum stream_state {
+  STREAM_NONE = 0,
+  STREAM_PENDING = 1,           /* Waiting for the transfer to begin. */
+  STREAM_LAUNCHED = 2           /* dekimberlize is running. */
+};
+
+typedef struct {
+  enum stream_state state;
+  int               generation;   /* Bumped when the session is dropped. */
+  char              vm_name[PATH_MAX];
+  char              filename[PATH_MAX];
+} stream_t;
+
+
+/*
+ * Everything the display knows about one client and the VM it runs.
+ * Sessions are reference counted: the connection carrying the client's
+ * calls, the display scripts, and every call being served each hold a
+ * reference, and the session is freed, and its work directory removed,
+ * when the last is dropped.
+ *
+ * The client's calls are told apart by the local port of the loopback
+ * connection the display opened to its RPC server for that client.
+ */
+
+typedef struct session session_t;
+
+struct session {
+  pthread_mutex_t mutex;        /* Held while the display scripts run. */
+  int id;
+  int refs;                     /* Protected by the session list lock. */
+  unsigned short rpc_port;      /* 0 once the connection has closed. */
   int display_in_progress;
+  int suspended;                /* Connection lost mid-transfer; the
+				 * client may reconnect and resume. */
+  time_t suspended_at;
+  char work_dir[PATH_MAX];
   char vm_name[PATH_MAX];
   char overlay_location[PATH_MAX];
+  char overlay_hash[65];        /* Set if overlay_location is a copy in
+				 * OVERLAY_CACHE_DIR. */
   char encryption_key_filename[PATH_MAX];
   char persistent_state_filename[PATH_MAX];
   char persistent_state_modified_filename[PATH_MAX];
   char persistent_state_diff_filename[PATH_MAX];
-} kimberley_state_t;
+  char command[SESSION_COMMAND_MAX];
+
+  pthread_mutex_t launch_mutex; /* The session's mutex is held for as
+				 * long as the display scripts run. */
+  pthread_cond_t  launch_changed;
+  launch_status   launch;       /* How far the VM launch has got. */
+  int             vnc_server_port;
+  int             vm_resumed;
+  int             launch_finished;
+  int             notify_pipe[2];  /* Reports from the display scripts. */
+  int             finish_pipe[2];  /* Closed when the user is done. */
+  span_id_t       client_span;     /* The client's span for the launch. */
+  span_id_t       launch_span;
+
+  incoming_t incoming;
+  stream_t   stream;
+  int        write_window;
+  int        receive_buffer;    /* Bytes the RPC connection's receive
+				 * buffer was last grown to hold. */
+  FILE      *read_attachment;
+  int        read_attachment_size;
 
-extern volatile kimberley_state_t current_state;
+  session_t *next;
+};
+
+extern int launcher_listenfd;
+
+session_t *	session_get(struct svc_req *rqstp);
+session_t *	session_find_suspended(int (*match)(session_t *, void *), 
+				       void *arg);
+void		session_adopt(session_t *s, session_t *suspended);
+void		session_hold(session_t *s);
+void		session_put(session_t *s);
+int		session_path(session_t *s, char *path, char *filename);
+int		session_new_transfer_id(session_t *s);
 
-int		make_tcpip_connection(char *hostname, unsigned short port);
-void		local_tunnel(int kcm_sock, int rpc_sock);
 int		create_kcm_service(char *name, unsigned short port);
+void		finish_launch(session_t *s);
+void		discard_session(session_t *s);
+
+void		init_session_transfers(session_t *s);
+int		transfer_interrupted(session_t *s);
+void		abandon_transfers(session_t *s);
+int		deliver_bulk_connection(uint32_t cookie, int connfd);
 
 #endif
@@ -0,0 +1,344 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * kcm_stub
+ *
+ * Stands in for the KCM on the session bus, so that the display and
+ * mobile launchers can find each other on one host without Avahi or a
+ * second machine.  It implements the edu.cmu.cs.kimberley.kcm interface
+ * of kcm.xml: sense() reports the interfaces given with -i, publish()
+ * remembers a service's port, and browse() answers with it, directly
+ * rather than through a tunnel, as both ends are on the loopback
+ * interface.  A browse() for a service not yet published is answered
+ * once it is.
+ *
+ * With -b it goes into the background once it owns the KCM's name on
+ * the bus, printing its process ID.
+ */
+
+#include <dbus/dbus.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "common.h"
+
+
+#define KCM_STUB_MAX_SERVICES 64
+#define KCM_STUB_MAX_PENDING  64
+#define KCM_STUB_MAX_IFACES   8
+
+typedef struct {
+  char          *name;
+  dbus_uint32_t  port;
+} service_t;
+
+static service_t     services[KCM_STUB_MAX_SERVICES];
+static int           num_services = 0;
+
+static DBusMessage  *pending[KCM_STUB_MAX_PENDING];
+static int           num_pending = 0;
+
+static const char   *interfaces[KCM_STUB_MAX_IFACES];
+static int           num_interfaces = 0;
+
+static int           verbose = 0;
+
+
+static service_t *
+find_service(const char *name) {
+  int i;
+
+  for(i=0; i<num_services; i++)
+    if(strcmp(services[i].name, name) == 0)
+      return &services[i];
+
+  return NULL;
+}
+
+
+static void
+send_reply(DBusConnection *conn, DBusMessage *reply) {
+  if(reply == NULL) {
+    fprintf(stderr, "(kcm-stub) out of memory\n");
+    return;
+  }
+
+  dbus_connection_send(conn, reply, NULL);
+  dbus_message_unref(reply);
+}
+
+
+static void
+reply_port(DBusConnection *conn, DBusMessage *call, dbus_uint32_t port) {
+  DBusMessage *reply = dbus_message_new_method_return(call);
+
+  if(reply != NULL)
+    dbus_message_append_args(reply, DBUS_TYPE_UINT32, &port,
+			     DBUS_TYPE_INVALID);
+  send_reply(conn, reply);
+}
+
+
+static void
+handle_sense(DBusConnection *conn, DBusMessage *call) {
+  DBusMessage *reply = dbus_message_new_method_return(call);
+  const char **names = interfaces;
+
+  if(reply != NULL)
+    dbus_message_append_args(reply, DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+			     &names, num_interfaces, DBUS_TYPE_INVALID);
+  send_reply(conn, reply);
+}
+
+
+static void
+handle_publish(DBusConnection *conn, DBusMessage *call) {
+  const char *name;
+  dbus_int32_t iface;
+  dbus_uint32_t port;
+  service_t *service;
+  int i;
+
+  if(!dbus_message_get_args(call, NULL, DBUS_TYPE_STRING, &name,
+			    DBUS_TYPE_INT32, &iface, DBUS_TYPE_UINT32, &port,
+			    DBUS_TYPE_INVALID)) {
+    send_reply(conn, dbus_message_new_error(call, DBUS_ERROR_INVALID_ARGS,
+					    "publish(s, i, u)"));
+    return;
+  }
+
+  if(verbose)
+    fprintf(stderr, "(kcm-stub) publish %s on port %u\n", name, port);
+
+  service = find_service(name);
+  if((service == NULL) && (num_services < KCM_STUB_MAX_SERVICES)) {
+    service = &services[num_services++];
+    service->name = strdup(name);
+  }
+  if(service == NULL) {
+    send_reply(conn, dbus_message_new_error(call, DBUS_ERROR_LIMITS_EXCEEDED,
+					    "too many services"));
+    return;
+  }
+  service->port = port;
+
+  send_reply(conn, dbus_message_new_method_return(call));
+
+
+  /*
+   * Answer whoever was browsing for it.
+   */
+
+  for(i=0; i<num_pending; ) {
+    const char *wanted;
+
+    if(dbus_message_get_args(pending[i], NULL, DBUS_TYPE_STRING, &wanted,
+			     DBUS_TYPE_INVALID) &&
+       (strcmp(wanted, name) == 0)) {
+      reply_port(conn, pending[i], port);
+      dbus_message_unref(pending[i]);
+      pending[i] = pending[--num_pending];
+    }
+    else
+      i++;
+  }
+}
+
+
+static void
+handle_browse(DBusConnection *conn, DBusMessage *call) {
+  const char *name;
+  dbus_int32_t iface;
+  service_t *service;
+
+  if(!dbus_message_get_args(call, NULL, DBUS_TYPE_STRING, &name,
+			    DBUS_TYPE_INT32, &iface, DBUS_TYPE_INVALID)) {
+    send_reply(conn, dbus_message_new_error(call, DBUS_ERROR_INVALID_ARGS,
+					    "browse(s, i)"));
+    return;
+  }
+
+  if(verbose)
+    fprintf(stderr, "(kcm-stub) browse %s\n", name);
+
+  service = find_service(name);
+  if(service != NULL) {
+    reply_port(conn, call, service->port);
+    return;
+  }
+
+  if(num_pending == KCM_STUB_MAX_PENDING) {
+    send_reply(conn, dbus_message_new_error(call, DBUS_ERROR_LIMITS_EXCEEDED,
+					    "too many browsers waiting"));
+    return;
+  }
+
+  pending[num_pending++] = dbus_message_ref(call);
+}
+
+
+static DBusHandlerResult
+handle_message(DBusConnection *conn, DBusMessage *msg, void *arg) {
+  if(dbus_message_is_method_call(msg, KCM_DBUS_SERVICE_NAME, "sense"))
+    handle_sense(conn, msg);
+  else if(dbus_message_is_method_call(msg, KCM_DBUS_SERVICE_NAME, "publish"))
+    handle_publish(conn, msg);
+  else if(dbus_message_is_method_call(msg, KCM_DBUS_SERVICE_NAME, "browse"))
+    handle_browse(conn, msg);
+  else
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+
+/*
+ * Connect to the session bus and take the KCM's name, returning NULL if
+ * it is taken already.
+ */
+
+static DBusConnection *
+claim_kcm_name(void) {
+  static DBusObjectPathVTable vtable;
+  DBusConnection *conn;
+  DBusError err;
+  int ret;
+
+  vtable.message_function = handle_message;
+  dbus_error_init(&err);
+
+  conn = dbus_bus_get(DBUS_BUS_SESSION, &err);
+  if(conn == NULL) {
+    fprintf(stderr, "(kcm-stub) Unable to connect to dbus: %s\n",
+	    err.message);
+    dbus_error_free(&err);
+    return NULL;
+  }
+
+  if(!dbus_connection_register_object_path(conn, KCM_DBUS_SERVICE_PATH,
+					   &vtable, NULL)) {
+    fprintf(stderr, "(kcm-stub) couldn't register %s\n",
+	    KCM_DBUS_SERVICE_PATH);
+    return NULL;
+  }
+
+  ret = dbus_bus_request_name(conn, KCM_DBUS_SERVICE_NAME,
+			      DBUS_NAME_FLAG_DO_NOT_QUEUE, &err);
+  if(ret != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+    fprintf(stderr, "(kcm-stub) couldn't own %s: %s\n",
+	    KCM_DBUS_SERVICE_NAME,
+	    dbus_error_is_set(&err) ? err.message : "already taken");
+    dbus_error_free(&err);
+    return NULL;
+  }
+
+  return conn;
+}
+
+
+static void
+usage(void) {
+  printf("kcm_stub [-b] [-v] [-i interface[,interface...]]\n");
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  DBusConnection *conn;
+  char lo[] = "lo", *iface_list = lo, *name, *save = NULL;
+  int opt, background = 0, ready[2] = { -1, -1 };
+
+  while((opt = getopt(argc, argv, "bi:vh")) != -1) {
+    switch(opt) {
+    case 'b':
+      background = 1;
+      break;
+    case 'i':
+      iface_list = optarg;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for(name = strtok_r(iface_list, ",", &save);
+      (name != NULL) && (num_interfaces < KCM_STUB_MAX_IFACES);
+      name = strtok_r(NULL, ",", &save))
+    interfaces[num_interfaces++] = name;
+
+
+  /*
+   * In the background, the parent returns once the child owns the
+   * name, so that whoever started it can go on to use it.
+   */
+
+  if(background) {
+    pid_t pid;
+    char ok;
+
+    if(pipe(ready) < 0) {
+      perror("pipe");
+      exit(EXIT_FAILURE);
+    }
+
+    pid = fork();
+    if(pid < 0) {
+      perror("fork");
+      exit(EXIT_FAILURE);
+    }
+    if(pid > 0) {
+      close(ready[1]);
+      if(read(ready[0], &ok, 1) != 1)
+	exit(EXIT_FAILURE);
+      printf("%d\n", pid);
+      exit(EXIT_SUCCESS);
+    }
+
+    /* Let go of stdout, or whoever reads the process ID waits on us. */
+    close(ready[0]);
+    if(freopen("/dev/null", "w", stdout) == NULL)
+      exit(EXIT_FAILURE);
+    setsid();
+  }
+
+  conn = claim_kcm_name();
+  if(conn == NULL)
+    exit(EXIT_FAILURE);
+
+  if(verbose)
+    fprintf(stderr, "(kcm-stub) serving %s\n", KCM_DBUS_SERVICE_NAME);
+
+  if(background) {
+    if(write(ready[1], "", 1) != 1)
+      exit(EXIT_FAILURE);
+    close(ready[1]);
+  }
+
+  while(dbus_connection_read_write_dispatch(conn, -1))
+    ;
+
+  return 0;
+}
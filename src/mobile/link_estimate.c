@@ -0,0 +1,130 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "common.h"
+#include "link_estimate.h"
+
+
+void
+link_estimate_init(link_estimate_t *link) {
+  memset(link, 0, sizeof(link_estimate_t));
+  link->chunk_size = transfer_tuning()->chunk_size;
+  link->window = SEND_WINDOW;
+  link->in_flight = link->chunk_size * link->window;
+}
+
+
+/*
+ * A round trip took "secs".  Anything slower than the quickest was
+ * held up in a queue somewhere, so only the quickest counts.
+ */
+
+void
+link_estimate_rtt(link_estimate_t *link, double secs) {
+  if((secs > 0) && ((link->rtt == 0) || (secs < link->rtt)))
+    link->rtt = secs;
+}
+
+
+/*
+ * "bytes" sent in one go were acknowledged "secs" after the first of
+ * them was sent.  One round trip of that was spent waiting for the
+ * acknowledgement rather than sending, so it comes off, but when the
+ * bytes fit in the link many times over there is little left to
+ * measure by: a sample is never taken as more than eight times the
+ * naive rate, which lets the plan grow quickly but not wildly.  Until
+ * a round trip has been measured, the naive rate is all there is.  The
+ * samples are smoothed, so that one stall doesn't shrink the plan.
+ */
+
+void
+link_estimate_delivery(link_estimate_t *link, long bytes, double secs) {
+  double sending, sample;
+
+  if((bytes <= 0) || (secs <= 0))
+    return;
+
+  sending = secs - link->rtt;
+  if(sending < secs / 8)
+    sending = secs / 8;
+  sample = bytes / sending;
+
+  link_estimate_rtt(link, secs);
+
+  if(link->bandwidth == 0)
+    link->bandwidth = sample;
+  else
+    link->bandwidth = 0.75 * link->bandwidth + 0.25 * sample;
+}
+
+
+long
+link_estimate_bdp(link_estimate_t *link) {
+  return (long) (link->bandwidth * link->rtt);
+}
+
+
+/*
+ * Plan for four times the bandwidth-delay product in flight.  A window
+ * of chunks is only sent once the last one's reply is back, so the
+ * link idles for a round trip per window, and with W bytes in flight
+ * is busy W / (W + BDP) of the time: four times keeps it 80% busy
+ * without queueing megabytes on a slow link.  The chunks are an eighth
+ * to a sixteenth of that, as a power of two: a few big calls where the
+ * link is fast and long, and small ones on a slow or lossy link, where
+ * less is resent after a reconnection.  Returns the number of chunks in
+ * the window.
+ */
+
+int
+link_estimate_plan(link_estimate_t *link, int max_window) {
+  long target, chunk;
+  int window;
+
+  if(max_window < 1)
+    max_window = 1;
+
+  if((link->bandwidth == 0) || (link->rtt == 0)) {
+    link->window = (SEND_WINDOW < max_window) ? SEND_WINDOW : max_window;
+    link->in_flight = link->chunk_size * link->window;
+    return link->window;
+  }
+
+  target = 4 * link_estimate_bdp(link);
+  if(target < LINK_IN_FLIGHT_MIN)
+    target = LINK_IN_FLIGHT_MIN;
+
+  for(chunk = LINK_CHUNK_MIN;
+      (chunk < CHUNK_SIZE_MAX) && (chunk * 2 * SEND_WINDOW <= target);
+      chunk *= 2)
+    ;
+
+  window = (target + chunk - 1) / chunk;
+  if(window < 2)
+    window = 2;
+  if(window > max_window)
+    window = max_window;
+
+  link->chunk_size = chunk;
+  link->window = window;
+  link->in_flight = chunk * window;
+
+  return window;
+}
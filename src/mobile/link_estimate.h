@@ -0,0 +1,60 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LINK_ESTIMATE_H_
+#define _LINK_ESTIMATE_H_
+
+
+/*
+ * What a client knows of its link to the display: the round trip time,
+ * taken as the quickest seen, and the bandwidth, from how quickly the
+ * display acknowledges what was sent.  Their product, the bandwidth-
+ * delay product, is how much must be in flight to keep the link busy,
+ * and from it come the size of send_partial chunks, the number of them
+ * in flight, and the socket buffers holding them.
+ *
+ * A transfer plans with link_estimate_plan() before it starts and again
+ * after every window of chunks, so that it follows the link as it
+ * changes.  Without a measured bandwidth, the plan is the tuned chunk
+ * size and SEND_WINDOW (see common.h).
+ */
+
+typedef struct {
+  double rtt;            /* Seconds, or 0 until measured. */
+  double bandwidth;      /* Bytes per second, or 0 until measured. */
+  int    chunk_size;     /* The plan: bytes per send_partial call, */
+  int    window;         /* calls in flight, */
+  int    in_flight;      /* and the bytes they hold. */
+} link_estimate_t;
+
+
+/*
+ * Chunks are never planned smaller than this, as each one costs a call.
+ */
+
+#define LINK_CHUNK_MIN     (64 * 1024)
+#define LINK_IN_FLIGHT_MIN (4 * LINK_CHUNK_MIN)
+
+void	link_estimate_init(link_estimate_t *link);
+void	link_estimate_rtt(link_estimate_t *link, double secs);
+void	link_estimate_delivery(link_estimate_t *link, long bytes, double secs);
+long	link_estimate_bdp(link_estimate_t *link);
+int	link_estimate_plan(link_estimate_t *link, int max_window);
+
+#endif
@@ -22,6 +22,7 @@
 #include <libgen.h>
 #include <math.h>
 #include <netdb.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/time.h>
@@ -37,171 +38,918 @@
 
 #include "kcm_dbus_app_glue.h"
 #include "rpc_mobile_launcher.h"
+#include "buffer_pool.h"
+#include "link_estimate.h"
+#include "path_probe.h"
+#include "ranges.h"
+#include "sha256.h"
 #include "common.h"
+#include "trace.h"
 
 
 #define AVAHI_TIMEOUT 15
 
+
+/*
+ * Round trips made to the display to tell how far apart its clock is
+ * from ours, of which the quickest is trusted.
+ */
+
+#define CLOCK_SYNC_ROUNDS 4
+
+
+/*
+ * If the round trip to the display is slower than this, in milliseconds,
+ * the thin client connection goes over the path probed quickest, such as
+ * a USB cable, and the launch waits up to PATH_PROBE_WAIT_MS for the
+ * probes to tell which that is.
+ */
+
+#define SLOW_PATH_MS       100
+#define PATH_PROBE_WAIT_MS 2000
+
+
+/*
+ * Seconds each wait_status call may be held by the display.
+ */
+
+#define LAUNCH_POLL_TIMEOUT 30
+
 char command[ARG_MAX];
 
-enum vm_type {
-  VM_UNKNOWN = 0,
-  VM_URL = 1,
-  VM_FILE = 2
-};
+static unsigned short launcher_port = 0;
+static DBusGProxy *display_proxy = NULL;
+static link_estimate_t display_link;
+
+enum vm_type {
+  VM_UNKNOWN = 0,
+  VM_URL = 1,
+  VM_FILE = 2
+};
+
+void
+usage(char *argv0) {
+  printf("mobile_launcher [-a floppy-file] [-d encryption-key-file]\n"
+	 "                <[-f patch-file] || [-i URL]> <vm-name>\n");
+}
+
+
+int
+perform_authentication(void) {
+  return 0;
+}
+
+
+/*
+ * Read the display's trace clock a few times, and record in the trace
+ * how far ahead of ours it is, by the quickest round trip: its reading
+ * is taken to be from halfway through.  The display's spans for this
+ * launch go under the span given.
+ */
+
+void
+sync_clock(CLIENT *clnt, span_id_t span) {
+  clock_reading reading;
+  enum clnt_stat retval;
+  uint64_t before, after, best_rtt = 0, process = 0;
+  int64_t offset = 0;
+  int i;
+
+  for(i=0; i<CLOCK_SYNC_ROUNDS; i++) {
+    before = trace_realtime();
+    retval = clock_sync_1(span, &reading, clnt);
+    after = trace_realtime();
+
+    if(retval != RPC_SUCCESS) {
+      if(retval != RPC_PROCUNAVAIL)
+	fprintf(stderr, "(mobile-launcher) clock_sync failed: %s\n", 
+		clnt_sperrno(retval));
+      return;
+    }
+
+    if((i == 0) || (after - before < best_rtt)) {
+      best_rtt = after - before;
+      offset = (int64_t) (reading.realtime_ns - (before + best_rtt / 2));
+      process = reading.process;
+    }
+  }
+
+  trace_clock(process, offset, best_rtt);
+  link_estimate_rtt(&display_link, best_rtt / 1e9);
+}
+
+
+/*
+ * Find the display launcher through the KCM and bring up a Sun RPC
+ * client over a local connection to it.
+ */
+
+CLIENT *
+connect_to_display(DBusGProxy *dbus_proxy) {
+  guint gport = 0;
+  GError *gerr = NULL;
+  enum clnt_stat retval;
+  int connfd;
+  CLIENT *clnt;
+
+  fprintf(stderr, "(mobile-launcher) DBus calling into kcm (browse)..\n");
+
+  if(!edu_cmu_cs_kimberley_kcm_browse(dbus_proxy, 
+				      LAUNCHER_KCM_SERVICE_NAME, 
+				      -1, 
+				      &gport, 
+				      &gerr)) {
+    g_warning("(mobile-launcher) kcm->browse() method failed: %s", 
+	      gerr->message);
+    g_error_free(gerr);
+    return NULL;
+  }
+
+  fprintf(stderr, "(mobile-launcher) KCM browse() returned port: %d\n", 
+	  gport);
+
+  launcher_port = gport;
+
+
+  /* Create new loopback connection to the Sun RPC server on the
+   * port that it indicated in the D-Bus message. */
+
+  fprintf(stderr, "(mobile-launcher) connect()ing locally to kcm..\n");
+
+  connfd = make_tcpip_connection("localhost", gport);
+  if(connfd < 0)
+    return NULL;
+
+  fprintf(stderr, "(mobile-launcher) successfully connected. bringing up "
+	  "launcher..\n");
+
+  clnt = convert_socket_to_rpc_client(connfd, MOBILELAUNCHER_PROG, 
+				      MOBILELAUNCHER_VERS);
+  if(clnt == NULL) {
+    fprintf(stderr, "(mobile-launcher) Sun RPC initialization failed");
+    close(connfd);
+    return NULL;
+  }
+
+  //perform_authentication();
+
+  retval = ping_1((void *)NULL, clnt);
+  if(retval != RPC_SUCCESS) {
+    fprintf(stderr, "(mobile-launcher) ping failed!\n");
+    clnt_destroy(clnt);
+    close(connfd);
+    return NULL;
+  }
+
+  return clnt;
+}
+
+
+/*
+ * Replace a client whose connection was lost with a fresh one.  The
+ * display keeps an interrupted transfer around, so once this succeeds
+ * the caller can pick up where it left off.
+ */
+
+int
+reconnect_to_display(CLIENT **clntp) {
+  int i, fd;
+
+  if(*clntp != NULL) {
+    if(clnt_control(*clntp, CLGET_FD, (char *)&fd))
+      close(fd);
+    clnt_destroy(*clntp);
+    *clntp = NULL;
+  }
+
+  if(display_proxy == NULL)
+    return -1;
+
+  for(i=0; i<RESUME_ATTEMPTS; i++) {
+    struct timeval tv;
+
+    fprintf(stderr, "(mobile-launcher) Reconnecting to display "
+	    "(attempt %d of %d)..\n", i + 1, RESUME_ATTEMPTS);
+
+    *clntp = connect_to_display(display_proxy);
+    if(*clntp != NULL) {
+      log_message("mobile launcher reconnected to display");
+      return 0;
+    }
+
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+
+    select(0, NULL, NULL, NULL, &tv);
+  }
+
+  fprintf(stderr, "(mobile-launcher) Giving up reconnecting to display.\n");
+
+  return -1;
+}
+
+
+/*
+ * Ask the display which parts of a transfer it already has.  Returns
+ * -1 if the call failed and -2 if the display no longer knows about
+ * the transfer.
+ */
+
+int
+query_transfer(CLIENT *clnt, int transfer_id, range_set_t *received) {
+  received_ranges result;
+  enum clnt_stat retval;
+  u_int i;
+
+  memset(&result, 0, sizeof(received_ranges));
+
+  retval = query_received_1(transfer_id, &result, clnt);
+  if(retval != RPC_SUCCESS) {
+    clnt_perror (clnt, "query_received RPC call failed");
+    return -1;
+  }
+
+  if(result.transfer_id != transfer_id) {
+    xdr_free((xdrproc_t)xdr_received_ranges, (char *)&result);
+    return -2;
+  }
+
+  range_set_clear(received);
+  for(i=0; i<result.ranges.ranges_len; i++)
+    range_set_add(received, result.ranges.ranges_val[i].offset, 
+		  result.ranges.ranges_val[i].length);
+
+  xdr_free((xdrproc_t)xdr_received_ranges, (char *)&result);
+
+  return 0;
+}
+
+
+int
+negotiate_window(CLIENT *clnt) {
+  enum clnt_stat retval;
+  int window;
+
+  retval = send_window_1(transfer_tuning()->adapt ? 
+			 SEND_WINDOW_MAX : SEND_WINDOW, &window, clnt);
+  if((retval != RPC_SUCCESS) || (window < 1)) {
+    fprintf(stderr, "(mobile-launcher) display doesn't support pipelined "
+	    "sends, waiting for every chunk.\n");
+    window = 1;
+  }
+
+  return window;
+}
+
+
+/*
+ * Tell the display how many send_partial calls will be in flight, so
+ * that it can make room for them, without waiting for its answer.
+ */
+
+static void
+announce_window(CLIENT *clnt, int window) {
+  int granted;
+
+  rpc_call_pipelined(clnt, send_window, (xdrproc_t) xdr_int, 
+		     (caddr_t) &window, (xdrproc_t) xdr_int, 
+		     (caddr_t) &granted);
+}
+
+
+/*
+ * Plan the chunks and window of a transfer from the link estimate, and
+ * let the socket buffer hold the window.  Returns the window.
+ */
+
+static int
+plan_transfer(CLIENT *clnt, int max_window) {
+  link_estimate_t old = display_link;
+  int fd;
+
+  if(!transfer_tuning()->adapt)
+    return max_window;
+
+  link_estimate_plan(&display_link, max_window);
+
+  if((display_link.chunk_size != old.chunk_size) || 
+     (display_link.window != old.window))
+    fprintf(stderr, "\n(mobile-launcher) Sending %d KB chunks, %d at a "
+	    "time (round trip %.1f ms, %.1f MB/s).\n", 
+	    display_link.chunk_size >> 10, display_link.window, 
+	    display_link.rtt * 1000, display_link.bandwidth / 1048576);
+
+  if(clnt_control(clnt, CLGET_FD, (char *)&fd))
+    grow_socket_buffer(fd, SO_SNDBUF, display_link.in_flight);
+
+  return display_link.window;
+}
+
+
+/*
+ * Send a file to the display in send_partial calls.  Rather than waiting
+ * a round trip for every chunk, up to a window of send_partial calls is
+ * kept in flight and only the last call in each window waits for its
+ * reply.  Older displays which don't know send_window get a window of 1,
+ * and those which don't know send_partial_at are sent the whole file
+ * again, in order, with send_partial.
+ *
+ * The chunk size and window are planned from the link estimate, and
+ * planned again as every window's reply shows how the link is doing,
+ * unless transfer_tuning() holds them fixed.
+ *
+ * If the connection is lost, reconnect, ask the display what it has
+ * and send only the chunks it is missing.  A transfer_id of zero
+ * starts a new transfer; otherwise the transfer is resumed.
+ */
+
+int
+send_file_in_pieces(char *path, CLIENT **clntp, int transfer_id) {
+  struct stat buf;
+  int ret, window, max_window, calls, fd, attempts = 0;
+  int chunk_size, partial_size, append = 0;
+  off_t offset = 0, size;
+  long window_bytes = 0;
+  uint64_t window_start = 0;
+  char *partial_bytes;
+  enum clnt_stat retval;
+  range_set_t received;
+  char logmsg[ARG_MAX];
+
+  if((path == NULL) || (clntp == NULL) || (*clntp == NULL))
+    return -1;
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    perror("open");
+    return -1;
+  }
+
+  memset(&buf, 0, sizeof(struct stat));
+
+  ret = fstat(fd, &buf);
+  if(ret < 0) {
+    perror("fstat");
+    close(fd);
+    return -1;
+  }
+
+  size = buf.st_size;
+  fprintf(stderr, "(mobile-launcher) Transfer of %s (size=%d) starting.\n",
+	  path, (int) size);
+
+  range_set_init(&received);
+
+  if(transfer_id > 0) {
+    ret = query_transfer(*clntp, transfer_id, &received);
+    if((ret == -1) && (reconnect_to_display(clntp) == 0))
+      ret = query_transfer(*clntp, transfer_id, &received);
+    if(ret < 0)
+      transfer_id = 0;
+  }
+
+  if(*clntp == NULL) {
+    close(fd);
+    return -1;
+  }
+
+  if(transfer_id <= 0) {
+    snprintf(logmsg, ARG_MAX, "mobile launcher requesting send of file, size: %u", buf.st_size);
+    log_message(logmsg);
+
+    retval = send_file_1(path, buf.st_size, &transfer_id, *clntp);
+    if(retval != RPC_SUCCESS) {
+      clnt_perror (*clntp, "send_file RPC call failed");
+      close(fd);
+      return -1;
+    }
+
+    log_message("mobile launcher completed send request");
+  }
+
+  max_window = negotiate_window(*clntp);
+  window = plan_transfer(*clntp, max_window);
+  if(window != max_window)
+    announce_window(*clntp, window);
+  chunk_size = transfer_tuning()->adapt ? 
+    display_link.chunk_size : transfer_tuning()->chunk_size;
+  calls = 0;
+
+  partial_size = chunk_size;
+  partial_bytes = chunk_buffer_get(partial_size);
+  if(partial_bytes == NULL) {
+    range_set_clear(&received);
+    close(fd);
+    return -1;
+  }
+
+  log_message("mobile launcher sending file");
+
+  while(offset < size) {
+    send_partial_at_1_argument arg;
+    int num_bytes, length, last;
+
+
+    /*
+     * Skip whatever the display already has.  The last chunk still to
+     * send is always a normal call, so that its reply covers the rest.
+     */
+
+    length = (size - offset < chunk_size) ? size - offset : chunk_size;
+
+    if(range_set_covers(&received, offset, length)) {
+      offset += length;
+      continue;
+    }
+
+    last = ((offset + length == size) || 
+	    range_set_covers(&received, offset + length, 
+			     size - offset - length));
+
+    num_bytes = pread(fd, partial_bytes, length, offset);
+    if(num_bytes < 0) {
+      perror("pread");
+      break;
+    }
+    if(num_bytes == 0)
+      break;
+
+    arg.offset = offset;
+    arg.part.chunk_len = num_bytes;
+    arg.part.chunk_val = partial_bytes;
+
+    if(calls == 0)
+      window_start = trace_now();
+    calls++;
+    window_bytes += num_bytes;
+
+
+    /*
+     * Only the last chunk of a window, and of the file, waits for
+     * its reply.  Since the display handles calls in order, that reply
+     * also accounts for every chunk sent before it.
+     */
+
+    if((calls < window) && !last) {
+      if(append)
+	retval = rpc_call_pipelined(*clntp, send_partial, 
+				    (xdrproc_t) xdr_chunk, 
+				    (caddr_t) &arg.part,
+				    (xdrproc_t) xdr_int, (caddr_t) &ret);
+      else
+	retval = rpc_call_pipelined(*clntp, send_partial_at, 
+				    (xdrproc_t) xdr_send_partial_at_1_argument, 
+				    (caddr_t) &arg,
+				    (xdrproc_t) xdr_int, (caddr_t) &ret);
+      ret = 0;
+    }
+    else if(append)
+      retval = send_partial_1(arg.part, &ret, *clntp);
+    else
+      retval = send_partial_at_1(arg.offset, arg.part, &ret, *clntp);
+
+
+    /*
+     * A display without send_partial_at wrote none of this transfer's
+     * chunks, so start over, appending them.
+     */
+
+    if((retval == RPC_PROCUNAVAIL) && !append) {
+      fprintf(stderr, "(mobile-launcher) Display doesn't know "
+	      "send_partial_at; sending %s in order.\n", path);
+      append = 1;
+      range_set_clear(&received);
+      offset = 0;
+      calls = 0;
+      window_bytes = 0;
+      continue;
+    }
+
+    if((retval != RPC_SUCCESS) || (ret < 0)) {
+      if(retval != RPC_SUCCESS)
+	clnt_perror (*clntp, "send_partial RPC call failed");
+      else
+	fprintf(stderr, "(mobile-launcher) display failed writing %s\n", 
+		path);
+
+      /* Appended chunks can't be resent where they belong. */
+      if(append || (++attempts > RESUME_ATTEMPTS) ||
+	 ((retval != RPC_SUCCESS) && (reconnect_to_display(clntp) < 0)))
+	break;
+
+
+      /*
+       * Start over from the display's idea of what arrived, since
+       * any number of the pipelined chunks may have been lost.
+       */
+
+      if(query_transfer(*clntp, transfer_id, &received) < 0) {
+	fprintf(stderr, "(mobile-launcher) display lost the transfer "
+		"of %s\n", path);
+	break;
+      }
+
+      fprintf(stderr, "(mobile-launcher) Resuming %s with %d of %d "
+	      "bytes sent.\n", path, range_set_total(&received), 
+	      (int) buf.st_size);
+      log_message("mobile launcher resuming send of file");
+
+      max_window = negotiate_window(*clntp);
+      window = plan_transfer(*clntp, max_window);
+      if(window != max_window)
+	announce_window(*clntp, window);
+      offset = 0;
+      calls = 0;
+      window_bytes = 0;
+      continue;
+    }
+
+    fprintf(stderr, ".");
+    offset += length;
+
+
+    /*
+     * A window's reply tells how quickly the link carried it.  Plan the
+     * next window, with the display told of any change before the
+     * chunks which make use of it.
+     */
+
+    if((calls == window) || last) {
+      if(transfer_tuning()->adapt) {
+	link_estimate_delivery(&display_link, window_bytes, 
+			       (trace_now() - window_start) / 1e9);
+	if(!last) {
+	  int planned = plan_transfer(*clntp, max_window);
+
+	  if(planned != window)
+	    announce_window(*clntp, planned);
+	  window = planned;
+	  chunk_size = display_link.chunk_size;
+
+	  /* Chunks planned larger than the buffer get a larger one. */
+	  if(chunk_size > partial_size) {
+	    chunk_buffer_put(partial_bytes, partial_size);
+	    partial_size = chunk_size;
+	    partial_bytes = chunk_buffer_get(partial_size);
+	    if(partial_bytes == NULL)
+	      break;
+	  }
+	}
+      }
+
+      calls = 0;
+      window_bytes = 0;
+    }
+  }
+
+  chunk_buffer_put(partial_bytes, partial_size);
+  range_set_clear(&received);
+  close(fd);
+
+  if(offset < size)
+    return -1;
+
+  log_message("mobile launcher completed send of file");
+
+  return 0;
+}
+
+
+/*
+ * Work out the digest of every CHUNK_SIZE piece of a file.  Reading it
+ * here also leaves it in the page cache for the upload that follows.
+ */
+
+int
+build_chunk_manifest(char *path, chunk_manifest *manifest) {
+  struct stat buf;
+  char *data;
+  int fd, n, i;
+
+  memset(manifest, 0, sizeof(chunk_manifest));
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    perror("open");
+    return -1;
+  }
+
+  if(fstat(fd, &buf) < 0) {
+    perror("fstat");
+    close(fd);
+    return -1;
+  }
+
+  n = (buf.st_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+  manifest->chunk_manifest_val = 
+    (chunk_digest *)malloc((n + 1) * sizeof(chunk_digest));
+  data = buffer_pool_get(chunk_buffer_pool());
+  if((manifest->chunk_manifest_val == NULL) || (data == NULL)) {
+    free(manifest->chunk_manifest_val);
+    manifest->chunk_manifest_val = NULL;
+    buffer_pool_put(chunk_buffer_pool(), data);
+    close(fd);
+    return -1;
+  }
+
+  for(i=0; i<n; i++) {
+    ssize_t num_bytes;
+
+    num_bytes = pread(fd, data, CHUNK_SIZE, (off_t) i * CHUNK_SIZE);
+    if(num_bytes <= 0) {
+      perror("pread");
+      break;
+    }
+
+    sha256(data, num_bytes, 
+	   (unsigned char *) manifest->chunk_manifest_val[i]);
+  }
+
+  buffer_pool_put(chunk_buffer_pool(), data);
+  close(fd);
+
+  if(i < n) {
+    free(manifest->chunk_manifest_val);
+    manifest->chunk_manifest_val = NULL;
+    return -1;
+  }
+
+  manifest->chunk_manifest_len = n;
+
+  return 0;
+}
+
+
+/*
+ * Start a transfer and offer the display the file's chunk manifest.
+ * Returns how many bytes of the file the display turned out to hold
+ * already, or -1 if it can't deduplicate chunks.
+ */
+
+int
+offer_chunk_manifest(char *path, CLIENT *clnt, chunk_manifest *manifest, 
+		     int *transfer_id) {
+  struct stat buf;
+  received_ranges result;
+  enum clnt_stat retval;
+  int held = 0;
+  u_int i;
+
+  if(stat(path, &buf) < 0) {
+    perror("stat");
+    return -1;
+  }
+
+  retval = send_file_1(path, buf.st_size, transfer_id, clnt);
+  if((retval != RPC_SUCCESS) || (*transfer_id <= 0)) {
+    clnt_perror (clnt, "send_file RPC call failed");
+    *transfer_id = 0;
+    return -1;
+  }
+
+  memset(&result, 0, sizeof(received_ranges));
+
+  retval = have_chunks_1(*transfer_id, *manifest, &result, clnt);
+  if(retval != RPC_SUCCESS) {
+    fprintf(stderr, "(mobile-launcher) display doesn't deduplicate "
+	    "chunks.\n");
+    return -1;
+  }
+
+  if(result.transfer_id != *transfer_id)
+    held = -1;
+  else
+    for(i=0; i<result.ranges.ranges_len; i++)
+      held += result.ranges.ranges_val[i].length;
+
+  xdr_free((xdrproc_t)xdr_received_ranges, (char *)&result);
+
+  return held;
+}
+
+
+/*
+ * Send a file over a separate raw connection through the KCM, leaving
+ * Sun RPC to carry only the send_file_bulk control call.  The file goes
+ * from the page cache straight to the socket, without XDR or any
+ * record buffers in between.
+ */
+
+int
+send_file_over_bulk_channel(char *path, CLIENT *clnt, 
+			    chunk_manifest *manifest, int *transfer_id) {
+  struct stat buf;
+  int fd, sockfd, cookie, ret = -1;
+  uint32_t net_value;
+  uint64_t start;
+  enum clnt_stat retval;
+  char logmsg[ARG_MAX];
+
+  if((path == NULL) || (clnt == NULL) || (launcher_port == 0))
+    return -1;
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    perror("open");
+    return -1;
+  }
+
+  memset(&buf, 0, sizeof(struct stat));
+  if(fstat(fd, &buf) < 0) {
+    perror("fstat");
+    close(fd);
+    return -1;
+  }
+
+  snprintf(logmsg, ARG_MAX, "mobile launcher requesting bulk send of file, "
+	   "size: %u", (unsigned int) buf.st_size);
+  log_message(logmsg);
+
+  retval = send_file_bulk_1(path, buf.st_size, &cookie, clnt);
+  if((retval != RPC_SUCCESS) || (cookie <= 0)) {
+    fprintf(stderr, "(mobile-launcher) display refused a bulk data "
+	    "connection.\n");
+    close(fd);
+    return -1;
+  }
 
-void
-usage(char *argv0) {
-  printf("mobile_launcher [-a floppy-file] [-d encryption-key-file]\n"
-	 "                <[-f patch-file] || [-i URL]> <vm-name>\n");
-}
+  *transfer_id = cookie;
 
 
-int
-perform_authentication(void) {
-  return 0;
-}
+  /*
+   * Let the display know the chunks, so that it can keep them in its
+   * chunk store for next time.
+   */
 
+  if((manifest != NULL) && (manifest->chunk_manifest_len > 0)) {
+    received_ranges result;
 
-/*
- * Perform a series of pings to determine the round-trip latency of
- * using the current connection through the KCM.  If this is below
- * some threshold, the system will prompt the user to optionally use
- * a USB cable for the thin client connection instead.
- */
+    memset(&result, 0, sizeof(received_ranges));
+    if(have_chunks_1(cookie, *manifest, &result, clnt) == RPC_SUCCESS)
+      xdr_free((xdrproc_t)xdr_received_ranges, (char *)&result);
+  }
 
-float
-determine_rtt(CLIENT *clnt) {
-  float rtt = 0;
-  enum clnt_stat retval;
-  struct timeval tv_before, tv_after;
-  int ret, i;
+  sockfd = make_tcpip_connection("localhost", launcher_port);
+  if(sockfd < 0) {
+    close(fd);
+    return -1;
+  }
 
-  if(clnt == NULL)
-    return (float) -1;
+  log_message("mobile launcher sending file over bulk data connection");
 
-  retval = ping_1((void *)NULL, clnt);
-  if(retval != RPC_SUCCESS) {
-    fprintf(stderr, "(mobile-launcher) ping failed!\n");
-    return (float) -1;
+  /* Hold as much as plan_transfer() would keep in flight, if the link is
+   * known from an earlier transfer. */
+
+  if(transfer_tuning()->adapt && (link_estimate_bdp(&display_link) > 0))
+    grow_socket_buffer(sockfd, SO_SNDBUF, 
+		       2 * link_estimate_bdp(&display_link));
+
+  net_value = htonl((uint32_t) cookie);
+  if(writen(sockfd, &net_value, sizeof(net_value)) < 0) {
+    perror("write");
+    goto done;
   }
 
-  for(i=0; i<10; i++) {  //perform 10 RPC pings
+  start = trace_now();
+  if(bulk_send_file(sockfd, fd, buf.st_size) < 0)
+    goto done;
 
-    memset(&tv_before, 0, sizeof(struct timeval));
-    memset(&tv_after, 0, sizeof(struct timeval));
-  
-    ret = gettimeofday(&tv_before, NULL);
-    if(ret < 0) {
-      perror("gettimeofday");
-      return (float) -1;
-    }
+  shutdown(sockfd, SHUT_WR);
 
-    fprintf(stderr, "Ping!\n");
-    retval = ping_1((void *)NULL, clnt);
-    if(retval != RPC_SUCCESS) {
-      fprintf(stderr, "(mobile-launcher) ping failed!\n");
-      return (float) -1;
-    }
-    
-    ret = gettimeofday(&tv_after, NULL);
-    if(ret < 0) {
-      perror("gettimeofday");
-      return (float) -1;
-    }
+  if(recv(sockfd, &net_value, sizeof(net_value), MSG_WAITALL) != 
+     sizeof(net_value)) {
+    fprintf(stderr, "(mobile-launcher) no status on bulk data "
+	    "connection\n");
+    goto done;
+  }
 
-    rtt += (tv_after.tv_sec - tv_before.tv_sec)*1000;
-    rtt += ((double)(tv_after.tv_usec - tv_before.tv_usec))/1000;
+  ret = (int) ntohl(net_value);
+  if(ret < 0)
+    fprintf(stderr, "(mobile-launcher) display failed writing %s\n", path);
+  else {
+    log_message("mobile launcher completed send of file over bulk data "
+		"connection");
+    link_estimate_delivery(&display_link, buf.st_size, 
+			   (trace_now() - start) / 1e9);
   }
 
-  rtt /= 10;  //average over 10 runs
-  fprintf(stderr, "(mobile-launcher) Average ping time: %f ms\n", rtt);
+ done:
+  close(sockfd);
+  close(fd);
 
-  return rtt;
+  return ret;
 }
 
 
+/*
+ * Send a file to the display, over a bulk data connection if possible
+ * and in send_partial calls otherwise.  If the bulk connection breaks
+ * part way, the send_partial calls only fill in what is missing.
+ *
+ * With dedup set, the display is first offered the file's chunk
+ * manifest.  If it already holds some of the chunks, only the others
+ * are sent, in send_partial calls.
+ */
+
 int
-send_file_in_pieces(char *path, CLIENT *clnt) {
-  struct stat buf;
-  int i, n, ret;
-  FILE *fp;
-  enum clnt_stat retval;
-  char logmsg[ARG_MAX];
+transfer_file(char *path, CLIENT **clntp, int dedup) {
+  chunk_manifest manifest;
+  int transfer_id = 0, held = -1, ret;
 
-  if((path == NULL) || (clnt == NULL))
-    return -1;
+  memset(&manifest, 0, sizeof(chunk_manifest));
 
-  memset(&buf, 0, sizeof(struct stat));
+  if(dedup && (build_chunk_manifest(path, &manifest) == 0))
+    held = offer_chunk_manifest(path, *clntp, &manifest, &transfer_id);
 
-  ret = stat(path, &buf);
-  if(ret < 0) {
-    perror("stat");
-    return -1;
+  if(held > 0) {
+    fprintf(stderr, "(mobile-launcher) Display already holds %d bytes of "
+	    "%s.\n", held, path);
+    ret = send_file_in_pieces(path, clntp, transfer_id);
+    goto done;
   }
 
-  fp = fopen(path, "r");
-  if(fp == NULL) {
-    perror("fopen");
-    return -1;
-  }
+  ret = send_file_over_bulk_channel(path, *clntp, &manifest, &transfer_id);
+  if(ret == 0)
+    goto done;
 
-  n = (buf.st_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
-  fprintf(stderr, "(mobile-launcher) Transfer of %s (size=%d) will take %d"
-	  " RPCs.\n", path, (int) buf.st_size, n);
+  fprintf(stderr, "(mobile-launcher) Falling back to sending %s in "
+	  "pieces.\n", path);
 
-  snprintf(logmsg, ARG_MAX, "mobile launcher requesting send of file, size: %u", buf.st_size);
-  log_message(logmsg);
+  ret = send_file_in_pieces(path, clntp, transfer_id);
 
-  retval = send_file_1(path, buf.st_size, &ret, clnt);
-  if(retval != RPC_SUCCESS) {
-    clnt_perror (clnt, "send_file RPC call failed");
-    return -1;
-  }
+ done:
+  free(manifest.chunk_manifest_val);
 
-  log_message("mobile launcher completed send request");
+  return ret;
+}
 
-  log_message("mobile launcher sending file");
 
-  for(i=0; i<n; i++) {
-    char partial_bytes[CHUNK_SIZE];
-    data partial_data;
-    int num_bytes;
+/*
+ * Ask the display whether it kept this overlay from an earlier launch,
+ * by the SHA-256 of the file.  Returns 0 if it did, so that the overlay
+ * needn't be sent at all.
+ */
 
-    num_bytes = fread(partial_bytes, 1, CHUNK_SIZE, fp);
-    if(num_bytes < 0) {
-      perror("fread");
-      return -1;
-    }
-    if(num_bytes == 0)
-      return 0;
+int
+offer_cached_overlay(char *path, CLIENT *clnt) {
+  file_hash hash;
+  sha256_ctx_t ctx;
+  enum clnt_stat retval;
+  char *data;
+  ssize_t num_bytes;
+  int fd, ret = -1;
 
-    partial_data.data_len = num_bytes;
-    partial_data.data_val = partial_bytes;
+  fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    perror("open");
+    return -1;
+  }
 
-    retval = send_partial_1(partial_data, &ret, clnt);
-    if(retval != RPC_SUCCESS) {
-      clnt_perror (clnt, "send_partial RPC call failed");
-      return -1;
-    }
+  data = buffer_pool_get(chunk_buffer_pool());
+  if(data == NULL) {
+    close(fd);
+    return -1;
+  }
 
-    fprintf(stderr, ".");
+  sha256_init(&ctx);
+  while((num_bytes = read(fd, data, CHUNK_SIZE)) > 0)
+    sha256_update(&ctx, data, num_bytes);
+
+  buffer_pool_put(chunk_buffer_pool(), data);
+  close(fd);
+
+  if(num_bytes < 0) {
+    perror("read");
+    return -1;
   }
 
-  log_message("mobile launcher completed send of file");
+  sha256_final(&ctx, (unsigned char *) hash.digest);
 
-  return 0;
+  retval = use_cached_overlay_1(path, hash, &ret, clnt);
+  if(retval != RPC_SUCCESS) {
+    fprintf(stderr, "(mobile-launcher) display doesn't cache overlays.\n");
+    return -1;
+  }
+
+  return ret;
 }
 
 
+/*
+ * Retrieve a file from the display in pieces of its chunk size.  If the
+ * connection is lost, reconnect and ask for the rest of the file from
+ * the offset reached so far.
+ */
+
 int
-retrieve_file_in_pieces(char *path, CLIENT *clnt) {
-  int i, n, size=0;
+retrieve_file_in_pieces(char *path, CLIENT **clntp) {
+  int size=0, received=0, attempts=0;
   FILE *fp;
   enum clnt_stat retval;
   char logmsg[ARG_MAX];
 
-  if((path == NULL) || (clnt == NULL))
+  if((path == NULL) || (clntp == NULL) || (*clntp == NULL))
     return -1;
 
   fprintf(stderr, "(mobile-launcher) Retrieving file to path: %s\n", path);
@@ -213,41 +961,68 @@ retrieve_file_in_pieces(char *path, CLIENT *clnt) {
   }
 
   log_message("mobile launcher requesting retrieval of file");
-  retval = retrieve_file_1(path, &size, clnt);
+  retval = retrieve_file_1(path, &size, *clntp);
   if(retval != RPC_SUCCESS) {
-    clnt_perror (clnt, "retrieve_file RPC call failed");
+    clnt_perror (*clntp, "retrieve_file RPC call failed");
     fclose(fp);
     return -1;
   }
   snprintf(logmsg, ARG_MAX, "mobile launcher completed request for retrieval of file, size: %d", size);
   log_message(logmsg);
 
-  n = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
-  fprintf(stderr, "(mobile-launcher) Transfer of %s (size=%d) will take %d"
-	  " RPCs.\n", path, (int) size, n);
+  fprintf(stderr, "(mobile-launcher) Transfer of %s (size=%d) "
+	  "starting.\n", path, (int) size);
 
   log_message("mobile launcher retrieving file");
-  for(i=0; i<n; i++) {
-    data partial_data;
+  while(received < size) {
+    chunk partial_data;
     unsigned int num_bytes;
 
-    memset(&partial_data, 0, sizeof(data));
+    memset(&partial_data, 0, sizeof(chunk));
 
-    retval = retrieve_partial_1(&partial_data, clnt);
+    retval = retrieve_partial_1(&partial_data, *clntp);
     if(retval != RPC_SUCCESS) {
-      clnt_perror (clnt, "retrieve_partial RPC call failed");
+      clnt_perror (*clntp, "retrieve_partial RPC call failed");
+
+      if((++attempts > RESUME_ATTEMPTS) || 
+	 (reconnect_to_display(clntp) < 0)) {
+	fclose(fp);
+	return -1;
+      }
+
+      retval = retrieve_file_from_1(path, received, &size, *clntp);
+      if((retval != RPC_SUCCESS) || (size < 0)) {
+	fprintf(stderr, "(mobile-launcher) display couldn't resume "
+		"retrieval of %s\n", path);
+	fclose(fp);
+	return -1;
+      }
+
+      fprintf(stderr, "(mobile-launcher) Resuming retrieval of %s from "
+	      "offset %d.\n", path, received);
+      log_message("mobile launcher resuming retrieval of file");
+      continue;
+    }
+
+    if(partial_data.chunk_len == 0) {
+      fprintf(stderr, "(mobile-launcher) display sent an empty chunk "
+	      "of %s\n", path);
+      xdr_free((xdrproc_t)xdr_chunk, (char *)&partial_data);
       fclose(fp);
       return -1;
     }
 
-    num_bytes = fwrite(partial_data.data_val, 1, partial_data.data_len, fp);
-    if(num_bytes < partial_data.data_len) {
-      perror("fread");
+    num_bytes = fwrite(partial_data.chunk_val, 1, partial_data.chunk_len, fp);
+    if(num_bytes < partial_data.chunk_len) {
+      perror("fwrite");
+      xdr_free((xdrproc_t)xdr_chunk, (char *)&partial_data);
       fclose(fp);
       return -1;
     }
 
-    xdr_free((xdrproc_t)xdr_data, (char *)&partial_data);
+    received += partial_data.chunk_len;
+
+    xdr_free((xdrproc_t)xdr_chunk, (char *)&partial_data);
 
     fprintf(stderr, ".");
   }
@@ -259,6 +1034,122 @@ retrieve_file_in_pieces(char *path, CLIENT *clnt) {
 }
 
 
+/*
+ * Start the display launching the VM, and follow the launch until the
+ * VM is up.  Returns 0 once it is, 1 if the display can't launch in the
+ * background, in which case the VM is to be loaded with the load_vm
+ * calls, and -1 if the launch failed.
+ */
+
+static const char *launch_phase_names[] = {
+  "not started", "starting", "unpacking overlay", "patching VM", 
+  "resuming VM", "ready", "ended", "failed"
+};
+
+static int
+launch_and_wait(CLIENT *clnt, char *vm, char *overlay_path, 
+		launch_source source) {
+  launch_status status;
+  enum clnt_stat retval;
+  char logmsg[ARG_MAX];
+  int handle;
+
+  retval = launch_vm_1(vm, overlay_path, source, &handle, clnt);
+  if(retval == RPC_PROCUNAVAIL)
+    return 1;
+  if(retval != RPC_SUCCESS) {
+    fprintf(stderr, "(mobile-launcher) launch_vm failed: %s\n",
+	    clnt_sperrno(retval));
+    return -1;
+  }
+  if(handle < 0) {
+    fprintf(stderr, "(mobile-launcher) display refused to launch VM\n");
+    return -1;
+  }
+
+  memset(&status, 0, sizeof(launch_status));
+  status.phase = LAUNCH_STARTING;
+
+  while(status.phase < LAUNCH_READY) {
+    launch_status seen = status;
+
+    retval = wait_status_1(handle, seen, LAUNCH_POLL_TIMEOUT, &status, clnt);
+    if(retval != RPC_SUCCESS) {
+      fprintf(stderr, "(mobile-launcher) wait_status failed: %s\n",
+	      clnt_sperrno(retval));
+      return -1;
+    }
+
+    if((status.phase != seen.phase) && (status.phase >= LAUNCH_NONE) &&
+       (status.phase <= LAUNCH_FAILED)) {
+      snprintf(logmsg, ARG_MAX, "mobile launcher sees display %s",
+	       launch_phase_names[status.phase]);
+      log_message(logmsg);
+      fprintf(stderr, "(mobile-launcher) VM launch on display: %s\n",
+	      launch_phase_names[status.phase]);
+    }
+  }
+
+  if(status.phase != LAUNCH_READY)
+    return -1;
+
+  fprintf(stderr, "(mobile-launcher) VM is up, VNC server on display "
+	  "port %d.\n", status.vnc_port);
+
+  return 0;
+}
+
+
+/*
+ * Choose the interface for the thin client connection from what the
+ * path probes found, logging it.  Unless the round trip to the display
+ * is slower than SLOW_PATH_MS, the KCM chooses (-1), and the probes
+ * aren't waited for.
+ */
+
+int
+choose_thin_client_path(path_prober_t *prober) {
+  path_result_t *results, *quickest;
+  char logmsg[ARG_MAX];
+  int slow, num_results, i, iface = -1;
+
+  slow = (display_link.rtt * 1000 > SLOW_PATH_MS);
+
+  num_results = path_probe_wait(prober, slow ? PATH_PROBE_WAIT_MS : 0, 
+				&results);
+
+  for(i=0; i<num_results; i++)
+    if(results[i].state == PATH_PROBED) {
+      snprintf(logmsg, ARG_MAX, "mobile launcher path over %s: "
+	       "%.1f/%.1f/%.1f ms round trip (median/90th/max), %.1f MB/s", 
+	       results[i].name, results[i].rtt_median * 1000, 
+	       results[i].rtt_p90 * 1000, results[i].rtt_max * 1000, 
+	       results[i].link.bandwidth / 1048576);
+      log_message(logmsg);
+    }
+
+  if(slow) {
+    fprintf(stderr, "(mobile-launcher) Connection is slower than %dms\n",
+	    SLOW_PATH_MS);
+
+    quickest = path_probe_quickest(results, num_results);
+    if((quickest != NULL) && (quickest->rtt_median < display_link.rtt)) {
+      fprintf(stderr, "(mobile-launcher) Using the path over %s for the "
+	      "thin client.\n", quickest->name);
+      iface = quickest->iface;
+    }
+  }
+  else {
+    fprintf(stderr, "(mobile-launcher) Connection is faster than %dms\n",
+	    SLOW_PATH_MS);
+  }
+
+  free(results);
+
+  return iface;
+}
+
+
 int
 establish_thin_client_connection(DBusGProxy *dbus_proxy, int iface) {
   int i, ret;
@@ -306,14 +1197,10 @@ main(int argc, char *argv[])
   DBusGConnection *dbus_conn;
   DBusGProxy *dbus_proxy = NULL;
   GError *gerr = NULL;
-  guint gport = 0;
   gchar **interface_strs = NULL;
   gint interface = -1;
   int err, ret = EXIT_SUCCESS, opt, i;
   int vnc_port;
-  int usb_idx = -1;
-  char port_str[NI_MAXSERV];
-  struct addrinfo *info = NULL, hints;
   enum clnt_stat retval;
   enum vm_type vmt = VM_UNKNOWN;
 
@@ -324,9 +1211,10 @@ main(int argc, char *argv[])
   char *encryption_key_path = NULL;
 
   char logmsg[ARG_MAX];
-  
-  int connfd = 0;
-  int ms;
+
+  path_prober_t *prober = NULL;
+
+  span_id_t launch_span = 0, options_span, use_span, span;
 
   CLIENT *clnt = NULL;
 
@@ -349,10 +1237,15 @@ main(int argc, char *argv[])
 
   log_message("mobile launcher started up..");
 
+  launch_span = span_begin(0, "launch");
+
+  signal(SIGPIPE, SIG_IGN);
+  link_estimate_init(&display_link);
+
 
   fprintf(stderr, "(mobile-launcher) starting up..\n");
   
-  log_message("mobile launcher parsing options..");
+  options_span = span_begin(launch_span, "parse options");
 
   while((opt = getopt(argc, argv, "a:d:f:i:")) != -1) {
 
@@ -365,14 +1258,14 @@ main(int argc, char *argv[])
       {
 	char command[ARG_MAX];
   
-	log_message("mobile launcher unmounting floppy..");
-
+	span = span_begin(options_span, "unmount floppy");
 	snprintf(command, ARG_MAX, "umount %s", floppy_path);
 	system(command);
+	span_end(span);
 
-	log_message("mobile launcher compressing floppy..");
+	span = span_begin(options_span, "compress floppy");
 	compress_file(floppy_path, floppy_compressed_path);
-	log_message("mobile launcher completed compressing floppy..");
+	span_end(span);
       }
 
       break;
@@ -410,10 +1303,13 @@ main(int argc, char *argv[])
 
   vm = argv[optind];
   
-  log_message("mobile launcher completed parsing options..");
+  span_end(options_span);
 
-  log_message("mobile launcher connecting to DBUS..");
+  span = span_begin(launch_span, "connect to DBus");
 
+  if(!g_thread_supported())
+    g_thread_init(NULL);
+  dbus_g_thread_init();
   g_type_init();
   
   fprintf(stderr, "(mobile-launcher) connecting to DBus session bus..\n");
@@ -443,7 +1339,7 @@ main(int argc, char *argv[])
     goto cleanup;
   }
 	
-  log_message("mobile launcher completed connecting to DBUS..");
+  span_end(span);
 	
 
   /*
@@ -466,106 +1362,34 @@ main(int argc, char *argv[])
 
   if(interface_strs != NULL) {
     fprintf(stderr, "(mobile-launcher) Found some interfaces:\n");
-    for(i=0; interface_strs[i] != NULL; i++) {
+    for(i=0; interface_strs[i] != NULL; i++)
       fprintf(stderr, "\t%d: %s\n", i, interface_strs[i]);
-      if(!strcmp(interface_strs[i], "usb0"))
-	usb_idx = i;
-    }
     fprintf(stderr, "\n");
   }
 
 
-  fprintf(stderr, "(mobile-launcher) DBus calling into kcm (browse)..\n");
-
-  if(!edu_cmu_cs_kimberley_kcm_browse(dbus_proxy, 
-				      LAUNCHER_KCM_SERVICE_NAME, 
-				      interface, 
-				      &gport, 
-				      &gerr)) {
-    /* Method failed, the GError is set, let's warn everyone */
-    g_warning("(mobile-launcher) kcm->browse() method failed: %s", 
-	      gerr->message);
-    ret = EXIT_FAILURE;
-    goto cleanup;
-  }
+  /*
+   * Probe the path over each interface while the launch goes on, so that
+   * the thin client connection can take the quickest.
+   */
 
+  prober = path_probe_start(interface_strs, launch_span);
 
-  fprintf(stderr, "(mobile-launcher) KCM browse() returned port: %d\n", 
-	  gport);
-  
-  
-  /* Create new loopback connection to the Sun RPC server on the
-   * port that it indicated in the D-Bus message. */
-  
-  if((connfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-    perror("socket");
-    ret = EXIT_FAILURE;
-    goto cleanup;
-  }
-    
-  memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_flags = AI_CANONNAME;
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_STREAM;
-  snprintf(port_str, 6, "%u", gport);
-  
-  if((err = getaddrinfo("localhost", port_str, &hints, &info)) < 0) {
-    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
-    ret = EXIT_FAILURE;
-    goto cleanup;
-  }
-  
-  fprintf(stderr, "(mobile-launcher) connect()ing locally to kcm..\n");
-	
-  if(connect(connfd, info->ai_addr, sizeof(struct sockaddr_in)) < 0) {
-    perror("connect");
-    ret = EXIT_FAILURE;
-    goto cleanup;
-  }
 
-  fprintf(stderr, "(mobile-launcher) successfully connected. bringing up "
-	  "launcher..\n");
-  
+  display_proxy = dbus_proxy;
 
-  clnt = convert_socket_to_rpc_client(connfd, MOBILELAUNCHER_PROG, 
-				      MOBILELAUNCHER_VERS);
+  span = span_begin(launch_span, "connect to display");
+  clnt = connect_to_display(dbus_proxy);
+  span_end(span);
   if(clnt == NULL) {
-    fprintf(stderr, "(mobile-launcher) Sun RPC initialization failed");
-    close(connfd);
     ret = EXIT_FAILURE;
     goto cleanup;
   }
 
-  //perform_authentication();
-
-  retval = ping_1((void *)NULL, clnt);
-  if(retval != RPC_SUCCESS) {
-    fprintf(stderr, "(mobile-launcher) ping failed!\n");
-    return (float) -1;
-  }
-
-  log_message("mobile launcher completed establishing connection to display");
-
-
-  log_message("mobile launcher calculating latency");
-
-
-  /*
-   * If the round trip time of a null RPC is greater than 100 milliseconds,
-   * try using USB networking for the thin client connection; better latency
-   * is possible.
-   */
-
-  ms = determine_rtt(clnt);
-  if(ms > 100) {
-    fprintf(stderr, "(mobile-launcher) Connection is slower than 100ms\n");
-    interface = usb_idx;
-  }
-  else {
-    fprintf(stderr, "(mobile-launcher) Connection is faster than 100ms\n");
-  }
+  sync_clock(clnt, launch_span);
 
-  snprintf(logmsg, ARG_MAX, "mobile launcher completed calculating latency: %u ms", ms);
+  snprintf(logmsg, ARG_MAX, "mobile launcher latency: %.1f ms", 
+	   display_link.rtt * 1000);
   log_message(logmsg);
 
   /*
@@ -576,21 +1400,22 @@ main(int argc, char *argv[])
   if(floppy_path != NULL) {
     fprintf(stderr, "(mobile-launcher) Sending floppy disk image..\n");
     
-    log_message("mobile launcher sending compressed floppy disk");
-    if(send_file_in_pieces(floppy_compressed_path, clnt) < 0) {
+    span = span_begin(launch_span, "send floppy disk");
+    if(transfer_file(floppy_compressed_path, &clnt, 0) < 0) {
       fprintf(stderr, "(mobile-launcher) failed sending compressed floppy disk image file\n");
       floppy_path = NULL;
+      span_end(span);
     }
     else {
-      log_message("mobile launcher completed sending floppy disk");
-      log_message("mobile launcher indicating floppy disk filename");
+      span_end(span);
+      span = span_begin(launch_span, "indicate floppy disk");
       retval = use_persistent_state_1(floppy_compressed_path, &err, clnt);
       if (retval != RPC_SUCCESS) {
 	fprintf(stderr, "(mobile-launcher) setting persistent state file "
 		"failed: %s\n", clnt_sperrno(retval));
 	floppy_path = NULL;
       }
-      log_message("mobile launcher completed indicating floppy disk filename");
+      span_end(span);
     }
   }
 
@@ -602,26 +1427,35 @@ main(int argc, char *argv[])
   if(encryption_key_path != NULL) {
     fprintf(stderr, "(mobile-launcher) Sending encryption key..\n");
     
-    log_message("mobile launcher sending encryption key");
-    if(send_file_in_pieces(encryption_key_path, clnt) < 0) {
+    span = span_begin(launch_span, "send encryption key");
+    if(transfer_file(encryption_key_path, &clnt, 0) < 0) {
       fprintf(stderr, "(mobile-launcher) failed sending encryption key file\n");
       floppy_path = NULL;
+      span_end(span);
     }
     else {
-      log_message("mobile launcher completed sending encryption key");
-      log_message("mobile launcher indicating encryption key filename");
+      span_end(span);
+      span = span_begin(launch_span, "indicate encryption key");
       retval = use_encryption_key_1(encryption_key_path, &err, clnt);
+      span_end(span);
       if (retval != RPC_SUCCESS) {
 	fprintf(stderr, "(mobile-launcher) setting encryption key file "
 		"failed: %s\n", clnt_sperrno(retval));
 	encryption_key_path = NULL;
 	goto cleanup;
       }
-      log_message("mobile launcher completed indicating encryption key filename");
     }
   }
 
 
+  if(clnt == NULL) {
+    fprintf(stderr, "(mobile-launcher) lost the connection to the "
+	    "display!\n");
+    ret = EXIT_FAILURE;
+    goto cleanup;
+  }
+
+
   /*
    * Transfer the VM overlay to the display.
    */
@@ -629,38 +1463,74 @@ main(int argc, char *argv[])
   switch(vmt) {
 
   case VM_FILE:
-    fprintf(stderr, "(mobile-launcher) Sending VM overlay..\n");
-    log_message("mobile launcher sending VM overlay");
-    if(send_file_in_pieces(overlay_path, clnt) < 0) {
-      fprintf(stderr, "(mobile-launcher) failed sending VM overlay!\n");
-      ret = EXIT_FAILURE;
-      goto cleanup;
+    span = span_begin(launch_span, "check overlay cache");
+    err = offer_cached_overlay(overlay_path, clnt);
+    span_end(span);
+    if(err == 0) {
+      fprintf(stderr, "(mobile-launcher) Display has the VM overlay "
+	      "cached.\n");
+      log_message("mobile launcher found VM overlay in display's cache");
+    }
+    else {
+      retval = stream_vm_from_attachment_1(vm, overlay_path, &err, clnt);
+      if((retval == RPC_SUCCESS) && (err == 0))
+	log_message("mobile launcher will have VM overlay unpacked as it "
+		    "arrives");
+
+      fprintf(stderr, "(mobile-launcher) Sending VM overlay..\n");
+      span = span_begin(launch_span, "send VM overlay");
+      err = transfer_file(overlay_path, &clnt, 1);
+      span_end(span);
+      if(err < 0) {
+	fprintf(stderr, "(mobile-launcher) failed sending VM overlay!\n");
+	ret = EXIT_FAILURE;
+	goto cleanup;
+      }
     }
-    log_message("mobile launcher completed sending VM overlay");
 
     fprintf(stderr, "(mobile-launcher) Loading VM..\n");
-    log_message("mobile launcher loading VM");
+    span = span_begin(launch_span, "load VM");
+    err = launch_and_wait(clnt, vm, overlay_path, LAUNCH_FROM_ATTACHMENT);
+    if(err < 0) {
+      span_end(span);
+      ret = EXIT_FAILURE;
+      goto cleanup;
+    }
+    if(err == 0) {
+      span_end(span);
+      break;
+    }
     retval = load_vm_from_attachment_1(vm, overlay_path, &err, clnt);
+    span_end(span);
     if (retval != RPC_SUCCESS) {
       fprintf(stderr, "(mobile-launcher) load VM from attachment failed: %s", 
 	      clnt_sperrno(retval));
       ret = EXIT_FAILURE;
       goto cleanup;
     }
-    log_message("mobile launcher completed loading VM");
     break;
 
   case VM_URL:
     fprintf(stderr, "(mobile-launcher) Loading VM..\n");
-    log_message("mobile launcher loading VM");
+    span = span_begin(launch_span, "load VM");
+    err = launch_and_wait(clnt, vm, overlay_path, LAUNCH_FROM_URL);
+    if(err < 0) {
+      span_end(span);
+      ret = EXIT_FAILURE;
+      goto cleanup;
+    }
+    if(err == 0) {
+      span_end(span);
+      break;
+    }
     retval = load_vm_from_url_1(vm, overlay_path, &err, clnt);
+    span_end(span);
     if (retval != RPC_SUCCESS) {
       fprintf(stderr, "(mobile-launcher) load VM from URL failed: %s", 
 	      clnt_sperrno(retval));
       ret = EXIT_FAILURE;
       goto cleanup;
     }
-    log_message("mobile launcher completed loading VM");
     break;
 
   default:
@@ -673,8 +1543,17 @@ main(int argc, char *argv[])
    * Signal KCM that you would like it to search for a VNC service.
    */
 
-  log_message("mobile launcher requesting into KCM for thin client connection");
+  /*
+   * If the display is slow to reach, try the path probed quickest, such
+   * as a USB cable, for the thin client connection; better latency is
+   * possible.
+   */
+
+  interface = choose_thin_client_path(prober);
+
+  span = span_begin(launch_span, "find thin client server");
   vnc_port = establish_thin_client_connection(dbus_proxy, interface);
+  span_end(span);
   if(vnc_port < 0) {
     fprintf(stderr, "(mobile-launcher) KCM couldn't discover thin client "
 	    "services!\n");
@@ -685,21 +1564,32 @@ main(int argc, char *argv[])
     fprintf(stderr, "(mobile-launcher) KCM client() returned port: %d\n", 
 	    vnc_port);
   }
-  log_message("mobile launcher completed request into KCM for thin client connection");
+
+  /*
+   * The launch is over once the viewer starts; the time the user spends
+   * in it, and the teardown after, are spans of their own.
+   */
+
+  span_end(launch_span);
+  launch_span = 0;
 
   snprintf(command, ARG_MAX, "vncviewer localhost::%u", vnc_port);
   fprintf(stderr, "(mobile-launcher) executing: %s\n", command);
-  log_message("mobile launcher executing VNCviewer");
+  use_span = span_begin(0, "use VM");
   err = system(command);
   if(err < 0) {
     perror("system");
     ret = EXIT_FAILURE;
   }
-  log_message("mobile launcher completed executing VNCviewer");
+  span_end(use_span);
 
   
  cleanup:
+  if(launch_span != 0)
+    span_end(launch_span);
+
   if(clnt != NULL) {
+    span_id_t finish_span = span_begin(0, "finish");
     char  *diff_filename = NULL;
 
 
@@ -711,9 +1601,9 @@ main(int argc, char *argv[])
     if(floppy_path != NULL) {
       char  diff_filename_local[PATH_MAX];
       
-      log_message("mobile launcher indicating end of use to display");
+      span = span_begin(finish_span, "end usage");
       end_usage_1(1, &diff_filename, clnt);
-      log_message("mobile launcher completed indicating end of use to display");
+      span_end(span);
       if(diff_filename != NULL) {
 	char *bname;
 	char command[ARG_MAX];
@@ -725,61 +1615,66 @@ main(int argc, char *argv[])
 	diff_filename_local[0] = '\0';
 	snprintf(diff_filename_local, PATH_MAX, "/tmp/%s", bname);
 
-	log_message("mobile launcher retrieving persistent state delta");
-	if(retrieve_file_in_pieces(diff_filename_local, clnt) < 0) {
+	span = span_begin(finish_span, "retrieve persistent state delta");
+	if(retrieve_file_in_pieces(diff_filename_local, &clnt) < 0) {
 	  fprintf(stderr, "(mobile-launcher) Couldn't retrieve '%s'\n",
 		  diff_filename);
 	}
-	log_message("mobile launcher completed retrieving persistent state delta");
+	span_end(span);
 
 	fprintf(stderr, "(mobile-launcher) applying pers. state patch..\n");
 	snprintf(floppy_sum_path, PATH_MAX, "%s.new", floppy_path);
 	snprintf(command, ARG_MAX, "xdelta patch %s %s %s", 
 		 diff_filename_local, floppy_path, floppy_sum_path);
-	log_message("mobile launcher applying persistent state delta");
+	span = span_begin(finish_span, "apply persistent state delta");
 	system(command);
-	log_message("mobile launcher completed applying persistent state delta");
+	span_end(span);
 
 	remove(floppy_path);
 	rename(floppy_sum_path, floppy_path);
 
 	fprintf(stderr, "(mobile-launcher) remounting state image..\n");
 	snprintf(command, ARG_MAX, "mount %s", floppy_path);
-	log_message("mobile launcher remounting persistent state");
+	span = span_begin(finish_span, "remount persistent state");
 	system(command);
-	log_message("mobile launcher remounting persistent state");
+	span_end(span);
       }
       else {
 	fprintf(stderr, "(mobile-launcher) no persistent state path returned to retrieve!\n");
       }
     }
     else {
-      log_message("mobile launcher indicating end of use to display");
+      span = span_begin(finish_span, "end usage");
       end_usage_1(0, &diff_filename, clnt);
-      log_message("mobile launcher completed indicating end of use to display");
+      span_end(span);
     }
 
-    log_message("mobile launcher retrieving dekimberlize log file");
-    if(retrieve_file_in_pieces("/tmp/dekimberlize.log", clnt) < 0) {
+    span = span_begin(finish_span, "retrieve dekimberlize log");
+    if((clnt != NULL) &&
+       (retrieve_file_in_pieces("/tmp/dekimberlize.log", &clnt) < 0)) {
       fprintf(stderr, "(mobile-launcher) Couldn't retrieve '/tmp/dekimberlize.log'\n");
     }
     else {
       log_append_file("/tmp/dekimberlize.log");
     }
     
-    log_message("mobile launcher retrieving dekimberlize log file");
+    span_end(span);
+    span_end(finish_span);
     
     xdr_free((xdrproc_t) xdr_wrapstring, (char *)&diff_filename);
 
-    clnt_destroy(clnt);
-    clnt = NULL;
+    if(clnt != NULL) {
+      clnt_destroy(clnt);
+      clnt = NULL;
+    }
   }
 
+  path_probe_free(prober);
+
   log_deinit();
 
   if(gerr) g_error_free (gerr);
   if(dbus_proxy) g_object_unref(dbus_proxy);
-  if(info) freeaddrinfo(info);
   
   exit(ret);
 }
@@ -17,533 +17,2135 @@
  *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include "rpc_mobile_launcher.h"
+#include "buffer_pool.h"
 #include "display_launcher.h"
+#include "ranges.h"
+#include "chunk_store.h"
+#include "probe.h"
 #include "common.h"
 
 
-static char  command[ARG_MAX];
+/*
+ * Append to the session's display_setup command line.
+ */
 
+static void
+command_append(session_t *s, const char *fmt, ...) {
+  size_t len = strlen(s->command);
+  va_list ap;
 
-void *
-launch_display_scripts(void *arg) {
-  int err;
+  va_start(ap, fmt);
+  vsnprintf(s->command + len, SESSION_COMMAND_MAX - len, fmt, ap);
+  va_end(ap);
+}
+
+
+/*
+ * Move the session's VM launch on to a later phase, and record the port
+ * of its VNC server if given, waking any wait_status calls.
+ */
+
+static void
+update_launch(session_t *s, launch_phase phase, int vnc_port) {
+  pthread_mutex_lock(&s->launch_mutex);
+  if(phase > s->launch.phase)
+    s->launch.phase = phase;
+  if(vnc_port > 0)
+    s->launch.vnc_port = vnc_port;
+  pthread_cond_broadcast(&s->launch_changed);
+  pthread_mutex_unlock(&s->launch_mutex);
+}
+
+
+static launch_phase
+current_launch_phase(session_t *s) {
+  launch_phase phase;
+
+  pthread_mutex_lock(&s->launch_mutex);
+  phase = s->launch.phase;
+  pthread_mutex_unlock(&s->launch_mutex);
+
+  return phase;
+}
+
+
+/*
+ * The display scripts report how the launch is going as lines on a
+ * pipe, whose write end they find in KIMBERLEY_NOTIFY_FD:
+ *
+ *   vnc-port <port>   x11vnc is listening on port
+ *   phase <name>      dekimberlize has begun unpacking, patching or
+ *                     resuming
+ *   resumed           the VM is running
+ *
+ * and the display launcher itself adds "exit <status>" once they have
+ * finished, as the scripts' children may keep the pipe open after.
+ * dekimberlize waits to power the VM down until the display closes the
+ * pipe in KIMBERLEY_FINISH_FD.  Both pipes are close-on-exec but for
+ * the scripts' ends in the scripts, so no other session's scripts hold
+ * them.
+ */
+
+static const struct {
+  const char   *name;
+  launch_phase  phase;
+} dekimberlize_phases[] = {
+  { "unpacking", LAUNCH_UNPACKING },
+  { "patching",  LAUNCH_PATCHING },
+  { "resuming",  LAUNCH_RESUMING }
+};
+
+
+static void *
+follow_launch_thread(void *arg) {
+  session_t *s = (session_t *)arg;
+  char line[128], name[32];
+  int status = -1;
+  unsigned int i;
+  FILE *fp;
+  int n;
+
+  fp = fdopen(s->notify_pipe[0], "r");
+  if(fp == NULL) {
+    perror("fdopen");
+    close(s->notify_pipe[0]);
+    update_launch(s, LAUNCH_FAILED, 0);
+    session_put(s);
+    return NULL;
+  }
+
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    if(sscanf(line, "vnc-port %d", &n) == 1) {
+      pthread_mutex_lock(&s->launch_mutex);
+      s->vnc_server_port = n;
+      pthread_cond_broadcast(&s->launch_changed);
+      pthread_mutex_unlock(&s->launch_mutex);
+    }
+    else if(sscanf(line, "phase %31s", name) == 1) {
+      for(i=0; i<sizeof(dekimberlize_phases)/sizeof(dekimberlize_phases[0]); i++)
+	if(strcmp(name, dekimberlize_phases[i].name) == 0)
+	  update_launch(s, dekimberlize_phases[i].phase, 0);
+    }
+    else if(strcmp(line, "resumed\n") == 0) {
+      pthread_mutex_lock(&s->launch_mutex);
+      s->vm_resumed = 1;
+      pthread_cond_broadcast(&s->launch_changed);
+      pthread_mutex_unlock(&s->launch_mutex);
+    }
+    else if(sscanf(line, "exit %d", &status) == 1)
+      break;
+  }
+
+  fclose(fp);
+
+  /* A VM that never came up won't now. */
+  update_launch(s, (current_launch_phase(s) >= LAUNCH_READY) ? 
+		LAUNCH_ENDED : LAUNCH_FAILED, 0);
+
+  fprintf(stderr, "(display-launcher) Display scripts of session %d "
+	  "exited with status %d.\n", s->id, status);
+
+  session_put(s);
+
+  return NULL;
+}
+
+
+/*
+ * Let the session's dekimberlize know the user is done, so that it
+ * powers the VM down.
+ */
+
+void
+finish_launch(session_t *s) {
+  pthread_mutex_lock(&s->launch_mutex);
+  s->launch_finished = 1;
+  if(s->finish_pipe[1] >= 0) {
+    close(s->finish_pipe[1]);
+    s->finish_pipe[1] = -1;
+  }
+  pthread_mutex_unlock(&s->launch_mutex);
+}
+
+
+/*
+ * Run the display scripts.  The session's mutex is held until they
+ * finish, so end_usage, which waits on it, only answers once the VM is
+ * down and any persistent state has been diffed.
+ */
 
-  fprintf(stderr, "(display-launcher) Executing display script: %s\n",
-	  command);
-  err = pthread_mutex_lock(&current_state.mutex);
+static void *
+launch_display_scripts(void *arg) {
+  session_t *s = (session_t *)arg;
+  char command[SESSION_COMMAND_MAX + 128];
+  int err, status = -1;
+  pid_t pid;
+
+  fprintf(stderr, "(display-launcher) Executing display script for "
+	  "session %d: %s\n", s->id, s->command);
+  err = pthread_mutex_lock(&s->mutex);
   if(err < 0) {
     fprintf(stderr, "(display-launcher) pthread_mutex_lock returned "
 	    "error: %d\n", err);
-    pthread_exit((void *)-1);
+    close(s->finish_pipe[0]);
+    dprintf(s->notify_pipe[1], "exit -1\n");
+    close(s->notify_pipe[1]);
+    session_put(s);
+    return NULL;
   }
 
-  current_state.display_in_progress = 1;
+  s->display_in_progress = 1;
 
-  remove("/tmp/x11vnc_port");
-  remove("/tmp/dekimberlize.resumed");
+  snprintf(command, sizeof(command), "KIMBERLEY_NOTIFY_FD=%d "
+	   "KIMBERLEY_FINISH_FD=%d KIMBERLEY_SPAN=%016llx "
+	   "KIMBERLEY_TRACE_PROCESS=%016llx exec %s", s->notify_pipe[1], 
+	   s->finish_pipe[0], (unsigned long long) s->launch_span,
+	   (unsigned long long) trace_process(), s->command);
 
-  err = system(command);
-  if(err < 0) {
-    perror("system");
-    pthread_exit((void *)-1);
+  pid = fork();
+  if(pid == 0) {
+    fcntl(s->notify_pipe[1], F_SETFD, 0);
+    fcntl(s->finish_pipe[0], F_SETFD, 0);
+    execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+    _exit(127);
   }
+
+  close(s->finish_pipe[0]);
+
+  if(pid < 0)
+    perror("fork");
+  else
+    while(waitpid(pid, &status, 0) < 0)
+      if(errno != EINTR) {
+	perror("waitpid");
+	break;
+      }
   
-  current_state.display_in_progress = 0;
+  s->display_in_progress = 0;
 
-  err = pthread_mutex_unlock(&current_state.mutex);
-  if(err < 0) {
+  dprintf(s->notify_pipe[1], "exit %d\n", 
+	  WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+  close(s->notify_pipe[1]);
+
+  err = pthread_mutex_unlock(&s->mutex);
+  if(err < 0)
     fprintf(stderr, "(display-launcher) pthread_mutex_unlock returned "
 	    "error: %d\n", err);
-    pthread_exit((void *)-1);
-  }
 
-  fprintf(stderr, "(display-launcher) Display scripts completed.\n");
+  fprintf(stderr, "(display-launcher) Display scripts of session %d "
+	  "completed.\n", s->id);
+
+  session_put(s);
 
-  exit(0);
+  return NULL;
 }
 
 
-int
-handle_dekimberlize_thread_setup() {
-  int err, port, i;
+/*
+ * Start running the display scripts in the session's command buffer,
+ * and a thread to follow their reports.  The launch's span lasts until
+ * the VM is up or the launch has failed, and the scripts record theirs
+ * under it, on this process's clock, as they share its host.
+ */
+
+static int
+launch_dekimberlize(session_t *s) {
+  int err;
   pthread_t tid;
-  FILE *fp = NULL;
-  char port_str[PATH_MAX];
 
+  pthread_mutex_lock(&s->launch_mutex);
+  if(s->launch_finished) {
+    pthread_mutex_unlock(&s->launch_mutex);
+    fprintf(stderr, "(display-launcher) Session %d is over, not "
+	    "launching its VM.\n", s->id);
+    return -1;
+  }
+  if(pipe2(s->notify_pipe, O_CLOEXEC) < 0) {
+    pthread_mutex_unlock(&s->launch_mutex);
+    perror("pipe2");
+    return -1;
+  }
+  if(pipe2(s->finish_pipe, O_CLOEXEC) < 0) {
+    pthread_mutex_unlock(&s->launch_mutex);
+    perror("pipe2");
+    close(s->notify_pipe[0]);
+    close(s->notify_pipe[1]);
+    return -1;
+  }
+  s->launch.phase = LAUNCH_STARTING;
+  s->launch.vnc_port = 0;
+  s->vnc_server_port = 0;
+  s->vm_resumed = 0;
+  s->launch_span = span_begin(s->client_span, "display launch");
+  pthread_cond_broadcast(&s->launch_changed);
+  pthread_mutex_unlock(&s->launch_mutex);
+
+  session_hold(s);
 
   memset(&tid, 0, sizeof(pthread_t));
-  err = pthread_create(&tid, NULL, launch_display_scripts, NULL);
+  err = pthread_create(&tid, NULL, follow_launch_thread, s);
   if(err != 0) {
     fprintf(stderr, "(display-launcher) failed creating thread\n");
+    close(s->notify_pipe[0]);
+    close(s->notify_pipe[1]);
+    close(s->finish_pipe[0]);
+    finish_launch(s);
+    update_launch(s, LAUNCH_FAILED, 0);
+    session_put(s);
     return -1;
   }
+  pthread_detach(tid);
 
+  session_hold(s);
 
-  /*
-   * At this point, a new nested X server and a VNC server connected to it
-   * will soon be created, listening for connections on a port specified
-   * in /tmp/x11vnc_port.  dekimberlize is loading the vm in the background.
-   */
-
-  fprintf(stderr, "\nWaiting for thin client server to come up..");
-
-  port_str[0]='\0';
-  do {
-    struct timeval tv;
-    struct stat buf;
-    int err;
-
-    memset(&buf, 0, sizeof(struct stat));
-    memset(&tv, 0, sizeof(struct timeval));
-
-    err = stat("/tmp/x11vnc_port", &buf);
-    if(!err && buf.st_size > 0) {
-      fprintf(stderr, "(display-launcher) opened /tmp/x11vnc_port (size=%u)\n",
-	      (unsigned int) buf.st_size);
-      fp = fopen("/tmp/x11vnc_port", "r");
-      if(fp != NULL)
-	break;
-      else
-      	perror("fopen"); 
-    }
+  err = pthread_create(&tid, NULL, launch_display_scripts, s);
+  if(err != 0) {
+    fprintf(stderr, "(display-launcher) failed creating thread\n");
+    close(s->finish_pipe[0]);
+    dprintf(s->notify_pipe[1], "exit -1\n");
+    close(s->notify_pipe[1]);
+    session_put(s);
+    return -1;
+  }
+  pthread_detach(tid);
 
+  return 0;
+}
 
-    /*
-     * Sleep a second, waiting for our thin client server to come up.
-     */
 
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
+/*
+ * Wait for the display scripts to bring up the VNC server and resume
+ * the VM, and advertise the VNC server through the KCM as soon as the
+ * probes find it usable.  Gives up if the scripts finish without the VM
+ * coming up.
+ */
 
-    select(0, NULL, NULL, NULL, &tv);
+static const probe_t vnc_probes[] = {
+  { "rfb-handshake",   probe_rfb_handshake,   NULL },
+  { "rfb-framebuffer", probe_rfb_framebuffer, NULL }
+};
 
-    fprintf(stderr, ".");
-  }
-  while(fp == NULL);
 
-  fprintf(stderr, "(display-launcher) opened /tmp/x11vnc_port!\n");
+static int
+launch_failed(void *arg) {
+  return current_launch_phase((session_t *)arg) == LAUNCH_FAILED;
+}
 
-  do {
-    char *str = fgets(port_str, PATH_MAX, fp);
-    struct timeval tv;
-    
-    if(str == NULL) 
-      goto loop;
-    
-    if(strlen(str) > 5)
-      break;
-    
-  loop:
 
-    rewind(fp);
-    
-    fprintf(stderr, ".");
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
+static int
+wait_for_dekimberlize(session_t *s) {
+  int port = 0, failed;
+  span_id_t span;
 
-    /* Sleep a second, then try again. */
-    select(0, NULL, NULL, NULL, &tv);
-  }
-  while(1);
+  fprintf(stderr, "(display-launcher) Waiting for thin client server of "
+	  "session %d to come up..\n", s->id);
 
-  fclose(fp);
-  fp = NULL;
+  span = span_begin(s->launch_span, "wait for VNC server");
+  pthread_mutex_lock(&s->launch_mutex);
+  while((s->vnc_server_port == 0) && (s->launch.phase != LAUNCH_FAILED))
+    pthread_cond_wait(&s->launch_changed, &s->launch_mutex);
+  port = s->vnc_server_port;
+  pthread_mutex_unlock(&s->launch_mutex);
+  span_end(span);
 
-  for(i=0; i<10; i++)
-    if(isdigit(port_str[i]))
-       break;
-  strcpy(port_str, &(port_str[i]));
 
-  port = atoi(port_str);
+  /* Only advertise the VNC server once it is really usable. */
 
-  /* Sleep for a couple of seconds before registering. */
   fprintf(stderr, "(display-launcher) Waiting for VNC server to finish startup\n");
-  struct timeval tv = { .tv_sec = 5 };
-  select(0, NULL, NULL, NULL, &tv);
+  span = span_begin(s->launch_span, "probe VNC server");
+  switch(probe_wait(vnc_probes, sizeof(vnc_probes)/sizeof(vnc_probes[0]),
+		    port, VNC_PROBE_TIMEOUT_MS, launch_failed, s)) {
+  case -1:
+    span_end(span);
+    update_launch(s, LAUNCH_FAILED, 0);
+    span_end(s->launch_span);
+    return -1;
+  case 1:
+    fprintf(stderr, "(display-launcher) VNC server isn't answering as "
+	    "expected, advertising it anyway\n");
+    break;
+  }
+  span_end(span);
 
   fprintf(stderr, "(display-launcher) Registering VNC port %u with Avahi\n",
 	  port);
 
+  span = span_begin(s->launch_span, "register VNC service");
   if(create_kcm_service(VNC_KCM_SERVICE_NAME, port) < 0) {
     fprintf(stderr, "(display-launcher) failed creating "
 	    "VNC service in KCM..\n");
+    span_end(span);
+    update_launch(s, LAUNCH_FAILED, 0);
+    span_end(s->launch_span);
     return -1;
   }
+  span_end(span);
 
+  update_launch(s, LAUNCH_NONE, port);
 
   fprintf(stderr, "(display-launcher) Waiting for VM to come up..\n");
 
-  do {
-    struct timeval tv;
-    struct stat buf;
-    int err;
+  span = span_begin(s->launch_span, "wait for VM");
+  pthread_mutex_lock(&s->launch_mutex);
+  while(!s->vm_resumed && (s->launch.phase != LAUNCH_FAILED))
+    pthread_cond_wait(&s->launch_changed, &s->launch_mutex);
+  failed = !s->vm_resumed;
+  pthread_mutex_unlock(&s->launch_mutex);
+  span_end(span);
+
+  if(failed) {
+    span_end(s->launch_span);
+    return -1;
+  }
+
+  update_launch(s, LAUNCH_READY, 0);
+  span_end(s->launch_span);
+
+  return 0;
+}
+
+
+static int
+handle_dekimberlize_thread_setup(session_t *s) {
+  if(launch_dekimberlize(s) < 0)
+    return -1;
+
+  return wait_for_dekimberlize(s);
+}
+
+
+/*
+ * Start the session's display_setup command line.
+ */
+
+static void
+command_start(session_t *s) {
+  s->command[0] = '\0';
+  command_append(s, "display_setup -w \"%s\" ", s->work_dir);
+}
+
+
+/*
+ * Fill the command buffer with the display_setup command line for an
+ * overlay at a path on the display.
+ */
+
+static int
+prepare_path_launch(session_t *s, char *vm_name, char *patch_path) {
+  command_start(s);
+  command_append(s, "-f \"%s\" \"%s\"", patch_path, vm_name);
+
+  return 0;
+}
+
+
+bool_t
+load_vm_from_path_1_svc(char *vm_name, char *patch_path, int *result, struct svc_req *rqstp)
+{
+  session_t *s;
+  
+  if((vm_name == NULL) || (patch_path == NULL) || (result == NULL)) {
+    fprintf(stderr, "(display-launcher) Bad args to vm_path!\n");
+    if(result)
+      *result = -1;
+    return FALSE;
+  }
+
+  s = session_get(rqstp);
+  if(s == NULL) {
+    *result = -1;
+    return TRUE;
+  }
+
+  fprintf(stderr, "(display-launcher) Preparing new VNC display with "
+	  "vm '%s', kimberlize patch '%s'..\n", vm_name, patch_path);
+
+  prepare_path_launch(s, vm_name, patch_path);
+
+  *result = handle_dekimberlize_thread_setup(s);
+
+  session_put(s);
+
+  return TRUE;
+}
+
+
+/*
+ * Fill the command buffer with the display_setup command line for an
+ * overlay to be fetched from a URL.
+ */
+
+static int
+prepare_url_launch(session_t *s, char *vm_name, char *patch_URL) {
+  int err;
+
+  err = pthread_mutex_lock(&s->mutex);
+  if(err < 0) {
+    fprintf(stderr, "(display-launcher) pthread_mutex_lock returned "
+	    "error: %d\n", err);
+    return -1;
+  }
+
+  strncpy(s->overlay_location, patch_URL, 2048);
+  s->overlay_location[PATH_MAX-1] = '\0';
+
+  strncpy(s->vm_name, vm_name, PATH_MAX);
+  s->vm_name[PATH_MAX-1] = '\0';
+
+  err = pthread_mutex_unlock(&s->mutex);
+  if(err < 0) {
+    fprintf(stderr, "(display-launcher) pthread_mutex_unlock returned "
+	    "error: %d\n", err);
+    return -1;
+  }
+
+  command_start(s);
+
+  if(strlen(s->persistent_state_filename) > 0)
+    command_append(s, "-a \"%s\" ", s->persistent_state_filename);
+
+  if(strlen(s->encryption_key_filename) > 0)
+    command_append(s, "-d \"%s\" ", s->encryption_key_filename);
+  
+  command_append(s, "-i \"%s\" ", s->overlay_location);
+  command_append(s, "\"%s\"", vm_name);
+
+  return 0;
+}
+
+
+bool_t
+load_vm_from_url_1_svc(char *vm_name, char *patch_URL, int *result,  struct svc_req *rqstp)
+{
+  session_t *s;
+    
+  if((vm_name == NULL) || (patch_URL == NULL) || (result == NULL)) {
+    fprintf(stderr, "(display-launcher) Bad args to vm_path!\n");
+    if(result)
+      *result = -1;
+    return FALSE;
+  }
+
+  s = session_get(rqstp);
+  if(s == NULL) {
+    *result = -1;
+    return TRUE;
+  }
+
+  fprintf(stderr, "(display-launcher) Preparing new VNC display with "
+	  "vm '%s', kimberlize patch '%s'..\n", vm_name, patch_URL);
+
+  if(prepare_url_launch(s, vm_name, patch_URL) < 0) {
+    *result = -1;
+    session_put(s);
+    return FALSE;
+  }
+
+  *result = handle_dekimberlize_thread_setup(s);
+
+  session_put(s);
+  
+  return TRUE;
+}
+
+
+/*
+ * Fill the command buffer with the display_setup command line for an
+ * attached overlay.  If stream is given, dekimberlize reads the overlay
+ * from that FIFO as it arrives rather than from the overlay file.
+ */
+
+static int
+prepare_attachment_launch(session_t *s, char *vm_name, char *patch_file, 
+			  char *stream) {
+  int err;
+  char *bname, *copy;
+
+  copy = strdup(patch_file);
+  bname = basename(copy);
+
+  err = pthread_mutex_lock(&s->mutex);
+  if(err < 0) {
+    fprintf(stderr, "(display-launcher) pthread_mutex_lock returned "
+	    "error: %d\n", err);
+    free(copy);
+    return -1;
+  }
+
+  if(strlen(s->overlay_hash) == 0)
+    session_path(s, s->overlay_location, bname);
+  strncpy(s->vm_name, vm_name, PATH_MAX);
+  s->vm_name[PATH_MAX-1] = '\0';
+
+  err = pthread_mutex_unlock(&s->mutex);
+  if(err < 0) {
+    fprintf(stderr, "(display-launcher) pthread_mutex_unlock returned "
+	    "error: %d\n", err);
+    free(copy);
+    return -1;
+  }
+
+  command_start(s);
+
+  if(strlen(s->persistent_state_filename) > 0)
+    command_append(s, "-a \"%s\" ", s->persistent_state_filename);
+
+  if(strlen(s->encryption_key_filename) > 0)
+    command_append(s, "-d \"%s\" ", s->encryption_key_filename);
+  
+  command_append(s, "-c \"%s\" ", OVERLAY_CACHE_DIR);
+
+  if(strlen(s->overlay_hash) > 0)
+    command_append(s, "-H %s ", s->overlay_hash);
+
+  if(stream != NULL)
+    command_append(s, "-S \"%s\" ", stream);
+
+  command_append(s, "-f \"%s\" ", s->overlay_location);
+  command_append(s, "\"%s\"", vm_name);
+
+  free(copy);
+
+  return 0;
+}
+
+
+static int	streamed_launch_started(session_t *s);
+
+
+bool_t
+load_vm_from_attachment_1_svc(char *vm_name, char *patch_file, int *result,  struct svc_req *rqstp)
+{
+  session_t *s;
+
+  if((vm_name == NULL) || (patch_file == NULL) || (result == NULL)) {
+    fprintf(stderr, "(display-launcher) Bad args to vm_path!\n");
+    *result = -1;
+    return FALSE;
+  }
+
+  s = session_get(rqstp);
+  if(s == NULL) {
+    *result = -1;
+    return TRUE;
+  }
+
+  fprintf(stderr, "(display-launcher) Preparing new VNC display with "
+	  "vm '%s', attached kimberlize patch '%s'..\n", vm_name, patch_file);
+
+
+  /*
+   * If dekimberlize was started while the overlay was still arriving,
+   * it only remains to wait for the VM.
+   */
+
+  if(streamed_launch_started(s)) {
+    fprintf(stderr, "(display-launcher) VM is already being loaded from "
+	    "the streamed overlay.\n");
+    *result = wait_for_dekimberlize(s);
+  }
+  else if(prepare_attachment_launch(s, vm_name, patch_file, NULL) < 0) 
+    *result = -1;
+  else
+    *result = handle_dekimberlize_thread_setup(s);
+
+  session_put(s);
+
+  return TRUE;
+}
+
+
+/*
+ * Launching a VM without keeping the client waiting.  launch_vm starts
+ * the display scripts as the load_vm calls do, and leaves a thread of
+ * its own to wait for the VM, while the client follows along with
+ * wait_status.  The session's ID is the handle of its launch.
+ */
+
+static void *
+watch_launch_thread(void *arg) {
+  session_t *s = (session_t *)arg;
+
+  if(wait_for_dekimberlize(s) < 0)
+    fprintf(stderr, "(display-launcher) VM of session %d did not come "
+	    "up.\n", s->id);
+
+  session_put(s);
+
+  return NULL;
+}
+
+
+static int
+watch_launch(session_t *s) {
+  pthread_t tid;
+
+  session_hold(s);
+
+  if(pthread_create(&tid, NULL, watch_launch_thread, s) != 0) {
+    fprintf(stderr, "(display-launcher) failed creating thread\n");
+    session_put(s);
+    return -1;
+  }
+  pthread_detach(tid);
+
+  return 0;
+}
+
+
+bool_t
+launch_vm_1_svc(char *vm_name, char *overlay, launch_source source, 
+		int *result, struct svc_req *rqstp)
+{
+  session_t *s;
+  int err = 0, started = 0;
+
+  if((vm_name == NULL) || (overlay == NULL) || (result == NULL)) {
+    fprintf(stderr, "(display-launcher) Bad args to launch_vm!\n");
+    if(result)
+      *result = -1;
+    return FALSE;
+  }
+
+  s = session_get(rqstp);
+  if(s == NULL) {
+    *result = -1;
+    return TRUE;
+  }
+
+  fprintf(stderr, "(display-launcher) Launching vm '%s' from '%s' in the "
+	  "background..\n", vm_name, overlay);
+
+  if((source == LAUNCH_FROM_ATTACHMENT) && streamed_launch_started(s)) {
+    fprintf(stderr, "(display-launcher) VM is already being loaded from "
+	    "the streamed overlay.\n");
+    started = 1;
+  }
+  else if(current_launch_phase(s) != LAUNCH_NONE) {
+    fprintf(stderr, "(display-launcher) Session %d has launched its VM "
+	    "already.\n", s->id);
+    err = -1;
+  }
+  else {
+    switch(source) {
+    case LAUNCH_FROM_ATTACHMENT:
+      err = prepare_attachment_launch(s, vm_name, overlay, NULL);
+      break;
+    case LAUNCH_FROM_URL:
+      err = prepare_url_launch(s, vm_name, overlay);
+      break;
+    case LAUNCH_FROM_PATH:
+      err = prepare_path_launch(s, vm_name, overlay);
+      break;
+    default:
+      err = -1;
+    }
+  }
+
+  if((err == 0) && !started)
+    err = launch_dekimberlize(s);
+
+  if(err == 0)
+    err = watch_launch(s);
+
+  *result = (err == 0) ? s->id : -1;
+
+  session_put(s);
+
+  return TRUE;
+}
+
+
+bool_t
+wait_status_1_svc(int handle, launch_status seen, int timeout, 
+		  launch_status *result, struct svc_req *rqstp)
+{
+  struct timespec deadline;
+  session_t *s;
+
+  if(result == NULL)
+    return FALSE;
+
+  s = session_get(rqstp);
+  if((s == NULL) || (s->id != handle)) {
+    result->phase = LAUNCH_FAILED;
+    result->vnc_port = 0;
+    if(s != NULL)
+      session_put(s);
+    return TRUE;
+  }
+
+  if(timeout < 0)
+    timeout = 0;
+  if(timeout > LAUNCH_WAIT_MAX)
+    timeout = LAUNCH_WAIT_MAX;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout;
+
+  pthread_mutex_lock(&s->launch_mutex);
+  while((s->launch.phase == seen.phase) && 
+	(s->launch.vnc_port == seen.vnc_port))
+    if(pthread_cond_timedwait(&s->launch_changed, &s->launch_mutex, 
+			      &deadline) == ETIMEDOUT)
+      break;
+  *result = s->launch;
+  pthread_mutex_unlock(&s->launch_mutex);
+
+  session_put(s);
+
+  return TRUE;
+}
+
+
+/*
+ * Use an overlay kept in the overlay cache by an earlier session, if
+ * there is one with the given hash.  dekimberlize then also skips
+ * unpacking it, if it was unpacked with the same key.
+ */
+
+bool_t
+use_cached_overlay_1_svc(char *patch_file, file_hash hash, int *result, 
+			 struct svc_req *rqstp)
+{
+  char hex[2 * CHUNK_DIGEST_SIZE + 1];
+  char path[PATH_MAX];
+  session_t *s;
+  int i;
+
+  *result = -1;
+
+  s = session_get(rqstp);
+  if(s == NULL)
+    return TRUE;
+
+  for(i=0; i<CHUNK_DIGEST_SIZE; i++)
+    sprintf(hex + 2*i, "%02x", (unsigned char) hash.digest[i]);
+
+  snprintf(path, PATH_MAX, "%s/%s/overlay", OVERLAY_CACHE_DIR, hex);
+  if(access(path, R_OK) < 0) {
+    fprintf(stderr, "(display-launcher) overlay '%s' isn't cached\n", 
+	    patch_file);
+    session_put(s);
+    return TRUE;
+  }
+
+  pthread_mutex_lock(&s->mutex);
+  strcpy(s->overlay_location, path);
+  strcpy(s->overlay_hash, hex);
+  pthread_mutex_unlock(&s->mutex);
+
+  fprintf(stderr, "(display-launcher) using cached copy of overlay '%s'\n",
+	  patch_file);
+
+  *result = 0;
+
+  session_put(s);
+
+  return TRUE;
+}
+
+
+/*
+ * Set up a new session's transfer state.  The incoming file is described
+ * in display_launcher.h.
+ */
+
+void
+init_session_transfers(session_t *s) {
+  pthread_mutex_init(&s->incoming.mutex, NULL);
+  pthread_cond_init(&s->incoming.arrived, NULL);
+  s->incoming.fd = -1;
+  range_set_init(&s->incoming.received);
+  s->stream.state = STREAM_NONE;
+  s->write_window = 1;
+  s->receive_buffer = 0;
+  s->read_attachment = NULL;
+}
+
+
+static void
+forget_manifest(session_t *s) {
+  free(s->incoming.manifest.chunk_manifest_val);
+  s->incoming.manifest.chunk_manifest_val = NULL;
+  s->incoming.manifest.chunk_manifest_len = 0;
+}
+
+
+/*
+ * Add every chunk of a received file to the chunk store, in the
+ * background so that the client's last call isn't held up by it.
+ */
+
+typedef struct {
+  int             fd;
+  int             size;
+  chunk_manifest  manifest;
+} index_args_t;
+
+static void *
+index_chunks_thread(void *arg) {
+  index_args_t *args = (index_args_t *)arg;
+  u_int i;
+  int added = 0;
+
+  for(i=0; i<args->manifest.chunk_manifest_len; i++) {
+    off_t offset = (off_t) i * CHUNK_SIZE;
+    size_t length;
+
+    if(offset >= args->size)
+      break;
+
+    length = args->size - offset;
+    if(length > CHUNK_SIZE)
+      length = CHUNK_SIZE;
+
+    if(chunk_store_insert_from_file((unsigned char *) 
+				    args->manifest.chunk_manifest_val[i], 
+				    args->fd, offset, length) == 0)
+      added++;
+  }
+
+  fprintf(stderr, "(display-launcher) indexed %d chunks into the chunk "
+	  "store\n", added);
+
+  close(args->fd);
+  free(args->manifest.chunk_manifest_val);
+  free(args);
+
+  return NULL;
+}
+
+
+/*
+ * Hand the incoming file and its manifest over to a thread that indexes
+ * them.  Called with s->incoming.mutex held, while s->incoming.fd is open.
+ */
+
+static void
+index_incoming_chunks(session_t *s) {
+  index_args_t *args;
+  pthread_t tid;
+
+  if(s->incoming.manifest.chunk_manifest_len == 0)
+    return;
+
+  args = (index_args_t *)calloc(1, sizeof(index_args_t));
+  if(args == NULL) {
+    perror("calloc");
+    return;
+  }
+
+  args->fd = dup(s->incoming.fd);
+  if(args->fd < 0) {
+    perror("dup");
+    free(args);
+    return;
+  }
+
+  args->size = s->incoming.size;
+  args->manifest = s->incoming.manifest;
+  s->incoming.manifest.chunk_manifest_val = NULL;
+  s->incoming.manifest.chunk_manifest_len = 0;
+
+  if(pthread_create(&tid, NULL, index_chunks_thread, (void *)args) != 0) {
+    fprintf(stderr, "(display-launcher) couldn't start chunk indexing\n");
+    close(args->fd);
+    free(args->manifest.chunk_manifest_val);
+    free(args);
+    return;
+  }
+
+  pthread_detach(tid);
+}
+
+
+/*
+ * Start receiving a new file, dropping whichever was being received
+ * before.  Returns the new transfer's ID.  Called with s->incoming.mutex
+ * held.
+ */
+
+static int
+begin_incoming_transfer(session_t *s, char *filename, int size) {
+  char *bname, *copy;
+
+  if(s->incoming.fd >= 0) {
+    close(s->incoming.fd);
+    s->incoming.fd = -1;
+  }
+
+  range_set_clear(&s->incoming.received);
+  forget_manifest(s);
+  s->incoming.id = 0;
+  s->incoming.size = 0;
+  s->incoming.error = 0;
+  pthread_cond_broadcast(&s->incoming.arrived);
+
+  if(size < 0)
+    return -1;
+
+  copy = strdup(filename);
+  bname = basename(copy);
+  session_path(s, s->incoming.filename, bname);
+  free(copy);
+
+  fprintf(stderr, "(display-launcher) Writing file '%s'\n", 
+	  s->incoming.filename);
+
+  s->incoming.fd = open(s->incoming.filename, O_RDWR|O_CREAT|O_TRUNC, 0600);
+  if(s->incoming.fd < 0) {
+    perror("open");
+    return -1;
+  }
+
+  if(preallocate_file(s->incoming.fd, size) < 0) {
+    close(s->incoming.fd);
+    s->incoming.fd = -1;
+    return -1;
+  }
+
+  s->incoming.size = size;
+  if(session_new_transfer_id(s) < 0) {
+    close(s->incoming.fd);
+    s->incoming.fd = -1;
+    return -1;
+  }
+
+  if(size == 0) {               /* Nothing will follow. */
+    close(s->incoming.fd);
+    s->incoming.fd = -1;
+  }
+
+  return s->incoming.id;
+}
+
+
+/*
+ * Record that [offset, offset+length) of the incoming file has been
+ * written, closing the file once all of it has arrived.  Called with
+ * s->incoming.mutex held.
+ */
+
+static void
+incoming_received(session_t *s, int offset, int length) {
+  if(range_set_add(&s->incoming.received, offset, length) < 0) {
+    s->incoming.error = 1;
+    return;
+  }
+
+  pthread_cond_broadcast(&s->incoming.arrived);
+
+  if((s->incoming.fd >= 0) && 
+     range_set_covers(&s->incoming.received, 0, s->incoming.size)) {
+    index_incoming_chunks(s);
+    close(s->incoming.fd);
+    s->incoming.fd = -1;
+
+    fprintf(stderr, "\n(display-launcher) File transfer complete!\n");
+  }
+}
+
+
+/*
+ * Streaming an overlay into dekimberlize while it is still arriving.
+ * The client asks for it with stream_vm_from_attachment before sending
+ * the overlay.  When the transfer of that file begins, dekimberlize is
+ * started reading the overlay from a FIFO in the session's work
+ * directory, and a feeder thread copies the file into the FIFO as far as
+ * it has arrived without gaps.  The transfer and the unpacking then
+ * overlap rather than run one after the other.
+ */
+
+#define STREAM_FIFO	"dekimberlize.stream"
+
+typedef struct {
+  session_t *session;
+  int        generation;
+} feeder_args_t;
+
+
+/*
+ * Open the FIFO once dekimberlize has opened its end.  dekimberlize may
+ * exit without ever doing so, when the VM is missing or already locked
+ * by another session's launch, say, so rather than block in open() the
+ * feeder tries every STREAM_OPEN_INTERVAL_MS until the launch has failed
+ * or the stream was given up.
+ */
+
+#define STREAM_OPEN_INTERVAL_MS 20
+
+static int
+open_stream_fifo(session_t *s, int generation, char *fifo) {
+  int fd, abandoned;
+
+  while((fd = open(fifo, O_WRONLY|O_NONBLOCK)) < 0) {
+    struct timeval tv;
+
+    if(errno != ENXIO) {
+      perror("open");
+      return -1;
+    }
+
+    pthread_mutex_lock(&s->incoming.mutex);
+    abandoned = (s->stream.generation != generation);
+    pthread_mutex_unlock(&s->incoming.mutex);
+
+    if(abandoned || (current_launch_phase(s) >= LAUNCH_ENDED)) {
+      fprintf(stderr, "(display-launcher) dekimberlize never read the "
+	      "streamed overlay.\n");
+      return -1;
+    }
+
+    tv.tv_sec = 0;
+    tv.tv_usec = STREAM_OPEN_INTERVAL_MS * 1000;
+    select(0, NULL, NULL, NULL, &tv);
+  }
+
+  /* Writes block as usual from here on. */
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+  return fd;
+}
+
+
+static void *
+stream_feeder_thread(void *arg) {
+  feeder_args_t *args = (feeder_args_t *)arg;
+  session_t *s = args->session;
+  int generation = args->generation;
+  int fifofd, fd;
+  off_t fed = 0, avail;
+  ssize_t n;
+  char *data;
+  char fifo[PATH_MAX];
+
+  free(args);
+
+  session_path(s, fifo, STREAM_FIFO);
+  fifofd = open_stream_fifo(s, generation, fifo);
+  if(fifofd < 0) {
+    session_put(s);
+    return NULL;
+  }
+
+  fd = open(s->stream.filename, O_RDONLY);
+  data = buffer_pool_get(chunk_buffer_pool());
+  if((fd < 0) || (data == NULL)) {
+    perror("open");
+    goto done;
+  }
+
+  fprintf(stderr, "(display-launcher) Streaming %s into dekimberlize..\n",
+	  s->stream.filename);
+
+  pthread_mutex_lock(&s->incoming.mutex);
+
+  while(1) {
+
+
+    /*
+     * Give up if the transfer was abandoned or replaced by another
+     * file.  A new transfer of the same file carries the same bytes, so
+     * carry on from where we were once it gets there.
+     */
+
+    if((s->stream.generation != generation) || (s->incoming.id == 0) ||
+       (strcmp(s->incoming.filename, s->stream.filename) != 0)) {
+      fprintf(stderr, "(display-launcher) Transfer of the streamed "
+	      "overlay was abandoned.\n");
+      break;
+    }
+
+    avail = range_set_prefix(&s->incoming.received);
+    if(avail <= fed) {
+      if(fed >= s->incoming.size)
+	break;
+      pthread_cond_wait(&s->incoming.arrived, &s->incoming.mutex);
+      continue;
+    }
+
+    pthread_mutex_unlock(&s->incoming.mutex);
+
+    if(avail - fed > CHUNK_SIZE)
+      avail = fed + CHUNK_SIZE;
+
+    n = pread(fd, data, avail - fed, fed);
+    if((n <= 0) || (writen(fifofd, data, n) < 0)) {
+      perror("(display-launcher) streaming overlay");
+      pthread_mutex_lock(&s->incoming.mutex);
+      break;
+    }
+    fed += n;
+
+    pthread_mutex_lock(&s->incoming.mutex);
+  }
+
+  pthread_mutex_unlock(&s->incoming.mutex);
+
+  fprintf(stderr, "(display-launcher) Streamed %ld bytes into "
+	  "dekimberlize.\n", (long) fed);
+
+ done:
+  buffer_pool_put(chunk_buffer_pool(), data);
+  if(fd >= 0)
+    close(fd);
+  close(fifofd);                /* dekimberlize sees the end of it. */
+
+  session_put(s);
+
+  return NULL;
+}
+
+
+/*
+ * If the transfer which just began is of the overlay to be streamed,
+ * start dekimberlize and the feeder.
+ */
+
+static void
+start_pending_stream(session_t *s) {
+  feeder_args_t *args;
+  pthread_t tid;
+  int start, generation;
+  char fifo[PATH_MAX];
+
+  pthread_mutex_lock(&s->incoming.mutex);
+  start = ((s->stream.state == STREAM_PENDING) && (s->incoming.id > 0) &&
+	   (strcmp(s->incoming.filename, s->stream.filename) == 0));
+  if(start)
+    s->stream.state = STREAM_LAUNCHED;
+  generation = s->stream.generation;
+  pthread_mutex_unlock(&s->incoming.mutex);
+
+  if(!start)
+    return;
+
+  session_path(s, fifo, STREAM_FIFO);
+  remove(fifo);
+  if(mkfifo(fifo, 0600) < 0) {
+    perror("mkfifo");
+    goto fail;
+  }
+
+  if(prepare_attachment_launch(s, s->stream.vm_name, s->stream.filename, 
+			       fifo) < 0)
+    goto fail;
+
+  args = (feeder_args_t *)malloc(sizeof(feeder_args_t));
+  if(args == NULL) {
+    perror("malloc");
+    goto fail;
+  }
+  args->session = s;
+  args->generation = generation;
+
+  session_hold(s);
+  if(pthread_create(&tid, NULL, stream_feeder_thread, args) != 0) {
+    fprintf(stderr, "(display-launcher) failed creating thread\n");
+    session_put(s);
+    free(args);
+    goto fail;
+  }
+  pthread_detach(tid);
+
+  fprintf(stderr, "(display-launcher) Loading VM '%s' while its overlay "
+	  "arrives..\n", s->stream.vm_name);
+
+  if(launch_dekimberlize(s) < 0) {
+    pthread_mutex_lock(&s->incoming.mutex);
+    s->stream.state = STREAM_NONE;
+    s->stream.generation++;
+    pthread_cond_broadcast(&s->incoming.arrived);
+    pthread_mutex_unlock(&s->incoming.mutex);
+  }
+
+  return;
+
+ fail:
+  pthread_mutex_lock(&s->incoming.mutex);
+  s->stream.state = STREAM_NONE;
+  pthread_mutex_unlock(&s->incoming.mutex);
+}
+
+
+/*
+ * Whether dekimberlize is already running on a streamed overlay, in
+ * which case load_vm_from_attachment needn't start it.
+ */
+
+static int
+streamed_launch_started(session_t *s) {
+  int started;
+
+  pthread_mutex_lock(&s->incoming.mutex);
+  started = (s->stream.state == STREAM_LAUNCHED);
+  s->stream.state = STREAM_NONE;
+  pthread_mutex_unlock(&s->incoming.mutex);
+
+  return started;
+}
+
+
+bool_t
+stream_vm_from_attachment_1_svc(char *vm_name, char *patch_file, 
+				int *result, struct svc_req *rqstp)
+{
+  char *bname, *copy;
+  session_t *s;
+
+  *result = -1;
+
+  s = session_get(rqstp);
+  if(s == NULL)
+    return TRUE;
+
+  if(strlen(s->overlay_hash) > 0) {
+    session_put(s);
+    return TRUE;                /* Already here, nothing to stream. */
+  }
+
+  copy = strdup(patch_file);
+  bname = basename(copy);
+
+  pthread_mutex_lock(&s->incoming.mutex);
+  if(s->stream.state != STREAM_LAUNCHED) {
+    s->stream.state = STREAM_PENDING;
+    snprintf(s->stream.vm_name, PATH_MAX, "%s", vm_name);
+    session_path(s, s->stream.filename, bname);
+    *result = 0;
+  }
+  pthread_mutex_unlock(&s->incoming.mutex);
+
+  free(copy);
+
+  fprintf(stderr, "(display-launcher) Will load VM '%s' while '%s' "
+	  "arrives.\n", vm_name, patch_file);
+
+  session_put(s);
+
+  return TRUE;
+}
+
+
+bool_t
+send_file_1_svc(char *filename, int size, int *result, struct svc_req *rqstp)
+{
+  session_t *s;
+
+  *result = -1;
+
+  s = session_get(rqstp);
+  if(s == NULL)
+    return TRUE;
+
+  fprintf(stderr, "(display-launcher) Receiving file '%s' of size %d..\n", 
+	  filename, size);
+
+  pthread_mutex_lock(&s->incoming.mutex);
+  *result = begin_incoming_transfer(s, filename, size);
+  pthread_mutex_unlock(&s->incoming.mutex);
+
+  start_pending_stream(s);
+
+  session_put(s);
+
+  return TRUE;
+}
+
+/*
+ * The client may pipeline up to "window" send_partial calls, only
+ * waiting for the reply of the last call in each window.  Chunks still
+ * arrive and are written in order since they share one connection, and
+ * TCP flow control pushes back on the client if we fall behind.  The
+ * replies of pipelined calls are never seen, so a failed chunk is
+ * remembered and reported by every later send_partial of the file.
+ */
+
+bool_t
+send_window_1_svc(int window, int *result, struct svc_req *rqstp)
+{
+  session_t *s;
+
+  *result = 1;
+
+  s = session_get(rqstp);
+  if(s == NULL)
+    return TRUE;
+
+  if(window < 1)
+    window = 1;
+  if(window > SEND_WINDOW_MAX)
+    window = SEND_WINDOW_MAX;
+
+  s->write_window = window;
+
+  fprintf(stderr, "(display-launcher) Using a send window of %d chunks\n",
+	  s->write_window);
+
+  *result = s->write_window;
+
+  session_put(s);
+
+  return TRUE;
+}
+
+
+/*
+ * Write a chunk of the incoming file at "offset", or, if it is -1, right
+ * after what has arrived so far, as send_partial appends.
+ */
+
+static bool_t
+receive_partial(int offset, chunk part, int *result, struct svc_req *rqstp)
+{
+  session_t *s;
+
+  *result = -1;
+
+  s = session_get(rqstp);
+  if(s == NULL)
+    return TRUE;
+
+  pthread_mutex_lock(&s->incoming.mutex);
+
+  if(s->incoming.error)
+    goto done;
+
+  if(offset == -1)
+    offset = range_set_prefix(&s->incoming.received);
+
+  if((s->incoming.fd < 0) || (offset < 0) || 
+     (part.chunk_len > (u_int) (s->incoming.size - offset))) {
+    fprintf(stderr, "(display-launcher) chunk at offset %d (length %u) "
+	    "is outside the file\n", offset, part.chunk_len);
+    s->incoming.error = 1;
+    goto done;
+  }
+
+  if(pwriten(s->incoming.fd, part.chunk_val, part.chunk_len, offset) < 0) {
+    perror("pwrite");
+    s->incoming.error = 1;
+    goto done;
+  }
+
+  fprintf(stderr, ".");
+
+
+  /*
+   * Let the connection's receive buffer hold a whole window of chunks
+   * of this size, which is what the client keeps in flight.
+   */
+
+  if(transfer_tuning()->adapt &&
+     (s->write_window * (int) part.chunk_len > s->receive_buffer)) {
+    s->receive_buffer = s->write_window * part.chunk_len;
+    grow_socket_buffer(rqstp->rq_xprt->xp_sock, SO_RCVBUF, 
+		       s->receive_buffer);
+  }
+
+  incoming_received(s, offset, part.chunk_len);
+  if(!s->incoming.error)
+    *result = 0;
+
+ done:
+  pthread_mutex_unlock(&s->incoming.mutex);
+  session_put(s);
+  
+  return TRUE;
+}
+
+
+bool_t
+send_partial_1_svc(chunk part, int *result,  struct svc_req *rqstp)
+{
+  return receive_partial(-1, part, result, rqstp);
+}
+
+
+bool_t
+send_partial_at_1_svc(int offset, chunk part, int *result,  
+		      struct svc_req *rqstp)
+{
+  if(offset < 0) {
+    *result = -1;
+    return TRUE;
+  }
+
+  return receive_partial(offset, part, result, rqstp);
+}
+
+
+/*
+ * Bulk transfers bypass Sun RPC entirely.  The client asks for one with
+ * send_file_bulk, then opens a second connection through the KCM to
+ * our launcher port, writes the cookie we returned, and streams the raw
+ * file.  We splice it to disk and answer with a 4-byte status once the
+ * whole file is written.  The cookie doubles as the transfer ID, so a
+ * bulk transfer which breaks off can be finished with send_partial.
+ *
+ * The launcher port is shared by every session's connections, so the
+ * display's acceptor recognises a bulk data connection by its cookie and
+ * hands it to the transfer waiting for that cookie.
+ */
+
+/*
+ * Bytes received on a bulk data connection between updates of what has
+ * arrived.
+ */
+
+#define BULK_PROGRESS_SIZE (4 * CHUNK_SIZE)
+
+typedef struct bulk_waiter {
+  uint32_t            cookie;
+  int                 connfd;
+  struct bulk_waiter *next;
+} bulk_waiter_t;
+
+static pthread_mutex_t bulk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  bulk_connected = PTHREAD_COND_INITIALIZER;
+static bulk_waiter_t  *bulk_waiters = NULL;
+
+
+/*
+ * Give a bulk data connection to the transfer expecting its cookie.
+ * Returns -1 if no transfer is.
+ */
+
+int
+deliver_bulk_connection(uint32_t cookie, int connfd) {
+  bulk_waiter_t *w;
+  int ret = -1;
+
+  pthread_mutex_lock(&bulk_mutex);
+  for(w = bulk_waiters; w != NULL; w = w->next)
+    if((w->cookie == cookie) && (w->connfd < 0)) {
+      w->connfd = connfd;
+      ret = 0;
+      pthread_cond_broadcast(&bulk_connected);
+      break;
+    }
+  pthread_mutex_unlock(&bulk_mutex);
+
+  return ret;
+}
+
+
+/*
+ * Start expecting the bulk data connection of a transfer.  This is done
+ * before the client hears the cookie, since it connects right away.
+ */
+
+static void
+expect_bulk_connection(bulk_waiter_t *waiter, uint32_t cookie) {
+  pthread_mutex_lock(&bulk_mutex);
+  waiter->cookie = cookie;
+  waiter->connfd = -1;
+  waiter->next = bulk_waiters;
+  bulk_waiters = waiter;
+  pthread_mutex_unlock(&bulk_mutex);
+}
+
+
+/*
+ * Wait up to "timeout" seconds for the bulk data connection of a
+ * transfer, and stop expecting it.  Returns the connection, or -1.
+ */
+
+static int
+await_bulk_connection(bulk_waiter_t *waiter, int timeout) {
+  bulk_waiter_t **wp;
+  struct timespec deadline;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout;
+
+  pthread_mutex_lock(&bulk_mutex);
+
+  while(waiter->connfd < 0)
+    if(pthread_cond_timedwait(&bulk_connected, &bulk_mutex, 
+			      &deadline) == ETIMEDOUT)
+      break;
+
+  for(wp = &bulk_waiters; *wp != waiter; wp = &(*wp)->next)
+    ;
+  *wp = waiter->next;
+  pthread_mutex_unlock(&bulk_mutex);
+
+  return waiter->connfd;
+}
 
-    memset(&buf, 0, sizeof(struct stat));
-    memset(&tv, 0, sizeof(struct timeval));
 
-    err = stat("/tmp/dekimberlize.resumed", &buf);
-    if(!err) {
-      fp = fopen("/tmp/dekimberlize.resumed", "r");
-      if(fp == NULL)
-	perror("fopen");
-      else
-	fprintf(stderr, "(display-launcher) opened /tmp/dekimberlize.resumed\n", (unsigned int) buf.st_size);
-    }
+typedef struct {
+  session_t    *session;
+  int           fd;
+  int           size;
+  uint32_t      cookie;
+  bulk_waiter_t waiter;
+} bulk_args_t;
 
-    /*
-     * Sleep a millisecond, waiting for our VM to come up.
-     */
 
-    tv.tv_sec = 0;
-    tv.tv_usec = 1000;
+static void *
+bulk_receive_thread(void *arg) {
+  bulk_args_t *args = (bulk_args_t *)arg;
+  session_t *s = args->session;
+  int connfd, status = -1;
+  off_t received = 0;
+  uint32_t net_status;
 
-    select(0, NULL, NULL, NULL, &tv);
+  pthread_detach(pthread_self());
+
+  connfd = await_bulk_connection(&args->waiter, BULK_ACCEPT_TIMEOUT);
+  if(connfd < 0) {
+    fprintf(stderr, "(display-launcher) client never opened the bulk "
+	    "data connection\n");
+    goto done;
   }
-  while(fp == NULL);
 
-  fclose(fp);
+  fprintf(stderr, "(display-launcher) Receiving %d bytes on bulk data "
+	  "connection..\n", args->size);
 
-  return 0;
-}
+  /*
+   * Record what made it to disk every few chunks, unless the client has
+   * moved on to another file in the meantime, so that a streamed
+   * overlay can be unpacked as it arrives.
+   */
 
+  while(received < args->size) {
+    off_t len, got;
 
-bool_t
-load_vm_from_path_1_svc(char *vm_name, char *patch_path, int *result, struct svc_req *rqstp)
-{
-  
-  if((vm_name == NULL) || (patch_path == NULL) || (result == NULL)) {
-    fprintf(stderr, "(display-launcher) Bad args to vm_path!\n");
-    if(result)
-      *result = -1;
-    return FALSE;
+    len = args->size - received;
+    if(len > BULK_PROGRESS_SIZE)
+      len = BULK_PROGRESS_SIZE;
+
+    got = bulk_receive_file(connfd, args->fd, received, len);
+    if(got > 0) {
+      pthread_mutex_lock(&s->incoming.mutex);
+      if(s->incoming.id == (int) args->cookie)
+	incoming_received(s, received, got);
+      pthread_mutex_unlock(&s->incoming.mutex);
+
+      received += got;
+    }
+
+    if(got < len)
+      break;
   }
 
-  fprintf(stderr, "(display-launcher) Preparing new VNC display with "
-	  "vm '%s', kimberlize patch '%s'..\n", vm_name, patch_path);
+  if(received == args->size) {
+    fprintf(stderr, "(display-launcher) Bulk file transfer complete!\n");
+    status = 0;
+  }
 
-  snprintf(command, ARG_MAX, "display_setup -f \"%s\" \"%s\"", patch_path, vm_name);
+  net_status = htonl((uint32_t) status);
+  if(send(connfd, &net_status, sizeof(net_status), 0) < 0)
+    perror("send");
 
-  *result = handle_dekimberlize_thread_setup();
+ done:
+  if(connfd >= 0)
+    close(connfd);
+  close(args->fd);
+  session_put(s);
+  free(args);
 
-  return TRUE;
+  return NULL;
 }
 
 
 bool_t
-load_vm_from_url_1_svc(char *vm_name, char *patch_URL, int *result,  struct svc_req *rqstp)
+send_file_bulk_1_svc(char *filename, int size, int *result, 
+		     struct svc_req *rqstp)
 {
-  int err;
-  char arg[PATH_MAX];
-    
-  if((vm_name == NULL) || (patch_URL == NULL) || (result == NULL)) {
-    fprintf(stderr, "(display-launcher) Bad args to vm_path!\n");
-    if(result)
-      *result = -1;
-    return FALSE;
-  }
+  bulk_args_t *args;
+  session_t *s;
+  pthread_t tid;
+  int err, id;
 
-  fprintf(stderr, "(display-launcher) Preparing new VNC display with "
-	  "vm '%s', kimberlize patch '%s'..\n", vm_name, patch_URL);
+  *result = -1;
 
-  err = pthread_mutex_lock(&current_state.mutex);
-  if(err < 0) {
-    fprintf(stderr, "(display-launcher) pthread_mutex_lock returned "
-	    "error: %d\n", err);
-    *result = -1;
-    return FALSE;
-  }
+  if((launcher_listenfd < 0) || (size < 0))
+    return TRUE;
 
-  strncpy(current_state.overlay_location, patch_URL, 2048);
-  current_state.overlay_location[PATH_MAX-1] = '\0';
+  s = session_get(rqstp);
+  if(s == NULL)
+    return TRUE;
 
-  strncpy(current_state.vm_name, vm_name, PATH_MAX);
-  current_state.vm_name[PATH_MAX-1] = '\0';
+  fprintf(stderr, "(display-launcher) Receiving file '%s' of size %d over "
+	  "a bulk data connection..\n", filename, size);
 
-  err = pthread_mutex_unlock(&current_state.mutex);
-  if(err < 0) {
-    fprintf(stderr, "(display-launcher) pthread_mutex_unlock returned "
-	    "error: %d\n", err);
-    *result = -1;
-    return FALSE;
+  args = (bulk_args_t *)calloc(1, sizeof(bulk_args_t));
+  if(args == NULL) {
+    perror("calloc");
+    session_put(s);
+    return TRUE;
   }
 
-  snprintf(command, ARG_MAX, "display_setup ");
+  pthread_mutex_lock(&s->incoming.mutex);
+  id = begin_incoming_transfer(s, filename, size);
+  args->fd = (s->incoming.fd >= 0) ? dup(s->incoming.fd) : -1;
+  pthread_mutex_unlock(&s->incoming.mutex);
 
-  if(strlen(current_state.persistent_state_filename) > 0) {
-    snprintf(arg, PATH_MAX, "-a \"%s\" ", current_state.persistent_state_filename);
-    strncat(command, arg, PATH_MAX);
-  }
+  start_pending_stream(s);
 
-  if(strlen(current_state.encryption_key_filename) > 0) {
-    snprintf(arg, PATH_MAX, "-d \"%s\" ", current_state.encryption_key_filename);
-    strncat(command, arg, PATH_MAX);
+  if((id < 0) || (args->fd < 0)) {
+    free(args);
+    session_put(s);
+    return TRUE;
   }
-  
-  snprintf(arg, PATH_MAX, "-i \"%s\" ", current_state.overlay_location);
-  strncat(command, arg, PATH_MAX);
 
-  snprintf(arg, PATH_MAX, "\"%s\"", vm_name);
-  strncat(command, arg, PATH_MAX);
+  args->session = s;            /* The thread takes our reference. */
+  args->size = size;
+  args->cookie = id;
 
+  expect_bulk_connection(&args->waiter, id);
+
+  err = pthread_create(&tid, NULL, bulk_receive_thread, (void *)args);
+  if(err != 0) {
+    fprintf(stderr, "(display-launcher) failed creating thread\n");
+    if(await_bulk_connection(&args->waiter, 0) >= 0)
+      close(args->waiter.connfd);
+    close(args->fd);
+    free(args);
+    session_put(s);
+    return TRUE;
+  }
 
-  *result = handle_dekimberlize_thread_setup();
+  *result = id;
 
-  
   return TRUE;
 }
 
 
-bool_t
-load_vm_from_attachment_1_svc(char *vm_name, char *patch_file, int *result,  struct svc_req *rqstp)
-{
-  int err;
-  char *bname, *copy;
-  char arg[PATH_MAX];
-  
-  if((vm_name == NULL) || (patch_file == NULL) || (result == NULL)) {
-    fprintf(stderr, "(display-launcher) Bad args to vm_path!\n");
-    *result = -1;
-    return FALSE;
-  }
+/*
+ * Describe what has arrived of the session's incoming file, if it is
+ * the given transfer.  Called with s->incoming.mutex held.
+ */
 
-  fprintf(stderr, "(display-launcher) Preparing new VNC display with "
-	  "vm '%s', attached kimberlize patch '%s'..\n", vm_name, patch_file);
+static void
+describe_incoming(session_t *s, int transfer_id, received_ranges *result) {
+  int i;
 
-  copy = strdup(patch_file);
-  bname = basename(copy);
+  memset((char *)result, 0, sizeof(received_ranges));
+  result->transfer_id = -1;
 
-  err = pthread_mutex_lock(&current_state.mutex);
-  if(err < 0) {
-    fprintf(stderr, "(display-launcher) pthread_mutex_lock returned "
-	    "error: %d\n", err);
-    *result = -1;
-    free(copy);
-    return FALSE;
+  if((transfer_id <= 0) || (transfer_id != s->incoming.id)) {
+    fprintf(stderr, "(display-launcher) client asked about unknown "
+	    "transfer %d\n", transfer_id);
+    return;
   }
 
-  snprintf(current_state.overlay_location, PATH_MAX, "/tmp/%s", bname);
-  strncpy(current_state.vm_name, vm_name, PATH_MAX);
-  current_state.vm_name[PATH_MAX-1] = '\0';
+  if((s->incoming.fd >= 0) && (fdatasync(s->incoming.fd) < 0))
+    perror("fdatasync");
 
-  err = pthread_mutex_unlock(&current_state.mutex);
-  if(err < 0) {
-    fprintf(stderr, "(display-launcher) pthread_mutex_unlock returned "
-	    "error: %d\n", err);
-    *result = -1;
-    free(copy);
-    return FALSE;
+  result->ranges.ranges_val = (range *)calloc(s->incoming.received.count + 1, 
+					      sizeof(range));
+  if(result->ranges.ranges_val == NULL) {
+    perror("calloc");
+    return;
   }
 
-  snprintf(command, ARG_MAX, "display_setup ");
-
-  if(strlen(current_state.persistent_state_filename) > 0) {
-    snprintf(arg, PATH_MAX, "-a \"%s\" ", current_state.persistent_state_filename);
-    strncat(command, arg, PATH_MAX);
+  for(i=0; i<s->incoming.received.count; i++) {
+    result->ranges.ranges_val[i].offset = s->incoming.received.ranges[i].offset;
+    result->ranges.ranges_val[i].length = s->incoming.received.ranges[i].length;
   }
+  result->ranges.ranges_len = s->incoming.received.count;
 
-  if(strlen(current_state.encryption_key_filename) > 0) {
-    snprintf(arg, PATH_MAX, "-d \"%s\" ", current_state.encryption_key_filename);
-    strncat(command, arg, PATH_MAX);
-  }
-  
-  snprintf(arg, PATH_MAX, "-f \"%s\" ", current_state.overlay_location);
-  strncat(command, arg, PATH_MAX);
+  result->transfer_id = s->incoming.id;
+  result->size = s->incoming.size;
+}
 
-  snprintf(arg, PATH_MAX, "\"%s\"", vm_name);
-  strncat(command, arg, PATH_MAX);
 
-  free(copy);
+static int
+receiving_transfer(session_t *s, void *arg) {
+  int id;
 
-  *result = handle_dekimberlize_thread_setup();
+  pthread_mutex_lock(&s->incoming.mutex);
+  id = s->incoming.id;
+  pthread_mutex_unlock(&s->incoming.mutex);
 
-  return TRUE;
+  return (id > 0) && (id == *(int *)arg);
 }
 
 
-static FILE *write_attachment = NULL;
-static int   write_attachment_size = 0;
+/*
+ * Report which parts of a transfer are safely on disk.  A client calls
+ * this after reconnecting, which also resumes the session it had before
+ * the connection dropped; the new connection then carries on that
+ * session in place of the fresh one it was given.
+ */
 
 bool_t
-send_file_1_svc(char *filename, int size, int *result, struct svc_req *rqstp)
+query_received_1_svc(int transfer_id, received_ranges *result, 
+		     struct svc_req *rqstp)
 {
-  char *bname, *copy;
-  char local_filename[PATH_MAX];
+  session_t *s, *suspended;
 
-  fprintf(stderr, "(display-launcher) Receiving file '%s' of size %d..\n", 
-	  filename, size);
-
-  copy = strdup(filename);
-  bname = basename(copy);
-  snprintf(local_filename, PATH_MAX, "/tmp/%s", bname);
-
-  fprintf(stderr, "(display-launcher) Writing file '%s'\n", local_filename);
+  memset((char *)result, 0, sizeof(received_ranges));
+  result->transfer_id = -1;
 
-  write_attachment = fopen(local_filename, "w+");
-  if(write_attachment == NULL) {
-    perror("fopen");
-    free(copy);
-    *result = -1;
+  s = session_get(rqstp);
+  if(s == NULL)
     return TRUE;
+
+  if(!receiving_transfer(s, &transfer_id)) {
+    suspended = session_find_suspended(receiving_transfer, &transfer_id);
+    if(suspended != NULL) {
+      session_adopt(s, suspended);
+      session_put(s);
+      s = suspended;
+    }
   }
 
-  write_attachment_size = size;
+  pthread_mutex_lock(&s->incoming.mutex);
 
-  free(copy);
-  *result = 0;
+  describe_incoming(s, transfer_id, result);
+  if(result->transfer_id < 0)
+    goto done;
+
+  s->incoming.error = 0;        /* The client resends what went missing. */
+
+  fprintf(stderr, "(display-launcher) Session %d has %d of %d bytes of %s.\n", 
+	  s->id, range_set_total(&s->incoming.received), s->incoming.size, 
+	  s->incoming.filename);
+
+ done:
+  pthread_mutex_unlock(&s->incoming.mutex);
+  session_put(s);
 
   return TRUE;
 }
 
 
+/*
+ * Take the digests of the incoming file's chunks, and copy in the ones
+ * the chunk store already has.  The manifest is kept so the rest can be
+ * added to the store once they arrive.
+ */
+
 bool_t
-send_partial_1_svc(data part, int *result,  struct svc_req *rqstp)
+have_chunks_1_svc(int transfer_id, chunk_manifest digests, 
+		  received_ranges *result, struct svc_req *rqstp)
 {
-  int err;
+  session_t *s;
+  u_int i, n;
+  int found = 0;
 
-  if((write_attachment_size <= 0) || (write_attachment == NULL)) {
-    *result = -1;
-    return TRUE;
-  }
+  memset((char *)result, 0, sizeof(received_ranges));
+  result->transfer_id = -1;
 
-  err = fwrite(part.data_val, part.data_len, 1, write_attachment);
-  if(err <= 0) {
-    perror("fwrite");
-    *result = -1;
+  s = session_get(rqstp);
+  if(s == NULL)
     return TRUE;
+
+  pthread_mutex_lock(&s->incoming.mutex);
+
+  if((transfer_id <= 0) || (transfer_id != s->incoming.id))
+    goto done;
+
+  n = ((off_t) s->incoming.size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  if(digests.chunk_manifest_len != n) {
+    fprintf(stderr, "(display-launcher) manifest has %u chunks, expected "
+	    "%u\n", digests.chunk_manifest_len, n);
+    goto done;
   }
 
-  write_attachment_size -= part.data_len;
-  fprintf(stderr, ".");
+  forget_manifest(s);
+  s->incoming.manifest.chunk_manifest_val = 
+    (chunk_digest *)malloc((n + 1) * sizeof(chunk_digest));
+  if(s->incoming.manifest.chunk_manifest_val == NULL) {
+    perror("malloc");
+    goto done;
+  }
+  memcpy(s->incoming.manifest.chunk_manifest_val, digests.chunk_manifest_val, 
+	 n * sizeof(chunk_digest));
+  s->incoming.manifest.chunk_manifest_len = n;
 
-  *result = 0;
+  for(i=0; (i < n) && (s->incoming.fd >= 0); i++) {
+    int offset = i * CHUNK_SIZE;
+    int length = s->incoming.size - offset;
 
-  if(write_attachment_size < 0)
-    *result = -1;
-  
-  if(write_attachment_size <= 0) {
-    fclose(write_attachment);
+    if(length > CHUNK_SIZE)
+      length = CHUNK_SIZE;
 
-    fprintf(stderr, "\n(display-launcher) File transfer complete!\n");
+    if(range_set_covers(&s->incoming.received, offset, length))
+      continue;
 
-    write_attachment = NULL;
-    write_attachment_size = 0;
+    if(chunk_store_fetch((unsigned char *) digests.chunk_manifest_val[i], 
+			 s->incoming.fd, offset, length) == 0) {
+      incoming_received(s, offset, length);
+      found++;
+    }
   }
-  
+
+  fprintf(stderr, "(display-launcher) chunk store had %d of %u chunks of "
+	  "%s\n", found, n, s->incoming.filename);
+
+ done:
+  describe_incoming(s, transfer_id, result);
+  pthread_mutex_unlock(&s->incoming.mutex);
+  session_put(s);
+
   return TRUE;
 }
 
 
-static FILE *read_attachment = NULL;
-static int   read_attachment_size = 0;
-
-bool_t
-retrieve_file_1_svc(char *filename, int *result, struct svc_req *rqstp)
-{
+static int
+begin_outgoing_transfer(session_t *s, char *filename, int offset) {
   char *bname, *copy;
   char localname[PATH_MAX];
   struct stat buf;
   int ret;
 
-  fprintf(stderr, "(display-launcher) client requested %s\n", filename);
+  if(s->read_attachment != NULL) {
+    fclose(s->read_attachment);
+    s->read_attachment = NULL;
+  }
 
   copy = strdup(filename);
   bname = basename(copy);
-  snprintf(localname, PATH_MAX, "/tmp/%s", bname);
+  session_path(s, localname, bname);
+  free(copy);
 
   memset(&buf, 0, sizeof(struct stat));
   ret = stat(localname, &buf);
   if(ret < 0) {
     perror("stat");
-    *result = -1;
-    return TRUE;
+    return -1;
+  }
+
+  if((offset < 0) || (offset > buf.st_size)) {
+    fprintf(stderr, "(display-launcher) offset %d is past the end of %s\n",
+	    offset, localname);
+    return -1;
   }
 
-  read_attachment = fopen(localname, "r");
-  if(read_attachment == NULL) {
+  s->read_attachment = fopen(localname, "r");
+  if(s->read_attachment == NULL) {
     perror("fopen");
-    *result = -1;
+    return -1;
+  }
+
+  if(fseek(s->read_attachment, offset, SEEK_SET) < 0) {
+    perror("fseek");
+    fclose(s->read_attachment);
+    s->read_attachment = NULL;
+    return -1;
+  }
+
+  s->read_attachment_size = buf.st_size - offset;
+
+  fprintf(stderr, "(display-launcher) sending client file %s from "
+	  "offset %d\n", localname, offset);
+
+  if(s->read_attachment_size <= 0) {
+    fclose(s->read_attachment);
+    s->read_attachment = NULL;
+  }
+
+  return buf.st_size;
+}
+
+
+bool_t
+retrieve_file_1_svc(char *filename, int *result, struct svc_req *rqstp)
+{
+  session_t *s;
+
+  *result = -1;
+
+  s = session_get(rqstp);
+  if(s == NULL)
+    return TRUE;
+
+  fprintf(stderr, "(display-launcher) client requested %s\n", filename);
+
+  *result = begin_outgoing_transfer(s, filename, 0);
+
+  session_put(s);
+
+  return TRUE;
+}
+
+
+static int
+sending_file(session_t *s, void *arg) {
+  char localname[PATH_MAX], *copy;
+
+  copy = strdup((char *)arg);
+  session_path(s, localname, basename(copy));
+  free(copy);
+
+  return (s->read_attachment != NULL) && (access(localname, R_OK) == 0);
+}
+
+
+/*
+ * Restart sending a file part way, after the connection dropped.  Like
+ * query_received, this resumes the interrupted session.
+ */
+
+bool_t
+retrieve_file_from_1_svc(char *filename, int offset, int *result, 
+			 struct svc_req *rqstp)
+{
+  session_t *s, *suspended;
+
+  *result = -1;
+
+  s = session_get(rqstp);
+  if(s == NULL)
     return TRUE;
+
+  fprintf(stderr, "(display-launcher) client requested %s from offset %d\n", 
+	  filename, offset);
+
+  suspended = session_find_suspended(sending_file, filename);
+  if(suspended != NULL) {
+    session_adopt(s, suspended);
+    session_put(s);
+    s = suspended;
   }
 
-  *result = buf.st_size;
-  read_attachment_size = buf.st_size;
+  *result = begin_outgoing_transfer(s, filename, offset);
 
-  fprintf(stderr, "(display-launcher) sending client file %s\n", localname);
+  session_put(s);
 
   return TRUE;
 }
 
 
 bool_t
-retrieve_partial_1_svc(data *result,  struct svc_req *rqstp)
+retrieve_partial_1_svc(chunk *result,  struct svc_req *rqstp)
 {
   int bytes_read;
   char *partial_read;
+  session_t *s;
 
-  memset((char *)result, 0, sizeof(data));
+  memset((char *)result, 0, sizeof(chunk));
 
-  if((read_attachment == NULL) || (read_attachment_size <= 0))
+  s = session_get(rqstp);
+  if(s == NULL)
     return FALSE;
 
-  partial_read = (char *)malloc(CHUNK_SIZE);
+  if((s->read_attachment == NULL) || (s->read_attachment_size <= 0)) {
+    session_put(s);
+    return FALSE;
+  }
+
+  partial_read = buffer_pool_get(chunk_buffer_pool());
   if(partial_read == NULL) {
-    perror("malloc");
+    session_put(s);
     return FALSE;
   }
 
-  bytes_read = fread(partial_read, 1, CHUNK_SIZE, read_attachment);
+  bytes_read = fread(partial_read, 1, transfer_tuning()->chunk_size,
+		     s->read_attachment);
   if(bytes_read <= 0) {
-    if(feof(read_attachment)) {
+    if(feof(s->read_attachment)) {
       fprintf(stderr, "(display-launcher) end of file retrieval\n");
     }
-    if(ferror(read_attachment)) {
+    if(ferror(s->read_attachment)) {
       fprintf(stderr, "(display-launcher) error in file retrieval\n");
       perror("fread");
     }
-    free(partial_read);
+    buffer_pool_put(chunk_buffer_pool(), partial_read);
+    session_put(s);
     return FALSE;
   }
 
-  read_attachment_size -= bytes_read;
+  s->read_attachment_size -= bytes_read;
   fprintf(stderr, ".");
 
-  if(read_attachment_size <= 0) {
-    fclose(read_attachment);
+  if(s->read_attachment_size <= 0) {
+    fclose(s->read_attachment);
 
     fprintf(stderr, "\n(display-launcher) Outgoing file transfer complete!\n");
 
-    read_attachment = NULL;
-    read_attachment_size = 0;
+    s->read_attachment = NULL;
+    s->read_attachment_size = 0;
   }
 
-  result->data_len = bytes_read;
-  result->data_val = partial_read;
+  result->chunk_len = bytes_read;
+  result->chunk_val = partial_read;
+
+  session_put(s);
   
   return TRUE;
 }
 
 
+/*
+ * Whether a transfer in either direction was cut off part way, in which
+ * case the client may reconnect and resume it.
+ */
+
+int
+transfer_interrupted(session_t *s) {
+  int ret;
+
+  pthread_mutex_lock(&s->incoming.mutex);
+  ret = (s->incoming.fd >= 0);
+  pthread_mutex_unlock(&s->incoming.mutex);
+
+  return ret || (s->read_attachment != NULL);
+}
+
+
+/*
+ * Give up on any unfinished transfers, removing partially received files.
+ */
+
+void
+abandon_transfers(session_t *s) {
+  pthread_mutex_lock(&s->incoming.mutex);
+  if(s->incoming.fd >= 0) {
+    close(s->incoming.fd);
+    s->incoming.fd = -1;
+    if(remove(s->incoming.filename) < 0)
+      if(errno != ENOENT)
+	perror("remove");
+  }
+  range_set_clear(&s->incoming.received);
+  forget_manifest(s);
+  s->incoming.id = 0;
+  s->incoming.size = 0;
+  s->incoming.error = 0;
+  s->stream.state = STREAM_NONE;
+  s->stream.generation++;
+  pthread_cond_broadcast(&s->incoming.arrived);
+  pthread_mutex_unlock(&s->incoming.mutex);
+
+  if(s->read_attachment != NULL) {
+    fclose(s->read_attachment);
+    s->read_attachment = NULL;
+    s->read_attachment_size = 0;
+  }
+}
+
+
 bool_t
 end_usage_1_svc(int retrieve_state, char **result, struct svc_req *rqstp)
 {
-  int fd, i, err;
   char *filename;
-
-  fd = open("/tmp/dekimberlize_finished", O_RDWR|O_CREAT);
-  close(fd);
-
-  fprintf(stderr, "(display-launcher) (**result)=%p, (*result)=%p\n",
-	  result, *result);
+  session_t *s;
 
   *result = (char *)malloc(PATH_MAX * sizeof(char));
   if(*result == NULL) {
@@ -553,25 +2155,33 @@ end_usage_1_svc(int retrieve_state, char **result, struct svc_req *rqstp)
   filename=*result;
   filename[0] = '\0';
 
+  s = session_get(rqstp);
+  if(s == NULL)
+    return TRUE;
+
+  finish_launch(s);
+
   if(retrieve_state > 0) {
     int err;
 
-    err = pthread_mutex_lock(&current_state.mutex);
+    err = pthread_mutex_lock(&s->mutex);
     if(err < 0) {
       fprintf(stderr, "(display-launcher) pthread_mutex_lock returned "
 	      "error: %d\n", err);
+      session_put(s);
       return FALSE;
     }
 
     fprintf(stderr, "(display-launcher) copying %s into returned filename.\n",
-	    current_state.persistent_state_diff_filename);
+	    s->persistent_state_diff_filename);
     
-    strcpy(filename, current_state.persistent_state_diff_filename);
+    strcpy(filename, s->persistent_state_diff_filename);
     
-    err = pthread_mutex_unlock(&current_state.mutex);
+    err = pthread_mutex_unlock(&s->mutex);
     if(err < 0) {
       fprintf(stderr, "(display-launcher) pthread_mutex_unlock returned "
 	      "error: %d\n", err);
+      session_put(s);
       return FALSE;
     }
   }
@@ -582,6 +2192,8 @@ end_usage_1_svc(int retrieve_state, char **result, struct svc_req *rqstp)
   fprintf(stderr, "(display-launcher) client told to retrieve state: %s\n",
 	  *result);
 
+  session_put(s);
+
   return TRUE;
 }
 
@@ -593,6 +2205,33 @@ ping_1_svc(void *result, struct svc_req *rqstp)
 }
 
 
+/*
+ * Read the trace clock for the client, and note which of its spans the
+ * session's spans go under.
+ */
+
+bool_t
+clock_sync_1_svc(u_quad_t span, clock_reading *result, 
+		 struct svc_req *rqstp)
+{
+  session_t *s;
+
+  if(result == NULL)
+    return FALSE;
+
+  s = session_get(rqstp);
+  if(s != NULL) {
+    s->client_span = span;
+    session_put(s);
+  }
+
+  result->process = trace_process();
+  result->realtime_ns = trace_realtime();
+
+  return TRUE;
+}
+
+
 bool_t
 use_usb_cable_1_svc(int *result, struct svc_req *rqstp)
 {
@@ -612,38 +2251,44 @@ use_persistent_state_1_svc(char *filename, int *result,  struct svc_req *rqstp)
 {
   int err;
   char *bname, *copy;
-  char command[ARG_MAX];
   char local_filename[PATH_MAX];
+  session_t *s;
+
+  *result = -1;
+
+  s = session_get(rqstp);
+  if(s == NULL)
+    return TRUE;
 
   copy = strdup(filename);
   bname = basename(copy);
-  snprintf(local_filename, PATH_MAX, "/tmp/%s", bname);
+  session_path(s, local_filename, bname);
 
 
-  err = pthread_mutex_lock(&current_state.mutex);
+  err = pthread_mutex_lock(&s->mutex);
   if(err < 0) {
     fprintf(stderr, "(display-launcher) pthread_mutex_lock returned "
 	    "error: %d\n", err);
     free(copy);
-    *result = -1;
+    session_put(s);
     return FALSE;
   }
 
   fprintf(stderr, "(display-launcher) Decompressing persistent state %s..\n",
 	  local_filename);
 
-  decompress_file(local_filename, current_state.persistent_state_filename);
-  snprintf(current_state.persistent_state_modified_filename, PATH_MAX, 
-	   "%s.new", current_state.persistent_state_filename);
-  snprintf(current_state.persistent_state_diff_filename, PATH_MAX, 
-	   "%s.diff", current_state.persistent_state_filename);
+  decompress_file(local_filename, s->persistent_state_filename);
+  snprintf(s->persistent_state_modified_filename, PATH_MAX, 
+	   "%s.new", s->persistent_state_filename);
+  snprintf(s->persistent_state_diff_filename, PATH_MAX, 
+	   "%s.diff", s->persistent_state_filename);
 
-  err = pthread_mutex_unlock(&current_state.mutex);
+  err = pthread_mutex_unlock(&s->mutex);
   if(err < 0) {
     fprintf(stderr, "(display-launcher) pthread_mutex_unlock returned "
 	    "error: %d\n", err);
-    *result = -1;
     free(copy);
+    session_put(s);
     return FALSE;
   }
 
@@ -651,13 +2296,15 @@ use_persistent_state_1_svc(char *filename, int *result,  struct svc_req *rqstp)
 	  "\t original file: %s\n"
 	  "\t modified file: %s\n"
 	  "\t binary difference file: %s\n",
-	  current_state.persistent_state_filename,
-	  current_state.persistent_state_modified_filename,
-	  current_state.persistent_state_diff_filename);
+	  s->persistent_state_filename,
+	  s->persistent_state_modified_filename,
+	  s->persistent_state_diff_filename);
 
   free(copy);
   *result = 0;
 
+  session_put(s);
+
   return TRUE;
 }
 
@@ -674,37 +2321,45 @@ use_encryption_key_1_svc(char *filename, int *result,  struct svc_req *rqstp)
 {
   int err;
   char *bname, *copy;
+  session_t *s;
+
+  *result = -1;
+
+  s = session_get(rqstp);
+  if(s == NULL)
+    return TRUE;
 
   copy = strdup(filename);
   bname = basename(copy);
 
-  err = pthread_mutex_lock(&current_state.mutex);
+  err = pthread_mutex_lock(&s->mutex);
   if(err < 0) {
     fprintf(stderr, "(display-launcher) pthread_mutex_lock returned "
 	    "error: %d\n", err);
     free(copy);
-    *result = -1;
+    session_put(s);
     return FALSE;
   }
   
-  snprintf(current_state.encryption_key_filename, PATH_MAX, 
-	   "/tmp/%s", bname);
+  session_path(s, s->encryption_key_filename, bname);
 
-  err = pthread_mutex_unlock(&current_state.mutex);
+  err = pthread_mutex_unlock(&s->mutex);
   if(err < 0) {
     fprintf(stderr, "(display-launcher) pthread_mutex_unlock returned "
 	    "error: %d\n", err);
-    *result = -1;
     free(copy);
+    session_put(s);
     return FALSE;
   }
 
   fprintf(stderr, "(display-launcher) Using encryption key: %s\n",
-	  current_state.encryption_key_filename);
+	  s->encryption_key_filename);
 
   free(copy);
   *result = 0;
 
+  session_put(s);
+
   return TRUE;
 }
 
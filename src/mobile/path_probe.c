@@ -0,0 +1,369 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <dbus/dbus-glib.h>
+#include <dbus/dbus-glib-lowlevel.h>
+#include <dbus/dbus-glib-bindings.h>
+#include <glib.h>
+
+#include "kcm_dbus_app_glue.h"
+#include "common.h"
+#include "path_probe.h"
+
+
+typedef struct {
+  path_prober_t *prober;
+  path_result_t  result;
+} path_t;
+
+struct path_prober {
+  pthread_mutex_t  mutex;
+  pthread_cond_t   finished;
+  int              refs;        /* The caller's, and each probe's. */
+  int              num_paths;
+  int              num_finished;
+  span_id_t        span;
+  path_t          *paths;
+};
+
+
+static void
+prober_put(path_prober_t *prober) {
+  int refs;
+
+  pthread_mutex_lock(&prober->mutex);
+  refs = --prober->refs;
+  pthread_mutex_unlock(&prober->mutex);
+
+  if(refs > 0)
+    return;
+
+  pthread_mutex_destroy(&prober->mutex);
+  pthread_cond_destroy(&prober->finished);
+  free(prober->paths);
+  free(prober);
+}
+
+
+/*
+ * Ask the KCM for a connection to the display over one interface.  The
+ * probes each have a private connection to the bus, as a proxy is not
+ * to be shared between threads.
+ */
+
+static int
+connect_over_interface(int iface) {
+  DBusGConnection *conn;
+  DBusGProxy *proxy;
+  GError *gerr = NULL;
+  guint gport = 0;
+
+  conn = dbus_g_bus_get_private(DBUS_BUS_SESSION, NULL, &gerr);
+  if(conn == NULL) {
+    fprintf(stderr, "(mobile-launcher) probe couldn't connect to DBus: %s\n",
+	    gerr->message);
+    g_error_free(gerr);
+    return -1;
+  }
+
+  proxy = dbus_g_proxy_new_for_name(conn,
+				    KCM_DBUS_SERVICE_NAME,
+				    KCM_DBUS_SERVICE_PATH,
+				    KCM_DBUS_SERVICE_NAME);
+  if(proxy != NULL) {
+    if(!edu_cmu_cs_kimberley_kcm_browse(proxy,
+					LAUNCHER_KCM_SERVICE_NAME,
+					iface,
+					&gport,
+					&gerr)) {
+      fprintf(stderr, "(mobile-launcher) probe's kcm->browse() failed: %s\n",
+	      gerr->message);
+      g_error_free(gerr);
+      gport = 0;
+    }
+    g_object_unref(proxy);
+  }
+
+  dbus_connection_set_exit_on_disconnect(dbus_g_connection_get_connection(conn),
+					 FALSE);
+  dbus_connection_close(dbus_g_connection_get_connection(conn));
+  dbus_g_connection_unref(conn);
+
+  if(gport == 0)
+    return -1;
+
+  return make_tcpip_connection("localhost", gport);
+}
+
+
+/*
+ * Send a probe message of "len" bytes and wait for the display to
+ * acknowledge it.
+ */
+
+static int
+probe_message(int fd, const char *buf, uint32_t len) {
+  uint32_t net_len = htonl(len), reply;
+
+  if((writen(fd, &net_len, sizeof(net_len)) < 0) ||
+     ((len > 0) && (writen(fd, buf, len) < 0)) ||
+     (recv(fd, &reply, sizeof(reply), MSG_WAITALL) != sizeof(reply)) ||
+     (reply != net_len))
+    return -1;
+
+  return 0;
+}
+
+
+static int
+compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+
+static int
+probe_path(path_result_t *path) {
+  double rtts[PATH_PROBE_PINGS];
+  uint32_t cookie = htonl(PATH_PROBE_COOKIE);
+  struct timeval tv;
+  uint64_t start;
+  char *bulk;
+  int fd, i, one = 1, ret = -1;
+
+  fd = connect_over_interface(path->iface);
+  if(fd < 0)
+    return -1;
+
+  tv.tv_sec = PATH_PROBE_IO_TIMEOUT_MS / 1000;
+  tv.tv_usec = (PATH_PROBE_IO_TIMEOUT_MS % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if(writen(fd, &cookie, sizeof(cookie)) < 0)
+    goto done;
+
+  for(i=0; i<PATH_PROBE_PINGS; i++) {
+    start = trace_now();
+    if(probe_message(fd, NULL, 0) < 0)
+      goto done;
+    rtts[i] = (trace_now() - start) / 1e9;
+    link_estimate_rtt(&path->link, rtts[i]);
+  }
+
+  qsort(rtts, PATH_PROBE_PINGS, sizeof(double), compare_doubles);
+  path->rtt_min = rtts[0];
+  path->rtt_median = rtts[PATH_PROBE_PINGS / 2];
+  path->rtt_p90 = rtts[(PATH_PROBE_PINGS * 9) / 10];
+  path->rtt_max = rtts[PATH_PROBE_PINGS - 1];
+
+  bulk = (char *)calloc(1, PATH_PROBE_BULK);
+  if(bulk == NULL)
+    goto done;
+
+  start = trace_now();
+  if(probe_message(fd, bulk, PATH_PROBE_BULK) == 0) {
+    link_estimate_delivery(&path->link, PATH_PROBE_BULK,
+			   (trace_now() - start) / 1e9);
+    ret = 0;
+  }
+  free(bulk);
+
+ done:
+  close(fd);
+
+  return ret;
+}
+
+
+static void *
+probe_thread(void *arg) {
+  path_t *path = (path_t *)arg;
+  path_prober_t *prober = path->prober;
+  path_result_t result;
+  char name[64];
+  span_id_t span;
+
+  pthread_mutex_lock(&prober->mutex);
+  result = path->result;
+  pthread_mutex_unlock(&prober->mutex);
+
+  snprintf(name, sizeof(name), "probe path %s", result.name);
+  span = span_begin(prober->span, name);
+  result.state = (probe_path(&result) < 0) ? PATH_FAILED : PATH_PROBED;
+  span_end(span);
+
+  if(result.state == PATH_PROBED)
+    fprintf(stderr, "(mobile-launcher) Path over %s: round trip %.2f ms "
+	    "(median), %.2f ms (90th percentile), %.2f ms (max); "
+	    "%.1f MB/s\n", result.name, result.rtt_median * 1000,
+	    result.rtt_p90 * 1000, result.rtt_max * 1000,
+	    result.link.bandwidth / 1048576);
+  else
+    fprintf(stderr, "(mobile-launcher) Couldn't probe the path over %s.\n",
+	    result.name);
+
+  pthread_mutex_lock(&prober->mutex);
+  path->result = result;
+  prober->num_finished++;
+  pthread_cond_broadcast(&prober->finished);
+  pthread_mutex_unlock(&prober->mutex);
+
+  prober_put(prober);
+
+  return NULL;
+}
+
+
+path_prober_t *
+path_probe_start(char **interfaces, span_id_t span) {
+  path_prober_t *prober;
+  pthread_condattr_t attr;
+  pthread_t tid;
+  int i, n;
+
+  for(n=0; (interfaces != NULL) && (interfaces[n] != NULL); n++)
+    ;
+  if(n == 0)
+    return NULL;
+
+  prober = (path_prober_t *)calloc(1, sizeof(path_prober_t));
+  if(prober == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+
+  prober->paths = (path_t *)calloc(n, sizeof(path_t));
+  if(prober->paths == NULL) {
+    perror("calloc");
+    free(prober);
+    return NULL;
+  }
+
+  pthread_mutex_init(&prober->mutex, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&prober->finished, &attr);
+  pthread_condattr_destroy(&attr);
+  prober->refs = 1;
+  prober->span = span;
+
+  for(i=0; i<n; i++) {
+    path_t *path = &prober->paths[i];
+
+    path->prober = prober;
+    path->result.iface = i;
+    snprintf(path->result.name, sizeof(path->result.name), "%s",
+	     interfaces[i]);
+    path->result.state = PATH_PROBING;
+    link_estimate_init(&path->result.link);
+  }
+
+  pthread_mutex_lock(&prober->mutex);
+  for(i=0; i<n; i++) {
+    prober->refs++;
+    if(pthread_create(&tid, NULL, probe_thread, &prober->paths[i]) != 0) {
+      fprintf(stderr, "(mobile-launcher) failed creating probe thread\n");
+      prober->refs--;
+      prober->paths[i].result.state = PATH_FAILED;
+      prober->num_finished++;
+      continue;
+    }
+    pthread_detach(tid);
+  }
+  prober->num_paths = n;
+  pthread_mutex_unlock(&prober->mutex);
+
+  return prober;
+}
+
+
+int
+path_probe_wait(path_prober_t *prober, int timeout_ms,
+		path_result_t **results) {
+  struct timespec deadline;
+  int i, n;
+
+  *results = NULL;
+  if(prober == NULL)
+    return 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+  if(deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&prober->mutex);
+
+  while(prober->num_finished < prober->num_paths)
+    if(pthread_cond_timedwait(&prober->finished, &prober->mutex,
+			      &deadline) != 0)
+      break;
+
+  n = prober->num_paths;
+  *results = (path_result_t *)calloc(n, sizeof(path_result_t));
+  if(*results == NULL)
+    n = 0;
+  for(i=0; i<n; i++)
+    (*results)[i] = prober->paths[i].result;
+
+  pthread_mutex_unlock(&prober->mutex);
+
+  return n;
+}
+
+
+path_result_t *
+path_probe_quickest(path_result_t *results, int num_results) {
+  path_result_t *quickest = NULL;
+  int i;
+
+  for(i=0; i<num_results; i++)
+    if((results[i].state == PATH_PROBED) &&
+       ((quickest == NULL) ||
+	(results[i].rtt_median < quickest->rtt_median)))
+      quickest = &results[i];
+
+  return quickest;
+}
+
+
+void
+path_probe_free(path_prober_t *prober) {
+  if(prober != NULL)
+    prober_put(prober);
+}
@@ -0,0 +1,93 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PATH_PROBE_H_
+#define _PATH_PROBE_H_
+
+#include "common.h"
+#include "link_estimate.h"
+#include "trace.h"
+
+
+/*
+ * Path probes measure the way to the display over each of the interfaces
+ * the KCM senses, all at once and in the background, so that a launch
+ * can go on with its setup meanwhile and choose a path once it needs
+ * one.  Each path gets its own connection through the KCM, on which the
+ * display answers probe messages (see PATH_PROBE_COOKIE in common.h)
+ * outside of any session: PATH_PROBE_PINGS empty ones, timed on the
+ * monotonic trace clock, then one of PATH_PROBE_BULK bytes, whose
+ * acknowledgement gives the path's throughput.  Every read and write
+ * on a path gives up after PATH_PROBE_IO_TIMEOUT_MS.
+ */
+
+typedef enum {
+  PATH_PROBING = 0,
+  PATH_PROBED,
+  PATH_FAILED
+} path_state_t;
+
+typedef struct {
+  int              iface;       /* The interface's index in kcm_sense(), */
+  char             name[32];    /* and its name. */
+  path_state_t     state;
+  double           rtt_min;     /* Round trips, in seconds. */
+  double           rtt_median;
+  double           rtt_p90;
+  double           rtt_max;
+  link_estimate_t  link;        /* Round trip and throughput, as planned */
+} path_result_t;                /* for by link_estimate_plan(). */
+
+typedef struct path_prober path_prober_t;
+
+
+/*
+ * Start probing the paths of the interfaces named, a NULL-terminated
+ * array as kcm_sense() returns them.  The probes' spans go under the
+ * span given.  Returns NULL if there is nothing to probe.
+ */
+
+path_prober_t *	path_probe_start(char **interfaces, span_id_t span);
+
+
+/*
+ * Wait up to timeout_ms for the probes to finish, then return how many
+ * paths there are, with *results set to a copy of what is known of them
+ * for the caller to free.  Paths whose probes haven't finished are left
+ * PATH_PROBING.
+ */
+
+int	path_probe_wait(path_prober_t *prober, int timeout_ms,
+			path_result_t **results);
+
+
+/*
+ * The probed path with the quickest median round trip, or NULL.
+ */
+
+path_result_t *	path_probe_quickest(path_result_t *results, int num_results);
+
+
+/*
+ * Let go of the prober.  Probes still running finish on their own.
+ */
+
+void	path_probe_free(path_prober_t *prober);
+
+#endif
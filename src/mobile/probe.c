@@ -0,0 +1,458 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include "probe.h"
+
+
+/*
+ * Longest a probe waits on the server for any one reply, so that a
+ * server which accepts connections but hasn't started answering them
+ * doesn't hold up the retries.
+ */
+
+#define PROBE_REPLY_TIMEOUT_MS 2000
+
+#define RFB_SECURITY_NONE 1
+
+
+static long long
+now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+int
+probe_wait(const probe_t *probes, int num_probes, unsigned short port,
+	   int timeout_ms, int (*cancelled)(void *), void *arg) {
+  long long start = now_ms(), attempt_start;
+  int i = 0, attempts = 0;
+
+  attempt_start = start;
+
+  while(i < num_probes) {
+    struct timespec ts = { 0, PROBE_INTERVAL_MS * 1000000 };
+    int ret;
+
+    if((cancelled != NULL) && cancelled(arg))
+      return -1;
+
+    ret = probes[i].check(port, probes[i].arg);
+    attempts++;
+
+    if(ret < 0) {
+      fprintf(stderr, "(display-launcher) probe '%s' of port %u failed\n",
+	      probes[i].name, port);
+      return -1;
+    }
+
+    if(ret > 0) {
+      fprintf(stderr, "(display-launcher) probe '%s' of port %u passed "
+	      "after %lld ms and %d attempts\n", probes[i].name, port, 
+	      now_ms() - attempt_start, attempts);
+      attempt_start = now_ms();
+      attempts = 0;
+      i++;
+      continue;
+    }
+
+    if(now_ms() - start >= timeout_ms) {
+      fprintf(stderr, "(display-launcher) probe '%s' of port %u timed "
+	      "out\n", probes[i].name, port);
+      return 1;
+    }
+
+    nanosleep(&ts, NULL);
+  }
+
+  return 0;
+}
+
+
+static int
+read_full(int fd, void *buf, size_t len) {
+  char *p = (char *)buf;
+
+  while(len > 0) {
+    ssize_t n = read(fd, p, len);
+    if(n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+
+static int
+write_full(int fd, const void *buf, size_t len) {
+  const char *p = (const char *)buf;
+
+  while(len > 0) {
+    ssize_t n = write(fd, p, len);
+    if(n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Connect to a VNC server on the loopback interface, returning -1 if
+ * nothing listens there yet.
+ */
+
+static int
+rfb_connect(unsigned short port) {
+  struct timeval tv = { PROBE_REPLY_TIMEOUT_MS / 1000, 
+			(PROBE_REPLY_TIMEOUT_MS % 1000) * 1000 };
+  struct sockaddr_in sa;
+  int fd;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(fd < 0)
+    return -1;
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sa.sin_port = htons(port);
+
+  if(connect(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+
+/*
+ * Negotiate the protocol version and security type as a client would.
+ * Returns 1 if the server let us in without a password, 2 if it wants
+ * one, 0 if it turned us away for now, and -1 if it doesn't speak RFB.
+ */
+
+static int
+rfb_negotiate(int fd) {
+  char version[13];
+  int major, minor;
+  uint32_t word;
+  uint8_t count, types[255];
+  int i, none = 0;
+
+  if(read_full(fd, version, 12) < 0)
+    return 0;
+  version[12] = '\0';
+
+  if((sscanf(version, "RFB %3d.%3d\n", &major, &minor) != 2) || (major < 3))
+    return -1;
+
+  if((major > 3) || (minor >= 8))
+    minor = 8;
+  else if(minor != 7)
+    minor = 3;
+
+  snprintf(version, sizeof(version), "RFB 003.%03d\n", minor);
+  if(write_full(fd, version, 12) < 0)
+    return 0;
+
+  if(minor == 3) {
+    /* The server picks: 0 for failure, 1 for none, 2 for VNC auth. */
+    if(read_full(fd, &word, 4) < 0)
+      return 0;
+    word = ntohl(word);
+    if(word == 0)
+      return 0;
+    return (word == RFB_SECURITY_NONE) ? 1 : 2;
+  }
+
+  if((read_full(fd, &count, 1) < 0) || (count == 0))
+    return 0;
+  if(read_full(fd, types, count) < 0)
+    return 0;
+
+  for(i=0; i<count; i++)
+    if(types[i] == RFB_SECURITY_NONE)
+      none = 1;
+
+  if(!none)
+    return 2;
+
+  count = RFB_SECURITY_NONE;
+  if(write_full(fd, &count, 1) < 0)
+    return 0;
+
+  if(minor == 8) {
+    if(read_full(fd, &word, 4) < 0)
+      return 0;
+    if(word != 0)
+      return 0;
+  }
+
+  return 1;
+}
+
+
+int
+probe_rfb_handshake(unsigned short port, void *arg) {
+  int fd, ret;
+
+  (void)arg;
+
+  fd = rfb_connect(port);
+  if(fd < 0)
+    return 0;
+
+  ret = rfb_negotiate(fd);
+  close(fd);
+
+  return (ret > 0) ? 1 : ret;
+}
+
+
+/*
+ * Read the rectangles of a framebuffer update, in raw encoding and
+ * 32-bit pixels, looking for one pixel which differs from the first.
+ * Returns 1 if there is one, 0 if the update was all one colour, -1 if
+ * it couldn't be read, and -2 if it isn't in raw encoding.  covered
+ * counts the pixels seen.
+ */
+
+static int
+rfb_read_update(int fd, uint32_t *first, int *have_first, 
+		long long *covered) {
+  uint8_t header[3];
+  uint16_t rects;
+  int differs = 0;
+  uint32_t *pixels;
+  size_t max = 16384;
+
+  if(read_full(fd, header, 3) < 0)
+    return -1;
+  memcpy(&rects, header + 1, 2);
+  rects = ntohs(rects);
+
+  pixels = (uint32_t *)malloc(max * sizeof(uint32_t));
+  if(pixels == NULL)
+    return -1;
+
+  while(rects-- > 0) {
+    uint16_t rect[4];
+    int32_t encoding;
+    long long left;
+
+    if((read_full(fd, rect, 8) < 0) || (read_full(fd, &encoding, 4) < 0)) {
+      free(pixels);
+      return -1;
+    }
+    if(ntohl(encoding) != 0) {
+      free(pixels);
+      return -2;
+    }
+
+    left = (long long) ntohs(rect[2]) * ntohs(rect[3]);
+    *covered += left;
+
+    while(left > 0) {
+      size_t n = (left > (long long) max) ? max : (size_t) left, i;
+
+      if(read_full(fd, pixels, n * sizeof(uint32_t)) < 0) {
+	free(pixels);
+	return -1;
+      }
+
+      if(!*have_first) {
+	*first = pixels[0];
+	*have_first = 1;
+      }
+      for(i=0; i<n; i++)
+	if(pixels[i] != *first)
+	  differs = 1;
+
+      left -= n;
+    }
+  }
+
+  free(pixels);
+
+  return differs;
+}
+
+
+int
+probe_rfb_framebuffer(unsigned short port, void *arg) {
+  uint8_t init[24], msg[20];
+  uint16_t width, height;
+  uint32_t name_len, first = 0;
+  long long covered = 0;
+  int fd, ret, have_first = 0;
+
+  (void)arg;
+
+  fd = rfb_connect(port);
+  if(fd < 0)
+    return 0;
+
+  ret = rfb_negotiate(fd);
+  if(ret != 1) {
+    close(fd);
+    if(ret == 2) {
+      /* No way in to look, so the handshake will have to do. */
+      fprintf(stderr, "(display-launcher) VNC server on port %u wants a "
+	      "password, not checking its framebuffer\n", port);
+      return 1;
+    }
+    return ret;
+  }
+
+
+  /*
+   * ClientInit, sharing the desktop with any other viewer, and the
+   * ServerInit reply with the framebuffer's size and name.
+   */
+
+  msg[0] = 1;
+  if((write_full(fd, msg, 1) < 0) || (read_full(fd, init, 24) < 0))
+    goto not_ready;
+
+  memcpy(&width, init, 2);
+  memcpy(&height, init + 2, 2);
+  memcpy(&name_len, init + 20, 4);
+  width = ntohs(width);
+  height = ntohs(height);
+  name_len = ntohl(name_len);
+
+  while(name_len > 0) {
+    size_t n = (name_len > sizeof(msg)) ? sizeof(msg) : name_len;
+    if(read_full(fd, msg, n) < 0)
+      goto not_ready;
+    name_len -= n;
+  }
+
+  if((width == 0) || (height == 0))
+    goto not_ready;
+
+
+  /*
+   * Ask for 32-bit true colour pixels, raw encoding, and the whole
+   * framebuffer.
+   */
+
+  memset(msg, 0, sizeof(msg));
+  msg[0] = 0;                        /* SetPixelFormat */
+  msg[4] = 32;                       /* bits per pixel */
+  msg[5] = 24;                       /* depth */
+  msg[6] = 0;                        /* little endian */
+  msg[7] = 1;                        /* true colour */
+  msg[8] = 0; msg[9] = 255;          /* red, green, blue maximum */
+  msg[10] = 0; msg[11] = 255;
+  msg[12] = 0; msg[13] = 255;
+  msg[14] = 16;                      /* red, green, blue shift */
+  msg[15] = 8;
+  msg[16] = 0;
+  if(write_full(fd, msg, 20) < 0)
+    goto not_ready;
+
+  memset(msg, 0, 8);
+  msg[0] = 2;                        /* SetEncodings, just raw */
+  msg[3] = 1;
+  if(write_full(fd, msg, 8) < 0)
+    goto not_ready;
+
+  memset(msg, 0, 10);
+  msg[0] = 3;                        /* FramebufferUpdateRequest */
+  msg[1] = 0;                        /* not incremental */
+  msg[6] = width >> 8;
+  msg[7] = width & 0xff;
+  msg[8] = height >> 8;
+  msg[9] = height & 0xff;
+  if(write_full(fd, msg, 10) < 0)
+    goto not_ready;
+
+
+  /*
+   * Read what comes back until the whole framebuffer has been seen,
+   * skipping bells and cut text.
+   */
+
+  while(covered < (long long) width * height) {
+    uint8_t type;
+    uint32_t len;
+
+    if(read_full(fd, &type, 1) < 0)
+      goto not_ready;
+
+    switch(type) {
+    case 0:
+      ret = rfb_read_update(fd, &first, &have_first, &covered);
+      if(ret == -1)
+	goto not_ready;
+      if(ret != 0) {
+	close(fd);
+	return (ret > 0) ? 1 : -1;
+      }
+      break;
+
+    case 2:
+      break;
+
+    case 3:
+      if((read_full(fd, msg, 3) < 0) || (read_full(fd, &len, 4) < 0))
+	goto not_ready;
+      for(len = ntohl(len); len > 0; ) {
+	size_t n = (len > sizeof(msg)) ? sizeof(msg) : len;
+	if(read_full(fd, msg, n) < 0)
+	  goto not_ready;
+	len -= n;
+      }
+      break;
+
+    default:
+      close(fd);
+      return -1;
+    }
+  }
+
+  /* All one colour: nothing drawn yet. */
+
+ not_ready:
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,64 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PROBE_H_
+#define _PROBE_H_
+
+
+/*
+ * Readiness probes tell when a service a launch brings up is really
+ * usable, rather than guessing with a fixed wait.  A probe checks once,
+ * returning 1 if the service at the port on the loopback interface is
+ * ready, 0 if it isn't yet, and -1 if it never will be.
+ */
+
+typedef int (*probe_check_t)(unsigned short port, void *arg);
+
+typedef struct {
+  const char    *name;
+  probe_check_t  check;
+  void          *arg;
+} probe_t;
+
+
+/*
+ * Run the probes in order until each has passed, retrying the one that
+ * hasn't every PROBE_INTERVAL_MS.  Returns 0 once all passed, 1 if
+ * timeout_ms ran out first, and -1 if a probe failed for good or
+ * cancelled(arg) became true.
+ */
+
+#define PROBE_INTERVAL_MS 20
+
+int	probe_wait(const probe_t *probes, int num_probes, unsigned short port,
+		   int timeout_ms, int (*cancelled)(void *), void *arg);
+
+
+/*
+ * Probes of a VNC server.  probe_rfb_handshake() passes once the server
+ * negotiates the protocol version and security type, and hangs up
+ * before initialisation, so that x11vnc doesn't count it as a viewer.
+ * probe_rfb_framebuffer() connects as a viewer and passes once the
+ * first full framebuffer update is not all one colour.
+ */
+
+int	probe_rfb_handshake(unsigned short port, void *arg);
+int	probe_rfb_framebuffer(unsigned short port, void *arg);
+
+#endif
@@ -0,0 +1,142 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ranges.h"
+
+
+void
+range_set_init(range_set_t *set) {
+  memset(set, 0, sizeof(range_set_t));
+}
+
+
+void
+range_set_clear(range_set_t *set) {
+  free(set->ranges);
+  range_set_init(set);
+}
+
+
+/*
+ * Add [offset, offset+length) to the set, merging it with any ranges it
+ * overlaps or touches.  Returns -1 if memory runs out.
+ */
+
+int
+range_set_add(range_set_t *set, int offset, int length) {
+  int i, j, end;
+
+  if(length <= 0)
+    return 0;
+
+  end = offset + length;
+
+
+  /* Find the first range which ends at or after our start. */
+
+  for(i=0; i<set->count; i++)
+    if(set->ranges[i].offset + set->ranges[i].length >= offset)
+      break;
+
+
+  /* Swallow every range which starts at or before our end. */
+
+  for(j=i; j<set->count; j++) {
+    int r_end = set->ranges[j].offset + set->ranges[j].length;
+
+    if(set->ranges[j].offset > end)
+      break;
+
+    if(set->ranges[j].offset < offset)
+      offset = set->ranges[j].offset;
+    if(r_end > end)
+      end = r_end;
+  }
+
+  if(j == i) {                  /* Nothing merged, insert a new range. */
+    if(set->count == set->capacity) {
+      int capacity = set->capacity ? set->capacity * 2 : 8;
+      byte_range_t *r;
+
+      r = (byte_range_t *)realloc(set->ranges, 
+				  capacity * sizeof(byte_range_t));
+      if(r == NULL) {
+	perror("realloc");
+	return -1;
+      }
+
+      set->ranges = r;
+      set->capacity = capacity;
+    }
+
+    memmove(&set->ranges[i+1], &set->ranges[i], 
+	    (set->count - i) * sizeof(byte_range_t));
+    set->count++;
+  }
+  else if(j > i + 1) {          /* Collapse ranges i..j-1 into range i. */
+    memmove(&set->ranges[i+1], &set->ranges[j],
+	    (set->count - j) * sizeof(byte_range_t));
+    set->count -= j - i - 1;
+  }
+
+  set->ranges[i].offset = offset;
+  set->ranges[i].length = end - offset;
+
+  return 0;
+}
+
+
+int
+range_set_covers(range_set_t *set, int offset, int length) {
+  int i;
+
+  for(i=0; i<set->count; i++)
+    if((set->ranges[i].offset <= offset) && 
+       (set->ranges[i].offset + set->ranges[i].length >= offset + length))
+      return 1;
+
+  return 0;
+}
+
+
+int
+range_set_total(range_set_t *set) {
+  int i, total = 0;
+
+  for(i=0; i<set->count; i++)
+    total += set->ranges[i].length;
+
+  return total;
+}
+
+
+/*
+ * Length of the unbroken run of bytes starting at offset zero.
+ */
+
+int
+range_set_prefix(range_set_t *set) {
+  if((set->count == 0) || (set->ranges[0].offset != 0))
+    return 0;
+
+  return set->ranges[0].length;
+}
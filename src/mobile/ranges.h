@@ -0,0 +1,47 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RANGES_H_
+#define _RANGES_H_
+
+
+/*
+ * A set of byte ranges of a file, kept sorted and merged, recording
+ * which parts of a transfer have arrived.
+ */
+
+typedef struct {
+  int offset;
+  int length;
+} byte_range_t;
+
+typedef struct {
+  int           count;
+  int           capacity;
+  byte_range_t *ranges;
+} range_set_t;
+
+void	range_set_init(range_set_t *set);
+void	range_set_clear(range_set_t *set);
+int	range_set_add(range_set_t *set, int offset, int length);
+int	range_set_covers(range_set_t *set, int offset, int length);
+int	range_set_total(range_set_t *set);
+int	range_set_prefix(range_set_t *set);
+
+#endif
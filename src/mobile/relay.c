@@ -0,0 +1,646 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "relay.h"
+
+
+/*
+ * Size asked for each direction's pipe, which bounds how much the relay
+ * holds for a slow receiver.  Smaller is used if the system won't allow
+ * it.
+ */
+
+#define RELAY_PIPE_SIZE (256 * 1024)
+
+
+/*
+ * Pipes' worth of data one direction may move per wakeup before the
+ * relay turns to other tunnels, so one busy tunnel can't starve them.
+ */
+
+#define RELAY_BURST_PIPES 4
+
+#define RELAY_MAX_EVENTS 64
+
+
+typedef struct tunnel tunnel_t;
+
+typedef struct {
+  tunnel_t *tunnel;
+  int       fd;
+} endpoint_t;
+
+typedef struct {
+  int            pipefd[2];
+  size_t         capacity;
+  size_t         pending;         /* Bytes in the pipe. */
+  int            eof;             /* The source has stopped sending. */
+  int            shut;            /* ...and the destination was told. */
+  struct timeval since;           /* When the pipe last stopped being empty. */
+} direction_t;
+
+struct tunnel {
+  int            id;
+  endpoint_t     end[2];
+  direction_t    dir[2];          /* dir[d] runs from end[d] to end[!d]. */
+  int            closed;
+  int            status;
+  int            again;           /* Stopped short, service it again. */
+  tunnel_stats_t stats;
+  tunnel_done_t  done;
+  void          *arg;
+  tunnel_t      *next;
+};
+
+struct relay {
+  pthread_mutex_t mutex;
+  pthread_t       thread;
+  int             epfd;
+  int             wakefd;
+  int             stopping;
+  int             next_id;
+  tunnel_t       *tunnels;
+};
+
+
+static unsigned long long
+elapsed_us(struct timeval *from, struct timeval *to) {
+  return (to->tv_sec - from->tv_sec) * 1000000ULL +
+    (to->tv_usec - from->tv_usec);
+}
+
+
+static void
+finish_tunnel(tunnel_t *t, int status) {
+  int i;
+
+  if(t->closed)
+    return;
+
+  t->closed = 1;
+  t->status = status;
+  gettimeofday(&t->stats.closed, NULL);
+
+  for(i=0; i<2; i++) {
+    close(t->end[i].fd);
+    close(t->dir[i].pipefd[0]);
+    close(t->dir[i].pipefd[1]);
+  }
+}
+
+
+/*
+ * Whether an error on a socket only means its peer went away.
+ */
+
+static int
+peer_gone(int err) {
+  return (err == EPIPE) || (err == ECONNRESET);
+}
+
+
+/*
+ * Move what one direction can without blocking, up to its share of
+ * this wakeup.  Returns -1 on an error, with errno set.
+ */
+
+static int
+pump(tunnel_t *t, int d) {
+  direction_t *dir = &t->dir[d];
+  int src = t->end[d].fd, dst = t->end[!d].fd;
+  size_t budget = RELAY_BURST_PIPES * dir->capacity;
+  ssize_t n;
+
+  while(budget > 0) {
+    int moved = 0;
+
+    if(!dir->eof && (dir->pending < dir->capacity)) {
+      n = splice(src, NULL, dir->pipefd[1], NULL,
+		 dir->capacity - dir->pending,
+		 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if(n > 0) {
+	if(dir->pending == 0)
+	  gettimeofday(&dir->since, NULL);
+	dir->pending += n;
+	moved = 1;
+      }
+      else if(n == 0) {
+	dir->eof = 1;
+      }
+      else if(errno == EINTR) {
+	continue;
+      }
+      else if(errno != EAGAIN) {
+	return -1;
+      }
+    }
+
+    if(dir->pending > 0) {
+      n = splice(dir->pipefd[0], NULL, dst, NULL, dir->pending,
+		 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if(n > 0) {
+	dir->pending -= n;
+	t->stats.bytes[d] += n;
+	budget = (budget > (size_t) n) ? budget - n : 0;
+	moved = 1;
+
+	if(dir->pending == 0) {
+	  struct timeval now;
+	  unsigned long long us;
+
+	  gettimeofday(&now, NULL);
+	  us = elapsed_us(&dir->since, &now);
+	  t->stats.bursts[d]++;
+	  t->stats.latency_us[d] += us;
+	  if(us > t->stats.max_latency_us[d])
+	    t->stats.max_latency_us[d] = us;
+	}
+      }
+      else if(n < 0) {
+	if(errno == EINTR)
+	  continue;
+	if(errno != EAGAIN)
+	  return -1;
+      }
+    }
+
+    if(!moved)
+      break;
+  }
+
+  if(budget == 0)
+    t->again = 1;
+
+
+  /*
+   * Pass on the end of the stream once all that came before it has
+   * been delivered.
+   */
+
+  if(dir->eof && (dir->pending == 0) && !dir->shut) {
+    if((shutdown(dst, SHUT_WR) < 0) && (errno != ENOTCONN))
+      return -1;
+    dir->shut = 1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Drain both directions of a tunnel, and close it once both are done.
+ */
+
+static void
+service_tunnel(tunnel_t *t) {
+  int d;
+
+  t->again = 0;
+
+  for(d=0; d<2; d++)
+    if(pump(t, d) < 0) {
+      if(!peer_gone(errno))
+	perror("(relay) splice");
+      finish_tunnel(t, peer_gone(errno) ? 0 : -1);
+      return;
+    }
+
+  if(t->dir[0].shut && t->dir[1].shut)
+    finish_tunnel(t, 0);
+}
+
+
+static void
+socket_error(tunnel_t *t, int fd) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  if((getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) || (err == 0))
+    return;
+
+  if(!peer_gone(err))
+    fprintf(stderr, "(relay) socket error: %s\n", strerror(err));
+  finish_tunnel(t, peer_gone(err) ? 0 : -1);
+}
+
+
+static void *
+relay_thread(void *arg) {
+  relay_t *relay = (relay_t *)arg;
+  struct epoll_event events[RELAY_MAX_EVENTS];
+  int i, n, timeout = -1;
+
+  while(1) {
+    tunnel_t *t, **tp, *finished = NULL;
+
+    n = epoll_wait(relay->epfd, events, RELAY_MAX_EVENTS, timeout);
+    if(n < 0) {
+      if(errno == EINTR)
+	continue;
+      perror("epoll_wait");
+      break;
+    }
+
+    pthread_mutex_lock(&relay->mutex);
+
+    if(relay->stopping) {
+      pthread_mutex_unlock(&relay->mutex);
+      break;
+    }
+
+    for(i=0; i<n; i++) {
+      endpoint_t *e = (endpoint_t *)events[i].data.ptr;
+      uint64_t count;
+
+      if(e == NULL) {
+	if(read(relay->wakefd, &count, sizeof(count)) < 0)
+	  perror("read");
+	continue;
+      }
+
+      t = e->tunnel;
+      if(t->closed)
+	continue;
+
+      if(events[i].events & EPOLLERR)
+	socket_error(t, e->fd);
+      if(!t->closed)
+	service_tunnel(t);
+    }
+
+
+    /*
+     * Service the tunnels which had more to move than their share of
+     * the last wakeup.  Their sockets won't signal again until there is
+     * something new, so keep polling without waiting until they're
+     * caught up.
+     */
+
+    timeout = -1;
+    for(t = relay->tunnels; t != NULL; t = t->next)
+      if(t->again && !t->closed) {
+	service_tunnel(t);
+	if(t->again)
+	  timeout = 0;
+      }
+
+    tp = &relay->tunnels;
+    while(*tp != NULL) {
+      t = *tp;
+      if(t->closed) {
+	*tp = t->next;
+	t->next = finished;
+	finished = t;
+      }
+      else
+	tp = &t->next;
+    }
+
+    pthread_mutex_unlock(&relay->mutex);
+
+    while(finished != NULL) {
+      t = finished;
+      finished = t->next;
+      if(t->done != NULL)
+	t->done(t->status, &t->stats, t->arg);
+      free(t);
+    }
+  }
+
+  return NULL;
+}
+
+
+relay_t *
+relay_create(void) {
+  relay_t *relay;
+  struct epoll_event ev;
+
+  relay = (relay_t *)calloc(1, sizeof(relay_t));
+  if(relay == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+
+  relay->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if(relay->epfd < 0) {
+    perror("epoll_create1");
+    free(relay);
+    return NULL;
+  }
+
+  relay->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if(relay->wakefd < 0) {
+    perror("eventfd");
+    close(relay->epfd);
+    free(relay);
+    return NULL;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if(epoll_ctl(relay->epfd, EPOLL_CTL_ADD, relay->wakefd, &ev) < 0) {
+    perror("epoll_ctl");
+    goto fail;
+  }
+
+  pthread_mutex_init(&relay->mutex, NULL);
+  relay->next_id = 1;
+
+  if(pthread_create(&relay->thread, NULL, relay_thread, relay) != 0) {
+    fprintf(stderr, "(relay) failed creating thread\n");
+    pthread_mutex_destroy(&relay->mutex);
+    goto fail;
+  }
+
+  return relay;
+
+ fail:
+  close(relay->wakefd);
+  close(relay->epfd);
+  free(relay);
+  return NULL;
+}
+
+
+/*
+ * Stop the relay's thread and close whatever tunnels remain, which are
+ * reported as failed.
+ */
+
+void
+relay_destroy(relay_t *relay) {
+  uint64_t one = 1;
+  tunnel_t *t;
+
+  if(relay == NULL)
+    return;
+
+  pthread_mutex_lock(&relay->mutex);
+  relay->stopping = 1;
+  pthread_mutex_unlock(&relay->mutex);
+
+  if(write(relay->wakefd, &one, sizeof(one)) < 0)
+    perror("write");
+  pthread_join(relay->thread, NULL);
+
+  while(relay->tunnels != NULL) {
+    t = relay->tunnels;
+    relay->tunnels = t->next;
+    finish_tunnel(t, -1);
+    if(t->done != NULL)
+      t->done(t->status, &t->stats, t->arg);
+    free(t);
+  }
+
+  close(relay->wakefd);
+  close(relay->epfd);
+  pthread_mutex_destroy(&relay->mutex);
+  free(relay);
+}
+
+
+static int
+open_direction(direction_t *dir) {
+  int size;
+
+  if(pipe2(dir->pipefd, O_NONBLOCK | O_CLOEXEC) < 0) {
+    perror("pipe2");
+    return -1;
+  }
+
+  fcntl(dir->pipefd[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+  size = fcntl(dir->pipefd[1], F_GETPIPE_SZ);
+  dir->capacity = (size > 0) ? size : 65536;
+
+  return 0;
+}
+
+
+/*
+ * Start relaying between two connected sockets, which now belong to
+ * the relay.  Returns the tunnel's ID, or -1 if it couldn't be set up,
+ * in which case the sockets are closed and done is not called.
+ */
+
+int
+relay_add(relay_t *relay, int sock1, int sock2, tunnel_done_t done,
+	  void *arg) {
+  struct epoll_event ev;
+  tunnel_t *t;
+  int i, id;
+
+  t = (tunnel_t *)calloc(1, sizeof(tunnel_t));
+  if(t == NULL) {
+    perror("calloc");
+    close(sock1);
+    close(sock2);
+    return -1;
+  }
+
+  t->end[0].fd = sock1;
+  t->end[1].fd = sock2;
+  t->dir[0].pipefd[0] = t->dir[0].pipefd[1] = -1;
+  t->dir[1].pipefd[0] = t->dir[1].pipefd[1] = -1;
+  t->done = done;
+  t->arg = arg;
+  gettimeofday(&t->stats.opened, NULL);
+
+  for(i=0; i<2; i++) {
+    t->end[i].tunnel = t;
+    if((fcntl(t->end[i].fd, F_SETFL,
+	      fcntl(t->end[i].fd, F_GETFL) | O_NONBLOCK) < 0) ||
+       (open_direction(&t->dir[i]) < 0))
+      goto fail;
+  }
+
+  pthread_mutex_lock(&relay->mutex);
+
+  t->id = id = relay->next_id++;
+  t->next = relay->tunnels;
+  relay->tunnels = t;
+
+
+  /*
+   * Edge triggered, since every wakeup moves all it can in both
+   * directions, and an empty pipe is refilled by the same wakeup that
+   * emptied it.
+   */
+
+  for(i=0; i<2; i++) {
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = &t->end[i];
+    if(epoll_ctl(relay->epfd, EPOLL_CTL_ADD, t->end[i].fd, &ev) < 0) {
+      perror("epoll_ctl");
+      relay->tunnels = t->next;
+      if(i > 0)
+	epoll_ctl(relay->epfd, EPOLL_CTL_DEL, t->end[0].fd, NULL);
+      pthread_mutex_unlock(&relay->mutex);
+      goto fail;
+    }
+  }
+
+  pthread_mutex_unlock(&relay->mutex);
+
+  return id;
+
+ fail:
+  finish_tunnel(t, -1);
+  free(t);
+  return -1;
+}
+
+
+/*
+ * Copy out what a tunnel has carried so far.  Returns -1 if it is over.
+ */
+
+int
+relay_stats(relay_t *relay, int tunnel, tunnel_stats_t *stats) {
+  tunnel_t *t;
+  int ret = -1;
+
+  pthread_mutex_lock(&relay->mutex);
+  for(t = relay->tunnels; t != NULL; t = t->next)
+    if((t->id == tunnel) && !t->closed) {
+      *stats = t->stats;
+      ret = 0;
+      break;
+    }
+  pthread_mutex_unlock(&relay->mutex);
+
+  return ret;
+}
+
+
+static pthread_once_t default_relay_once = PTHREAD_ONCE_INIT;
+static relay_t       *default_relay = NULL;
+
+static void
+create_default_relay(void) {
+  default_relay = relay_create();
+}
+
+
+relay_t *
+relay_default(void) {
+  pthread_once(&default_relay_once, create_default_relay);
+
+  return default_relay;
+}
+
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t  over;
+  int             done;
+  int             status;
+  tunnel_stats_t  stats;
+} tunnel_wait_t;
+
+
+static void
+tunnel_over(int status, tunnel_stats_t *stats, void *arg) {
+  tunnel_wait_t *w = (tunnel_wait_t *)arg;
+
+  pthread_mutex_lock(&w->mutex);
+  w->status = status;
+  w->stats = *stats;
+  w->done = 1;
+  pthread_cond_signal(&w->over);
+  pthread_mutex_unlock(&w->mutex);
+}
+
+
+int
+local_tunnel_stats(int sock1, int sock2, tunnel_stats_t *stats) {
+  relay_t *relay;
+  tunnel_wait_t w;
+  int d;
+
+  relay = relay_default();
+  if(relay == NULL) {
+    close(sock1);
+    close(sock2);
+    return -1;
+  }
+
+  fprintf(stderr, "Tunneling between fd=%d and fd=%d\n", sock1, sock2);
+
+  memset(&w, 0, sizeof(w));
+  pthread_mutex_init(&w.mutex, NULL);
+  pthread_cond_init(&w.over, NULL);
+
+  if(relay_add(relay, sock1, sock2, tunnel_over, &w) < 0) {
+    pthread_mutex_destroy(&w.mutex);
+    pthread_cond_destroy(&w.over);
+    return -1;
+  }
+
+  pthread_mutex_lock(&w.mutex);
+  while(!w.done)
+    pthread_cond_wait(&w.over, &w.mutex);
+  pthread_mutex_unlock(&w.mutex);
+
+  pthread_mutex_destroy(&w.mutex);
+  pthread_cond_destroy(&w.over);
+
+  fprintf(stderr, "(launcher-tunnel) Tunnel between fd=%d and fd=%d "
+	  "closed after %.3f s%s\n", sock1, sock2,
+	  elapsed_us(&w.stats.opened, &w.stats.closed) / 1e6,
+	  (w.status < 0) ? " on an error." : ".");
+  for(d=0; d<2; d++)
+    fprintf(stderr, "\t%s: %llu bytes in %llu bursts, held %llu us on "
+	    "average, %llu us at most\n", (d == TUNNEL_OUT) ? "out" : "in",
+	    w.stats.bytes[d], w.stats.bursts[d],
+	    w.stats.bursts[d] ? w.stats.latency_us[d] / w.stats.bursts[d] : 0,
+	    w.stats.max_latency_us[d]);
+
+  if(stats != NULL)
+    *stats = w.stats;
+
+  return w.status;
+}
+
+
+/*
+ * Relay data between two sockets until both sides have closed, then
+ * close both.  Returns 0 on a clean close and -1 on an error.
+ */
+
+int
+local_tunnel(int sock1, int sock2) {
+  return local_tunnel_stats(sock1, sock2, NULL);
+}
@@ -0,0 +1,90 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RELAY_H_
+#define _RELAY_H_
+
+#include <sys/time.h>
+
+
+/*
+ * A relay moves data both ways between the two sockets of each of its
+ * tunnels, all from one thread waiting in epoll.  Data is spliced from
+ * one socket into a pipe and from the pipe into the other socket, so it
+ * never passes through user space.
+ *
+ * When one side stops sending, the other side's write half is shut down
+ * once everything it sent has been delivered, and the tunnel stays up
+ * for the other direction.  The tunnel is over, and both sockets closed,
+ * once both directions have finished or either fails.
+ */
+
+typedef struct relay relay_t;
+
+
+/*
+ * What a tunnel has carried.  Direction 0 is from the first socket to
+ * the second, direction 1 the other way.  Latency is the time from data
+ * becoming readable on one socket until the relay has written all it had
+ * to the other.
+ */
+
+#define TUNNEL_OUT 0
+#define TUNNEL_IN  1
+
+typedef struct {
+  unsigned long long bytes[2];
+  unsigned long long bursts[2];          /* Times data had to be moved. */
+  unsigned long long latency_us[2];      /* Summed over the bursts. */
+  unsigned long long max_latency_us[2];
+  struct timeval     opened;
+  struct timeval     closed;
+} tunnel_stats_t;
+
+
+/*
+ * Called on the relay's thread once a tunnel is over, with 0 if both
+ * directions finished and -1 if it failed.
+ */
+
+typedef void (*tunnel_done_t)(int status, tunnel_stats_t *stats, void *arg);
+
+relay_t *	relay_create(void);
+void		relay_destroy(relay_t *relay);
+int		relay_add(relay_t *relay, int sock1, int sock2,
+			  tunnel_done_t done, void *arg);
+int		relay_stats(relay_t *relay, int tunnel, tunnel_stats_t *stats);
+
+
+/*
+ * The relay shared by every tunnel of the process, started on first use.
+ */
+
+relay_t *	relay_default(void);
+
+
+/*
+ * Tunnel between two sockets through the shared relay, returning once
+ * the tunnel is over with its status.  Fills in stats if it isn't NULL.
+ */
+
+int		local_tunnel(int sock1, int sock2);
+int		local_tunnel_stats(int sock1, int sock2, tunnel_stats_t *stats);
+
+#endif
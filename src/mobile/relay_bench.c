@@ -0,0 +1,380 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * relay_bench
+ *
+ * Measures the tunnel relay over loopback TCP: the throughput of
+ * several tunnels streaming at once, and the round trip time of small
+ * messages through one tunnel.  With -m select, the same is measured
+ * for a relay thread per tunnel copying through a 4 KB buffer after
+ * select(), as local_tunnel() used to, for comparison.
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "relay.h"
+
+
+#define BENCH_BUFFER_SIZE (256 * 1024)
+#define MAX_TUNNELS       256
+
+static int use_select = 0;
+
+
+static double
+now(void) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+/*
+ * Connect a pair of loopback sockets through the listener.
+ */
+
+static int
+loopback_pair(int listenfd, int fds[2]) {
+  struct sockaddr_in sa;
+  socklen_t len = sizeof(sa);
+  int one = 1;
+
+  if(getsockname(listenfd, (struct sockaddr *) &sa, &len) < 0)
+    return -1;
+
+  fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+  if((fds[0] < 0) ||
+     (connect(fds[0], (struct sockaddr *) &sa, sizeof(sa)) < 0))
+    return -1;
+
+  fds[1] = accept(listenfd, NULL, NULL);
+  if(fds[1] < 0)
+    return -1;
+
+  setsockopt(fds[0], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  setsockopt(fds[1], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  return 0;
+}
+
+
+/*
+ * The old local_tunnel(): one direction per select(), 4 KB at a time.
+ */
+
+static void *
+select_tunnel_thread(void *arg) {
+  int *socks = (int *)arg;
+  char buf[4096];
+
+  while(1) {
+    fd_set readfds;
+    int in, out, n;
+
+    FD_ZERO(&readfds);
+    FD_SET(socks[0], &readfds);
+    FD_SET(socks[1], &readfds);
+
+    if(select(((socks[0] > socks[1]) ? socks[0] : socks[1]) + 1,
+	      &readfds, NULL, NULL, NULL) < 0)
+      break;
+
+    in = FD_ISSET(socks[0], &readfds) ? socks[0] : socks[1];
+    out = (in == socks[0]) ? socks[1] : socks[0];
+
+    n = read(in, buf, sizeof(buf));
+    if((n <= 0) || (write(out, buf, n) != n))
+      break;
+  }
+
+  close(socks[0]);
+  close(socks[1]);
+  free(socks);
+
+  return NULL;
+}
+
+
+/*
+ * Tunnel between the inner ends of two socket pairs, leaving the outer
+ * ends for the benchmark to talk through.
+ */
+
+static int
+open_tunnel(int listenfd, int *near, int *far) {
+  int a[2], b[2];
+
+  if((loopback_pair(listenfd, a) < 0) || (loopback_pair(listenfd, b) < 0)) {
+    perror("loopback_pair");
+    return -1;
+  }
+
+  *near = a[0];
+  *far = b[1];
+
+  if(use_select) {
+    int *socks = (int *)malloc(2 * sizeof(int));
+    pthread_t tid;
+
+    socks[0] = a[1];
+    socks[1] = b[0];
+    if(pthread_create(&tid, NULL, select_tunnel_thread, socks) != 0)
+      return -1;
+    pthread_detach(tid);
+    return 0;
+  }
+
+  return (relay_add(relay_default(), a[1], b[0], NULL, NULL) < 0) ? -1 : 0;
+}
+
+
+typedef struct {
+  int       fd;
+  long long bytes;
+} stream_args_t;
+
+
+static void *
+stream_writer(void *arg) {
+  stream_args_t *args = (stream_args_t *)arg;
+  char *buf = calloc(1, BENCH_BUFFER_SIZE);
+  long long left = args->bytes;
+
+  while(left > 0) {
+    ssize_t n = write(args->fd, buf,
+		      (left > BENCH_BUFFER_SIZE) ? BENCH_BUFFER_SIZE : left);
+    if(n <= 0) {
+      perror("write");
+      break;
+    }
+    left -= n;
+  }
+
+  shutdown(args->fd, SHUT_WR);
+  free(buf);
+
+  return NULL;
+}
+
+
+static void *
+stream_reader(void *arg) {
+  stream_args_t *args = (stream_args_t *)arg;
+  char *buf = malloc(BENCH_BUFFER_SIZE);
+  ssize_t n;
+
+  args->bytes = 0;
+  while((n = read(args->fd, buf, BENCH_BUFFER_SIZE)) > 0)
+    args->bytes += n;
+
+  free(buf);
+
+  return NULL;
+}
+
+
+/*
+ * Stream "megabytes" through each of "tunnels" tunnels at once.
+ */
+
+static int
+bench_throughput(int listenfd, int tunnels, int megabytes) {
+  stream_args_t writers[MAX_TUNNELS], readers[MAX_TUNNELS];
+  pthread_t wtid[MAX_TUNNELS], rtid[MAX_TUNNELS];
+  long long total = 0;
+  double start, secs;
+  int i;
+
+  for(i=0; i<tunnels; i++) {
+    if(open_tunnel(listenfd, &writers[i].fd, &readers[i].fd) < 0)
+      return -1;
+    writers[i].bytes = (long long) megabytes << 20;
+  }
+
+  start = now();
+
+  for(i=0; i<tunnels; i++) {
+    pthread_create(&rtid[i], NULL, stream_reader, &readers[i]);
+    pthread_create(&wtid[i], NULL, stream_writer, &writers[i]);
+  }
+
+  for(i=0; i<tunnels; i++) {
+    pthread_join(wtid[i], NULL);
+    pthread_join(rtid[i], NULL);
+    total += readers[i].bytes;
+    close(writers[i].fd);
+    close(readers[i].fd);
+  }
+
+  secs = now() - start;
+
+  if(total != ((long long) megabytes << 20) * tunnels) {
+    fprintf(stderr, "relay_bench: %lld bytes went missing\n",
+	    ((long long) megabytes << 20) * tunnels - total);
+    return -1;
+  }
+
+  printf("%-8s %8d %10d %12.1f\n", use_select ? "select" : "relay",
+	 tunnels, megabytes * tunnels, total / secs / 1048576);
+
+  return 0;
+}
+
+
+static void *
+echo_thread(void *arg) {
+  int fd = *(int *)arg;
+  char buf[4096];
+  ssize_t n;
+
+  while((n = read(fd, buf, sizeof(buf))) > 0)
+    if(write(fd, buf, n) != n)
+      break;
+
+  return NULL;
+}
+
+
+/*
+ * Bounce "rounds" messages of "size" bytes off an echo thread.
+ */
+
+static int
+bench_latency(int listenfd, int rounds, int size) {
+  char buf[4096];
+  pthread_t tid;
+  int near, far, i;
+  double start, secs;
+
+  if(size > (int) sizeof(buf))
+    size = sizeof(buf);
+
+  if(open_tunnel(listenfd, &near, &far) < 0)
+    return -1;
+
+  pthread_create(&tid, NULL, echo_thread, &far);
+
+  memset(buf, 0, sizeof(buf));
+  start = now();
+
+  for(i=0; i<rounds; i++) {
+    int got = 0;
+
+    if(write(near, buf, size) != size) {
+      perror("write");
+      return -1;
+    }
+    while(got < size) {
+      ssize_t n = read(near, buf + got, size - got);
+      if(n <= 0) {
+	perror("read");
+	return -1;
+      }
+      got += n;
+    }
+  }
+
+  secs = now() - start;
+
+  shutdown(near, SHUT_WR);
+  pthread_join(tid, NULL);
+  close(near);
+  close(far);
+
+  printf("%-8s %8d bytes %10.1f us per round trip\n",
+	 use_select ? "select" : "relay", size, secs * 1e6 / rounds);
+
+  return 0;
+}
+
+
+static void
+usage(void) {
+  printf("relay_bench [-m relay|select] [-t tunnels] [-s megabytes] "
+	 "[-r rounds]\n");
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  struct sockaddr_in sa;
+  int listenfd, opt, tunnels = 4, megabytes = 256, rounds = 10000;
+
+  while((opt = getopt(argc, argv, "m:t:s:r:h")) != -1) {
+    switch(opt) {
+    case 'm':
+      use_select = (strcmp(optarg, "select") == 0);
+      break;
+    case 't':
+      tunnels = atoi(optarg);
+      break;
+    case 's':
+      megabytes = atoi(optarg);
+      break;
+    case 'r':
+      rounds = atoi(optarg);
+      break;
+    default:
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if((tunnels < 1) || (tunnels > MAX_TUNNELS) || (megabytes < 1) ||
+     (rounds < 1)) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  listenfd = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if((listenfd < 0) || (bind(listenfd, (struct sockaddr *) &sa,
+			     sizeof(sa)) < 0) ||
+     (listen(listenfd, SOMAXCONN) < 0)) {
+    perror("listen");
+    exit(EXIT_FAILURE);
+  }
+
+  printf("%-8s %8s %10s %12s\n", "engine", "tunnels", "MB", "MB/s");
+  if(bench_throughput(listenfd, tunnels, megabytes) < 0)
+    exit(EXIT_FAILURE);
+
+  if(bench_latency(listenfd, rounds, 64) < 0)
+    exit(EXIT_FAILURE);
+
+  return 0;
+}
@@ -0,0 +1,237 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * rfb_stub
+ *
+ * Stands in for x11vnc where there is no X display: a VNC server on the
+ * loopback interface with a small framebuffer of raw 32-bit pixels and
+ * no password.  Like x11vnc, it prints PORT=<port> once it listens,
+ * which display_setup passes on to the display launcher.  The options
+ * display_setup gives x11vnc are accepted and ignored, except for
+ * -rfbport; without it, it listens on a port the kernel picks.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+#define RFB_STUB_WIDTH  64
+#define RFB_STUB_HEIGHT 48
+#define RFB_STUB_NAME   "kimberley"
+
+
+static int
+read_full(int fd, void *buf, size_t len) {
+  char *p = (char *)buf;
+
+  while(len > 0) {
+    ssize_t n = read(fd, p, len);
+    if(n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+
+static int
+write_full(int fd, const void *buf, size_t len) {
+  const char *p = (const char *)buf;
+
+  while(len > 0) {
+    ssize_t n = write(fd, p, len);
+    if(n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+
+static int
+send_framebuffer(int fd) {
+  static uint8_t update[16 + RFB_STUB_WIDTH * RFB_STUB_HEIGHT * 4];
+  uint32_t *pixels = (uint32_t *)(update + 16);
+  int i;
+
+  update[0] = 0;                     /* FramebufferUpdate */
+  update[3] = 1;                     /* one rectangle, */
+  update[8] = RFB_STUB_WIDTH >> 8;   /* all of it, */
+  update[9] = RFB_STUB_WIDTH & 0xff;
+  update[10] = RFB_STUB_HEIGHT >> 8;
+  update[11] = RFB_STUB_HEIGHT & 0xff;
+  /* in raw encoding, */
+
+  /* and not all one colour. */
+  for(i=0; i<RFB_STUB_WIDTH * RFB_STUB_HEIGHT; i++)
+    pixels[i] = (i * 2654435761u) & 0xffffff;
+
+  return write_full(fd, update, sizeof(update));
+}
+
+
+/*
+ * Serve one viewer: version 3.3, no security, then a framebuffer update
+ * for each request until it hangs up.
+ */
+
+static void
+serve(int fd) {
+  uint8_t msg[24], init[24] = { 0 };
+  uint32_t word = htonl(1), len;
+
+  if((write_full(fd, "RFB 003.003\n", 12) < 0) ||
+     (read_full(fd, msg, 12) < 0) ||
+     (write_full(fd, &word, 4) < 0) ||
+     (read_full(fd, msg, 1) < 0))
+    return;
+
+  init[0] = RFB_STUB_WIDTH >> 8;
+  init[1] = RFB_STUB_WIDTH & 0xff;
+  init[2] = RFB_STUB_HEIGHT >> 8;
+  init[3] = RFB_STUB_HEIGHT & 0xff;
+  init[4] = 32;                      /* bits per pixel */
+  init[5] = 24;                      /* depth */
+  init[7] = 1;                       /* true colour */
+  init[9] = 255;                     /* red, green, blue maximum */
+  init[11] = 255;
+  init[13] = 255;
+  init[14] = 16;                     /* red, green, blue shift */
+  init[15] = 8;
+  len = htonl(strlen(RFB_STUB_NAME));
+  memcpy(init + 20, &len, 4);
+
+  if((write_full(fd, init, sizeof(init)) < 0) ||
+     (write_full(fd, RFB_STUB_NAME, strlen(RFB_STUB_NAME)) < 0))
+    return;
+
+  while(read_full(fd, msg, 1) == 0) {
+    switch(msg[0]) {
+    case 0:                          /* SetPixelFormat */
+      if(read_full(fd, msg, 19) < 0)
+	return;
+      break;
+
+    case 2:                          /* SetEncodings */
+      if(read_full(fd, msg, 3) < 0)
+	return;
+      for(len = (msg[1] << 8) | msg[2]; len > 0; len--)
+	if(read_full(fd, msg, 4) < 0)
+	  return;
+      break;
+
+    case 3:                          /* FramebufferUpdateRequest */
+      if((read_full(fd, msg, 9) < 0) || (send_framebuffer(fd) < 0))
+	return;
+      break;
+
+    case 4:                          /* KeyEvent */
+      if(read_full(fd, msg, 7) < 0)
+	return;
+      break;
+
+    case 5:                          /* PointerEvent */
+      if(read_full(fd, msg, 5) < 0)
+	return;
+      break;
+
+    case 6:                          /* ClientCutText */
+      if(read_full(fd, msg, 7) < 0)
+	return;
+      memcpy(&len, msg + 3, 4);
+      for(len = ntohl(len); len > 0; len--)
+	if(read_full(fd, msg, 1) < 0)
+	  return;
+      break;
+
+    default:
+      return;
+    }
+  }
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  struct sockaddr_in sa;
+  socklen_t sa_len = sizeof(sa);
+  int listenfd, i, one = 1;
+  unsigned short port = 0;
+
+  for(i=1; i<argc; i++)
+    if((strcmp(argv[i], "-rfbport") == 0) && (i + 1 < argc))
+      port = atoi(argv[++i]);
+
+  signal(SIGCHLD, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  listenfd = socket(AF_INET, SOCK_STREAM, 0);
+  if((listenfd < 0) ||
+     (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one,
+		 sizeof(one)) < 0) ||
+     (bind(listenfd, (struct sockaddr *) &sa, sizeof(sa)) < 0) ||
+     (listen(listenfd, SOMAXCONN) < 0) ||
+     (getsockname(listenfd, (struct sockaddr *) &sa, &sa_len) < 0)) {
+    perror("(rfb-stub) listen");
+    exit(EXIT_FAILURE);
+  }
+
+  printf("PORT=%u\n", ntohs(sa.sin_port));
+  fflush(stdout);
+
+  while(1) {
+    int fd = accept(listenfd, NULL, NULL);
+
+    if(fd < 0) {
+      perror("(rfb-stub) accept");
+      continue;
+    }
+
+    /* The handshake is all small writes; don't hold them for acks. */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if(fork() == 0) {
+      close(listenfd);
+      serve(fd);
+      _exit(0);
+    }
+    close(fd);
+  }
+
+  return 0;
+}
@@ -0,0 +1,1063 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * rpc_bench
+ *
+ * Measures file transfers over the real Sun RPC stubs and transports:
+ * a file sent with pipelined send_partial calls, as the mobile launcher
+ * sends an overlay, and retrieved with retrieve_partial calls, for every
+ * combination of the chunk sizes, XDR record sizes and socket buffer
+ * sizes given (see transfer_tuning in common.h).  The display's side is
+ * served by setup_rpc_server() as in the display launcher, writing into
+ * a temporary file, but without sessions or a KCM.  With -a, each
+ * combination of record and socket buffer sizes also gets a send with
+ * its chunks and window planned from the link (see link_estimate.h).
+ *
+ * The connection runs over loopback TCP, or through a shaped link with
+ * -d and -r: a relay which delays everything by the given number of
+ * milliseconds each way, and holds it to the given rate.  The RPC layer
+ * sees the link's round trips, but TCP on either side of the relay
+ * still sees loopback, so the effect of socket buffers on a long link
+ * is better measured with the link shaped by netem.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "rpc_mobile_launcher.h"
+#include "buffer_pool.h"
+#include "common.h"
+#include "link_estimate.h"
+
+
+#define MAX_SIZES      16
+#define LINK_PACKET    (16 * 1024)
+
+static double link_delay = 0;     /* seconds, each way */
+static double link_rate = 0;      /* bytes per second, or 0 for no limit */
+
+
+static double
+now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * The display's side: one transfer at a time, into a temporary file.
+ */
+
+static int   data_fd = -1;
+static off_t data_size = 0;
+static off_t read_offset = 0;
+
+
+bool_t
+send_file_1_svc(char *filename, int size, int *result, struct svc_req *rqstp)
+{
+  (void)filename;
+  (void)rqstp;
+
+  data_size = size;
+  *result = (preallocate_file(data_fd, size) < 0) ? -1 : 1;
+
+  return TRUE;
+}
+
+
+bool_t
+send_window_1_svc(int window, int *result, struct svc_req *rqstp)
+{
+  (void)rqstp;
+
+  *result = (window > SEND_WINDOW_MAX) ? SEND_WINDOW_MAX : window;
+
+  return TRUE;
+}
+
+
+bool_t
+send_partial_1_svc(chunk part, int *result,  struct svc_req *rqstp)
+{
+  (void)part;
+  (void)result;
+  (void)rqstp;
+
+  return FALSE;
+}
+
+
+bool_t
+send_partial_at_1_svc(int offset, chunk part, int *result,  
+		      struct svc_req *rqstp)
+{
+  (void)rqstp;
+
+  *result = -1;
+
+  if((offset < 0) || (part.chunk_len > (u_int) (data_size - offset)))
+    return TRUE;
+
+  if(pwriten(data_fd, part.chunk_val, part.chunk_len, offset) < 0) {
+    perror("pwrite");
+    return TRUE;
+  }
+
+  *result = 0;
+
+  return TRUE;
+}
+
+
+bool_t
+retrieve_file_1_svc(char *filename, int *result,  struct svc_req *rqstp)
+{
+  (void)filename;
+  (void)rqstp;
+
+  read_offset = 0;
+  *result = data_size;
+
+  return TRUE;
+}
+
+
+bool_t
+retrieve_partial_1_svc(chunk *result,  struct svc_req *rqstp)
+{
+  ssize_t bytes_read;
+  size_t len = transfer_tuning()->chunk_size;
+
+  (void)rqstp;
+
+  memset((char *)result, 0, sizeof(chunk));
+
+  if(read_offset >= data_size)
+    return FALSE;
+
+  if(len > (size_t) (data_size - read_offset))
+    len = data_size - read_offset;
+
+  result->chunk_val = buffer_pool_get(chunk_buffer_pool());
+  if(result->chunk_val == NULL)
+    return FALSE;
+
+  bytes_read = pread(data_fd, result->chunk_val, len, read_offset);
+  if(bytes_read <= 0) {
+    buffer_pool_put(chunk_buffer_pool(), result->chunk_val);
+    result->chunk_val = NULL;
+    return FALSE;
+  }
+
+  result->chunk_len = bytes_read;
+  read_offset += bytes_read;
+
+  return TRUE;
+}
+
+
+int
+mobilelauncher_prog_1_freeresult(SVCXPRT *transp, xdrproc_t xdr_result,
+				 caddr_t result)
+{
+  (void)transp;
+
+  xdr_free (xdr_result, result);
+  return 1;
+}
+
+
+/*
+ * Nothing else is served; callers get a system error.
+ */
+
+bool_t
+load_vm_from_url_1_svc(char *vm_name, char *url, int *result,
+		       struct svc_req *rqstp)
+{
+  (void)vm_name;
+  (void)url;
+  (void)result;
+  (void)rqstp;
+
+  return FALSE;
+}
+
+bool_t
+load_vm_from_path_1_svc(char *vm_name, char *path, int *result,
+			struct svc_req *rqstp)
+{
+  (void)vm_name;
+  (void)path;
+  (void)result;
+  (void)rqstp;
+
+  return FALSE;
+}
+
+bool_t
+load_vm_from_attachment_1_svc(char *vm_name, char *file, int *result,
+			      struct svc_req *rqstp)
+{
+  (void)vm_name;
+  (void)file;
+  (void)result;
+  (void)rqstp;
+
+  return FALSE;
+}
+
+bool_t
+send_file_bulk_1_svc(char *filename, int size, int *result,
+		     struct svc_req *rqstp)
+{
+  (void)filename;
+  (void)size;
+  (void)result;
+  (void)rqstp;
+
+  return FALSE;
+}
+
+bool_t
+query_received_1_svc(int transfer_id, received_ranges *result,
+		     struct svc_req *rqstp)
+{
+  (void)transfer_id;
+  (void)result;
+  (void)rqstp;
+
+  return FALSE;
+}
+
+bool_t
+retrieve_file_from_1_svc(char *filename, int offset, int *result,
+			 struct svc_req *rqstp)
+{
+  (void)filename;
+  (void)offset;
+  (void)result;
+  (void)rqstp;
+
+  return FALSE;
+}
+
+bool_t
+have_chunks_1_svc(int transfer_id, chunk_manifest digests,
+		  received_ranges *result, struct svc_req *rqstp)
+{
+  (void)transfer_id;
+  (void)digests;
+  (void)result;
+  (void)rqstp;
+
+  return FALSE;
+}
+
+bool_t
+use_cached_overlay_1_svc(char *file, file_hash hash, int *result,
+			 struct svc_req *rqstp)
+{
+  (void)file;
+  (void)hash;
+  (void)result;
+  (void)rqstp;
+
+  return FALSE;
+}
+
+bool_t
+stream_vm_from_attachment_1_svc(char *vm_name, char *file, int *result,
+				struct svc_req *rqstp)
+{
+  (void)vm_name;
+  (void)file;
+  (void)result;
+  (void)rqstp;
+
+  return FALSE;
+}
+
+bool_t
+launch_vm_1_svc(char *vm_name, char *overlay, launch_source source,
+		int *result, struct svc_req *rqstp)
+{
+  (void)vm_name;
+  (void)overlay;
+  (void)source;
+  (void)result;
+  (void)rqstp;
+
+  return FALSE;
+}
+
+bool_t
+wait_status_1_svc(int handle, launch_status seen, int timeout,
+		  launch_status *result, struct svc_req *rqstp)
+{
+  (void)handle;
+  (void)seen;
+  (void)timeout;
+  (void)result;
+  (void)rqstp;
+
+  return FALSE;
+}
+
+bool_t
+clock_sync_1_svc(u_quad_t span, clock_reading *result, struct svc_req *rqstp)
+{
+  (void)span;
+  (void)result;
+  (void)rqstp;
+
+  return FALSE;
+}
+
+bool_t
+ping_1_svc(void *result, struct svc_req *rqstp)
+{
+  (void)result;
+  (void)rqstp;
+
+  return TRUE;
+}
+
+bool_t
+use_usb_cable_1_svc(int *result, struct svc_req *rqstp)
+{
+  (void)result;
+  (void)rqstp;
+
+  return FALSE;
+}
+
+bool_t
+use_persistent_state_1_svc(char *filename, int *result,
+			   struct svc_req *rqstp)
+{
+  (void)filename;
+  (void)result;
+  (void)rqstp;
+
+  return FALSE;
+}
+
+bool_t
+use_encryption_key_1_svc(char *filename, int *result, struct svc_req *rqstp)
+{
+  (void)filename;
+  (void)result;
+  (void)rqstp;
+
+  return FALSE;
+}
+
+bool_t
+end_usage_1_svc(int retrieve_state, char **result, struct svc_req *rqstp)
+{
+  (void)retrieve_state;
+  (void)result;
+  (void)rqstp;
+
+  return FALSE;
+}
+
+
+/*
+ * The shaped link.  Each direction has a reader, which stamps what it
+ * reads with the time it will have crossed the link, and a writer,
+ * which passes it on at that time.  The reader stops reading once the
+ * link holds twice its bandwidth-delay product, so that TCP's flow
+ * control sees a full link rather than an endless buffer.
+ */
+
+typedef struct packet {
+  double         due;
+  int            len;
+  struct packet *next;
+  char           data[LINK_PACKET];
+} packet_t;
+
+struct link;
+
+typedef struct {
+  int              in, out;
+  pthread_mutex_t  mutex;
+  pthread_cond_t   changed;
+  packet_t        *head, *tail;
+  long             queued, limit;
+  double           free_at;
+  int              eof;
+  struct link     *link;
+} link_end_t;
+
+typedef struct link {
+  link_end_t       ends[2];
+  int              running;
+} link_t;
+
+static pthread_mutex_t link_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void
+sleep_until(double when) {
+  struct timespec ts;
+
+  ts.tv_sec = (time_t) when;
+  ts.tv_nsec = (long) ((when - ts.tv_sec) * 1e9);
+
+  while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+
+static void *
+link_reader(void *arg) {
+  link_end_t *end = (link_end_t *)arg;
+
+  while(1) {
+    packet_t *p = (packet_t *)malloc(sizeof(packet_t));
+    double start;
+
+    p->len = read(end->in, p->data, LINK_PACKET);
+    if(p->len <= 0) {
+      free(p);
+      break;
+    }
+    p->next = NULL;
+
+    pthread_mutex_lock(&end->mutex);
+    while(end->queued >= end->limit)
+      pthread_cond_wait(&end->changed, &end->mutex);
+
+    start = now();
+    if(start < end->free_at)
+      start = end->free_at;
+    end->free_at = start + ((link_rate > 0) ? p->len / link_rate : 0);
+    p->due = end->free_at + link_delay;
+
+    if(end->tail != NULL)
+      end->tail->next = p;
+    else
+      end->head = p;
+    end->tail = p;
+    end->queued += p->len;
+
+    pthread_cond_broadcast(&end->changed);
+    pthread_mutex_unlock(&end->mutex);
+  }
+
+  pthread_mutex_lock(&end->mutex);
+  end->eof = 1;
+  pthread_cond_broadcast(&end->changed);
+  pthread_mutex_unlock(&end->mutex);
+
+  return NULL;
+}
+
+
+static void *
+link_writer(void *arg) {
+  link_end_t *end = (link_end_t *)arg;
+  link_t *link = end->link;
+  pthread_t tid;
+  int last, ok = 1;
+
+  pthread_create(&tid, NULL, link_reader, end);
+
+  while(1) {
+    packet_t *p;
+
+    pthread_mutex_lock(&end->mutex);
+    while((end->head == NULL) && !end->eof)
+      pthread_cond_wait(&end->changed, &end->mutex);
+    p = end->head;
+    pthread_mutex_unlock(&end->mutex);
+
+    if(p == NULL)
+      break;
+
+    /* Once the far end is gone, what still arrives is dropped. */
+    sleep_until(p->due);
+    if(ok)
+      ok = (writen(end->out, p->data, p->len) == p->len);
+
+    pthread_mutex_lock(&end->mutex);
+    end->head = p->next;
+    if(end->head == NULL)
+      end->tail = NULL;
+    end->queued -= p->len;
+    pthread_cond_broadcast(&end->changed);
+    pthread_mutex_unlock(&end->mutex);
+
+    free(p);
+  }
+
+  shutdown(end->out, SHUT_WR);
+  pthread_join(tid, NULL);
+
+
+  /*
+   * The second direction to finish closes the connections.
+   */
+
+  pthread_mutex_lock(&link_mutex);
+  last = (--link->running == 0);
+  pthread_mutex_unlock(&link_mutex);
+
+  if(last) {
+    close(link->ends[0].in);
+    close(link->ends[1].in);
+    free(link);
+  }
+
+  return NULL;
+}
+
+
+/*
+ * Relay between the sockets a and b through a shaped link.
+ */
+
+static void
+link_start(int a, int b) {
+  link_t *link = (link_t *)calloc(1, sizeof(link_t));
+  pthread_t tid;
+  int i;
+
+  link->running = 2;
+
+  for(i=0; i<2; i++) {
+    link_end_t *end = &link->ends[i];
+
+    end->in = (i == 0) ? a : b;
+    end->out = (i == 0) ? b : a;
+    end->limit = 2 * link_rate * link_delay;
+    if(end->limit < LINK_PACKET * 64)
+      end->limit = LINK_PACKET * 64;
+    end->link = link;
+    pthread_mutex_init(&end->mutex, NULL);
+    pthread_cond_init(&end->changed, NULL);
+  }
+
+  for(i=0; i<2; i++) {
+    pthread_create(&tid, NULL, link_writer, &link->ends[i]);
+    pthread_detach(tid);
+  }
+}
+
+
+static int
+loopback_connect(unsigned short port) {
+  struct sockaddr_in sa;
+  int fd;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if((fd < 0) || (connect(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0)) {
+    perror("connect");
+    if(fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+
+/*
+ * Connect to the display's side, through the shaped link if there is
+ * one, listening on "link_port".
+ */
+
+static int
+connect_to_server(unsigned short port, int link_listenfd,
+		  unsigned short link_port) {
+  int fd, near, far, one = 1;
+
+  if(link_listenfd < 0)
+    return loopback_connect(port);
+
+  fd = loopback_connect(link_port);
+  if(fd < 0)
+    return -1;
+
+  near = accept(link_listenfd, NULL, NULL);
+  far = loopback_connect(port);
+  if((near < 0) || (far < 0)) {
+    perror("rpc_bench: link");
+    close(fd);
+    return -1;
+  }
+
+  /* The relay writes whatever it has; don't hold it for acks. */
+  setsockopt(near, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  setsockopt(far, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  link_start(near, far);
+
+  return fd;
+}
+
+
+/*
+ * Send "size" bytes of the file "fd" as send_file_in_pieces() does,
+ * keeping a window of send_partial calls in flight.  Given a link
+ * estimate, the chunks and window are planned from it as they go.
+ */
+
+static int
+bench_send(CLIENT *clnt, int fd, int size, int window, link_estimate_t *link) {
+  int chunk_size = transfer_tuning()->chunk_size;
+  int offset = 0, calls = 0, ret = -1, max_window = window, buf_size;
+  long window_bytes = 0;
+  double window_start = 0;
+  char *buf;
+
+  if((send_file_1("rpc_bench", size, &ret, clnt) != RPC_SUCCESS) ||
+     (ret < 0) ||
+     (send_window_1(window, &max_window, clnt) != RPC_SUCCESS)) {
+    clnt_perror(clnt, "rpc_bench: starting send");
+    return -1;
+  }
+  window = max_window;
+
+  if(link != NULL) {
+    window = link_estimate_plan(link, max_window);
+    chunk_size = link->chunk_size;
+  }
+
+  buf_size = chunk_size;
+  buf = chunk_buffer_get(buf_size);
+  if(buf == NULL)
+    return -1;
+
+  while(offset < size) {
+    send_partial_at_1_argument arg;
+    enum clnt_stat retval;
+    int last;
+
+    arg.offset = offset;
+    arg.part.chunk_val = buf;
+    arg.part.chunk_len = pread(fd, buf, chunk_size, offset);
+    if((int) arg.part.chunk_len <= 0) {
+      perror("pread");
+      break;
+    }
+    last = (offset + (int) arg.part.chunk_len == size);
+
+    if(calls++ == 0)
+      window_start = now();
+    window_bytes += arg.part.chunk_len;
+
+    if((calls < window) && !last) {
+      retval = rpc_call_pipelined(clnt, send_partial_at,
+				  (xdrproc_t) xdr_send_partial_at_1_argument,
+				  (caddr_t) &arg,
+				  (xdrproc_t) xdr_int, (caddr_t) &ret);
+      ret = 0;
+    }
+    else
+      retval = send_partial_at_1(arg.offset, arg.part, &ret, clnt);
+
+    if((retval != RPC_SUCCESS) || (ret < 0)) {
+      clnt_perror(clnt, "rpc_bench: send_partial_at");
+      break;
+    }
+
+    offset += arg.part.chunk_len;
+
+    if((calls == window) || last) {
+      if(link != NULL) {
+	link_estimate_delivery(link, window_bytes, now() - window_start);
+	window = link_estimate_plan(link, max_window);
+	chunk_size = link->chunk_size;
+      }
+      if(chunk_size > buf_size) {
+	chunk_buffer_put(buf, buf_size);
+	buf_size = chunk_size;
+	buf = chunk_buffer_get(buf_size);
+	if(buf == NULL)
+	  break;
+      }
+      calls = 0;
+      window_bytes = 0;
+    }
+  }
+
+  chunk_buffer_put(buf, buf_size);
+
+  return (offset == size) ? 0 : -1;
+}
+
+
+/*
+ * Retrieve what was sent, as retrieve_file_in_pieces() does.
+ */
+
+static int
+bench_retrieve(CLIENT *clnt) {
+  int size = 0, received = 0;
+
+  if(retrieve_file_1("rpc_bench", &size, clnt) != RPC_SUCCESS) {
+    clnt_perror(clnt, "rpc_bench: retrieve_file");
+    return -1;
+  }
+
+  while(received < size) {
+    chunk part;
+
+    memset(&part, 0, sizeof(chunk));
+    if((retrieve_partial_1(&part, clnt) != RPC_SUCCESS) ||
+       (part.chunk_len == 0)) {
+      clnt_perror(clnt, "rpc_bench: retrieve_partial");
+      return -1;
+    }
+
+    received += part.chunk_len;
+    xdr_free((xdrproc_t) xdr_chunk, (char *) &part);
+  }
+
+  return received;
+}
+
+
+static char *
+size_name(int size, char *name, size_t len) {
+  if(size == 0)
+    snprintf(name, len, "auto");
+  else if(size % 1048576 == 0)
+    snprintf(name, len, "%dm", size >> 20);
+  else if(size % 1024 == 0)
+    snprintf(name, len, "%dk", size >> 10);
+  else
+    snprintf(name, len, "%d", size);
+
+  return name;
+}
+
+
+/*
+ * Transfer the file both ways with the transfer_tuning() of the moment.
+ */
+
+static int
+bench_one(unsigned short port, int link_listenfd, unsigned short link_port,
+	  int fd, int size, int window) {
+  transfer_tuning_t *tuning = transfer_tuning();
+  char chunk_name[16], record_name[16], socket_name[16];
+  double start, send_secs, retrieve_secs;
+  link_estimate_t link;
+  CLIENT *clnt;
+  int connfd, ret = -1, i;
+
+  connfd = connect_to_server(port, link_listenfd, link_port);
+  if(connfd < 0)
+    return -1;
+
+  clnt = convert_socket_to_rpc_client(connfd, MOBILELAUNCHER_PROG,
+				      MOBILELAUNCHER_VERS);
+  if(clnt == NULL) {
+    close(connfd);
+    return -1;
+  }
+
+  /*
+   * Adapting starts from the round trip, which the mobile launcher
+   * measures with pings before it sends anything.
+   */
+
+  if(tuning->adapt) {
+    link_estimate_init(&link);
+    for(i=0; i<10; i++) {
+      start = now();
+      if(ping_1(NULL, clnt) != RPC_SUCCESS) {
+	clnt_perror(clnt, "rpc_bench: ping");
+	goto done;
+      }
+      link_estimate_rtt(&link, now() - start);
+    }
+  }
+
+  start = now();
+  if(bench_send(clnt, fd, size, window, tuning->adapt ? &link : NULL) < 0)
+    goto done;
+  send_secs = now() - start;
+
+  start = now();
+  if(bench_retrieve(clnt) != size) {
+    fprintf(stderr, "rpc_bench: retrieved the wrong number of bytes\n");
+    goto done;
+  }
+  retrieve_secs = now() - start;
+
+  printf("%8s %8s %8s %14.1f %16.1f",
+	 tuning->adapt ? "adapt" :
+	 size_name(tuning->chunk_size, chunk_name, sizeof(chunk_name)),
+	 size_name(tuning->record_size, record_name, sizeof(record_name)),
+	 size_name(tuning->socket_buffer, socket_name, sizeof(socket_name)),
+	 size / send_secs / 1048576, size / retrieve_secs / 1048576);
+  if(tuning->adapt)
+    printf("   ended at %s x %d",
+	   size_name(link.chunk_size, chunk_name, sizeof(chunk_name)),
+	   link.window);
+  printf("\n");
+  fflush(stdout);
+  ret = 0;
+
+ done:
+  clnt_destroy(clnt);
+  close(connfd);
+
+  return ret;
+}
+
+
+/*
+ * Parse a comma-separated list of sizes such as "64k,1m", each from
+ * min to max.  Returns how many there were, or -1.
+ */
+
+static int
+parse_sizes(char *list, int *sizes, int min, int max) {
+  char *str, *save = NULL, *end;
+  int n = 0;
+
+  for(str = strtok_r(list, ",", &save); str != NULL;
+      str = strtok_r(NULL, ",", &save)) {
+    long size = strtol(str, &end, 10);
+
+    if(tolower(*end) == 'k') {
+      size <<= 10;
+      end++;
+    }
+    else if(tolower(*end) == 'm') {
+      size <<= 20;
+      end++;
+    }
+
+    if((*end != '\0') || (size < min) || (size > max) || (n == MAX_SIZES))
+      return -1;
+    sizes[n++] = size;
+  }
+
+  return n;
+}
+
+
+/*
+ * Listen on the loopback interface, on a port the kernel picks.
+ */
+
+static int
+loopback_listen(unsigned short *port) {
+  struct sockaddr_in sa;
+  socklen_t len = sizeof(sa);
+  int fd;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if((fd < 0) || (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) ||
+     (listen(fd, SOMAXCONN) < 0) ||
+     (getsockname(fd, (struct sockaddr *) &sa, &len) < 0)) {
+    perror("listen");
+    exit(EXIT_FAILURE);
+  }
+
+  *port = ntohs(sa.sin_port);
+
+  return fd;
+}
+
+
+/*
+ * A temporary file of "size" bytes of pseudo-random data.
+ */
+
+static int
+temp_file(int size) {
+  char path[] = "/tmp/rpc_bench.XXXXXX";
+  unsigned int seed = 1;
+  char *buf;
+  int fd, i;
+
+  fd = mkstemp(path);
+  if(fd < 0) {
+    perror("mkstemp");
+    exit(EXIT_FAILURE);
+  }
+  unlink(path);
+
+  if(size == 0)
+    return fd;
+
+  buf = malloc(CHUNK_SIZE);
+  while(size > 0) {
+    int len = (size > CHUNK_SIZE) ? CHUNK_SIZE : size;
+
+    for(i=0; i<len; i++)
+      buf[i] = rand_r(&seed);
+    if(writen(fd, buf, len) < 0) {
+      perror("write");
+      exit(EXIT_FAILURE);
+    }
+    size -= len;
+  }
+  free(buf);
+
+  return fd;
+}
+
+
+static void
+usage(void) {
+  printf("rpc_bench [-a] [-c chunk-sizes] [-b record-sizes] "
+	 "[-w socket-buffers]\n"
+	 "          [-s megabytes] [-n window] [-d delay-ms] [-r rate-Mbit/s]\n"
+	 "sizes are comma-separated and may end in k or m; a socket buffer\n"
+	 "of 0 leaves it to the kernel; -a adds a send with chunks and\n"
+	 "window planned from the link\n");
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  char chunk_list[] = "64k,256k,1m,4m", record_list[] = "8k,64k,1m";
+  char socket_list[] = "0,4m";
+  char *chunk_arg = chunk_list, *record_arg = record_list;
+  char *socket_arg = socket_list;
+  int chunks[MAX_SIZES], records[MAX_SIZES], sockets[MAX_SIZES];
+  int num_chunks, num_records, num_sockets, c, r, w, opt;
+  int megabytes = 64, window = SEND_WINDOW, adapt = 0, fd, failed = 0;
+  int link_listenfd = -1;
+  transfer_tuning_t *tuning = transfer_tuning();
+  unsigned short port, link_port = 0;
+
+  while((opt = getopt(argc, argv, "ac:b:w:s:n:d:r:h")) != -1) {
+    switch(opt) {
+    case 'a':
+      adapt = 1;
+      break;
+    case 'c':
+      chunk_arg = optarg;
+      break;
+    case 'b':
+      record_arg = optarg;
+      break;
+    case 'w':
+      socket_arg = optarg;
+      break;
+    case 's':
+      megabytes = atoi(optarg);
+      break;
+    case 'n':
+      window = atoi(optarg);
+      break;
+    case 'd':
+      link_delay = atof(optarg) / 1000;
+      break;
+    case 'r':
+      link_rate = atof(optarg) * 1e6 / 8;
+      break;
+    default:
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  num_chunks = parse_sizes(chunk_arg, chunks, CHUNK_SIZE_MIN, CHUNK_SIZE_MAX);
+  num_records = parse_sizes(record_arg, records, 512, CHUNK_SIZE_MAX);
+  num_sockets = parse_sizes(socket_arg, sockets, 0, 64 << 20);
+
+  if((num_chunks < 1) || (num_records < 1) || (num_sockets < 1) ||
+     (megabytes < 1) || (megabytes > 1024) || (window < 1) ||
+     (window > SEND_WINDOW_MAX) || (link_delay < 0) || (link_rate < 0)) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  fd = temp_file(megabytes << 20);
+  data_fd = temp_file(0);
+
+  /*
+   * setup_rpc_server() picks a port at random; pick a free one for it.
+   */
+
+  close(loopback_listen(&port));
+  setup_rpc_server_with_port(MOBILELAUNCHER_PROG, MOBILELAUNCHER_VERS,
+			     mobilelauncher_prog_1, INADDR_LOOPBACK, port);
+
+  if((link_delay > 0) || (link_rate > 0)) {
+    link_listenfd = loopback_listen(&link_port);
+    printf("link: %.1f ms each way, ", link_delay * 1000);
+    if(link_rate > 0)
+      printf("%.1f Mbit/s\n", link_rate * 8 / 1e6);
+    else
+      printf("no rate limit\n");
+  }
+  printf("%8s %8s %8s %14s %16s\n",
+	 "chunk", "record", "sockbuf", "send (MB/s)", "retrieve (MB/s)");
+
+
+  /*
+   * Both ends of each connection read transfer_tuning() as it is made.
+   */
+
+  for(w=0; w<num_sockets; w++)
+    for(r=0; r<num_records; r++)
+      for(c=0; c<num_chunks + adapt; c++) {
+	tuning->adapt = (c == num_chunks);
+	tuning->chunk_size = tuning->adapt ? CHUNK_SIZE : chunks[c];
+	tuning->record_size = records[r];
+	tuning->socket_buffer = sockets[w];
+
+	if(bench_one(port, link_listenfd, link_port, fd, megabytes << 20,
+		     tuning->adapt ? SEND_WINDOW_MAX : window) < 0)
+	  failed++;
+      }
+
+  return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,46 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * SHA-256 (FIPS 180-2), used to name file chunks by their content so
+ * that a display can tell which ones it already holds.
+ */
+
+#define SHA256_DIGEST_LENGTH 32
+
+typedef struct {
+  uint32_t      state[8];
+  uint64_t      length;
+  unsigned char block[64];
+  size_t        used;
+} sha256_ctx_t;
+
+void	sha256_init(sha256_ctx_t *ctx);
+void	sha256_update(sha256_ctx_t *ctx, const void *data, size_t len);
+void	sha256_final(sha256_ctx_t *ctx, unsigned char *digest);
+void	sha256(const void *data, size_t len, unsigned char *digest);
+
+#endif
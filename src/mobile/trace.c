@@ -0,0 +1,496 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace.h"
+
+
+/*
+ * Each ring has one writer, its thread, and one reader, the drain
+ * thread.  The writer alone advances head and the reader alone advances
+ * tail, so each publishes its side with a release store and reads the
+ * other's with an acquire load.  Rings are pushed onto the list by
+ * their threads and only ever taken off by the drain thread, once their
+ * thread has exited and they are empty.
+ */
+
+typedef struct trace_ring trace_ring_t;
+
+struct trace_ring {
+  trace_record_t  records[TRACE_RING_RECORDS];
+  uint64_t        head;
+  uint64_t        tail;
+  uint64_t        dropped;
+  uint32_t        tid;
+  int             exited;
+  trace_ring_t   *next;
+};
+
+static trace_ring_t *trace_rings = NULL;
+static __thread trace_ring_t *trace_ring = NULL;
+
+static pthread_once_t  trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t   trace_key;
+static uint64_t        trace_process_id;
+static uint64_t        trace_anchor_realtime;
+static uint64_t        trace_anchor_monotonic;
+static uint32_t        trace_spans = 0;
+
+static int             trace_on = 0;
+static int             trace_fd = -1;
+static int             trace_stop = 0;
+static pthread_t       trace_tid;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  trace_cond;
+
+
+uint64_t
+trace_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void
+trace_thread_exit(void *arg) {
+  trace_ring_t *ring = (trace_ring_t *)arg;
+
+  __atomic_store_n(&ring->exited, 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Set up what the process's trace needs before any event: the key to
+ * find out about exiting threads, the process's random ID, and the
+ * instant at which the trace clock is pinned to the wall clock.
+ */
+
+static void
+trace_setup(void) {
+  struct timespec rt;
+  int fd;
+
+  pthread_key_create(&trace_key, trace_thread_exit);
+
+  fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+  if((fd < 0) || (read(fd, &trace_process_id, sizeof(trace_process_id)) !=
+		  sizeof(trace_process_id)))
+    trace_process_id = ((uint64_t) getpid() << 32) ^ trace_now();
+  if(fd >= 0)
+    close(fd);
+
+  clock_gettime(CLOCK_REALTIME, &rt);
+  trace_anchor_monotonic = trace_now();
+  trace_anchor_realtime = (uint64_t) rt.tv_sec * 1000000000ULL + rt.tv_nsec;
+}
+
+
+uint64_t
+trace_process(void) {
+  pthread_once(&trace_once, trace_setup);
+
+  return trace_process_id;
+}
+
+
+/*
+ * The time on the wall clock as the trace sees it: the monotonic clock
+ * moved onto the wall clock where they were pinned together.  It is
+ * what the decoders show, and what clock_sync tells other processes.
+ */
+
+uint64_t
+trace_realtime(void) {
+  pthread_once(&trace_once, trace_setup);
+
+  return trace_now() - trace_anchor_monotonic + trace_anchor_realtime;
+}
+
+
+static trace_ring_t *
+trace_thread_ring(void) {
+  trace_ring_t *ring;
+
+  if(trace_ring != NULL)
+    return trace_ring;
+
+  ring = (trace_ring_t *)calloc(1, sizeof(trace_ring_t));
+  if(ring == NULL)
+    return NULL;
+  ring->tid = syscall(SYS_gettid);
+
+  ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+  while(!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 0,
+				     __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+
+  pthread_setspecific(trace_key, ring);
+  trace_ring = ring;
+
+  return ring;
+}
+
+
+/*
+ * Record an event on the calling thread's ring, in as many records as
+ * its data needs.  They are published together, so the drain thread
+ * never writes part of an event.
+ */
+
+void
+trace_event(uint16_t type, const char *data, size_t len) {
+  trace_ring_t *ring;
+  uint64_t head, tail, ns;
+  size_t needed, i;
+
+  if(!__atomic_load_n(&trace_on, __ATOMIC_RELAXED))
+    return;
+
+  ring = trace_thread_ring();
+  if(ring == NULL)
+    return;
+
+  ns = trace_now();
+  needed = (len == 0) ? 1 : (len + TRACE_DATA_MAX - 1) / TRACE_DATA_MAX;
+
+  head = ring->head;
+  tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if(head - tail + needed > TRACE_RING_RECORDS) {
+    __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  for(i=0; i<needed; i++) {
+    trace_record_t *r = &ring->records[(head + i) & (TRACE_RING_RECORDS - 1)];
+    size_t n = (len > TRACE_DATA_MAX) ? TRACE_DATA_MAX : len;
+
+    r->ns = ns;
+    r->tid = ring->tid;
+    r->type = (i + 1 < needed) ? (type | TRACE_MORE) : type;
+    r->len = n;
+    memcpy(r->data, data, n);
+    data += n;
+    len -= n;
+  }
+
+  __atomic_store_n(&ring->head, head + needed, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * A span's ID is the top half of the process's ID followed by a count,
+ * so that it can be handed to other processes.
+ */
+
+span_id_t
+span_begin(span_id_t parent, const char *name) {
+  char data[sizeof(trace_span_t) + 2 * TRACE_DATA_MAX];
+  trace_span_t span;
+  size_t len = strlen(name);
+
+  span.id = (trace_process() & 0xffffffff00000000ULL) |
+    __atomic_add_fetch(&trace_spans, 1, __ATOMIC_RELAXED);
+  span.parent = parent;
+
+  if(len > sizeof(data) - sizeof(span))
+    len = sizeof(data) - sizeof(span);
+  memcpy(data, &span, sizeof(span));
+  memcpy(data + sizeof(span), name, len);
+  trace_event(TRACE_SPAN_BEGIN, data, sizeof(span) + len);
+
+  return span.id;
+}
+
+
+void
+span_end(span_id_t span) {
+  trace_event(TRACE_SPAN_END, (char *)&span, sizeof(span));
+}
+
+
+void
+trace_clock(uint64_t process, int64_t offset_ns, uint64_t rtt_ns) {
+  trace_clock_t clock = { process, offset_ns, rtt_ns };
+
+  trace_event(TRACE_CLOCK, (char *)&clock, sizeof(clock));
+}
+
+
+void
+trace_message(const char *message) {
+  trace_event(TRACE_MESSAGE, message, strlen(message));
+}
+
+
+void
+trace_printf(const char *format, ...) {
+  char message[4 * TRACE_DATA_MAX];
+  va_list ap;
+  int n;
+
+  if(!__atomic_load_n(&trace_on, __ATOMIC_RELAXED))
+    return;
+
+  va_start(ap, format);
+  n = vsnprintf(message, sizeof(message), format, ap);
+  va_end(ap);
+
+  if(n < 0)
+    return;
+  if(n >= (int) sizeof(message))
+    n = sizeof(message) - 1;
+
+  trace_event(TRACE_MESSAGE, message, n);
+}
+
+
+/*
+ * Write out what a ring holds, straight from the ring, in at most two
+ * pieces where it wraps around.
+ */
+
+static int
+trace_drain_ring(trace_ring_t *ring) {
+  uint64_t head, tail, dropped;
+
+  dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+  if(dropped > 0) {
+    trace_record_t r;
+
+    memset(&r, 0, sizeof(r));
+    r.ns = trace_now();
+    r.tid = ring->tid;
+    r.type = TRACE_DROPPED;
+    r.len = sizeof(dropped);
+    memcpy(r.data, &dropped, sizeof(dropped));
+    if(write(trace_fd, &r, sizeof(r)) != sizeof(r))
+      return -1;
+  }
+
+  head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  tail = ring->tail;
+
+  while(tail < head) {
+    struct iovec iov[2];
+    uint64_t first = tail & (TRACE_RING_RECORDS - 1);
+    uint64_t count = head - tail;
+    ssize_t n;
+    int iovcnt = 1;
+
+    iov[0].iov_base = &ring->records[first];
+    if(first + count > TRACE_RING_RECORDS) {
+      iov[0].iov_len = (TRACE_RING_RECORDS - first) * sizeof(trace_record_t);
+      iov[1].iov_base = &ring->records[0];
+      iov[1].iov_len = (first + count - TRACE_RING_RECORDS) *
+	sizeof(trace_record_t);
+      iovcnt = 2;
+    }
+    else
+      iov[0].iov_len = count * sizeof(trace_record_t);
+
+    n = writev(trace_fd, iov, iovcnt);
+    if(n < 0) {
+      if(errno == EINTR)
+	continue;
+      return -1;
+    }
+
+    /* A short write still ends on a whole record: the file is local. */
+    tail += n / sizeof(trace_record_t);
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+  }
+
+  return 0;
+}
+
+
+/*
+ * Drain every ring, freeing those whose threads have exited.  A ring's
+ * exited flag is read before draining, so that nothing its thread
+ * recorded can be left behind.
+ */
+
+static int
+trace_drain(void) {
+  trace_ring_t **prev = &trace_rings;
+  trace_ring_t *ring;
+  int err = 0;
+
+  ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+  while(ring != NULL) {
+    int exited = __atomic_load_n(&ring->exited, __ATOMIC_ACQUIRE);
+    trace_ring_t *next = ring->next;
+
+    if(trace_drain_ring(ring) < 0)
+      err = -1;
+
+    if(!exited || (ring->tail != ring->head)) {
+      prev = &ring->next;
+      ring = next;
+      continue;
+    }
+
+    /*
+     * Unlink the ring.  Threads push new rings only at the head of the
+     * list, so if it is the head a new ring may have to be stepped over.
+     */
+
+    if(prev == &trace_rings) {
+      trace_ring_t *expected = ring;
+
+      if(!__atomic_compare_exchange_n(&trace_rings, &expected, next, 0,
+				      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	for(prev = &expected->next; *prev != ring; prev = &(*prev)->next)
+	  ;
+	*prev = next;
+      }
+    }
+    else
+      *prev = next;
+
+    free(ring);
+    ring = next;
+  }
+
+  return err;
+}
+
+
+static void *
+trace_drain_thread(void *arg) {
+  int stop = 0;
+
+  (void)arg;
+
+  while(!stop) {
+    struct timespec ts;
+
+    pthread_mutex_lock(&trace_mutex);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_nsec += TRACE_DRAIN_MS * 1000000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    while(!trace_stop &&
+	  (pthread_cond_timedwait(&trace_cond, &trace_mutex, &ts) != ETIMEDOUT))
+      ;
+    stop = trace_stop;
+    pthread_mutex_unlock(&trace_mutex);
+
+    if(trace_drain() < 0) {
+      perror("(trace) write");
+      __atomic_store_n(&trace_on, 0, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+
+int
+trace_open(const char *filename) {
+  trace_header_t header;
+  pthread_condattr_t attr;
+
+  if(trace_fd >= 0)
+    return -1;
+
+  pthread_once(&trace_once, trace_setup);
+
+  trace_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(trace_fd < 0) {
+    perror("(trace) open");
+    return -1;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  header.record_size = sizeof(trace_record_t);
+  header.pid = getpid();
+  header.realtime_ns = trace_anchor_realtime;
+  header.monotonic_ns = trace_anchor_monotonic;
+  header.process = trace_process_id;
+
+  if(write(trace_fd, &header, sizeof(header)) != sizeof(header)) {
+    perror("(trace) write");
+    close(trace_fd);
+    trace_fd = -1;
+    return -1;
+  }
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&trace_cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  trace_stop = 0;
+  __atomic_store_n(&trace_on, 1, __ATOMIC_RELEASE);
+
+  if(pthread_create(&trace_tid, NULL, trace_drain_thread, NULL) != 0) {
+    fprintf(stderr, "(trace) failed creating drain thread\n");
+    __atomic_store_n(&trace_on, 0, __ATOMIC_RELAXED);
+    pthread_cond_destroy(&trace_cond);
+    close(trace_fd);
+    trace_fd = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Stop tracing and write out what is left.  Rings stay allocated, as
+ * their threads may still be in the middle of recording.
+ */
+
+void
+trace_close(void) {
+  if(trace_fd < 0)
+    return;
+
+  __atomic_store_n(&trace_on, 0, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&trace_mutex);
+  trace_stop = 1;
+  pthread_cond_signal(&trace_cond);
+  pthread_mutex_unlock(&trace_mutex);
+
+  pthread_join(trace_tid, NULL);
+  pthread_cond_destroy(&trace_cond);
+
+  close(trace_fd);
+  trace_fd = -1;
+}
@@ -0,0 +1,136 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * Tracing records events from any thread into a ring buffer of that
+ * thread's own, with neither locks nor system calls, stamped with the
+ * monotonic clock in nanoseconds.  A background thread drains the rings
+ * into a binary trace file every TRACE_DRAIN_MS, and trace_decode
+ * prints the file.  An event that finds its thread's ring full is
+ * dropped and counted, rather than waiting for the drain.
+ */
+
+#define TRACE_RING_RECORDS 1024         /* Per thread; a power of two. */
+#define TRACE_DRAIN_MS     50
+
+
+/*
+ * The trace file is a header followed by records of a fixed size, in
+ * the byte order of the machine that wrote it.  The header pairs the
+ * wall clock with the monotonic clock at one instant, so that the
+ * decoder can show when an event happened, and names the process by a
+ * random ID, which other processes' traces use to refer to it.
+ */
+
+#define TRACE_MAGIC   "KTRACE\0\0"
+#define TRACE_VERSION 2
+
+typedef struct {
+  char     magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t pid;
+  uint32_t reserved;
+  uint64_t realtime_ns;
+  uint64_t monotonic_ns;
+  uint64_t process;
+} trace_header_t;
+
+
+/*
+ * Record types.  Text longer than a record holds goes on in the records
+ * after it, each but the last with TRACE_MORE set in its type.
+ */
+
+#define TRACE_MESSAGE 1         /* A log message. */
+#define TRACE_TEXT    2         /* A line of a log file appended. */
+#define TRACE_DROPPED 3         /* Data is how many events a ring lost. */
+#define TRACE_SPAN_BEGIN 4      /* Data is a trace_span_t and the name. */
+#define TRACE_SPAN_END   5      /* Data is the span's ID. */
+#define TRACE_CLOCK      6      /* Data is a trace_clock_t. */
+
+#define TRACE_MORE    0x8000
+
+#define TRACE_DATA_MAX 112
+
+typedef struct {
+  uint64_t ns;
+  uint32_t tid;
+  uint16_t type;
+  uint16_t len;
+  char     data[TRACE_DATA_MAX];
+} trace_record_t;
+
+
+/*
+ * Spans time the steps of a launch across the processes taking part in
+ * it.  A span's ID is unique to its process, and its parent, 0 for
+ * none, may be a span of another process that passed it the ID.  The
+ * display scripts record their spans as lines of text in their logs:
+ *
+ *   span <ns> <process> begin <id> <parent> <name>
+ *   span <ns> <process> end <id>
+ *
+ * with the process and IDs in hex, and times in nanoseconds on the
+ * clock of the process named.
+ */
+
+typedef uint64_t span_id_t;
+
+typedef struct {
+  span_id_t id;
+  span_id_t parent;
+} trace_span_t;
+
+
+/*
+ * How far another process's trace clock is ahead of this one's, as
+ * estimated from the quickest of a few RPC round trips to it.
+ */
+
+typedef struct {
+  uint64_t process;
+  int64_t  offset_ns;
+  uint64_t rtt_ns;
+} trace_clock_t;
+
+
+int		trace_open(const char *filename);
+void		trace_close(void);
+uint64_t	trace_now(void);
+uint64_t	trace_realtime(void);
+uint64_t	trace_process(void);
+void		trace_event(uint16_t type, const char *data, size_t len);
+void		trace_message(const char *message);
+void		trace_printf(const char *format, ...)
+		  __attribute__ ((format (printf, 1, 2)));
+
+span_id_t	span_begin(span_id_t parent, const char *name);
+void		span_end(span_id_t span);
+void		trace_clock(uint64_t process, int64_t offset_ns, 
+			    uint64_t rtt_ns);
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * trace_decode
+ *
+ * Prints the events of trace files, such as the launchers' logs, in the
+ * order they happened, one per line, as the local time followed by the
+ * thread that recorded it.  With -m, times are instead seconds since
+ * the first event, with the time since the thread's previous event.
+ * Spans are shown as their beginning and their end, with how long they
+ * took.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace_read.h"
+
+
+typedef struct {
+  trace_event_t  event;
+  size_t         seq;
+} entry_t;
+
+static entry_t *entries = NULL;
+static size_t num_entries = 0, max_entries = 0;
+
+
+static void
+add_event(const trace_event_t *event, void *arg) {
+  entry_t *e;
+  char *data;
+
+  (void)arg;
+
+  if(num_entries == max_entries) {
+    max_entries = (max_entries == 0) ? 1024 : 2 * max_entries;
+    entries = (entry_t *)realloc(entries, max_entries * sizeof(entry_t));
+    if(entries == NULL) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  data = (char *)malloc(event->len + 1);
+  if(data == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(data, event->data, event->len + 1);
+
+  e = &entries[num_entries];
+  e->event = *event;
+  e->event.data = data;
+  e->seq = num_entries++;
+}
+
+
+static int
+compare_entries(const void *a, const void *b) {
+  const entry_t *ea = (const entry_t *)a, *eb = (const entry_t *)b;
+
+  if(ea->event.ns != eb->event.ns)
+    return (ea->event.ns < eb->event.ns) ? -1 : 1;
+
+  return (ea->seq < eb->seq) ? -1 : 1;
+}
+
+
+/*
+ * Find where a span began, to name it at its end.
+ */
+
+static const trace_event_t *
+find_span(size_t before, span_id_t id) {
+  size_t i;
+
+  for(i=before; i-- > 0;) {
+    const trace_event_t *e = &entries[i].event;
+    trace_span_t span;
+
+    if((e->type != TRACE_SPAN_BEGIN) || (e->len < sizeof(span)))
+      continue;
+    memcpy(&span, e->data, sizeof(span));
+    if(span.id == id)
+      return e;
+  }
+
+  return NULL;
+}
+
+
+static void
+print_event(size_t i, int relative) {
+  static uint64_t first_ns = 0;
+  static uint64_t last_ns[64];
+  static uint32_t last_tid[64];
+  const trace_event_t *e = &entries[i].event;
+  char time_str[200];
+
+  if(relative) {
+    int slot = e->tid % 64;
+    uint64_t since = 0;
+
+    if(first_ns == 0)
+      first_ns = e->ns;
+    if((last_tid[slot] == e->tid) && (last_ns[slot] != 0))
+      since = e->ns - last_ns[slot];
+    last_tid[slot] = e->tid;
+    last_ns[slot] = e->ns;
+
+    printf("%12.6f %+10.6f ", (e->ns - first_ns) / 1e9, since / 1e9);
+  }
+  else {
+    time_t secs = e->ns / 1000000000ULL;
+
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d_%H:%M:%S",
+	     localtime(&secs));
+    printf("%s.%.6u ", time_str,
+	   (unsigned int) (e->ns % 1000000000ULL) / 1000);
+  }
+
+  switch(e->type) {
+  case TRACE_MESSAGE:
+    printf("[%u]: %s\n", e->tid, e->data);
+    break;
+
+  case TRACE_TEXT:
+    printf("[%u] | %s\n", e->tid, e->data);
+    break;
+
+  case TRACE_DROPPED: {
+    uint64_t dropped = 0;
+
+    memcpy(&dropped, e->data,
+	   (e->len < sizeof(dropped)) ? e->len : sizeof(dropped));
+    printf("[%u]: (%" PRIu64 " events dropped)\n", e->tid, dropped);
+    break;
+  }
+
+  case TRACE_SPAN_BEGIN: {
+    trace_span_t span;
+
+    if(e->len < sizeof(span))
+      break;
+    memcpy(&span, e->data, sizeof(span));
+    printf("[%u]: begin %s\n", e->tid, e->data + sizeof(span));
+    break;
+  }
+
+  case TRACE_SPAN_END: {
+    const trace_event_t *begin;
+    span_id_t id;
+
+    if(e->len < sizeof(id))
+      break;
+    memcpy(&id, e->data, sizeof(id));
+    begin = find_span(i, id);
+    if(begin != NULL)
+      printf("[%u]: end %s (%.6f s)\n", e->tid, 
+	     begin->data + sizeof(trace_span_t), (e->ns - begin->ns) / 1e9);
+    else
+      printf("[%u]: end span %016" PRIx64 "\n", e->tid, id);
+    break;
+  }
+
+  case TRACE_CLOCK: {
+    trace_clock_t clock;
+
+    if(e->len < sizeof(clock))
+      break;
+    memcpy(&clock, e->data, sizeof(clock));
+    printf("[%u]: clock of %016" PRIx64 " is %+.6f s from ours "
+	   "(round trip %.6f s)\n", e->tid, clock.process, 
+	   clock.offset_ns / 1e9, clock.rtt_ns / 1e9);
+    break;
+  }
+
+  default:
+    printf("[%u]: (event of unknown type %u)\n", e->tid, e->type);
+    break;
+  }
+}
+
+
+static void
+usage(void) {
+  printf("trace_decode [-m] <trace-file> [<trace-file> ...]\n");
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  size_t i;
+  int opt, relative = 0;
+
+  while((opt = getopt(argc, argv, "mh")) != -1) {
+    switch(opt) {
+    case 'm':
+      relative = 1;
+      break;
+    default:
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if(optind >= argc) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  for(; optind < argc; optind++)
+    if(trace_read(argv[optind], add_event, NULL) < 0)
+      exit(EXIT_FAILURE);
+
+  qsort(entries, num_entries, sizeof(entry_t), compare_entries);
+
+  for(i=0; i<num_entries; i++)
+    print_event(i, relative);
+
+  for(i=0; i<num_entries; i++)
+    free((char *)entries[i].event.data);
+  free(entries);
+
+  return 0;
+}
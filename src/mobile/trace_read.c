@@ -0,0 +1,141 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace_read.h"
+
+
+static int
+read_text(FILE *fp, trace_event_fn fn, void *arg) {
+  trace_event_t event;
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+
+  memset(&event, 0, sizeof(event));
+  event.type = TRACE_TEXT;
+
+  while((len = getline(&line, &size, fp)) > 0) {
+    if(line[len - 1] == '\n')
+      line[--len] = '\0';
+    event.data = line;
+    event.len = len;
+    fn(&event, arg);
+  }
+
+  free(line);
+
+  return 0;
+}
+
+
+int
+trace_read(const char *filename, trace_event_fn fn, void *arg) {
+  trace_header_t header;
+  trace_record_t r;
+  trace_event_t event;
+  char *data = NULL;
+  size_t len = 0;
+  FILE *fp;
+
+  fp = fopen(filename, "r");
+  if(fp == NULL) {
+    perror(filename);
+    return -1;
+  }
+
+  if((fread(&header, sizeof(header), 1, fp) != 1) ||
+     (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0)) {
+    rewind(fp);
+    read_text(fp, fn, arg);
+    fclose(fp);
+    return 0;
+  }
+
+  if((header.version != TRACE_VERSION) ||
+     (header.record_size != sizeof(trace_record_t))) {
+    fprintf(stderr, "%s: trace file version %u is not supported\n", 
+	    filename, header.version);
+    fclose(fp);
+    return -1;
+  }
+
+  while(fread(&r, sizeof(r), 1, fp) == 1) {
+    if(r.len > TRACE_DATA_MAX)
+      break;
+
+    data = (char *)realloc(data, len + r.len + 1);
+    memcpy(data + len, r.data, r.len);
+    len += r.len;
+    data[len] = '\0';
+
+    if(r.type & TRACE_MORE)
+      continue;
+
+    event.process = header.process;
+    event.ns = r.ns - header.monotonic_ns + header.realtime_ns;
+    event.tid = r.tid;
+    event.type = r.type;
+    event.len = len;
+    event.data = data;
+    fn(&event, arg);
+
+    len = 0;
+  }
+
+  free(data);
+  fclose(fp);
+
+  return 0;
+}
+
+
+int
+trace_parse_text_span(const char *line, trace_text_span_t *span) {
+  char kind[8];
+  int name;
+
+  memset(span, 0, sizeof(*span));
+
+  if(sscanf(line, "span %" SCNu64 " %" SCNx64 " %7s", &span->ns, 
+	    &span->process, kind) != 3)
+    return -1;
+
+  if(strcmp(kind, "begin") == 0) {
+    if(sscanf(line, "span %*u %*x begin %" SCNx64 " %" SCNx64 " %n",
+	      &span->id, &span->parent, &name) != 2)
+      return -1;
+    span->begin = 1;
+    span->name = line + name;
+    return 0;
+  }
+
+  if(strcmp(kind, "end") == 0) {
+    if(sscanf(line, "span %*u %*x end %" SCNx64, &span->id) != 1)
+      return -1;
+    return 0;
+  }
+
+  return -1;
+}
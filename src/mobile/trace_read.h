@@ -0,0 +1,65 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TRACE_READ_H_
+#define _TRACE_READ_H_
+
+#include "trace.h"
+
+
+/*
+ * Reading trace files back, for trace_decode and trace_timeline.  Each
+ * event is handed over whole, its records joined, with its time moved
+ * onto the wall clock of the process that recorded it.  A file that is
+ * not a trace file is read as text, such as a display script's log,
+ * each line an event of type TRACE_TEXT with no time or process.
+ */
+
+typedef struct {
+  uint64_t     process;
+  uint64_t     ns;
+  uint32_t     tid;
+  uint16_t     type;
+  size_t       len;
+  const char  *data;         /* Followed by a NUL. */
+} trace_event_t;
+
+typedef void (*trace_event_fn)(const trace_event_t *event, void *arg);
+
+int	trace_read(const char *filename, trace_event_fn fn, void *arg);
+
+
+/*
+ * A span recorded by a display script in its log (see trace.h).  Parses
+ * a line of the log, returning 0 if it is one.  name points into the
+ * line.
+ */
+
+typedef struct {
+  uint64_t     ns;
+  uint64_t     process;
+  int          begin;
+  span_id_t    id;
+  span_id_t    parent;
+  const char  *name;
+} trace_text_span_t;
+
+int	trace_parse_text_span(const char *line, trace_text_span_t *span);
+
+#endif
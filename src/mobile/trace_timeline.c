@@ -0,0 +1,741 @@
+/*
+ *  Kimberley
+ *
+ *  Copyright (c) 2008-2009 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  Kimberley is free software: you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License
+ *  as published by the Free Software Foundation.
+ *
+ *  Kimberley is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kimberley. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * trace_timeline
+ *
+ * Merges the spans in the traces of the processes taking part in
+ * launches into one timeline per launch: the mobile launcher's and the
+ * display launcher's trace files, and the display scripts' logs, which
+ * the mobile launcher keeps in its trace or which may be given as text
+ * files.  Each process's times are moved onto the clock of the first
+ * process given, by way of the clock offsets the mobile launcher
+ * measured from its RPC round trips to the display.
+ *
+ * For each launch, a span named "launch" with no parent by default, it
+ * prints the spans as a tree and the critical path through them: going
+ * back from the launch's end, whichever step was under way or finished
+ * last at each moment, down to the innermost span.  With -s it prints
+ * instead, across all the launches, how long each step took as a
+ * histogram, and how much of the launches' time each was on the
+ * critical path.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "trace_read.h"
+
+
+#define HISTOGRAM_BUCKETS 24            /* Powers of two of milliseconds. */
+#define HISTOGRAM_WIDTH   40
+
+typedef struct {
+  span_id_t  id;
+  span_id_t  parent;
+  uint64_t   process;
+  uint64_t   start;
+  uint64_t   end;
+  int        ended;
+  char      *name;
+  int        up;            /* Index of the parent span, or -1. */
+  int        child;         /* First child, in order of starting. */
+  int        sibling;
+} span_t;
+
+typedef struct {
+  span_id_t  id;
+  uint64_t   process;
+  uint64_t   ns;
+} span_end_t;
+
+typedef struct {
+  uint64_t   from;
+  uint64_t   to;
+  int64_t    offset_ns;
+  uint64_t   rtt_ns;
+} clock_link_t;
+
+typedef struct {
+  uint64_t   id;
+  int64_t    correction;
+  int        known;
+} process_t;
+
+typedef struct {
+  int        span;
+  uint64_t   start;
+  uint64_t   end;
+} segment_t;
+
+static span_t       *spans = NULL;
+static span_end_t   *ends = NULL;
+static clock_link_t *links = NULL;
+static process_t    *processes = NULL;
+static segment_t    *segments = NULL;
+static int num_spans = 0, num_ends = 0, num_links = 0, num_processes = 0;
+static int num_segments = 0;
+
+
+/*
+ * Make room in an array for one more than count, doubling it from 16
+ * as count reaches each power of two.
+ */
+
+static void *
+grow(void *array, int count, size_t size) {
+  if((count == 0) || ((count >= 16) && ((count & (count - 1)) == 0))) {
+    array = realloc(array, (count ? 2 * count : 16) * size);
+    if(array == NULL) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return array;
+}
+
+
+static process_t *
+find_process(uint64_t id) {
+  int i;
+
+  for(i=0; i<num_processes; i++)
+    if(processes[i].id == id)
+      return &processes[i];
+
+  processes = grow(processes, num_processes, sizeof(process_t));
+  memset(&processes[num_processes], 0, sizeof(process_t));
+  processes[num_processes].id = id;
+
+  return &processes[num_processes++];
+}
+
+
+static void
+add_begin(uint64_t process, uint64_t ns, span_id_t id, span_id_t parent,
+	  const char *name) {
+  span_t *s;
+
+  find_process(process);
+
+  spans = grow(spans, num_spans, sizeof(span_t));
+  s = &spans[num_spans++];
+  memset(s, 0, sizeof(*s));
+  s->id = id;
+  s->parent = parent;
+  s->process = process;
+  s->start = ns;
+  s->name = strdup(name);
+  s->up = s->child = s->sibling = -1;
+}
+
+
+static void
+add_end(uint64_t process, uint64_t ns, span_id_t id) {
+  ends = grow(ends, num_ends, sizeof(span_end_t));
+  ends[num_ends].id = id;
+  ends[num_ends].process = process;
+  ends[num_ends].ns = ns;
+  num_ends++;
+}
+
+
+static void
+add_event(const trace_event_t *e, void *arg) {
+  trace_text_span_t text;
+  trace_span_t span;
+  trace_clock_t clock;
+  span_id_t id;
+
+  (void)arg;
+
+  switch(e->type) {
+  case TRACE_SPAN_BEGIN:
+    if(e->len < sizeof(span))
+      break;
+    memcpy(&span, e->data, sizeof(span));
+    add_begin(e->process, e->ns, span.id, span.parent, 
+	      e->data + sizeof(span));
+    break;
+
+  case TRACE_SPAN_END:
+    if(e->len < sizeof(id))
+      break;
+    memcpy(&id, e->data, sizeof(id));
+    add_end(e->process, e->ns, id);
+    break;
+
+  case TRACE_TEXT:
+    if(trace_parse_text_span(e->data, &text) < 0)
+      break;
+    if(text.begin)
+      add_begin(text.process, text.ns, text.id, text.parent, text.name);
+    else
+      add_end(text.process, text.ns, text.id);
+    break;
+
+  case TRACE_CLOCK:
+    if(e->len < sizeof(clock))
+      break;
+    memcpy(&clock, e->data, sizeof(clock));
+    find_process(e->process);
+    find_process(clock.process);
+    links = grow(links, num_links, sizeof(clock_link_t));
+    links[num_links].from = e->process;
+    links[num_links].to = clock.process;
+    links[num_links].offset_ns = clock.offset_ns;
+    links[num_links].rtt_ns = clock.rtt_ns;
+    num_links++;
+    break;
+  }
+}
+
+
+static int
+compare_links(const void *a, const void *b) {
+  const clock_link_t *la = (const clock_link_t *)a;
+  const clock_link_t *lb = (const clock_link_t *)b;
+
+  return (la->rtt_ns < lb->rtt_ns) ? -1 : (la->rtt_ns > lb->rtt_ns);
+}
+
+
+/*
+ * Work out how far to move each process's times to put them on the
+ * first process's clock, trusting the quickest round trips most.  A
+ * process with no measured link to the first keeps its own clock.
+ */
+
+static void
+correct_clocks(void) {
+  int i, j, changed;
+
+  qsort(links, num_links, sizeof(clock_link_t), compare_links);
+
+  for(i=0; i<num_processes; i++) {
+    if(processes[i].known)
+      continue;
+    processes[i].known = 1;
+    processes[i].correction = 0;
+
+    do {
+      changed = 0;
+      for(j=0; j<num_links; j++) {
+	process_t *from = find_process(links[j].from);
+	process_t *to = find_process(links[j].to);
+
+	if(from->known && !to->known) {
+	  to->correction = from->correction - links[j].offset_ns;
+	  to->known = changed = 1;
+	}
+	else if(to->known && !from->known) {
+	  from->correction = to->correction + links[j].offset_ns;
+	  from->known = changed = 1;
+	}
+      }
+    } while(changed);
+  }
+
+  for(i=0; i<num_spans; i++)
+    spans[i].start += find_process(spans[i].process)->correction;
+  for(i=0; i<num_ends; i++)
+    ends[i].ns += find_process(ends[i].process)->correction;
+}
+
+
+static int
+compare_span_ids(const void *a, const void *b) {
+  const span_t *sa = (const span_t *)a, *sb = (const span_t *)b;
+
+  if(sa->id != sb->id)
+    return (sa->id < sb->id) ? -1 : 1;
+
+  return (sa->start < sb->start) ? -1 : (sa->start > sb->start);
+}
+
+
+static int
+compare_span_starts(const void *a, const void *b) {
+  const span_t *sa = &spans[*(const int *)a], *sb = &spans[*(const int *)b];
+
+  if(sa->start != sb->start)
+    return (sa->start < sb->start) ? -1 : 1;
+
+  return (*(const int *)a < *(const int *)b) ? -1 : 1;
+}
+
+
+static int
+find_span(span_id_t id) {
+  int lo = 0, hi = num_spans;
+
+  while(lo < hi) {
+    int mid = (lo + hi) / 2;
+
+    if(spans[mid].id < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return ((lo < num_spans) && (spans[lo].id == id)) ? lo : -1;
+}
+
+
+/*
+ * A span that never ended, because its process died or its trace was
+ * cut short, is taken to last as long as anything under it.
+ */
+
+static uint64_t
+settle_end(int i) {
+  uint64_t last = spans[i].start;
+  int c;
+
+  for(c = spans[i].child; c >= 0; c = spans[c].sibling) {
+    uint64_t end = settle_end(c);
+
+    if(end > last)
+      last = end;
+  }
+
+  if(!spans[i].ended)
+    spans[i].end = last;
+
+  return spans[i].end;
+}
+
+
+/*
+ * Link each span under its parent, children in order of starting.  With
+ * local_only, only spans of the same process as their parent are linked.
+ */
+
+static void
+link_children(int *order, int local_only) {
+  int *last = (int *)malloc((num_spans + 1) * sizeof(int));
+  int i;
+
+  for(i=0; i<num_spans; i++) {
+    last[i] = -1;
+    spans[i].child = spans[i].sibling = -1;
+  }
+
+  for(i=0; i<num_spans; i++) {
+    int s = order[i], up = spans[s].up;
+
+    if((up < 0) || (local_only && (spans[up].process != spans[s].process)))
+      continue;
+    if(last[up] < 0)
+      spans[up].child = s;
+    else
+      spans[last[up]].sibling = s;
+    last[up] = s;
+  }
+
+  free(last);
+}
+
+
+/*
+ * The innermost step of span s under way at time ns, or s itself.
+ */
+
+static int
+innermost_step(int s, uint64_t ns) {
+  int c = spans[s].child;
+
+  while(c >= 0) {
+    if((spans[c].start <= ns) && (!spans[c].ended || (spans[c].end > ns))) {
+      s = c;
+      c = spans[c].child;
+    }
+    else
+      c = spans[c].sibling;
+  }
+
+  return s;
+}
+
+
+/*
+ * Put the spans into trees: end each span at its first end, and link it
+ * under its parent, children in order of starting.  A span another
+ * process began on behalf of a span goes under the innermost of that
+ * span's steps that was under way when it began, so that the critical
+ * path follows it out of whatever step was waiting for it.
+ */
+
+static void
+build_trees(void) {
+  int i, *order;
+
+  qsort(spans, num_spans, sizeof(span_t), compare_span_ids);
+
+  for(i=0; i<num_ends; i++) {
+    int s = find_span(ends[i].id);
+
+    if((s >= 0) && (!spans[s].ended || (ends[i].ns < spans[s].end))) {
+      spans[s].end = ends[i].ns;
+      spans[s].ended = 1;
+    }
+  }
+
+  for(i=0; i<num_spans; i++)
+    spans[i].up = (spans[i].parent != 0) ? find_span(spans[i].parent) : -1;
+
+  order = (int *)malloc((num_spans + 1) * sizeof(int));
+  for(i=0; i<num_spans; i++)
+    order[i] = i;
+  qsort(order, num_spans, sizeof(int), compare_span_starts);
+
+  link_children(order, 1);
+
+  for(i=0; i<num_spans; i++)
+    if((spans[i].up >= 0) &&
+       (spans[spans[i].up].process != spans[i].process))
+      spans[i].up = innermost_step(spans[i].up, spans[i].start);
+
+  link_children(order, 0);
+  free(order);
+
+  for(i=0; i<num_spans; i++)
+    if(spans[i].up < 0)
+      settle_end(i);
+}
+
+
+static void
+add_segment(int span, uint64_t start, uint64_t end) {
+  if(end <= start)
+    return;
+
+  segments = grow(segments, num_segments, sizeof(segment_t));
+  segments[num_segments].span = span;
+  segments[num_segments].start = start;
+  segments[num_segments].end = end;
+  num_segments++;
+}
+
+
+/*
+ * Find the critical path through span s between lo and hi, going back
+ * from hi.  At each moment the step on the path is the child under way
+ * then or, if none is, the one that finished last before it; time no
+ * child accounts for is the span's own.  Segments are added latest
+ * first.
+ */
+
+static void
+critical_path(int s, uint64_t lo, uint64_t hi) {
+  uint64_t t = hi;
+
+  while(t > lo) {
+    uint64_t best_end = 0;
+    int c, best = -1;
+
+    for(c = spans[s].child; c >= 0; c = spans[c].sibling) {
+      uint64_t end = (spans[c].end < t) ? spans[c].end : t;
+
+      if((spans[c].start >= t) || (spans[c].end <= lo))
+	continue;
+      if((best < 0) || (end > best_end) ||
+	 ((end == best_end) && (spans[c].start > spans[best].start))) {
+	best = c;
+	best_end = end;
+      }
+    }
+
+    if(best < 0) {
+      add_segment(s, lo, t);
+      break;
+    }
+
+    add_segment(s, best_end, t);
+    critical_path(best, (spans[best].start > lo) ? spans[best].start : lo,
+		  best_end);
+    t = (spans[best].start > lo) ? spans[best].start : lo;
+  }
+}
+
+
+static void
+print_tree(int s, uint64_t origin, int depth) {
+  int c;
+
+  printf("  %10.6f %10.6f%s %*s%s\n", (spans[s].start - origin) / 1e9,
+	 (spans[s].end - spans[s].start) / 1e9, spans[s].ended ? " " : "?",
+	 2 * depth, "", spans[s].name);
+
+  for(c = spans[s].child; c >= 0; c = spans[c].sibling)
+    print_tree(c, origin, depth + 1);
+}
+
+
+/*
+ * Print the critical path of launch s, merging the segments that are
+ * one span's, and return where its segments start.
+ */
+
+static int
+print_critical_path(int s) {
+  uint64_t origin = spans[s].start, total = spans[s].end - spans[s].start;
+  int first = num_segments, i, j;
+
+  critical_path(s, spans[s].start, spans[s].end);
+
+  /* Latest first to earliest first. */
+  for(i=first, j=num_segments-1; i<j; i++, j--) {
+    segment_t t = segments[i];
+    segments[i] = segments[j];
+    segments[j] = t;
+  }
+
+  printf("  critical path:\n");
+  for(i=first; i<num_segments; i=j) {
+    uint64_t time = 0;
+
+    for(j=i; (j < num_segments) && (segments[j].span == segments[i].span); 
+	j++)
+      time += segments[j].end - segments[j].start;
+
+    printf("  %10.6f %10.6f %5.1f%%  %s\n", 
+	   (segments[i].start - origin) / 1e9, time / 1e9,
+	   total ? 100.0 * time / total : 0.0, spans[segments[i].span].name);
+  }
+
+  return first;
+}
+
+
+static int
+is_launch(int s, const char *launch_name) {
+  return (spans[s].up < 0) && 
+    ((launch_name == NULL) || (strcmp(spans[s].name, launch_name) == 0));
+}
+
+
+/*
+ * The steps of the launches, by name, for the summary.
+ */
+
+typedef struct {
+  const char *name;
+  uint64_t   *durations;
+  int         count;
+  uint64_t    critical;
+} step_t;
+
+static step_t *steps = NULL;
+static int num_steps = 0;
+
+
+static step_t *
+find_step(const char *name) {
+  int i;
+
+  for(i=0; i<num_steps; i++)
+    if(strcmp(steps[i].name, name) == 0)
+      return &steps[i];
+
+  steps = grow(steps, num_steps, sizeof(step_t));
+  memset(&steps[num_steps], 0, sizeof(step_t));
+  steps[num_steps].name = name;
+
+  return &steps[num_steps++];
+}
+
+
+static void
+gather_steps(int s) {
+  step_t *step = find_step(spans[s].name);
+  int c;
+
+  step->durations = grow(step->durations, step->count, sizeof(uint64_t));
+  step->durations[step->count++] = spans[s].end - spans[s].start;
+
+  for(c = spans[s].child; c >= 0; c = spans[c].sibling)
+    gather_steps(c);
+}
+
+
+static int
+compare_durations(const void *a, const void *b) {
+  uint64_t da = *(const uint64_t *)a, db = *(const uint64_t *)b;
+
+  return (da < db) ? -1 : (da > db);
+}
+
+
+static int
+compare_steps(const void *a, const void *b) {
+  const step_t *sa = (const step_t *)a, *sb = (const step_t *)b;
+
+  return (sa->critical > sb->critical) ? -1 : (sa->critical < sb->critical);
+}
+
+
+static void
+print_histogram(step_t *step) {
+  int buckets[HISTOGRAM_BUCKETS], i, most = 0, lowest = -1, highest = 0;
+
+  memset(buckets, 0, sizeof(buckets));
+  for(i=0; i<step->count; i++) {
+    uint64_t ms = step->durations[i] / 1000000;
+    int b = 0;
+
+    while((ms > 0) && (b < HISTOGRAM_BUCKETS - 1)) {
+      ms >>= 1;
+      b++;
+    }
+    buckets[b]++;
+    if(buckets[b] > most)
+      most = buckets[b];
+    if((lowest < 0) || (b < lowest))
+      lowest = b;
+    if(b > highest)
+      highest = b;
+  }
+
+  for(i=lowest; i<=highest; i++) {
+    int width = (most > 0) ? (buckets[i] * HISTOGRAM_WIDTH + most - 1) / most 
+      : 0;
+
+    if(i == 0)
+      printf("    %8s  < 1 ms  ", "");
+    else
+      printf("    %8u..%-6u ms ", 1u << (i - 1), (1u << i) - 1);
+    printf("%5d %.*s\n", buckets[i], width, 
+	   "########################################");
+  }
+}
+
+
+static void
+print_summary(uint64_t total, int launches) {
+  int i;
+
+  qsort(steps, num_steps, sizeof(step_t), compare_steps);
+
+  printf("%d launches, %.6f s on average\n\n", launches, 
+	 launches ? total / 1e9 / launches : 0.0);
+
+  for(i=0; i<num_steps; i++) {
+    step_t *step = &steps[i];
+    uint64_t sum = 0;
+    int j;
+
+    qsort(step->durations, step->count, sizeof(uint64_t), compare_durations);
+    for(j=0; j<step->count; j++)
+      sum += step->durations[j];
+
+    printf("%s: %d times, mean %.6f s, median %.6f s, 90th %.6f s, "
+	   "max %.6f s; %.1f%% of launch time on the critical path\n",
+	   step->name, step->count, sum / 1e9 / step->count,
+	   step->durations[step->count / 2] / 1e9,
+	   step->durations[(step->count * 9) / 10] / 1e9,
+	   step->durations[step->count - 1] / 1e9,
+	   total ? 100.0 * step->critical / total : 0.0);
+    print_histogram(step);
+    printf("\n");
+  }
+}
+
+
+static void
+usage(void) {
+  printf("trace_timeline [-s] [-a | -n launch-span-name] "
+	 "<trace-file> [<trace-file> ...]\n");
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  const char *launch_name = "launch";
+  uint64_t total = 0;
+  int opt, summary = 0, launches = 0, i;
+
+  while((opt = getopt(argc, argv, "an:sh")) != -1) {
+    switch(opt) {
+    case 'a':
+      launch_name = NULL;
+      break;
+    case 'n':
+      launch_name = optarg;
+      break;
+    case 's':
+      summary = 1;
+      break;
+    default:
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if(optind >= argc) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  for(; optind < argc; optind++)
+    if(trace_read(argv[optind], add_event, NULL) < 0)
+      exit(EXIT_FAILURE);
+
+  correct_clocks();
+  build_trees();
+
+  for(i=0; i<num_spans; i++) {
+    int first, j;
+
+    if(!is_launch(i, launch_name))
+      continue;
+
+    launches++;
+    total += spans[i].end - spans[i].start;
+
+    if(!summary) {
+      printf("%s %016" PRIx64 ": %.6f s\n", spans[i].name, spans[i].id,
+	     (spans[i].end - spans[i].start) / 1e9);
+      printf("  %10s %10s\n", "start", "duration");
+      print_tree(i, spans[i].start, 0);
+      first = print_critical_path(i);
+      printf("\n");
+    }
+    else {
+      first = num_segments;
+      critical_path(i, spans[i].start, spans[i].end);
+    }
+
+    gather_steps(i);
+    for(j=first; j<num_segments; j++)
+      find_step(spans[segments[j].span].name)->critical += 
+	segments[j].end - segments[j].start;
+  }
+
+  if(summary)
+    print_summary(total, launches);
+  else if(launches == 0)
+    fprintf(stderr, "trace_timeline: no launches found\n");
+
+  return 0;
+}